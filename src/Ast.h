@@ -2,15 +2,147 @@
 
 #define RETURN_FALSE(x) if(!(x)) return false
 
+#include "Builtins.h"
+#include "Bytecode.h"
+#include "IrBuilder.h"
+#include "Token.h"
+#include "Type.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+// Script functions and host functions are called directly by index, imports
+// are called through the import table until the program is linked. Builtins
+// are the functions of the numeric library, see Builtins.
+enum class CallKind
+{
+  SCRIPT, HOST, IMPORT, BUILTIN
+};
+
+struct FunctionSignature
+{
+  std::string name;
+  Type returnType;
+  std::vector<Type> params;
+  int index;
+  CallKind kind;
+};
+
+struct AstCall;
+struct AstNode;
+
+struct Local
+{
+  Type type;
+  int slot;
+};
+
+// What the body of a #parallel loop does with the variables declared before
+// the loop, collected while the body is checked, see AstParallelFor
+struct ParallelCheck
+{
+  // Element of an array declared before the loop that is read or stored
+  struct Access
+  {
+    AstNode* node;
+    std::string array;
+    int slot;
+    bool store;
+    // Whether the index is the loop variable
+    bool atVariable;
+  };
+
+  // Slots from firstSlot on are declared in the loop, firstSlot is the loop
+  // variable
+  int firstSlot;
+  std::vector<int> reductions;
+  // Slots before the loop that are read, including the reductions
+  std::set<int> reads;
+  std::vector<Access> accesses;
+  bool variableAssigned = false;
+  // Set by AstAssignIndex for the AstIndex it stores to
+  bool storing = false;
 
-enum class Type
+  bool IsReduction(int slot) const
+  {
+    return std::find(reductions.begin(), reductions.end(), slot) != reductions.end();
+  }
+
+  // Variables declared before the loop are shared by the iterations
+  bool IsShared(int slot) const
+  {
+    return slot < firstSlot && !IsReduction(slot);
+  }
+};
+
+struct CheckData
 {
-  INVALID, VOID, INT, FLOAT, CHAR, STRING
+  // Shared by the functions checked at the same time, never changed
+  const std::map<std::string, FunctionSignature>& functions;
+  std::vector<std::map<std::string, Local>> scopes;
+  std::vector<Type> slotTypes;
+  Type returnType;
+  // Calls to script functions, considered by the Inliner
+  std::vector<AstCall*> calls;
+  // Set while checking the body of a #parallel loop
+  ParallelCheck* parallel = nullptr;
+
+  CheckData(const std::map<std::string, FunctionSignature>& functions, Type returnType)
+    : functions{functions}, returnType{returnType}
+  {}
+
+  void PushScope()
+  {
+    scopes.push_back({});
+  }
+
+  void PopScope()
+  {
+    scopes.pop_back();
+  }
+
+  const Local* Declare(const std::string& name, Type type)
+  {
+    auto it = scopes.back().find(name);
+    if(it != scopes.back().end())
+      return nullptr;
+    Local& local = scopes.back()[name] = {type, (int)slotTypes.size()};
+    slotTypes.push_back(type);
+    return &local;
+  }
+
+  const Local* Find(const std::string& name)
+  {
+    for(auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+    {
+      auto local = it->find(name);
+      if(local != it->end())
+        return &local->second;
+    }
+    return nullptr;
+  }
+
+  const FunctionSignature* FindFunction(const std::string& name)
+  {
+    auto it = functions.find(name);
+    if(it == functions.end())
+      return nullptr;
+    return &it->second;
+  }
 };
 
 struct AstNode
 {
+  TokenPos pos;
+
   void PrintIndent(std::ostream& os, size_t indent)
   {
     for(int i = 0;i<indent;i++)
@@ -24,37 +156,40 @@ struct AstNode
     PrintIndent(os, indent);
     Print(os, indent);
   }
-  virtual bool Check() = 0;
+  virtual bool Check(CheckData& data) = 0;
   virtual void Print(std::ostream& os, size_t indent) = 0;
 
-  friend std::ostream& operator<<(std::ostream& os, AstNode* node)
+  bool Error(const std::string& message)
   {
-    node->PrintWithIndent(os, 0);
-    return os;
+    std::cerr << message << " at " << pos.line << ":" << pos.column << std::endl;
+    return false;
   }
-};
 
-struct AstNodeImpl : public AstNode
-{
-  bool Check(){ return true; }
-  void Print(std::ostream& os, size_t index)
+  void Warning(const std::string& message)
   {
-    os << "AstNodeImpl" << std::endl;
+    std::cerr << "Warning: " << message << " at " << pos.line << ":" << pos.column << std::endl;
+  }
+
+  friend std::ostream& operator<<(std::ostream& os, AstNode* node)
+  {
+    node->PrintWithIndent(os, 0);
+    return os;
   }
 };
 
 struct AstName : public AstNode
 {
   Type type;
-  AstName(Type type)
-    : type{type}
+  std::string name;
+  AstName(Type type, const std::string& name)
+    : type{type}, name{name}
   {}
 
-  bool Check() override { return true; }
+  bool Check(CheckData& data) override { return true; }
 
   void Print(std::ostream& os, size_t indent) override
   {
-    os << "AstName" << std::endl;
+    os << "AstName " << type << " " << name << std::endl;
   }
 };
 
@@ -65,7 +200,12 @@ struct AstFuncParam : public AstNode
     : arg{arg}
   {}
 
-  bool Check() override { return true; }
+  bool Check(CheckData& data) override
+  {
+    if(data.Declare(arg->name, arg->type) == nullptr)
+      return Error("Redefinition of parameter " + arg->name);
+    return true;
+  }
 
   void Print(std::ostream& os, size_t indent) override
   {
@@ -82,7 +222,22 @@ struct AstFuncParams : public AstNode
     : first{first}, tail{tail}
   {}
 
-  bool Check() override { return true; }
+  bool Check(CheckData& data) override
+  {
+    if(first)
+      RETURN_FALSE(first->Check(data));
+    if(tail)
+      RETURN_FALSE(tail->Check(data));
+    return true;
+  }
+
+  std::vector<Type> GetTypes()
+  {
+    std::vector<Type> types;
+    for(AstFuncParams* params = this; params && params->first; params = params->tail)
+      types.push_back(params->first->arg->type);
+    return types;
+  }
 
   void Print(std::ostream& os, size_t indent) override
   {
@@ -101,7 +256,9 @@ struct AstStatement : public AstNode
   AstStatement()
   {}
 
-  bool Check() override { return true; }
+  bool Check(CheckData& data) override { return true; }
+
+  virtual void Lower(IrBuilder& builder) {}
 
   void Print(std::ostream& os, size_t indent) override
   {
@@ -109,12 +266,47 @@ struct AstStatement : public AstNode
   }
 };
 
+inline size_t HashCombine(size_t seed, size_t value)
+{
+  return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
 struct AstExpression : public AstStatement
 {
-  Type type;
-  void* value;
-};
+  Type type = Type::INVALID;
+
+  // Expressions without side effects can be shared by every place they
+  // occur, see ExpressionTable. Children are compared by address since they
+  // are shared before their parent is created.
+  virtual bool IsShareable() const
+  {
+    return false;
+  }
+
+  virtual size_t Hash() const
+  {
+    return typeid(*this).hash_code();
+  }
+
+  virtual bool Equals(const AstExpression* other) const
+  {
+    return typeid(*this) == typeid(*other);
+  }
+
+  // Emits the expression and returns the value it evaluates to
+  virtual IrInstruction* LowerValue(IrBuilder& builder) = 0;
 
+  // Emits return of the expression from the current function
+  virtual void LowerReturn(IrBuilder& builder)
+  {
+    builder.Return(LowerValue(builder));
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    LowerValue(builder);
+  }
+};
 
 struct AstStatements : public AstNode
 {
@@ -124,15 +316,33 @@ struct AstStatements : public AstNode
     : first{first}, tail{tail}
   {}
 
-  bool Check() override
+  bool Check(CheckData& data) override
   {
     if(first)
-      RETURN_FALSE(first->Check());
+      RETURN_FALSE(first->Check(data));
     if(tail)
-      RETURN_FALSE(tail->Check());
+      RETURN_FALSE(tail->Check(data));
     return true;
   }
 
+  // Checks the statements in a scope of their own
+  bool CheckScope(CheckData& data)
+  {
+    data.PushScope();
+    bool valid = Check(data);
+    data.PopScope();
+    return valid;
+  }
+
+  void Lower(IrBuilder& builder)
+  {
+    for(AstStatements* statements = this; statements && statements->first; statements = statements->tail)
+    {
+      builder.SetPosition(statements->first->pos);
+      statements->first->Lower(builder);
+    }
+  }
+
   void Print(std::ostream& os, size_t indent) override
   {
     os << "AstStatements" << std::endl;
@@ -159,9 +369,41 @@ struct AstIf : public AstStatement
     : condition{condition}, body{body}, elseBody{elseBody}
   {}
 
-  bool Check() { return false; }
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(condition->Check(data));
+    if(condition->type != Type::INT)
+      return Error("If condition must be of type int");
+    RETURN_FALSE(body->CheckScope(data));
+    if(elseBody)
+      RETURN_FALSE(elseBody->CheckScope(data));
+    return true;
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    IrBlock* thenBlock = builder.CreateBlock();
+    IrBlock* elseBlock = elseBody ? builder.CreateBlock() : nullptr;
+    IrBlock* endBlock = builder.CreateBlock();
+    builder.Branch(condition->LowerValue(builder), thenBlock, elseBlock ? elseBlock : endBlock);
+
+    builder.SealBlock(thenBlock);
+    builder.SetBlock(thenBlock);
+    body->Lower(builder);
+    builder.Jump(endBlock);
 
-  void Print(std::ostream& os, size_t indent)
+    if(elseBlock)
+    {
+      builder.SealBlock(elseBlock);
+      builder.SetBlock(elseBlock);
+      elseBody->Lower(builder);
+      builder.Jump(endBlock);
+    }
+    builder.SealBlock(endBlock);
+    builder.SetBlock(endBlock);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
   {
     os << "[IF]" << std::endl;
     PrintIndent(os, indent+1);
@@ -179,166 +421,1787 @@ struct AstIf : public AstStatement
   }
 };
 
-struct AstFunction : public AstNode
+struct AstLoop : public AstStatement
 {
-  AstName* name;
-  AstFuncParams* params;
+  // Emits the condition that is checked before every iteration
+  virtual IrInstruction* LowerCondition(IrBuilder& builder) = 0;
+
+  // Emits what runs after the body of every iteration
+  virtual void LowerNext(IrBuilder& builder) {}
+
+  // Loops are rotated so the condition is checked once before entering the
+  // loop and then at the end of each iteration. The preheader gives loop
+  // invariant code somewhere to be hoisted to.
+  void LowerLoop(IrBuilder& builder, AstStatements* body)
+  {
+    IrBlock* preheader = builder.CreateBlock();
+    IrBlock* bodyBlock = builder.CreateBlock();
+    IrBlock* endBlock = builder.CreateBlock();
+    builder.Branch(LowerCondition(builder), preheader, endBlock);
+
+    builder.SealBlock(preheader);
+    builder.SetBlock(preheader);
+    builder.Jump(bodyBlock);
+
+    builder.SetBlock(bodyBlock);
+    LowerBody(builder, body);
+    builder.SetPosition(pos);
+    LowerNext(builder);
+    builder.Branch(LowerCondition(builder), bodyBlock, endBlock);
+    builder.SealBlock(bodyBlock);
+
+    builder.SealBlock(endBlock);
+    builder.SetBlock(endBlock);
+  }
+
+  // Emits the body of the loop, at the start of the loop block
+  virtual void LowerBody(IrBuilder& builder, AstStatements* body)
+  {
+    body->Lower(builder);
+  }
+};
+
+struct AstFor : public AstLoop
+{
+  AstExpression* init;
+  AstExpression* condition;
+  AstExpression* next;
   AstStatements* body;
-  AstFunction(AstName* name, AstFuncParams* params, AstStatements* body)
-    : name{name}, params{params}, body{body}
+
+  AstFor(AstExpression* init, AstExpression* condition, AstExpression* next, AstStatements* body)
+    : init{init}, condition{condition}, next{next}, body{body}
   {}
 
-  bool Check() override { return body->Check(); }
+  bool Check(CheckData& data) override
+  {
+    data.PushScope();
+    bool valid = CheckLoop(data);
+    data.PopScope();
+    return valid;
+  }
+
+  bool CheckLoop(CheckData& data)
+  {
+    RETURN_FALSE(init->Check(data));
+    RETURN_FALSE(condition->Check(data));
+    if(condition->type != Type::INT)
+      return Error("For condition must be of type int");
+    RETURN_FALSE(next->Check(data));
+    return body->CheckScope(data);
+  }
+
+  IrInstruction* LowerCondition(IrBuilder& builder) override
+  {
+    return condition->LowerValue(builder);
+  }
+
+  void LowerNext(IrBuilder& builder) override
+  {
+    next->Lower(builder);
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    init->Lower(builder);
+    LowerLoop(builder, body);
+  }
 
   void Print(std::ostream& os, size_t indent) override
   {
-    os << "[FUNCTION] " << std::endl;
+    os << "[FOR]" << std::endl;
     PrintIndent(os, indent+1);
-    os << "[NAME] " << std::endl;
-    name->PrintWithIndent(os, indent+2);
+    os << "[INIT]" << std::endl;
+    init->PrintWithIndent(os, indent+2);
     PrintIndent(os, indent+1);
-    os << "[PARAMS] " << std::endl;
-    params->PrintWithIndent(os, indent+2);
+    os << "[CONDITION]" << std::endl;
+    condition->PrintWithIndent(os, indent+2);
     PrintIndent(os, indent+1);
-    os << "[BODY] " << std::endl;
+    os << "[NEXT]" << std::endl;
+    next->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[BODY]" << std::endl;
     body->PrintWithIndent(os, indent+2);
   }
 };
 
-struct AstExpressionImpl : public AstExpression
+struct AstWhile : public AstLoop
 {
-  void Print(std::ostream& os, size_t indent)
+  AstExpression* condition;
+  AstStatements* body;
+
+  AstWhile(AstExpression* condition, AstStatements* body)
+    : condition{condition}, body{body}
+  {}
+
+  bool Check(CheckData& data) override
   {
-    os << "AstExpressionImpl" << std::endl;
+    RETURN_FALSE(condition->Check(data));
+    if(condition->type != Type::INT)
+      return Error("While condition must be of type int");
+    return body->CheckScope(data);
   }
 
-  bool Check()
+  IrInstruction* LowerCondition(IrBuilder& builder) override
   {
-    return true;
+    return condition->LowerValue(builder);
   }
-};
-
-struct AstBinOp : public AstExpression
-{
-  private:
-    AstExpression* left;
-    AstExpression* right;
-  public:
-    AstBinOp(AstExpression* left, AstExpression* right)
-      : AstExpression{}, left{left}, right{right}
-    {}
 
-  void Print(std::ostream& os, size_t indent)
+  void Lower(IrBuilder& builder) override
   {
-    os << "AstBinOp" << std::endl;
-    left->PrintWithIndent(os, indent);
-    right->PrintWithIndent(os, indent);
+    LowerLoop(builder, body);
   }
 
-  bool Check()
+  void Print(std::ostream& os, size_t indent) override
   {
-    RETURN_FALSE(left->Check());
-    RETURN_FALSE(right->Check());
-    type = left->type;
-    return left->type == right->type;
+    os << "[WHILE]" << std::endl;
+    PrintIndent(os, indent+1);
+    os << "[CONDITION]" << std::endl;
+    condition->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[BODY]" << std::endl;
+    body->PrintWithIndent(os, indent+2);
   }
 };
 
-struct AstUnOp : public AstExpression
+// range(start, end[, step]) in a for loop. Never evaluates to an object, it
+// only describes the bounds of a counted loop.
+struct AstRange : public AstNode
 {
-  private:
-    AstExpression* expr;
-  public:
-    AstUnOp(AstExpression* expr)
-      : AstExpression{}, expr{expr}
-    {}
+  AstExpression* start;
+  AstExpression* end;
+  AstExpression* step;
+
+  AstRange(AstExpression* start, AstExpression* end, AstExpression* step)
+    : start{start}, end{end}, step{step}
+  {}
 
-  bool Check()
+  bool Check(CheckData& data) override
   {
-    RETURN_FALSE(expr->Check());
-    type = expr->type;
+    RETURN_FALSE(start->Check(data));
+    RETURN_FALSE(end->Check(data));
+    if(step)
+      RETURN_FALSE(step->Check(data));
+    if(start->type != Type::INT || end->type != Type::INT || (step && step->type != Type::INT))
+      return Error("Range bounds must be of type int");
     return true;
   }
-};
 
-struct AstAdd : public AstBinOp
-{
-  public:
-    AstAdd(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstRange" << std::endl;
+    start->PrintWithIndent(os, indent+1);
+    end->PrintWithIndent(os, indent+1);
+    if(step)
+      step->PrintWithIndent(os, indent+1);
+  }
 };
 
-struct AstSub : public AstBinOp
+// Loops driven by a hidden counter going from start towards end. The bounds
+// are evaluated once before the loop, so no range or iterator object exists
+// at runtime and assigning the loop variable in the body doesn't change the
+// iteration.
+struct AstCountedLoop : public AstLoop
 {
-  public:
-    AstSub(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  AstName* name;
+  AstStatements* body;
+  int slot;
 
-struct AstMul : public AstBinOp
-{
-  public:
-    AstMul(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  int counter;
+  IrInstruction* end;
+  IrInstruction* step;
+  // Whether the counter before the last step was far enough from the end
+  // for the step to not overflow, see LowerNext
+  IrInstruction* fits;
 
-struct AstDiv : public AstBinOp
-{
-  public:
-    AstDiv(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  AstCountedLoop(AstName* name, AstStatements* body)
+    : name{name}, body{body}, slot{-1}, fits{nullptr}
+  {}
 
-struct AstEqual : public AstBinOp
-{
-  public:
-    AstEqual(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  bool CheckBody(CheckData& data)
+  {
+    data.PushScope();
+    slot = data.Declare(name->name, name->type)->slot;
+    bool valid = body->CheckScope(data);
+    data.PopScope();
+    return valid;
+  }
 
-struct AstNEqual : public AstBinOp
-{
-  public:
-    AstNEqual(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  // Emits the value of the loop variable for the current counter
+  virtual IrInstruction* LowerVariable(IrBuilder& builder, IrInstruction* counter) = 0;
 
-struct AstLT : public AstBinOp
-{
-  public:
-    AstLT(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  IrInstruction* LowerCondition(IrBuilder& builder) override
+  {
+    IrInstruction* condition = LowerInRange(builder, builder.ReadVariable(counter));
+    if(fits)
+      condition = builder.Binary(Opcode::MUL_INT, Type::INT, fits, condition);
+    fits = nullptr;
+    return condition;
+  }
 
-struct AstGT : public AstBinOp
-{
-  public:
-    AstGT(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
-};
+  // Emits whether i is short of the end, in the direction of the step
+  IrInstruction* LowerInRange(IrBuilder& builder, IrInstruction* i)
+  {
+    // A step of 0 runs no iterations, like one only known at runtime
+    if(step->op == IrOp::CONST && step->imm == 0)
+      return builder.Const(Type::INT, 0);
+    if(step->op == IrOp::CONST)
+      return builder.Binary(step->imm < 0 ? Opcode::GT_INT : Opcode::LT_INT, Type::INT, i, end);
 
-struct AstLTE : public AstBinOp
-{
-  public:
-    AstLTE(AstExpression* left, AstExpression* right)
-      : AstBinOp{left, right}
-    {}
+    // The direction is only known at runtime, (step > 0 && i < end) || (step < 0 && i > end)
+    IrInstruction* zero = builder.Const(Type::INT, 0);
+    IrInstruction* up = builder.Binary(Opcode::MUL_INT, Type::INT,
+        builder.Binary(Opcode::GT_INT, Type::INT, step, zero),
+        builder.Binary(Opcode::LT_INT, Type::INT, i, end));
+    IrInstruction* down = builder.Binary(Opcode::MUL_INT, Type::INT,
+        builder.Binary(Opcode::LT_INT, Type::INT, step, zero),
+        builder.Binary(Opcode::GT_INT, Type::INT, i, end));
+    return builder.Binary(Opcode::ADD_INT, Type::INT, up, down);
+  }
+
+  void LowerBody(IrBuilder& builder, AstStatements* body) override
+  {
+    builder.WriteVariable(slot, LowerVariable(builder, builder.ReadVariable(counter)));
+    body->Lower(builder);
+  }
+
+  // The counter wraps around if the step takes it past the range of int,
+  // so unless the step is 1 or -1 the next iteration also needs the step to
+  // be short of the distance d = end - i. The distance is computed with
+  // wrapping, it only wraps when it is larger than any step, which flips
+  // its sign: (step > 0 && (d < 0 || step < d)) || (step < 0 && (d > 0 || step > d))
+  void LowerNext(IrBuilder& builder) override
+  {
+    IrInstruction* i = builder.ReadVariable(counter);
+    if(step->op != IrOp::CONST || (step->imm != 1 && step->imm != -1))
+    {
+      IrInstruction* zero = builder.Const(Type::INT, 0);
+      IrInstruction* d = builder.Binary(Opcode::SUB_INT, Type::INT, end, i);
+      IrInstruction* up = builder.Binary(Opcode::ADD_INT, Type::INT,
+          builder.Binary(Opcode::LT_INT, Type::INT, d, zero),
+          builder.Binary(Opcode::LT_INT, Type::INT, step, d));
+      IrInstruction* down = builder.Binary(Opcode::ADD_INT, Type::INT,
+          builder.Binary(Opcode::GT_INT, Type::INT, d, zero),
+          builder.Binary(Opcode::GT_INT, Type::INT, step, d));
+      if(step->op == IrOp::CONST)
+        fits = step->imm < 0 ? down : up;
+      else
+      {
+        fits = builder.Binary(Opcode::ADD_INT, Type::INT,
+            builder.Binary(Opcode::MUL_INT, Type::INT, builder.Binary(Opcode::GT_INT, Type::INT, step, zero), up),
+            builder.Binary(Opcode::MUL_INT, Type::INT, builder.Binary(Opcode::LT_INT, Type::INT, step, zero), down));
+      }
+    }
+    builder.WriteVariable(counter, builder.Binary(Opcode::ADD_INT, Type::INT, i, step));
+  }
+
+  void LowerCounted(IrBuilder& builder, IrInstruction* start, IrInstruction* end, IrInstruction* step)
+  {
+    counter = builder.CreateVariable(Type::INT);
+    builder.WriteVariable(counter, start);
+    this->end = end;
+    this->step = step;
+    LowerLoop(builder, body);
+  }
 };
 
-struct AstGTE : public AstBinOp
+// for(int i in range(a, b, step))
+struct AstForRange : public AstCountedLoop
 {
-  public:
-    AstGTE(AstExpression* left, AstExpression* right)
+  AstRange* range;
+
+  AstForRange(AstName* name, AstRange* range, AstStatements* body)
+    : AstCountedLoop{name, body}, range{range}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(range->Check(data));
+    if(name->type != Type::INT)
+      return Error("Range loop variable must be of type int");
+    return CheckBody(data);
+  }
+
+  IrInstruction* LowerVariable(IrBuilder& builder, IrInstruction* counter) override
+  {
+    return builder.Emit(IrOp::COPY, Type::INT, {counter});
+  }
+
+  void LowerRange(IrBuilder& builder, IrInstruction*& start, IrInstruction*& end, IrInstruction*& step)
+  {
+    start = range->start->LowerValue(builder);
+    end = range->end->LowerValue(builder);
+    step = range->step ? range->step->LowerValue(builder) : builder.Const(Type::INT, 1);
+    // A negative literal step is still a constant, which decides the comparison
+    if(step->op == IrOp::UNARY && step->opcode == Opcode::NEG_INT && step->operands[0]->op == IrOp::CONST)
+      step = builder.Const(Type::INT, -step->operands[0]->imm);
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    IrInstruction* start;
+    IrInstruction* end;
+    IrInstruction* step;
+    LowerRange(builder, start, end, step);
+    LowerCounted(builder, start, end, step);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "[FOR IN]" << std::endl;
+    PrintIndent(os, indent+1);
+    os << "[VARIABLE]" << std::endl;
+    name->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[RANGE]" << std::endl;
+    range->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[BODY]" << std::endl;
+    body->PrintWithIndent(os, indent+2);
+  }
+};
+
+// #parallel for(int i in range(a, b, step)) runs the iterations of a range
+// loop on the threads of a ParallelPool, in no particular order. The body is
+// outlined into a function that runs a chunk of the iterations, see
+// ParallelLoop, and gets a copy of the variables declared before the loop.
+// Those can't be assigned unless they are listed as reductions, such as in
+// #parallel(sum total, max best), which each chunk starts at the identity of
+// the operation. Storing to an element of a shared array that another
+// iteration reads is an error, storing at another index than the loop
+// variable is a warning.
+struct AstParallelFor : public AstForRange
+{
+  struct ReductionName
+  {
+    ReductionKind kind;
+    std::string name;
+    int slot;
+  };
+
+  std::vector<ReductionName> reductions;
+  // Slots declared before the loop that the body reads, passed to the body
+  std::vector<int> captures;
+  std::vector<Type> slotTypes;
+  // Start and step of the range in the outlined body
+  IrInstruction* first;
+  IrInstruction* stride;
+
+  AstParallelFor(AstName* name, AstRange* range, AstStatements* body, const std::vector<ReductionName>& reductions)
+    : AstForRange{name, range, body}, reductions{reductions}, first{nullptr}, stride{nullptr}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    if(data.parallel)
+      return Error("Parallel loops can't be nested");
+    RETURN_FALSE(range->Check(data));
+    if(name->type != Type::INT)
+      return Error("Range loop variable must be of type int");
+    ParallelCheck parallel{(int)data.slotTypes.size()};
+    for(ReductionName& reduction : reductions)
+    {
+      const Local* local = data.Find(reduction.name);
+      if(local == nullptr)
+        return Error("Undefined variable " + reduction.name);
+      if(local->type != Type::INT && local->type != Type::FLOAT)
+        return Error("Reduction " + reduction.name + " must be of type int or float");
+      if(parallel.IsReduction(local->slot))
+        return Error("Reduction " + reduction.name + " is listed twice");
+      reduction.slot = local->slot;
+      parallel.reductions.push_back(local->slot);
+    }
+    data.parallel = &parallel;
+    bool valid = CheckBody(data);
+    data.parallel = nullptr;
+    RETURN_FALSE(valid);
+    slotTypes = data.slotTypes;
+    captures.clear();
+    for(int slot : parallel.reads)
+    {
+      if(!parallel.IsReduction(slot))
+        captures.push_back(slot);
+    }
+    return CheckAccesses(parallel);
+  }
+
+  // An element stored by one iteration must not be used by another, which
+  // holds when every iteration only uses the element at the loop variable
+  bool CheckAccesses(const ParallelCheck& parallel)
+  {
+    std::map<int, const ParallelCheck::Access*> stored;
+    std::map<int, const ParallelCheck::Access*> scattered;
+    std::map<int, const ParallelCheck::Access*> gathered;
+    for(const ParallelCheck::Access& access : parallel.accesses)
+    {
+      bool atVariable = access.atVariable && !parallel.variableAssigned;
+      if(access.store)
+        stored.insert({access.slot, &access});
+      if(access.store && !atVariable)
+        scattered.insert({access.slot, &access});
+      else if(!atVariable)
+        gathered.insert({access.slot, &access});
+    }
+    for(const auto& [slot, access] : stored)
+    {
+      if(scattered.count(slot))
+        scattered[slot]->node->Warning("Iterations of the parallel loop may store to the same element of " + access->array);
+      else if(gathered.count(slot))
+        return gathered[slot]->node->Error("Element of " + access->array + " may be stored by another iteration of the parallel loop");
+    }
+    return true;
+  }
+
+  IrInstruction* LowerVariable(IrBuilder& builder, IrInstruction* counter) override
+  {
+    if(stride->op == IrOp::CONST && stride->imm == 1)
+      return builder.Binary(Opcode::ADD_INT, Type::INT, first, counter);
+    return builder.Binary(Opcode::ADD_INT, Type::INT, first, builder.Binary(Opcode::MUL_INT, Type::INT, counter, stride));
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    IrInstruction* start;
+    IrInstruction* end;
+    IrInstruction* step;
+    LowerRange(builder, start, end, step);
+
+    IrFunction& function = builder.GetFunction();
+    int index = function.parallelLoops.size();
+    IrParallelLoop loop{std::make_unique<IrFunction>()};
+    for(const ReductionName& reduction : reductions)
+      loop.reductions.push_back({reduction.kind, slotTypes[reduction.slot]});
+    LowerOutlined(builder.GetProgram(), *loop.body, function.name + ".parallel" + std::to_string(index), start, step);
+    function.parallelLoops.push_back(std::move(loop));
+
+    // The reductions go through an array since PARALLEL defines no value
+    builder.SetPosition(pos);
+    IrInstruction* results;
+    if(reductions.empty())
+      results = builder.Const(Type::INT_ARRAY, 0);
+    else
+      results = builder.Emit(IrOp::NEW_ARRAY, Type::INT_ARRAY, {builder.Const(Type::INT, reductions.size())}, sizeof(int32_t));
+    for(size_t i = 0;i<reductions.size();i++)
+      builder.Store(results, builder.Const(Type::INT, i), builder.ReadVariable(reductions[i].slot));
+    std::vector<IrInstruction*> operands{start, end, step, results};
+    for(int slot : captures)
+      operands.push_back(builder.ReadVariable(slot));
+    builder.Emit(IrOp::PARALLEL, Type::VOID, operands, index);
+    for(size_t i = 0;i<reductions.size();i++)
+      builder.WriteVariable(reductions[i].slot, builder.Load(slotTypes[reductions[i].slot], results, builder.Const(Type::INT, i)));
+  }
+
+  // Lowers the body into a function running the iterations [from, to)
+  void LowerOutlined(Program& program, IrFunction& function, const std::string& name, IrInstruction* start, IrInstruction* step)
+  {
+    function.name = name;
+    function.returnType = Type::VOID;
+    function.params = {Type::INT, Type::INT, Type::INT, Type::INT, Type::INT, Type::INT_ARRAY};
+    for(int slot : captures)
+      function.params.push_back(slotTypes[slot]);
+    IrBuilder builder{function, program, slotTypes};
+    builder.SetPosition(pos);
+    std::vector<IrInstruction*> params;
+    for(size_t i = 0;i<function.params.size();i++)
+      params.push_back(builder.Emit(IrOp::PARAM, function.params[i], {}, i));
+    // Constant bounds stay constant in the body
+    first = start->op == IrOp::CONST ? builder.Const(Type::INT, start->imm) : params[2];
+    stride = step->op == IrOp::CONST ? builder.Const(Type::INT, step->imm) : params[4];
+    for(size_t i = 0;i<captures.size();i++)
+      builder.WriteVariable(captures[i], params[6 + i]);
+    for(const ReductionName& reduction : reductions)
+      builder.WriteVariable(reduction.slot, Identity(builder, reduction.kind, slotTypes[reduction.slot]));
+    LowerCounted(builder, params[0], params[1], builder.Const(Type::INT, 1));
+
+    builder.SetPosition(pos);
+    for(size_t i = 0;i<reductions.size();i++)
+      builder.Store(params[5], builder.Const(Type::INT, i), builder.ReadVariable(reductions[i].slot));
+    builder.Return(nullptr);
+  }
+
+  static IrInstruction* Identity(IrBuilder& builder, ReductionKind kind, Type type)
+  {
+    if(type == Type::INT)
+    {
+      int32_t identity = kind == ReductionKind::SUM ? 0 : kind == ReductionKind::MIN ? INT32_MAX : INT32_MIN;
+      return builder.Const(Type::INT, identity);
+    }
+    float identity = kind == ReductionKind::SUM ? 0.0f : kind == ReductionKind::MIN ? INFINITY : -INFINITY;
+    int32_t bits;
+    memcpy(&bits, &identity, sizeof(float));
+    return builder.Const(Type::FLOAT, bits);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "[PARALLEL FOR IN]" << std::endl;
+    for(const ReductionName& reduction : reductions)
+    {
+      static const char* kinds[] = {"sum", "min", "max"};
+      PrintIndent(os, indent+1);
+      os << "[REDUCTION] " << kinds[(int)reduction.kind] << " " << reduction.name << std::endl;
+    }
+    PrintIndent(os, indent+1);
+    os << "[VARIABLE]" << std::endl;
+    name->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[RANGE]" << std::endl;
+    range->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[BODY]" << std::endl;
+    body->PrintWithIndent(os, indent+2);
+  }
+};
+
+// for(int x in array) is an indexed loop over the elements of an array, the
+// characters of a string or the keys of a map in the order they were added.
+// The counter is always within the array so the elements are loaded without
+// bounds checks. Keys added by the body aren't visited.
+struct AstForEach : public AstCountedLoop
+{
+  AstExpression* array;
+  IrInstruction* arrayValue;
+
+  AstForEach(AstName* name, AstExpression* array, AstStatements* body)
+    : AstCountedLoop{name, body}, array{array}
+  {}
+
+  // Defined after AstVariable, which it looks for in parallel loops
+  bool Check(CheckData& data) override;
+
+  IrInstruction* LowerVariable(IrBuilder& builder, IrInstruction* counter) override
+  {
+    if(Types::IsMap(arrayValue->type))
+      return builder.MapOp(Opcode::MAP_KEY, name->type, {arrayValue, counter});
+    return builder.Load(name->type, arrayValue, counter);
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    arrayValue = array->LowerValue(builder);
+    IrInstruction* length = builder.Length(arrayValue);
+    LowerCounted(builder, builder.Const(Type::INT, 0), length, builder.Const(Type::INT, 1));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "[FOR IN]" << std::endl;
+    PrintIndent(os, indent+1);
+    os << "[VARIABLE]" << std::endl;
+    name->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[ARRAY]" << std::endl;
+    array->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[BODY]" << std::endl;
+    body->PrintWithIndent(os, indent+2);
+  }
+};
+
+struct AstReturn : public AstStatement
+{
+  AstExpression* value;
+
+  AstReturn(AstExpression* value)
+    : value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    if(data.parallel)
+      return Error("Cannot return from a parallel loop");
+    if(value == nullptr)
+    {
+      if(data.returnType != Type::VOID)
+        return Error("Missing return value");
+      return true;
+    }
+    RETURN_FALSE(value->Check(data));
+    if(value->type != data.returnType)
+      return Error(std::string("Returning ") + Types::GetName(value->type) + " from function returning " + Types::GetName(data.returnType));
+    return true;
+  }
+
+  void Lower(IrBuilder& builder) override
+  {
+    if(value)
+      value->LowerReturn(builder);
+    else
+      builder.Return(nullptr);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "[RETURN]" << std::endl;
+    if(value)
+      value->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstFunction : public AstNode
+{
+  AstName* name;
+  AstFuncParams* params;
+  // Null for declarations and bodies that haven't been parsed
+  AstStatements* body;
+  // Tokens of the file, the first token of the body after the opening brace
+  // and whether its expressions are shared while the body isn't parsed, see
+  // Parser::ParseLazy
+  std::shared_ptr<const std::vector<TokenPos>> lazyTokens;
+  size_t lazyBegin;
+  bool lazyShareExpressions;
+  std::vector<Type> slotTypes;
+  std::vector<AstCall*> calls;
+  AstFunction(AstName* name, AstFuncParams* params, AstStatements* body)
+    : name{name}, params{params}, body{body}, lazyBegin{0}, lazyShareExpressions{false}
+  {}
+
+  bool IsDeclaration() const
+  {
+    return body == nullptr && lazyTokens == nullptr;
+  }
+
+  bool IsLazy() const
+  {
+    return body == nullptr && lazyTokens != nullptr;
+  }
+
+  bool Check(CheckData& data) override
+  {
+    data.PushScope();
+    bool valid = params->Check(data) && body->CheckScope(data);
+    data.PopScope();
+    slotTypes = data.slotTypes;
+    calls = data.calls;
+    return valid;
+  }
+
+  void Lower(Program& program, IrFunction& function)
+  {
+    function.name = name->name;
+    function.returnType = name->type;
+    function.params = params->GetTypes();
+    IrBuilder builder{function, program, slotTypes};
+    builder.SetPosition(pos);
+    // Parameters occupy the first slots
+    for(size_t i = 0;i<function.params.size();i++)
+      builder.WriteVariable(i, builder.Emit(IrOp::PARAM, function.params[i], {}, i));
+    body->Lower(builder);
+
+    // Falling off the end returns the default value of the return type
+    builder.SetPosition(pos);
+    if(name->type == Type::VOID)
+      builder.Return(nullptr);
+    else
+      builder.Return(builder.Default(name->type));
+  }
+
+  // Lowers the body in place of a call with the given arguments, returns the
+  // result or nullptr if the function returns void. The locals are renamed to
+  // slots of their own in the caller.
+  IrInstruction* LowerInline(IrBuilder& builder, const std::vector<IrInstruction*>& args)
+  {
+    builder.EnterInline(name->name, slotTypes, name->type);
+    for(size_t i = 0;i<args.size();i++)
+      builder.WriteVariable(i, args[i]);
+    body->Lower(builder);
+    builder.SetPosition(pos);
+    builder.Return(name->type == Type::VOID ? nullptr : builder.Default(name->type));
+    return builder.LeaveInline();
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "[FUNCTION] " << std::endl;
+    PrintIndent(os, indent+1);
+    os << "[NAME] " << std::endl;
+    name->PrintWithIndent(os, indent+2);
+    PrintIndent(os, indent+1);
+    os << "[PARAMS] " << std::endl;
+    params->PrintWithIndent(os, indent+2);
+    if(body == nullptr)
+      return;
+    PrintIndent(os, indent+1);
+    os << "[BODY] " << std::endl;
+    body->PrintWithIndent(os, indent+2);
+  }
+};
+
+struct AstInt : public AstExpression
+{
+  int32_t value;
+  AstInt(int32_t value)
+    : value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    type = Type::INT;
+    return true;
+  }
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), std::hash<int32_t>{}(value));
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && value == static_cast<const AstInt*>(other)->value;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Const(type, value);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstInt " << value << std::endl;
+  }
+};
+
+struct AstFloat : public AstExpression
+{
+  float value;
+  AstFloat(float value)
+    : value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    type = Type::FLOAT;
+    return true;
+  }
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  // By bits, so 0.0 and -0.0 aren't the same
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), Bits());
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && Bits() == static_cast<const AstFloat*>(other)->Bits();
+  }
+
+  int32_t Bits() const
+  {
+    int32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Const(type, Bits());
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstFloat " << value << std::endl;
+  }
+};
+
+struct AstChar : public AstExpression
+{
+  char value;
+  AstChar(char value)
+    : value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    type = Type::CHAR;
+    return true;
+  }
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), std::hash<char>{}(value));
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && value == static_cast<const AstChar*>(other)->value;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Const(type, value);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstChar " << value << std::endl;
+  }
+};
+
+struct AstString : public AstExpression
+{
+  std::string value;
+  AstString(const std::string& value)
+    : value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    type = Type::STRING;
+    return true;
+  }
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), std::hash<std::string>{}(value));
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && value == static_cast<const AstString*>(other)->value;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Const(type, builder.GetProgram().AddString(value));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstString \"" << value << "\"" << std::endl;
+  }
+};
+
+struct AstVariable : public AstExpression
+{
+  std::string name;
+  // Variables with the same name and binding refer to the same declaration,
+  // set by the parser when expressions are shared
+  uint32_t binding;
+  int slot;
+  AstVariable(const std::string& name)
+    : name{name}, binding{0}, slot{-1}
+  {}
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(HashCombine(AstExpression::Hash(), std::hash<std::string>{}(name)), binding);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    if(!AstExpression::Equals(other))
+      return false;
+    const AstVariable* variable = static_cast<const AstVariable*>(other);
+    return name == variable->name && binding == variable->binding;
+  }
+
+  bool Check(CheckData& data) override
+  {
+    const Local* local = data.Find(name);
+    if(local == nullptr)
+      return Error("Undefined variable " + name);
+    type = local->type;
+    slot = local->slot;
+    if(data.parallel && slot < data.parallel->firstSlot)
+      data.parallel->reads.insert(slot);
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.ReadVariable(slot);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstVariable " << name << std::endl;
+  }
+};
+
+inline bool AstForEach::Check(CheckData& data)
+{
+  RETURN_FALSE(array->Check(data));
+  if(!Types::IsIndexable(array->type))
+    return Error(std::string("Cannot iterate over ") + Types::GetName(array->type));
+  // Reads every element, which a parallel loop must know of
+  AstVariable* variable = dynamic_cast<AstVariable*>(array);
+  if(data.parallel && variable && data.parallel->IsShared(variable->slot))
+    data.parallel->accesses.push_back({this, variable->name, variable->slot, false, false});
+  if(name->type != Types::IterationOf(array->type))
+    return Error(std::string("Loop variable must be of type ") + Types::GetName(Types::IterationOf(array->type)));
+  return CheckBody(data);
+}
+
+// Maps are changed in place, so the iterations of a parallel loop may only
+// read the maps declared before the loop and not pass them on
+inline bool IsSharedMap(CheckData& data, AstExpression* value)
+{
+  AstVariable* variable = dynamic_cast<AstVariable*>(value);
+  return data.parallel && variable && Types::IsMap(variable->type) && data.parallel->IsShared(variable->slot);
+}
+
+// Assigning a variable to another copies its value
+inline IrInstruction* LowerAssignedValue(IrBuilder& builder, AstExpression* value)
+{
+  IrInstruction* result = value->LowerValue(builder);
+  if(dynamic_cast<AstVariable*>(value))
+    return builder.Emit(IrOp::COPY, result->type, {result});
+  return result;
+}
+
+struct AstDeclaration : public AstExpression
+{
+  AstName* name;
+  AstExpression* value;
+  int slot;
+  AstDeclaration(AstName* name, AstExpression* value)
+    : name{name}, value{value}, slot{-1}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    if(value)
+    {
+      RETURN_FALSE(value->Check(data));
+      if(value->type != name->type)
+        return Error(std::string("Cannot assign ") + Types::GetName(value->type) + " to " + Types::GetName(name->type));
+      if(IsSharedMap(data, value))
+        return Error("Cannot assign the shared map " + static_cast<AstVariable*>(value)->name + " in a parallel loop");
+    }
+    const Local* local = data.Declare(name->name, name->type);
+    if(local == nullptr)
+      return Error("Redefinition of variable " + name->name);
+    type = name->type;
+    slot = local->slot;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* result = value ? LowerAssignedValue(builder, value) : builder.Default(type);
+    builder.WriteVariable(slot, result);
+    return result;
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstDeclaration" << std::endl;
+    name->PrintWithIndent(os, indent+1);
+    if(value)
+      value->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstAssign : public AstExpression
+{
+  AstVariable* target;
+  AstExpression* value;
+  AstAssign(AstVariable* target, AstExpression* value)
+    : target{target}, value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(target->Check(data));
+    RETURN_FALSE(value->Check(data));
+    if(value->type != target->type)
+      return Error(std::string("Cannot assign ") + Types::GetName(value->type) + " to " + Types::GetName(target->type));
+    if(data.parallel && data.parallel->IsShared(target->slot))
+      return Error("Cannot assign " + target->name + " in a parallel loop unless it is a reduction");
+    if(IsSharedMap(data, value))
+      return Error("Cannot assign the shared map " + static_cast<AstVariable*>(value)->name + " in a parallel loop");
+    if(data.parallel && target->slot == data.parallel->firstSlot)
+      data.parallel->variableAssigned = true;
+    type = target->type;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* result = LowerAssignedValue(builder, value);
+    builder.WriteVariable(target->slot, result);
+    return result;
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstAssign" << std::endl;
+    target->PrintWithIndent(os, indent+1);
+    value->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstIndex : public AstExpression
+{
+  AstExpression* array;
+  AstExpression* index;
+  AstIndex(AstExpression* array, AstExpression* index)
+    : array{array}, index{index}
+  {}
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(HashCombine(AstExpression::Hash(), (size_t)array), (size_t)index);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    if(!AstExpression::Equals(other))
+      return false;
+    const AstIndex* element = static_cast<const AstIndex*>(other);
+    return array == element->array && index == element->index;
+  }
+
+  bool Check(CheckData& data) override
+  {
+    bool store = data.parallel && data.parallel->storing;
+    if(data.parallel)
+      data.parallel->storing = false;
+    RETURN_FALSE(array->Check(data));
+    RETURN_FALSE(index->Check(data));
+    if(!Types::IsIndexable(array->type))
+      return Error(std::string("Cannot index ") + Types::GetName(array->type));
+    if(Types::IsMap(array->type))
+      return CheckMap(data, store);
+    if(index->type != Type::INT)
+      return Error("Index must be of type int");
+    type = Types::ElementOf(array->type);
+    if(data.parallel)
+      AddAccess(*data.parallel, store);
+    return true;
+  }
+
+  bool CheckMap(CheckData& data, bool store)
+  {
+    Type key = Types::KeyOf(array->type);
+    if(index->type != key)
+      return Error(std::string("Key must be of type ") + Types::GetName(key));
+    if(store && IsSharedMap(data, array))
+      return Error("Cannot store to the shared map " + static_cast<AstVariable*>(array)->name + " in a parallel loop");
+    type = Types::ElementOf(array->type);
+    return true;
+  }
+
+  // Records the element if it belongs to an array shared by the iterations
+  // of a parallel loop
+  void AddAccess(ParallelCheck& parallel, bool store)
+  {
+    AstVariable* variable = dynamic_cast<AstVariable*>(array);
+    if(variable == nullptr || !parallel.IsShared(variable->slot))
+      return;
+    AstVariable* indexVariable = dynamic_cast<AstVariable*>(index);
+    bool atVariable = indexVariable && indexVariable->slot == parallel.firstSlot;
+    parallel.accesses.push_back({this, variable->name, variable->slot, store, atVariable});
+  }
+
+  // Emits the bounds check and returns the array and index
+  std::pair<IrInstruction*, IrInstruction*> LowerChecked(IrBuilder& builder)
+  {
+    IrInstruction* arrayValue = array->LowerValue(builder);
+    IrInstruction* indexValue = index->LowerValue(builder);
+    builder.Emit(IrOp::CHECK, Type::VOID, {arrayValue, indexValue});
+    return {arrayValue, indexValue};
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    if(Types::IsMap(array->type))
+    {
+      IrInstruction* map = array->LowerValue(builder);
+      IrInstruction* key = index->LowerValue(builder);
+      Opcode opcode = index->type == Type::STRING ? Opcode::MAP_GET_STRING : Opcode::MAP_GET_INT;
+      return builder.MapOp(opcode, type, {map, key});
+    }
+    auto element = LowerChecked(builder);
+    return builder.Load(type, element.first, element.second);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstIndex" << std::endl;
+    array->PrintWithIndent(os, indent+1);
+    index->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstAssignIndex : public AstExpression
+{
+  AstIndex* target;
+  AstExpression* value;
+  AstAssignIndex(AstIndex* target, AstExpression* value)
+    : target{target}, value{value}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    if(data.parallel)
+      data.parallel->storing = true;
+    RETURN_FALSE(target->Check(data));
+    RETURN_FALSE(value->Check(data));
+    if(target->array->type == Type::STRING)
+      return Error("Cannot assign to a character of a string");
+    if(value->type != target->type)
+      return Error(std::string("Cannot assign ") + Types::GetName(value->type) + " to " + Types::GetName(target->type));
+    type = target->type;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    if(Types::IsMap(target->array->type))
+    {
+      IrInstruction* map = target->array->LowerValue(builder);
+      IrInstruction* key = target->index->LowerValue(builder);
+      IrInstruction* result = value->LowerValue(builder);
+      Opcode opcode = key->type == Type::STRING ? Opcode::MAP_SET_STRING : Opcode::MAP_SET_INT;
+      builder.MapOp(opcode, Type::VOID, {map, key, result});
+      return result;
+    }
+    auto element = target->LowerChecked(builder);
+    IrInstruction* result = value->LowerValue(builder);
+    builder.Store(element.first, element.second, result);
+    return result;
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstAssignIndex" << std::endl;
+    target->PrintWithIndent(os, indent+1);
+    value->PrintWithIndent(os, indent+1);
+  }
+};
+
+// int[n] creates an array of n zeroed elements
+struct AstNewArray : public AstExpression
+{
+  Type element;
+  AstExpression* length;
+  AstNewArray(Type element, AstExpression* length)
+    : element{element}, length{length}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(length->Check(data));
+    type = Types::ArrayOf(element);
+    if(type == Type::INVALID)
+      return Error(std::string("Cannot create an array of ") + Types::GetName(element));
+    if(length->type != Type::INT)
+      return Error("Array length must be of type int");
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* lengthValue = length->LowerValue(builder);
+    builder.SetPosition(pos);
+    return builder.Emit(IrOp::NEW_ARRAY, type, {lengthValue}, Types::GetSize(element));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstNewArray " << element << std::endl;
+    length->PrintWithIndent(os, indent+1);
+  }
+};
+
+// int[string] creates an empty map from strings to ints
+struct AstNewMap : public AstExpression
+{
+  AstNewMap(Type map)
+  {
+    type = map;
+  }
+
+  bool Check(CheckData& data) override
+  {
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    builder.SetPosition(pos);
+    return builder.NewMap(type);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstNewMap " << type << std::endl;
+  }
+};
+
+// has(m, key) is 1 if the map has the key and 0 otherwise
+struct AstHas : public AstExpression
+{
+  AstExpression* map;
+  AstExpression* key;
+  AstHas(AstExpression* map, AstExpression* key)
+    : map{map}, key{key}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(map->Check(data));
+    RETURN_FALSE(key->Check(data));
+    if(!Types::IsMap(map->type))
+      return Error(std::string("Cannot look up a key in ") + Types::GetName(map->type));
+    if(key->type != Types::KeyOf(map->type))
+      return Error(std::string("Key must be of type ") + Types::GetName(Types::KeyOf(map->type)));
+    type = Type::INT;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* mapValue = map->LowerValue(builder);
+    IrInstruction* keyValue = key->LowerValue(builder);
+    Opcode opcode = key->type == Type::STRING ? Opcode::MAP_HAS_STRING : Opcode::MAP_HAS_INT;
+    return builder.MapOp(opcode, Type::INT, {mapValue, keyValue});
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstHas" << std::endl;
+    map->PrintWithIndent(os, indent+1);
+    key->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstLength : public AstExpression
+{
+  AstExpression* array;
+  AstLength(AstExpression* array)
+    : array{array}
+  {}
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), (size_t)array);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && array == static_cast<const AstLength*>(other)->array;
+  }
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(array->Check(data));
+    if(!Types::IsIndexable(array->type))
+      return Error(std::string("Cannot take the length of ") + Types::GetName(array->type));
+    type = Type::INT;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Length(array->LowerValue(builder));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstLength" << std::endl;
+    array->PrintWithIndent(os, indent+1);
+  }
+};
+
+// substr(s, start, count) is the part of s starting at start with count
+// characters, both are clamped to the string
+struct AstSubstring : public AstExpression
+{
+  AstExpression* str;
+  AstExpression* start;
+  AstExpression* count;
+  AstSubstring(AstExpression* str, AstExpression* start, AstExpression* count)
+    : str{str}, start{start}, count{count}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(str->Check(data));
+    RETURN_FALSE(start->Check(data));
+    RETURN_FALSE(count->Check(data));
+    if(str->type != Type::STRING)
+      return Error(std::string("Cannot take a substring of ") + Types::GetName(str->type));
+    if(start->type != Type::INT || count->type != Type::INT)
+      return Error("Substring start and count must be of type int");
+    type = Type::STRING;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* value = str->LowerValue(builder);
+    IrInstruction* startValue = start->LowerValue(builder);
+    IrInstruction* countValue = count->LowerValue(builder);
+    builder.SetPosition(pos);
+    IrInstruction* suffix = builder.Binary(Opcode::DROP_STRING, Type::STRING, value, startValue);
+    return builder.Binary(Opcode::TAKE_STRING, Type::STRING, suffix, countValue);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstSubstring" << std::endl;
+    str->PrintWithIndent(os, indent+1);
+    start->PrintWithIndent(os, indent+1);
+    count->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstFuncArgs : public AstNode
+{
+  AstExpression* first;
+  AstFuncArgs* tail;
+  AstFuncArgs(AstExpression* first, AstFuncArgs* tail)
+    : first{first}, tail{tail}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    if(first)
+      RETURN_FALSE(first->Check(data));
+    if(tail)
+      RETURN_FALSE(tail->Check(data));
+    return true;
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstFuncArgs" << std::endl;
+    if(first)
+    {
+      first->PrintWithIndent(os, indent+1);
+      if(tail)
+        tail->PrintWithIndent(os, indent);
+    }
+  }
+};
+
+struct AstCall : public AstExpression
+{
+  std::string name;
+  AstFuncArgs* args;
+  int index;
+  CallKind kind;
+  // Function whose body replaces the call, set by the Inliner
+  AstFunction* inlined;
+  AstCall(const std::string& name, AstFuncArgs* args)
+    : name{name}, args{args}, index{-1}, kind{CallKind::SCRIPT}, inlined{nullptr}
+  {}
+
+  bool Check(CheckData& data) override
+  {
+    const FunctionSignature* signature = data.FindFunction(name);
+    if(signature == nullptr && Builtins::Has(name))
+      return CheckBuiltin(data);
+    if(signature == nullptr)
+      return Error("Undefined function " + name);
+    RETURN_FALSE(args->Check(data));
+    size_t i = 0;
+    for(AstFuncArgs* arg = args; arg && arg->first; arg = arg->tail, i++)
+    {
+      if(i >= signature->params.size())
+        return Error("Too many arguments to " + name);
+      if(arg->first->type != signature->params[i])
+        return Error(std::string("Argument ") + std::to_string(i + 1) + " to " + name + " must be of type " + Types::GetName(signature->params[i]));
+      if(IsSharedMap(data, arg->first))
+        return Error("Cannot pass the shared map " + static_cast<AstVariable*>(arg->first)->name + " in a parallel loop");
+    }
+    if(i != signature->params.size())
+      return Error("Too few arguments to " + name);
+    type = signature->returnType;
+    index = signature->index;
+    kind = signature->kind;
+    if(kind == CallKind::SCRIPT)
+      data.calls.push_back(this);
+    return true;
+  }
+
+  // The version of the builtin is picked by the types of the arguments
+  bool CheckBuiltin(CheckData& data)
+  {
+    RETURN_FALSE(args->Check(data));
+    std::vector<Type> types;
+    for(AstFuncArgs* arg = args; arg && arg->first; arg = arg->tail)
+      types.push_back(arg->first->type);
+    const BuiltinSignature* builtin = Builtins::Find(name, types);
+    if(builtin == nullptr)
+    {
+      std::string names;
+      for(Type argType : types)
+        names += std::string(names.empty() ? "" : ", ") + Types::GetName(argType);
+      return Error("No version of " + name + " takes (" + names + ")");
+    }
+    type = builtin->returnType;
+    index = (int)builtin->builtin;
+    kind = CallKind::BUILTIN;
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    if(inlined)
+    {
+      std::vector<IrInstruction*> values;
+      for(AstFuncArgs* arg = args; arg && arg->first; arg = arg->tail)
+        values.push_back(LowerAssignedValue(builder, arg->first));
+      IrInstruction* result = inlined->LowerInline(builder, values);
+      builder.SetPosition(pos);
+      return result;
+    }
+    std::vector<IrInstruction*> values;
+    for(AstFuncArgs* arg = args; arg && arg->first; arg = arg->tail)
+      values.push_back(arg->first->LowerValue(builder));
+    // Builtins don't allocate, so the heap isn't collected while they run.
+    // Arrays they return are allocated before with the length of the first.
+    if(kind == CallKind::BUILTIN && Builtins::ReturnsArray((Builtin)index))
+    {
+      IrInstruction* length = builder.Length(values[0]);
+      values.insert(values.begin(), builder.Emit(IrOp::NEW_ARRAY, type, {length}, Types::GetSize(Types::ElementOf(type))));
+    }
+    if(kind == CallKind::BUILTIN)
+      return builder.Emit(IrOp::CALL_BUILTIN, type, values, index);
+    IrOp op = kind == CallKind::HOST ? IrOp::CALL_HOST : kind == CallKind::IMPORT ? IrOp::CALL_IMPORT : IrOp::CALL;
+    return builder.Emit(op, type, values, index);
+  }
+
+  // Calls to script functions in tail position are always tail calls, so
+  // recursion through them runs in constant stack space. Imports might be
+  // host functions so they are called normally, and inlined functions can't
+  // replace the frame of their caller.
+  void LowerReturn(IrBuilder& builder) override
+  {
+    if(kind != CallKind::SCRIPT || inlined || builder.IsInlining())
+    {
+      AstExpression::LowerReturn(builder);
+      return;
+    }
+    std::vector<IrInstruction*> values;
+    for(AstFuncArgs* arg = args; arg && arg->first; arg = arg->tail)
+      values.push_back(arg->first->LowerValue(builder));
+    builder.TailCall(index, values);
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstCall " << name << std::endl;
+    args->PrintWithIndent(os, indent+1);
+  }
+};
+
+struct AstBinOp : public AstExpression
+{
+  protected:
+    AstExpression* left;
+    AstExpression* right;
+  public:
+    AstBinOp(AstExpression* left, AstExpression* right)
+      : AstExpression{}, left{left}, right{right}
+    {}
+
+  // Shared concatenations attribute their allocations to the first
+  // occurrence
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(HashCombine(AstExpression::Hash(), (size_t)left), (size_t)right);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    if(!AstExpression::Equals(other))
+      return false;
+    const AstBinOp* binOp = static_cast<const AstBinOp*>(other);
+    return left == binOp->left && right == binOp->right;
+  }
+
+  void Print(std::ostream& os, size_t indent)
+  {
+    os << GetName() << std::endl;
+    left->PrintWithIndent(os, indent+1);
+    right->PrintWithIndent(os, indent+1);
+  }
+
+  bool Check(CheckData& data)
+  {
+    RETURN_FALSE(left->Check(data));
+    RETURN_FALSE(right->Check(data));
+    if(left->type != right->type)
+      return Error(std::string("Mismatching types ") + Types::GetName(left->type) + " and " + Types::GetName(right->type) + " in " + GetName());
+    type = GetType(left->type);
+    if(type == Type::INVALID)
+      return Error(std::string("Invalid operand type ") + Types::GetName(left->type) + " in " + GetName());
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    IrInstruction* l = left->LowerValue(builder);
+    IrInstruction* r = right->LowerValue(builder);
+    // Concatenations allocate, they are attributed to the operator
+    if(type == Type::STRING)
+      builder.SetPosition(pos);
+    return builder.Binary(GetOpcode(left->type), type, l, r);
+  }
+
+  // Returns the resulting type for the given operand type or INVALID if the
+  // operand type isn't supported
+  virtual Type GetType(Type operand) = 0;
+  virtual Opcode GetOpcode(Type operand) = 0;
+  virtual const char* GetName() = 0;
+};
+
+struct AstArithmetic : public AstBinOp
+{
+  public:
+    AstArithmetic(AstExpression* left, AstExpression* right)
+      : AstBinOp{left, right}
+    {}
+
+  Type GetType(Type operand) override
+  {
+    if(operand == Type::INT || operand == Type::FLOAT)
+      return operand;
+    return Type::INVALID;
+  }
+};
+
+struct AstCompare : public AstBinOp
+{
+  public:
+    AstCompare(AstExpression* left, AstExpression* right)
       : AstBinOp{left, right}
     {}
+
+  Type GetType(Type operand) override
+  {
+    if(operand == Type::INT || operand == Type::FLOAT || operand == Type::CHAR || operand == Type::STRING)
+      return Type::INT;
+    return Type::INVALID;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    // Comparisons without an opcode for strings compare the strings once and
+    // test the sign of the result
+    if(left->type != Type::STRING || GetOpcode(Type::STRING) != GetOpcode(Type::INT))
+      return AstBinOp::LowerValue(builder);
+    IrInstruction* l = left->LowerValue(builder);
+    IrInstruction* r = right->LowerValue(builder);
+    IrInstruction* compare = builder.Binary(Opcode::COMPARE_STRING, Type::INT, l, r);
+    return builder.Binary(GetOpcode(Type::INT), Type::INT, compare, builder.Const(Type::INT, 0));
+  }
+};
+
+#define AST_BINOP(Name, Base, op) \
+struct Ast##Name : public Base \
+{ \
+  public: \
+    Ast##Name(AstExpression* left, AstExpression* right) \
+      : Base{left, right} \
+    {} \
+ \
+  Opcode GetOpcode(Type operand) override \
+  { \
+    return operand == Type::FLOAT ? Opcode::op##_FLOAT : Opcode::op##_INT; \
+  } \
+ \
+  const char* GetName() override { return "Ast" #Name; } \
+};
+
+AST_BINOP(Sub, AstArithmetic, SUB)
+AST_BINOP(Mul, AstArithmetic, MUL)
+AST_BINOP(Div, AstArithmetic, DIV)
+AST_BINOP(LT, AstCompare, LT)
+AST_BINOP(GT, AstCompare, GT)
+AST_BINOP(LTE, AstCompare, LE)
+AST_BINOP(GTE, AstCompare, GE)
+
+#undef AST_BINOP
+
+struct AstAdd : public AstArithmetic
+{
+  public:
+    AstAdd(AstExpression* left, AstExpression* right)
+      : AstArithmetic{left, right}
+    {}
+
+  Type GetType(Type operand) override
+  {
+    if(operand == Type::STRING)
+      return operand;
+    return AstArithmetic::GetType(operand);
+  }
+
+  Opcode GetOpcode(Type operand) override
+  {
+    if(operand == Type::STRING)
+      return Opcode::ADD_STRING;
+    return operand == Type::FLOAT ? Opcode::ADD_FLOAT : Opcode::ADD_INT;
+  }
+
+  const char* GetName() override { return "AstAdd"; }
+};
+
+struct AstEqual : public AstCompare
+{
+  public:
+    AstEqual(AstExpression* left, AstExpression* right)
+      : AstCompare{left, right}
+    {}
+
+  Opcode GetOpcode(Type operand) override
+  {
+    if(operand == Type::STRING)
+      return Opcode::EQ_STRING;
+    return operand == Type::FLOAT ? Opcode::EQ_FLOAT : Opcode::EQ_INT;
+  }
+
+  const char* GetName() override { return "AstEqual"; }
+};
+
+struct AstNEqual : public AstCompare
+{
+  public:
+    AstNEqual(AstExpression* left, AstExpression* right)
+      : AstCompare{left, right}
+    {}
+
+  Opcode GetOpcode(Type operand) override
+  {
+    if(operand == Type::STRING)
+      return Opcode::NE_STRING;
+    return operand == Type::FLOAT ? Opcode::NE_FLOAT : Opcode::NE_INT;
+  }
+
+  const char* GetName() override { return "AstNEqual"; }
+};
+
+// Short circuiting && and ||, the result is always 0 or 1
+struct AstLogical : public AstBinOp
+{
+  private:
+    Opcode jump;
+  public:
+    AstLogical(AstExpression* left, AstExpression* right, Opcode jump)
+      : AstBinOp{left, right}, jump{jump}
+    {}
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstBinOp::Hash(), (size_t)jump);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstBinOp::Equals(other) && jump == static_cast<const AstLogical*>(other)->jump;
+  }
+
+  Type GetType(Type operand) override
+  {
+    return operand == Type::INT ? Type::INT : Type::INVALID;
+  }
+
+  Opcode GetOpcode(Type operand) override
+  {
+    return Opcode::BOOL;
+  }
+
+  const char* GetName() override { return jump == Opcode::JUMP_IF_FALSE ? "AstAnd" : "AstOr"; }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    // The result is merged through a variable that only exists in the IR
+    int result = builder.CreateVariable(Type::INT);
+    IrInstruction* l = builder.Unary(Opcode::BOOL, Type::INT, left->LowerValue(builder));
+    builder.WriteVariable(result, l);
+
+    IrBlock* rightBlock = builder.CreateBlock();
+    IrBlock* endBlock = builder.CreateBlock();
+    if(jump == Opcode::JUMP_IF_FALSE)
+      builder.Branch(l, rightBlock, endBlock);
+    else
+      builder.Branch(l, endBlock, rightBlock);
+
+    builder.SealBlock(rightBlock);
+    builder.SetBlock(rightBlock);
+    builder.WriteVariable(result, builder.Unary(Opcode::BOOL, Type::INT, right->LowerValue(builder)));
+    builder.Jump(endBlock);
+
+    builder.SealBlock(endBlock);
+    builder.SetBlock(endBlock);
+    return builder.ReadVariable(result);
+  }
+};
+
+struct AstUnOp : public AstExpression
+{
+  protected:
+    AstExpression* expr;
+  public:
+    AstUnOp(AstExpression* expr)
+      : AstExpression{}, expr{expr}
+    {}
+
+  bool IsShareable() const override
+  {
+    return true;
+  }
+
+  size_t Hash() const override
+  {
+    return HashCombine(AstExpression::Hash(), (size_t)expr);
+  }
+
+  bool Equals(const AstExpression* other) const override
+  {
+    return AstExpression::Equals(other) && expr == static_cast<const AstUnOp*>(other)->expr;
+  }
+
+  bool Check(CheckData& data)
+  {
+    RETURN_FALSE(expr->Check(data));
+    type = expr->type;
+    return true;
+  }
 };
 
 struct AstUMinus : public AstUnOp
@@ -347,6 +2210,25 @@ struct AstUMinus : public AstUnOp
     AstUMinus(AstExpression* expr)
       : AstUnOp{expr}
     {}
+
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(AstUnOp::Check(data));
+    if(type != Type::INT && type != Type::FLOAT)
+      return Error(std::string("Cannot negate ") + Types::GetName(type));
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Unary(type == Type::FLOAT ? Opcode::NEG_FLOAT : Opcode::NEG_INT, type, expr->LowerValue(builder));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstUMinus" << std::endl;
+    expr->PrintWithIndent(os, indent+1);
+  }
 };
 
 struct AstNot : public AstUnOp
@@ -355,8 +2237,23 @@ struct AstNot : public AstUnOp
     AstNot(AstExpression* expr)
       : AstUnOp{expr}
     {}
-};
 
-struct AstFor
-{
+  bool Check(CheckData& data) override
+  {
+    RETURN_FALSE(AstUnOp::Check(data));
+    if(type != Type::INT)
+      return Error(std::string("Cannot apply ! to ") + Types::GetName(type));
+    return true;
+  }
+
+  IrInstruction* LowerValue(IrBuilder& builder) override
+  {
+    return builder.Unary(Opcode::NOT, type, expr->LowerValue(builder));
+  }
+
+  void Print(std::ostream& os, size_t indent) override
+  {
+    os << "AstNot" << std::endl;
+    expr->PrintWithIndent(os, indent+1);
+  }
 };
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "Simd.h"
+#include "Type.h"
+#include "Value.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Numeric library over int and float arrays. The functions are called like
+// script functions, a script function of the same name is called instead.
+// Each name takes either int or float arrays, picked by the arguments, and
+// runs the kernel of the same name at the current Simd level. Functions
+// returning an array fill one allocated by the caller, see AstCall.
+#define LIST_BUILTINS \
+  BUILTIN(SUM_INT, "sum", Type::INT, Type::INT_ARRAY) \
+  BUILTIN(SUM_FLOAT, "sum", Type::FLOAT, Type::FLOAT_ARRAY) \
+  BUILTIN(MIN_INT, "min", Type::INT, Type::INT_ARRAY) \
+  BUILTIN(MIN_FLOAT, "min", Type::FLOAT, Type::FLOAT_ARRAY) \
+  BUILTIN(MAX_INT, "max", Type::INT, Type::INT_ARRAY) \
+  BUILTIN(MAX_FLOAT, "max", Type::FLOAT, Type::FLOAT_ARRAY) \
+  BUILTIN(DOT_INT, "dot", Type::INT, Type::INT_ARRAY, Type::INT_ARRAY) \
+  BUILTIN(DOT_FLOAT, "dot", Type::FLOAT, Type::FLOAT_ARRAY, Type::FLOAT_ARRAY) \
+  BUILTIN(PREFIX_INT, "prefix", Type::INT_ARRAY, Type::INT_ARRAY) \
+  BUILTIN(PREFIX_FLOAT, "prefix", Type::FLOAT_ARRAY, Type::FLOAT_ARRAY) \
+  BUILTIN(SCALE_INT, "scale", Type::INT_ARRAY, Type::INT_ARRAY, Type::INT) \
+  BUILTIN(SCALE_FLOAT, "scale", Type::FLOAT_ARRAY, Type::FLOAT_ARRAY, Type::FLOAT) \
+  BUILTIN(CLAMP_INT, "clamp", Type::INT_ARRAY, Type::INT_ARRAY, Type::INT, Type::INT) \
+  BUILTIN(CLAMP_FLOAT, "clamp", Type::FLOAT_ARRAY, Type::FLOAT_ARRAY, Type::FLOAT, Type::FLOAT)
+
+enum class Builtin
+{
+#define BUILTIN(name, function, returnType, ...) name,
+  LIST_BUILTINS
+#undef BUILTIN
+};
+
+struct BuiltinSignature
+{
+  Builtin builtin;
+  const char* name;
+  Type returnType;
+  std::vector<Type> params;
+};
+
+class Builtins
+{
+  public:
+    static const std::vector<BuiltinSignature>& GetSignatures()
+    {
+      static const std::vector<BuiltinSignature> signatures{
+#define BUILTIN(name, function, returnType, ...) {Builtin::name, function, returnType, {__VA_ARGS__}},
+        LIST_BUILTINS
+#undef BUILTIN
+      };
+      return signatures;
+    }
+
+    static bool Has(const std::string& name)
+    {
+      for(const BuiltinSignature& signature : GetSignatures())
+      {
+        if(name == signature.name)
+          return true;
+      }
+      return false;
+    }
+
+    // Returns the version of the function taking the arguments or nullptr
+    static const BuiltinSignature* Find(const std::string& name, const std::vector<Type>& args)
+    {
+      for(const BuiltinSignature& signature : GetSignatures())
+      {
+        if(name == signature.name && args == signature.params)
+          return &signature;
+      }
+      return nullptr;
+    }
+
+    // Whether the result is written to an array passed before the arguments
+    static bool ReturnsArray(Builtin builtin)
+    {
+      return Types::IsArray(GetSignatures()[(int)builtin].returnType);
+    }
+
+    // Runs the function on the arguments, the result replaces the first.
+    // Returns the error message or nullptr.
+    static const char* Run(Builtin builtin, Value* args)
+    {
+      const SimdKernels& kernels = Simd::Kernels();
+      switch(builtin)
+      {
+        case Builtin::SUM_INT: return Fold(kernels.SUM_INT, args, false);
+        case Builtin::SUM_FLOAT: return Fold(kernels.SUM_FLOAT, args, false);
+        case Builtin::MIN_INT: return Fold(kernels.MIN_INT, args, true);
+        case Builtin::MIN_FLOAT: return Fold(kernels.MIN_FLOAT, args, true);
+        case Builtin::MAX_INT: return Fold(kernels.MAX_INT, args, true);
+        case Builtin::MAX_FLOAT: return Fold(kernels.MAX_FLOAT, args, true);
+        case Builtin::DOT_INT: return Dot(kernels.DOT_INT, args);
+        case Builtin::DOT_FLOAT: return Dot(kernels.DOT_FLOAT, args);
+        case Builtin::PREFIX_INT:
+        case Builtin::PREFIX_FLOAT:
+        {
+          SimdUnary kernel = builtin == Builtin::PREFIX_INT ? kernels.PREFIX_INT : kernels.PREFIX_FLOAT;
+          kernel(args[0].a->Data<int32_t>(), args[1].a->Data<int32_t>(), args[1].a->length);
+          return nullptr;
+        }
+        case Builtin::SCALE_INT: return Map(kernels.SCALE_INT, args, 1);
+        case Builtin::SCALE_FLOAT: return Map(kernels.SCALE_FLOAT, args, 1);
+        case Builtin::CLAMP_INT: return Map(kernels.CLAMP_INT, args, 2);
+        case Builtin::CLAMP_FLOAT: return Map(kernels.CLAMP_FLOAT, args, 2);
+      }
+      return "Invalid builtin";
+    }
+
+  private:
+    // Min and max have no value for an empty array
+    static const char* Fold(SimdFold kernel, Value* args, bool needsElements)
+    {
+      Array* array = args[0].a;
+      if(needsElements && array->length == 0)
+        return "Array is empty";
+      kernel(&args[0], array->Data<int32_t>(), array->length);
+      return nullptr;
+    }
+
+    static const char* Dot(SimdDot kernel, Value* args)
+    {
+      Array* a = args[0].a;
+      Array* b = args[1].a;
+      if(a->length != b->length)
+        return "Arrays differ in length";
+      kernel(&args[0], a->Data<int32_t>(), b->Data<int32_t>(), a->length);
+      return nullptr;
+    }
+
+    // The scalars follow the array, ints and floats are both 4 bytes
+    static const char* Map(SimdMap kernel, Value* args, int count)
+    {
+      int32_t scalars[2];
+      for(int i = 0;i<count;i++)
+        scalars[i] = args[2 + i].i;
+      kernel(args[0].a->Data<int32_t>(), args[1].a->Data<int32_t>(), scalars, args[1].a->length);
+      return nullptr;
+    }
+};
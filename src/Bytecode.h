@@ -0,0 +1,583 @@
+#pragma once
+
+#include "Heap.h"
+#include "Type.h"
+#include "Value.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Register based instructions. Unless stated otherwise a is the destination
+// register and b, c are the operand registers. Jumps store the target in a.
+#define LIST_OPCODES \
+  OPCODE(NOP) \
+  OPCODE(LOAD_INT)      /* a = b */ \
+  OPCODE(LOAD_FLOAT)    /* a = bitcast(b) */ \
+  OPCODE(LOAD_STRING)   /* a = string constant b */ \
+  OPCODE(MOVE) \
+  OPCODE(ADD_INT) \
+  OPCODE(SUB_INT) \
+  OPCODE(MUL_INT) \
+  OPCODE(DIV_INT) \
+  OPCODE(ADD_FLOAT) \
+  OPCODE(SUB_FLOAT) \
+  OPCODE(MUL_FLOAT) \
+  OPCODE(DIV_FLOAT) \
+  OPCODE(ADD_STRING) \
+  OPCODE(NEG_INT) \
+  OPCODE(NEG_FLOAT) \
+  OPCODE(NOT) \
+  OPCODE(BOOL)          /* a = b != 0 */ \
+  OPCODE(EQ_INT) \
+  OPCODE(NE_INT) \
+  OPCODE(LT_INT) \
+  OPCODE(LE_INT) \
+  OPCODE(GT_INT) \
+  OPCODE(GE_INT) \
+  OPCODE(EQ_FLOAT) \
+  OPCODE(NE_FLOAT) \
+  OPCODE(LT_FLOAT) \
+  OPCODE(LE_FLOAT) \
+  OPCODE(GT_FLOAT) \
+  OPCODE(GE_FLOAT) \
+  OPCODE(EQ_STRING) \
+  OPCODE(NE_STRING) \
+  OPCODE(COMPARE_STRING)     /* a = -1, 0 or 1 as b is less, equal or greater than c */ \
+  OPCODE(STRING_LENGTH)      /* a = length of b */ \
+  OPCODE(CHECK_STRING_INDEX) /* error unless 0 <= c < length of b */ \
+  OPCODE(LOAD_STRING_CHAR)   /* a = b[c] */ \
+  OPCODE(DROP_STRING)        /* a = b without its first c characters, clamped */ \
+  OPCODE(TAKE_STRING)        /* a = the first c characters of b, clamped */ \
+  OPCODE(NEW_ARRAY)          /* a = zeroed array of length b with elements of c bytes */ \
+  OPCODE(LOAD_EMPTY_ARRAY)   /* a = array without elements */ \
+  OPCODE(ARRAY_LENGTH)       /* a = length of b */ \
+  OPCODE(CHECK_INDEX)        /* error unless 0 <= c < length of b */ \
+  OPCODE(LOAD_ELEMENT)       /* a = b[c] for int and float elements */ \
+  OPCODE(LOAD_ELEMENT_CHAR)  /* a = b[c] */ \
+  OPCODE(STORE_ELEMENT)      /* a[b] = c for int and float elements */ \
+  OPCODE(STORE_ELEMENT_CHAR) /* a[b] = c */ \
+  OPCODE(NEW_MAP)            /* a = empty map with the Map::kind b */ \
+  OPCODE(MAP_LENGTH)         /* a = length of b */ \
+  OPCODE(MAP_HAS_INT)        /* a = b has the key c */ \
+  OPCODE(MAP_HAS_STRING)     /* a = b has the key c */ \
+  OPCODE(MAP_GET_INT)        /* a = b[c], error unless b has the key c */ \
+  OPCODE(MAP_GET_STRING)     /* a = b[c], error unless b has the key c */ \
+  OPCODE(MAP_SET_INT)        /* a[b] = c */ \
+  OPCODE(MAP_SET_STRING)     /* a[b] = c */ \
+  OPCODE(MAP_KEY)            /* a = key of the c:th entry of b */ \
+  OPCODE(JUMP)          /* goto a */ \
+  OPCODE(JUMP_IF_FALSE) /* if !b goto a */ \
+  OPCODE(JUMP_IF_TRUE)  /* if b goto a */ \
+  OPCODE(CALL)          /* functions[a] with frame starting at b, result in b */ \
+  OPCODE(CALL_HOST)     /* hostCalls[a] with arguments starting at b, result in b */ \
+  OPCODE(CALL_IMPORT)   /* imports[a], replaced by CALL or CALL_HOST when linked */ \
+  OPCODE(CALL_BUILTIN)  /* Builtin a with arguments starting at b, result in b */ \
+  OPCODE(TAIL_CALL)     /* functions[a] in place of the current frame with c arguments starting at b */ \
+  OPCODE(VECTOR_LOOP)   /* vectorLoops[a] with operands starting at b */ \
+  OPCODE(PARALLEL_FOR)  /* parallelLoops[a] with operands starting at b */ \
+  OPCODE(COMPILE)       /* compiles functions[a], the current function, and runs it */ \
+  OPCODE(CALL_NATIVE)   /* runs the native code of functions[a], the current function, on its registers */ \
+  OPCODE(RETURN)        /* return a */ \
+  OPCODE(RETURN_VOID) \
+
+enum class Opcode : uint8_t
+{
+#define OPCODE(x) x,
+  LIST_OPCODES
+#undef OPCODE
+};
+
+class Opcodes
+{
+  public:
+    static const char* GetName(Opcode opcode)
+    {
+      switch(opcode)
+      {
+#define OPCODE(x) case Opcode::x: return #x;
+        LIST_OPCODES
+#undef OPCODE
+      }
+      return "INVALID";
+    }
+};
+
+struct Instruction
+{
+  Opcode op;
+  int32_t a;
+  int32_t b;
+  int32_t c;
+
+  friend std::ostream& operator<<(std::ostream& os, const Instruction& instruction)
+  {
+    return os << Opcodes::GetName(instruction.op) << " " << instruction.a << " " << instruction.b << " " << instruction.c;
+  }
+};
+
+enum class VectorOpKind : uint8_t
+{
+  LOAD,     /* dst = elements of the array in operand a */
+  SCALAR,   /* dst = operand a in every lane */
+  CONSTANT, /* dst = imm in every lane */
+  INDEX,    /* dst = the loop index of every lane */
+  BINARY,   /* dst = opcode applied to temporaries a and b */
+  UNARY,    /* dst = opcode applied to temporary a */
+  STORE,    /* elements of the array in operand a = temporary b */
+};
+
+struct VectorOp
+{
+  VectorOpKind kind;
+  Opcode opcode;
+  int dst;
+  int a;
+  int b;
+  int32_t imm;
+};
+
+// An element-wise loop over int and float arrays, run in tiles by vector
+// kernels. The operands are read from consecutive registers: the start and
+// end of the index followed by the arrays and scalars used by the loop. Like
+// the loop it replaces it always runs at least one iteration.
+struct VectorLoop
+{
+  std::vector<VectorOp> ops;
+  int temps;
+  // Operands holding arrays that are indexed by the loop
+  std::vector<int> arrays;
+
+  void Print(std::ostream& os) const
+  {
+    for(const VectorOp& op : ops)
+    {
+      static const char* names[] = {"LOAD", "SCALAR", "CONSTANT", "INDEX", "BINARY", "UNARY", "STORE"};
+      os << "    " << names[(int)op.kind];
+      if(op.kind == VectorOpKind::BINARY || op.kind == VectorOpKind::UNARY)
+        os << " " << Opcodes::GetName(op.opcode);
+      os << " " << op.dst << " " << op.a << " " << op.b << " " << op.imm << std::endl;
+    }
+  }
+};
+
+enum class ReductionKind : uint8_t
+{
+  SUM, MIN, MAX
+};
+
+// Variable of a parallel loop that each chunk of iterations starts at the
+// identity of the operation and that is combined over the chunks, in order,
+// once the loop is done
+struct Reduction
+{
+  ReductionKind kind;
+  Type type;
+};
+
+struct CompiledFunction;
+
+// The body of a #parallel loop, outlined into a function of its own that runs
+// the iterations [from, to) of the loop. Its parameters are from and to
+// followed by the operands: the start, end and step of the range, an int
+// array holding the reductions and the variables read by the body. The
+// array passed to the body receives the reductions of the chunk.
+struct ParallelLoop
+{
+  std::shared_ptr<CompiledFunction> body;
+  std::vector<Reduction> reductions;
+};
+
+struct NativeRuntime;
+
+// Function compiled to machine code from the C written by CCodegen. The
+// arguments are read from regs and the result is written to regs[0]. Returns
+// 0 if it failed.
+using NativeFunction = int(*)(NativeRuntime* runtime, Value* regs);
+
+// Line and column in the source, line is 0 where it isn't known
+struct SourcePos
+{
+  int32_t line;
+  int32_t column;
+  // 1 + the index of the InlineSite the position is in, 0 outside of
+  // inlined code
+  int32_t inlined = 0;
+
+  bool operator==(const SourcePos& other) const
+  {
+    return line == other.line && column == other.column && inlined == other.inlined;
+  }
+};
+
+// A call whose callee was inlined, so the code of the callee can still be
+// reported as running in the callee. The call may itself be in inlined code.
+struct InlineSite
+{
+  std::string name;
+  SourcePos call;
+};
+
+// Maps code offsets to source positions. Only the offsets where the position
+// changes have an entry, stored as the differences to the previous entry in
+// variable length bytes. The vm never reads it while running, it is decoded
+// for diagnostics and profiles.
+class LineTable
+{
+  private:
+    std::vector<uint8_t> bytes;
+    int32_t lastPc = 0;
+    SourcePos lastPos{0, 0};
+    // Where the last entry starts and the state before it
+    size_t lastStart = 0;
+    int32_t previousPc = 0;
+    SourcePos previousPos{0, 0};
+
+  public:
+    // Positions must be added in order of pc, adding a pc again replaces its
+    // position
+    void Add(int32_t pc, SourcePos pos)
+    {
+      if(pc == lastPc && !bytes.empty())
+      {
+        bytes.resize(lastStart);
+        lastPc = previousPc;
+        lastPos = previousPos;
+      }
+      if(pos == lastPos)
+        return;
+      lastStart = bytes.size();
+      previousPc = lastPc;
+      previousPos = lastPos;
+      WriteUnsigned(pc - lastPc);
+      WriteSigned(pos.line - lastPos.line);
+      WriteSigned(pos.column - lastPos.column);
+      WriteSigned(pos.inlined - lastPos.inlined);
+      lastPc = pc;
+      lastPos = pos;
+    }
+
+    // Position of the instruction at pc
+    SourcePos Find(int32_t pc) const
+    {
+      SourcePos found{0, 0};
+      ForEach([&](int32_t entryPc, SourcePos pos)
+      {
+        if(entryPc > pc)
+          return false;
+        found = pos;
+        return true;
+      });
+      return found;
+    }
+
+    // Calls visit(pc, pos) for every entry in order until it returns false
+    template <typename Visit>
+    void ForEach(const Visit& visit) const
+    {
+      size_t i = 0;
+      int32_t pc = 0;
+      SourcePos pos{0, 0};
+      while(i < bytes.size())
+      {
+        pc += ReadUnsigned(i);
+        pos.line += ReadSigned(i);
+        pos.column += ReadSigned(i);
+        pos.inlined += ReadSigned(i);
+        if(!visit(pc, pos))
+          return;
+      }
+    }
+
+    // Drops the entries from pc on
+    void Truncate(int32_t pc)
+    {
+      LineTable table;
+      ForEach([&](int32_t entryPc, SourcePos pos)
+      {
+        if(entryPc >= pc)
+          return false;
+        table.Add(entryPc, pos);
+        return true;
+      });
+      *this = std::move(table);
+    }
+
+    const std::vector<uint8_t>& Bytes() const
+    {
+      return bytes;
+    }
+
+    // Returns false if the bytes don't decode to a table
+    bool SetBytes(std::vector<uint8_t> data)
+    {
+      LineTable table;
+      table.bytes = std::move(data);
+      size_t i = 0;
+      while(i < table.bytes.size())
+      {
+        table.lastStart = i;
+        table.previousPc = table.lastPc;
+        table.previousPos = table.lastPos;
+        int32_t delta = table.ReadUnsigned(i);
+        table.lastPc += delta;
+        table.lastPos.line += table.ReadSigned(i);
+        table.lastPos.column += table.ReadSigned(i);
+        table.lastPos.inlined += table.ReadSigned(i);
+        if(i > table.bytes.size() || delta < 0)
+          return false;
+      }
+      *this = std::move(table);
+      return true;
+    }
+
+  private:
+    void WriteUnsigned(uint32_t value)
+    {
+      while(value >= 0x80)
+      {
+        bytes.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+      }
+      bytes.push_back((uint8_t)value);
+    }
+
+    void WriteSigned(int32_t value)
+    {
+      WriteUnsigned(((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+    }
+
+    // Reads past the end as zeros and leaves i past the end
+    int32_t ReadUnsigned(size_t& i) const
+    {
+      uint32_t value = 0;
+      for(int shift = 0;shift < 35;shift += 7)
+      {
+        uint8_t byte = i < bytes.size() ? bytes[i] : 0;
+        i++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+          break;
+      }
+      return (int32_t)value;
+    }
+
+    int32_t ReadSigned(size_t& i) const
+    {
+      uint32_t value = ReadUnsigned(i);
+      return (int32_t)((value >> 1) ^ (0u - (value & 1)));
+    }
+};
+
+// Registers holding strings, arrays and maps at an instruction where the heap may
+// be collected: the calls, for the frames of the callers, and the
+// instructions that allocate. Registers that aren't live there aren't listed
+// since they may hold anything.
+struct StackMap
+{
+  int32_t pc;
+  std::vector<int32_t> strings;
+  std::vector<int32_t> arrays;
+  std::vector<int32_t> maps;
+};
+
+struct LazyFunction;
+
+struct CompiledFunction
+{
+  std::string name;
+  Type returnType;
+  std::vector<Type> params;
+  int registerCount;
+  std::vector<Instruction> code;
+  // Source position of the instructions
+  LineTable lines;
+  // Calls inlined into the function, see SourcePos::inlined
+  std::vector<InlineSite> inlineSites;
+  std::vector<VectorLoop> vectorLoops;
+  // The bodies aren't functions of the program, only PARALLEL_FOR calls them
+  std::vector<ParallelLoop> parallelLoops;
+  // Sorted by pc
+  std::vector<StackMap> stackMaps;
+  // Set for a function compiled on its first call, whose code is a single
+  // COMPILE that continues in the compiled function
+  std::shared_ptr<LazyFunction> lazy;
+  // Set for a function loaded from a shared library, whose code is a single
+  // CALL_NATIVE followed by a RETURN
+  NativeFunction native = nullptr;
+
+  // Decodes the line table, which is only meant for diagnostics
+  SourcePos GetPosition(const Instruction* instruction) const
+  {
+    return lines.Find(instruction - code.data());
+  }
+
+  // Name of the function that the code at the position came from, which is
+  // an inlined callee in inlined code
+  const std::string& GetName(SourcePos pos) const
+  {
+    return pos.inlined == 0 ? name : inlineSites[pos.inlined - 1].name;
+  }
+
+  // Returns nullptr if the heap can't be collected at the instruction
+  const StackMap* GetStackMap(const Instruction* instruction) const
+  {
+    int32_t pc = instruction - code.data();
+    auto it = std::lower_bound(stackMaps.begin(), stackMaps.end(), pc, [](const StackMap& map, int32_t pc) { return map.pc < pc; });
+    return it != stackMaps.end() && it->pc == pc ? &*it : nullptr;
+  }
+
+  void Print(std::ostream& os) const
+  {
+    os << "[" << name << "] registers: " << registerCount << std::endl;
+    std::vector<std::pair<int32_t, SourcePos>> entries;
+    lines.ForEach([&](int32_t pc, SourcePos pos)
+    {
+      entries.push_back({pc, pos});
+      return true;
+    });
+    SourcePos pos{0, 0};
+    size_t next = 0;
+    for(size_t i = 0;i<code.size();i++)
+    {
+      os << "  " << i << ": " << code[i];
+      for(;next<entries.size() && entries[next].first <= (int32_t)i;next++)
+        pos = entries[next].second;
+      if(pos.line != 0)
+        os << "  ; " << pos.line << ":" << pos.column;
+      if(pos.inlined != 0)
+        os << " in " << GetName(pos);
+      os << std::endl;
+    }
+    for(size_t i = 0;i<vectorLoops.size();i++)
+    {
+      os << "  vector loop " << i << ":" << std::endl;
+      vectorLoops[i].Print(os);
+    }
+    for(const ParallelLoop& loop : parallelLoops)
+      loop.body->Print(os);
+  }
+};
+
+// Body of a function compiled on its first call. The stub stays in
+// Program::functions, so threads already running it are unaffected, and the
+// compiled function is published once it is complete. Lazy functions are
+// compiled one at a time since checking a body reads the other functions and
+// adds to the strings of the program.
+struct LazyFunction
+{
+  std::function<bool(CompiledFunction&)> compile;
+  std::atomic<const CompiledFunction*> compiled{nullptr};
+  std::unique_ptr<CompiledFunction> function;
+  bool failed = false;
+
+  // Compiles the function unless it has been, returns nullptr if it failed
+  const CompiledFunction* Get()
+  {
+    const CompiledFunction* result = compiled.load(std::memory_order_acquire);
+    if(result)
+      return result;
+    std::lock_guard<std::mutex> lock{GetMutex()};
+    if(function == nullptr && !failed)
+    {
+      std::unique_ptr<CompiledFunction> body = std::make_unique<CompiledFunction>();
+      failed = !compile(*body);
+      if(!failed)
+      {
+        function = std::move(body);
+        compiled.store(function.get(), std::memory_order_release);
+      }
+    }
+    return function.get();
+  }
+
+  static std::mutex& GetMutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+};
+
+// Host functions are called through a trampoline generated by HostBinding
+// which reads the arguments directly from the registers.
+using HostInvoke = void(*)(void(*function)(), Value* args, Heap& heap);
+
+struct HostFunction
+{
+  std::string name;
+  Type returnType;
+  std::vector<Type> params;
+  HostInvoke invoke;
+  void(*function)();
+};
+
+// What the interpreter needs to call a host function, kept apart from the
+// rest of HostFunction so that a call only touches these two pointers
+struct HostCall
+{
+  HostInvoke invoke;
+  void(*function)();
+};
+
+// Function that is declared but not defined by the scripts calling it. It is
+// resolved to a script or host function with the same signature when the
+// program is linked.
+struct Import
+{
+  std::string name;
+  Type returnType;
+  std::vector<Type> params;
+};
+
+struct Program
+{
+  std::vector<CompiledFunction> functions;
+  std::vector<HostFunction> hostFunctions;
+  std::vector<HostCall> hostCalls;
+  std::vector<Import> imports;
+  std::deque<std::string> strings;
+  // Registers of the string constants, long constants point to the
+  // characters in strings
+  std::deque<StringData> stringData;
+  std::vector<String> stringValues;
+
+  // Returns -1 if the function is already imported with another signature
+  int AddImport(const Import& function)
+  {
+    for(size_t i = 0;i<imports.size();i++)
+    {
+      if(imports[i].name != function.name)
+        continue;
+      if(imports[i].returnType != function.returnType || imports[i].params != function.params)
+        return -1;
+      return i;
+    }
+    imports.push_back(function);
+    return imports.size() - 1;
+  }
+
+  int AddString(const std::string& str)
+  {
+    for(size_t i = 0;i<strings.size();i++)
+    {
+      if(strings[i] == str)
+        return i;
+    }
+    strings.push_back(str);
+    if(str.size() <= String::INLINE_LENGTH)
+      stringValues.push_back(String::Inline(str.data(), str.size()));
+    else
+    {
+      stringData.push_back({strings.back().data(), (int32_t)str.size(), 0, nullptr});
+      stringValues.push_back(String::FromData(&stringData.back()));
+    }
+    return strings.size() - 1;
+  }
+};
@@ -0,0 +1,527 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "Native.h"
+#include "Vm.h"
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+// Writes a linked program as C, one C function per script function with
+// typed parameters and result. The C follows the optimized bytecode
+// instruction by instruction, so the results are the same as in the vm.
+// Build it with the system C compiler into a shared library, such as
+// "cc -O2 -shared -fPIC program.c -o program.so", and load it with
+// Module::LoadNative. Floats must not be compiled with -ffast-math.
+class CCodegen
+{
+  private:
+    std::ostream& os;
+    const Program& program;
+
+  public:
+    // Fails if a function isn't linked or compiled to bytecode
+    static bool Generate(const Program& program, std::ostream& os)
+    {
+      for(const CompiledFunction& function : program.functions)
+      {
+        for(const Instruction& instruction : function.code)
+        {
+          if(instruction.op == Opcode::CALL_IMPORT || instruction.op == Opcode::COMPILE || instruction.op == Opcode::CALL_NATIVE)
+          {
+            std::cerr << "Can't write " << function.name << " as C, it isn't linked or compiled to bytecode" << std::endl;
+            return false;
+          }
+        }
+      }
+      CCodegen codegen{program, os};
+      codegen.Generate();
+      return true;
+    }
+
+  private:
+    CCodegen(const Program& program, std::ostream& os)
+      : os{os}, program{program}
+    {}
+
+    static const char* CType(Type type)
+    {
+      switch(type)
+      {
+        case Type::INT:
+        case Type::CHAR:
+          return "int32_t";
+        case Type::FLOAT:
+          return "float";
+        case Type::STRING:
+          return "uint64_t";
+        case Type::INT_ARRAY:
+        case Type::FLOAT_ARRAY:
+        case Type::CHAR_ARRAY:
+        case Type::INT_BY_INT:
+        case Type::INT_BY_STRING:
+        case Type::FLOAT_BY_INT:
+        case Type::FLOAT_BY_STRING:
+        case Type::STRING_BY_INT:
+        case Type::STRING_BY_STRING:
+          return "void*";
+        case Type::VOID:
+        case Type::INVALID:
+          break;
+      }
+      return "void";
+    }
+
+    // Member of GrValue holding a value of the type
+    static const char* Field(Type type)
+    {
+      switch(type)
+      {
+        case Type::FLOAT:
+          return "f";
+        case Type::STRING:
+          return "s";
+        case Type::INT_ARRAY:
+        case Type::FLOAT_ARRAY:
+        case Type::CHAR_ARRAY:
+        case Type::INT_BY_INT:
+        case Type::INT_BY_STRING:
+        case Type::FLOAT_BY_INT:
+        case Type::FLOAT_BY_STRING:
+        case Type::STRING_BY_INT:
+        case Type::STRING_BY_STRING:
+          return "a";
+        default:
+          return "i";
+      }
+    }
+
+    void Generate()
+    {
+      os << "#include <stdint.h>" << std::endl;
+      os << "#include <string.h>" << std::endl;
+      os << std::endl;
+      os << "#define GR_RUNTIME " << (int)VmError::RUNTIME << std::endl;
+      os << "#define GR_STACK " << (int)VmError::STACK << std::endl;
+      os << "#define GR_MAX_LENGTH " << String::MAX_LENGTH << std::endl;
+      os << PRELUDE;
+
+      for(size_t i = 0;i<program.functions.size();i++)
+      {
+        WriteSignature(i);
+        os << ";" << std::endl;
+      }
+      for(size_t i = 0;i<program.functions.size();i++)
+        WriteFunction(i);
+
+      for(size_t i = 0;i<program.functions.size();i++)
+      {
+        const CompiledFunction& function = program.functions[i];
+        os << std::endl << "static int gr_entry" << i << "(GrRuntime* rt, GrValue* regs)" << std::endl << "{" << std::endl << "  ";
+        if(function.returnType != Type::VOID)
+          os << "regs[0]." << Field(function.returnType) << " = ";
+        os << "gr_f" << i << "(rt";
+        for(size_t j = 0;j<function.params.size();j++)
+          os << ", regs[" << j << "]." << Field(function.params[j]);
+        os << ");" << std::endl << "  return !rt->failed;" << std::endl << "}" << std::endl;
+      }
+
+      os << std::endl << "const uint32_t gr_abi = " << NATIVE_ABI << ";" << std::endl;
+      os << "const char* const gr_function_names[] = {";
+      for(const CompiledFunction& function : program.functions)
+        os << "\"" << function.name << "\", ";
+      os << "0};" << std::endl;
+      os << "const char* const gr_host_names[] = {";
+      for(const HostFunction& host : program.hostFunctions)
+        os << "\"" << host.name << "\", ";
+      os << "0};" << std::endl;
+      os << "int (*const gr_functions[])(GrRuntime*, GrValue*) = {";
+      for(size_t i = 0;i<program.functions.size();i++)
+        os << "gr_entry" << i << ", ";
+      os << "0};" << std::endl;
+    }
+
+    void WriteSignature(size_t index)
+    {
+      const CompiledFunction& function = program.functions[index];
+      os << "static " << CType(function.returnType) << " gr_f" << index << "(GrRuntime* rt";
+      for(size_t i = 0;i<function.params.size();i++)
+        os << ", " << CType(function.params[i]) << " p" << i;
+      os << ")";
+    }
+
+    void WriteFunction(size_t index)
+    {
+      const CompiledFunction& function = program.functions[index];
+      std::set<int32_t> labels;
+      bool selfTailCall = false;
+      for(const Instruction& in : function.code)
+      {
+        if(in.op == Opcode::JUMP || in.op == Opcode::JUMP_IF_FALSE || in.op == Opcode::JUMP_IF_TRUE)
+          labels.insert(in.a);
+        if(in.op == Opcode::TAIL_CALL && in.a == (int32_t)index)
+          selfTailCall = true;
+      }
+      std::string fail = function.returnType == Type::VOID ? "return;" : "return 0;";
+
+      os << std::endl << "/* " << function.name << " */" << std::endl;
+      WriteSignature(index);
+      os << std::endl << "{" << std::endl;
+      os << "  GrValue r[" << function.registerCount << "];" << std::endl;
+      os << "  if(++rt->depth > rt->maxDepth)" << std::endl;
+      os << "  {" << std::endl;
+      os << "    rt->fail(rt, " << index << ", \"Stack overflow\", GR_STACK);" << std::endl;
+      os << "    " << fail << std::endl;
+      os << "  }" << std::endl;
+      for(size_t i = 0;i<function.params.size();i++)
+        os << "  r[" << i << "]." << Field(function.params[i]) << " = p" << i << ";" << std::endl;
+      if(selfTailCall)
+        os << "start:" << std::endl;
+
+      for(size_t i = 0;i<function.code.size();i++)
+      {
+        const Instruction& in = function.code[i];
+        if(labels.count(i))
+          os << "L" << i << ":" << std::endl;
+        os << "  ";
+        WriteInstruction(index, in, fail);
+        os << std::endl;
+      }
+      os << "}" << std::endl;
+    }
+
+    void WriteCall(const CompiledFunction& callee, const Instruction& in)
+    {
+      os << "gr_f" << in.a << "(rt";
+      for(size_t i = 0;i<callee.params.size();i++)
+        os << ", r[" << in.b + i << "]." << Field(callee.params[i]);
+      os << ")";
+    }
+
+    void WriteInstruction(size_t index, const Instruction& in, const std::string& fail)
+    {
+      const CompiledFunction& function = program.functions[index];
+      int32_t a = in.a;
+      int32_t b = in.b;
+      int32_t c = in.c;
+      switch(in.op)
+      {
+        case Opcode::NOP:
+          os << ";";
+          break;
+        case Opcode::LOAD_INT:
+          os << "r[" << a << "].i = " << b << ";";
+          break;
+        case Opcode::LOAD_FLOAT:
+          // b holds the bits of the float
+          os << "r[" << a << "].i = " << b << ";";
+          break;
+        case Opcode::LOAD_STRING:
+          os << "r[" << a << "].s = rt->strings[" << b << "];";
+          break;
+        case Opcode::MOVE:
+          os << "r[" << a << "] = r[" << b << "];";
+          break;
+        case Opcode::ADD_INT:
+          os << "r[" << a << "].i = (int32_t)((uint32_t)r[" << b << "].i + (uint32_t)r[" << c << "].i);";
+          break;
+        case Opcode::SUB_INT:
+          os << "r[" << a << "].i = (int32_t)((uint32_t)r[" << b << "].i - (uint32_t)r[" << c << "].i);";
+          break;
+        case Opcode::MUL_INT:
+          os << "r[" << a << "].i = (int32_t)((uint32_t)r[" << b << "].i * (uint32_t)r[" << c << "].i);";
+          break;
+        case Opcode::DIV_INT:
+          os << "if(r[" << c << "].i == 0) { rt->fail(rt, " << index << ", \"Division by zero\", GR_RUNTIME); " << fail << " } "
+            << "r[" << a << "].i = r[" << c << "].i == -1 ? (int32_t)(0u - (uint32_t)r[" << b << "].i) : r[" << b << "].i / r[" << c << "].i;";
+          break;
+        case Opcode::ADD_FLOAT:
+          WriteBinary(a, b, c, "f", "+", "f");
+          break;
+        case Opcode::SUB_FLOAT:
+          WriteBinary(a, b, c, "f", "-", "f");
+          break;
+        case Opcode::MUL_FLOAT:
+          WriteBinary(a, b, c, "f", "*", "f");
+          break;
+        case Opcode::DIV_FLOAT:
+          WriteBinary(a, b, c, "f", "/", "f");
+          break;
+        case Opcode::ADD_STRING:
+          os << "r[" << a << "].s = rt->concat(rt, " << index << ", r[" << b << "].s, r[" << c << "].s); if(rt->failed) " << fail;
+          break;
+        case Opcode::NEG_INT:
+          os << "r[" << a << "].i = (int32_t)(0u - (uint32_t)r[" << b << "].i);";
+          break;
+        case Opcode::NEG_FLOAT:
+          os << "r[" << a << "].f = -r[" << b << "].f;";
+          break;
+        case Opcode::NOT:
+          os << "r[" << a << "].i = r[" << b << "].i == 0;";
+          break;
+        case Opcode::BOOL:
+          os << "r[" << a << "].i = r[" << b << "].i != 0;";
+          break;
+        case Opcode::EQ_INT:
+          WriteBinary(a, b, c, "i", "==", "i");
+          break;
+        case Opcode::NE_INT:
+          WriteBinary(a, b, c, "i", "!=", "i");
+          break;
+        case Opcode::LT_INT:
+          WriteBinary(a, b, c, "i", "<", "i");
+          break;
+        case Opcode::LE_INT:
+          WriteBinary(a, b, c, "i", "<=", "i");
+          break;
+        case Opcode::GT_INT:
+          WriteBinary(a, b, c, "i", ">", "i");
+          break;
+        case Opcode::GE_INT:
+          WriteBinary(a, b, c, "i", ">=", "i");
+          break;
+        case Opcode::EQ_FLOAT:
+          WriteBinary(a, b, c, "i", "==", "f");
+          break;
+        case Opcode::NE_FLOAT:
+          WriteBinary(a, b, c, "i", "!=", "f");
+          break;
+        case Opcode::LT_FLOAT:
+          WriteBinary(a, b, c, "i", "<", "f");
+          break;
+        case Opcode::LE_FLOAT:
+          WriteBinary(a, b, c, "i", "<=", "f");
+          break;
+        case Opcode::GT_FLOAT:
+          WriteBinary(a, b, c, "i", ">", "f");
+          break;
+        case Opcode::GE_FLOAT:
+          WriteBinary(a, b, c, "i", ">=", "f");
+          break;
+        case Opcode::EQ_STRING:
+          os << "r[" << a << "].i = gr_string_equals(r[" << b << "].s, r[" << c << "].s);";
+          break;
+        case Opcode::NE_STRING:
+          os << "r[" << a << "].i = !gr_string_equals(r[" << b << "].s, r[" << c << "].s);";
+          break;
+        case Opcode::COMPARE_STRING:
+          os << "r[" << a << "].i = gr_string_compare(r[" << b << "].s, r[" << c << "].s);";
+          break;
+        case Opcode::STRING_LENGTH:
+          os << "r[" << a << "].i = gr_string_length(r[" << b << "].s);";
+          break;
+        case Opcode::CHECK_STRING_INDEX:
+          os << "if((uint32_t)r[" << c << "].i >= (uint32_t)gr_string_length(r[" << b << "].s)) { rt->fail(rt, "
+            << index << ", \"Index out of bounds\", GR_RUNTIME); " << fail << " }";
+          break;
+        case Opcode::PARALLEL_FOR:
+          // The body of the loop runs as bytecode in the vm
+          os << "if(!rt->parallelFor(rt, " << index << ", " << a << ", &r[" << b << "])) { " << fail << " }";
+          break;
+        case Opcode::LOAD_STRING_CHAR:
+          os << "r[" << a << "].i = gr_string_at(r[" << b << "].s, r[" << c << "].i);";
+          break;
+        case Opcode::DROP_STRING:
+          os << "r[" << a << "].s = rt->substring(rt, " << index << ", r[" << b << "].s, r[" << c << "].i, GR_MAX_LENGTH); if(rt->failed) " << fail;
+          break;
+        case Opcode::TAKE_STRING:
+          os << "r[" << a << "].s = rt->substring(rt, " << index << ", r[" << b << "].s, 0, r[" << c << "].i); if(rt->failed) " << fail;
+          break;
+        case Opcode::NEW_ARRAY:
+          os << "r[" << a << "].a = rt->newArray(rt, " << index << ", r[" << b << "].i, " << c << "); if(rt->failed) " << fail;
+          break;
+        case Opcode::LOAD_EMPTY_ARRAY:
+          os << "r[" << a << "].a = rt->emptyArray;";
+          break;
+        case Opcode::ARRAY_LENGTH:
+          os << "r[" << a << "].i = GR_LENGTH(r[" << b << "].a);";
+          break;
+        case Opcode::CHECK_INDEX:
+          os << "if((uint32_t)r[" << c << "].i >= (uint32_t)GR_LENGTH(r[" << b << "].a)) { rt->fail(rt, "
+            << index << ", \"Index out of bounds\", GR_RUNTIME); " << fail << " }";
+          break;
+        case Opcode::LOAD_ELEMENT:
+          os << "memcpy(&r[" << a << "].i, GR_ELEMENTS(r[" << b << "].a) + 4 * (intptr_t)r[" << c << "].i, 4);";
+          break;
+        case Opcode::LOAD_ELEMENT_CHAR:
+          os << "r[" << a << "].i = ((char*)GR_ELEMENTS(r[" << b << "].a))[r[" << c << "].i];";
+          break;
+        case Opcode::STORE_ELEMENT:
+          os << "memcpy(GR_ELEMENTS(r[" << a << "].a) + 4 * (intptr_t)r[" << b << "].i, &r[" << c << "].i, 4);";
+          break;
+        case Opcode::STORE_ELEMENT_CHAR:
+          os << "((char*)GR_ELEMENTS(r[" << a << "].a))[r[" << b << "].i] = (char)r[" << c << "].i;";
+          break;
+        case Opcode::MAP_LENGTH:
+          // Maps keep their length where arrays do
+          os << "r[" << a << "].i = GR_LENGTH(r[" << b << "].a);";
+          break;
+        case Opcode::NEW_MAP:
+        case Opcode::MAP_HAS_INT:
+        case Opcode::MAP_HAS_STRING:
+        case Opcode::MAP_GET_INT:
+        case Opcode::MAP_GET_STRING:
+        case Opcode::MAP_SET_INT:
+        case Opcode::MAP_SET_STRING:
+        case Opcode::MAP_KEY:
+          os << "if(!rt->map(rt, " << index << ", " << (int)in.op << ", r, " << a << ", " << b << ", " << c << ")) { " << fail << " }";
+          break;
+        case Opcode::JUMP:
+          os << "goto L" << a << ";";
+          break;
+        case Opcode::JUMP_IF_FALSE:
+          os << "if(!r[" << b << "].i) goto L" << a << ";";
+          break;
+        case Opcode::JUMP_IF_TRUE:
+          os << "if(r[" << b << "].i) goto L" << a << ";";
+          break;
+        case Opcode::CALL:
+        {
+          const CompiledFunction& callee = program.functions[a];
+          if(callee.returnType != Type::VOID)
+            os << "r[" << b << "]." << Field(callee.returnType) << " = ";
+          WriteCall(callee, in);
+          os << "; if(rt->failed) " << fail;
+          break;
+        }
+        case Opcode::TAIL_CALL:
+        {
+          const CompiledFunction& callee = program.functions[a];
+          if(a == (int32_t)index)
+          {
+            // The arguments are copied through temporaries as they may
+            // overlap the parameters
+            os << "{ ";
+            for(int32_t i = 0;i<c;i++)
+              os << "GrValue t" << i << " = r[" << b + i << "]; ";
+            for(int32_t i = 0;i<c;i++)
+              os << "r[" << i << "] = t" << i << "; ";
+            os << "goto start; }";
+          }
+          else if(function.returnType == Type::VOID)
+          {
+            os << "{ ";
+            WriteCall(callee, in);
+            os << "; rt->depth--; return; }";
+          }
+          else
+          {
+            os << "{ " << CType(function.returnType) << " result = ";
+            WriteCall(callee, in);
+            os << "; rt->depth--; return result; }";
+          }
+          break;
+        }
+        case Opcode::CALL_HOST:
+          os << "rt->callHost(rt, " << a << ", &r[" << b << "]);";
+          break;
+        case Opcode::CALL_BUILTIN:
+          os << "if(!rt->builtin(rt, " << index << ", " << a << ", &r[" << b << "])) { " << fail << " }";
+          break;
+        case Opcode::VECTOR_LOOP:
+          os << "if(!rt->vectorLoop(rt, " << index << ", " << a << ", &r[" << b << "])) { rt->fail(rt, "
+            << index << ", \"Index out of bounds\", GR_RUNTIME); " << fail << " }";
+          break;
+        case Opcode::RETURN:
+        case Opcode::RETURN_VOID:
+          if(function.returnType == Type::VOID)
+            os << "rt->depth--; return;";
+          else
+            os << "rt->depth--; return r[" << a << "]." << Field(function.returnType) << ";";
+          break;
+        case Opcode::CALL_IMPORT:
+        case Opcode::COMPILE:
+        case Opcode::CALL_NATIVE:
+          break;
+      }
+    }
+
+    void WriteBinary(int32_t a, int32_t b, int32_t c, const char* result, const char* op, const char* operands)
+    {
+      os << "r[" << a << "]." << result << " = r[" << b << "]." << operands << " " << op << " r[" << c << "]." << operands << ";";
+    }
+
+    // Declares the runtime like NativeRuntime and the string functions like String
+    static inline const char* PRELUDE = R"(
+typedef union { int32_t i; float f; uint64_t s; void* a; } GrValue;
+typedef struct { const char* data; int32_t length; void* buffer; } GrStringData;
+
+typedef struct GrRuntime GrRuntime;
+struct GrRuntime
+{
+  void* vm;
+  const void* program;
+  const uint64_t* strings;
+  void* emptyArray;
+  int32_t depth;
+  int32_t maxDepth;
+  int32_t failed;
+  void (*fail)(GrRuntime* rt, int32_t function, const char* message, int32_t kind);
+  uint64_t (*concat)(GrRuntime* rt, int32_t function, uint64_t left, uint64_t right);
+  uint64_t (*substring)(GrRuntime* rt, int32_t function, uint64_t str, int32_t start, int32_t count);
+  void* (*newArray)(GrRuntime* rt, int32_t function, int32_t length, int32_t elementSize);
+  void (*callHost)(GrRuntime* rt, int32_t host, GrValue* args);
+  int (*vectorLoop)(GrRuntime* rt, int32_t function, int32_t loop, GrValue* operands);
+  int (*parallelFor)(GrRuntime* rt, int32_t function, int32_t loop, GrValue* operands);
+  int (*map)(GrRuntime* rt, int32_t function, int32_t opcode, GrValue* regs, int32_t a, int32_t b, int32_t c);
+  int (*builtin)(GrRuntime* rt, int32_t function, int32_t builtin, GrValue* args);
+};
+
+#define GR_LENGTH(a) (*(const int32_t*)(a))
+#define GR_ELEMENTS(a) ((char*)(a) + 32)
+
+static inline int32_t gr_string_length(uint64_t s)
+{
+  if(s & 1)
+    return (int32_t)((s & 0xff) >> 1);
+  return ((const GrStringData*)(uintptr_t)s)->length;
+}
+
+static inline char gr_string_at(uint64_t s, int32_t index)
+{
+  if(s & 1)
+    return (char)(s >> (8 * (index + 1)));
+  return ((const GrStringData*)(uintptr_t)s)->data[index];
+}
+
+static inline const char* gr_string_view(uint64_t s, char* scratch, int32_t* length)
+{
+  int32_t i;
+  *length = gr_string_length(s);
+  if(!(s & 1))
+    return ((const GrStringData*)(uintptr_t)s)->data;
+  for(i = 0;i<*length;i++)
+    scratch[i] = gr_string_at(s, i);
+  return scratch;
+}
+
+static inline int32_t gr_string_equals(uint64_t a, uint64_t b)
+{
+  const GrStringData* x;
+  const GrStringData* y;
+  if(a == b)
+    return 1;
+  if((a & 1) || (b & 1))
+    return 0;
+  x = (const GrStringData*)(uintptr_t)a;
+  y = (const GrStringData*)(uintptr_t)b;
+  return x->length == y->length && memcmp(x->data, y->data, x->length) == 0;
+}
+
+static inline int32_t gr_string_compare(uint64_t a, uint64_t b)
+{
+  char scratchA[7];
+  char scratchB[7];
+  int32_t lengthA;
+  int32_t lengthB;
+  const char* x = gr_string_view(a, scratchA, &lengthA);
+  const char* y = gr_string_view(b, scratchB, &lengthB);
+  int result = memcmp(x, y, lengthA < lengthB ? lengthA : lengthB);
+  if(result == 0)
+    result = lengthA < lengthB ? -1 : lengthA > lengthB ? 1 : 0;
+  return result < 0 ? -1 : result > 0 ? 1 : 0;
+}
+)";
+};
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "Module.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Line based requests and length prefixed responses over a socket
+class SocketStream
+{
+  private:
+    int fd;
+    std::string buffer;
+
+  public:
+    explicit SocketStream(int fd)
+      : fd{fd}
+    {}
+
+    ~SocketStream()
+    {
+      if(fd != -1)
+        close(fd);
+    }
+
+    SocketStream(const SocketStream&) = delete;
+    SocketStream& operator=(const SocketStream&) = delete;
+
+    bool ReadLine(std::string& line)
+    {
+      size_t end;
+      while((end = buffer.find('\n')) == std::string::npos)
+      {
+        if(!Fill())
+          return false;
+      }
+      line = buffer.substr(0, end);
+      buffer.erase(0, end + 1);
+      return true;
+    }
+
+    bool Read(std::string& data, size_t size)
+    {
+      while(buffer.size() < size)
+      {
+        if(!Fill())
+          return false;
+      }
+      data = buffer.substr(0, size);
+      buffer.erase(0, size);
+      return true;
+    }
+
+    bool Write(const std::string& data)
+    {
+      for(size_t sent = 0;sent < data.size();)
+      {
+        // A client that went away mustn't stop the server with SIGPIPE
+        ssize_t count = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if(count <= 0)
+          return false;
+        sent += count;
+      }
+      return true;
+    }
+
+  private:
+    bool Fill()
+    {
+      char chunk[4096];
+      ssize_t count = recv(fd, chunk, sizeof(chunk), 0);
+      if(count <= 0)
+        return false;
+      buffer.append(chunk, count);
+      return true;
+    }
+};
+
+// Compiles scripts for short-lived clients, such as build tools running the
+// compiler for every file. Compiled modules are kept in memory and reused as
+// long as the modification time and size of the file are the same, or its
+// contents hash to the same value when they aren't. Requests are one line:
+//
+//   check <path>              compiles the file and returns the errors
+//   compile <path>\t<image>   also saves the module as an image
+//   stop                      stops the server
+//
+// A path is the rest of the line after the space following the command, so
+// it can contain spaces. The image is separated from the path by a tab.
+//
+// The response is "ok <length>" or "error <length>" followed by length
+// bytes of messages. Requests are handled one at a time, the messages are
+// captured by redirecting std::cerr while compiling.
+class CompileServer
+{
+  private:
+    struct Entry
+    {
+      int64_t mtime;
+      int64_t size;
+      uint64_t hash;
+      bool valid;
+      std::string messages;
+      std::unique_ptr<Module> module;
+    };
+
+    // Binds the host functions and sets the options of new modules
+    std::function<void(Module&)> setup;
+    std::map<std::string, Entry> cache;
+    uint64_t hits;
+    uint64_t misses;
+
+  public:
+    explicit CompileServer(std::function<void(Module&)> setup)
+      : setup{std::move(setup)}, hits{0}, misses{0}
+    {}
+
+    // Serves requests until a stop request, returns false if the socket
+    // can't be created or stops accepting connections
+    bool Serve(const std::string& path)
+    {
+      sockaddr_un address{};
+      address.sun_family = AF_UNIX;
+      if(path.size() >= sizeof(address.sun_path))
+      {
+        std::cerr << "Socket path is too long: " << path << std::endl;
+        return false;
+      }
+      strcpy(address.sun_path, path.c_str());
+      int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+      unlink(path.c_str());
+      if(listener == -1 || bind(listener, (sockaddr*)&address, sizeof(address)) == -1 || listen(listener, 16) == -1)
+      {
+        std::cerr << "Failed to listen on " << path << ": " << strerror(errno) << std::endl;
+        if(listener != -1)
+          close(listener);
+        return false;
+      }
+
+      bool running = true;
+      while(running)
+      {
+        int fd = accept(listener, nullptr, nullptr);
+        if(fd == -1)
+        {
+          // Other errors, such as running out of file descriptors, would
+          // fail again right away
+          if(errno == EINTR || errno == ECONNABORTED)
+            continue;
+          std::cerr << "Failed to accept on " << path << ": " << strerror(errno) << std::endl;
+          close(listener);
+          unlink(path.c_str());
+          return false;
+        }
+        SocketStream stream{fd};
+        std::string line;
+        while(running && stream.ReadLine(line))
+        {
+          if(line == "stop")
+          {
+            running = false;
+            stream.Write(Response(true, ""));
+          }
+          else if(!stream.Write(Handle(line)))
+            break;
+        }
+      }
+      close(listener);
+      unlink(path.c_str());
+      return true;
+    }
+
+    // Compiles the file unless the cached module is still up to date
+    const Entry& Check(const std::string& path)
+    {
+      Entry& entry = cache[path];
+      struct stat info;
+      if(stat(path.c_str(), &info) == -1)
+      {
+        entry = {0, 0, 0, false, "Failed to open " + path + "\n", nullptr};
+        return entry;
+      }
+      int64_t mtime = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+      if(entry.module && entry.mtime == mtime && entry.size == info.st_size)
+      {
+        hits++;
+        return entry;
+      }
+
+      std::ifstream file{path, std::ios::binary};
+      std::string source{std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}};
+      uint64_t hash = Hash(source);
+      entry.mtime = mtime;
+      entry.size = info.st_size;
+      if(entry.module && entry.hash == hash)
+      {
+        hits++;
+        return entry;
+      }
+
+      misses++;
+      entry.hash = hash;
+      entry.module = std::make_unique<Module>();
+      setup(*entry.module);
+      std::ostringstream messages;
+      std::streambuf* cerr = std::cerr.rdbuf(messages.rdbuf());
+      entry.valid = entry.module->Compile(source) && entry.module->Link();
+      std::cerr.rdbuf(cerr);
+      entry.messages = messages.str();
+      return entry;
+    }
+
+    uint64_t Hits() const
+    {
+      return hits;
+    }
+
+    uint64_t Misses() const
+    {
+      return misses;
+    }
+
+  private:
+    std::string Handle(const std::string& line)
+    {
+      std::istringstream request{line};
+      std::string command;
+      std::string path;
+      std::string image;
+      std::getline(request, command, ' ');
+      if(command == "check")
+        std::getline(request, path);
+      else if(command == "compile")
+      {
+        std::getline(request, path, '\t');
+        std::getline(request, image);
+      }
+      else
+        return Response(false, "Unknown request: " + line + "\n");
+
+      const Entry& entry = Check(path);
+      if(command == "check" || !entry.valid)
+        return Response(entry.valid, entry.messages);
+
+      std::ostringstream messages;
+      std::streambuf* cerr = std::cerr.rdbuf(messages.rdbuf());
+      bool saved = entry.module->SaveImage(image);
+      std::cerr.rdbuf(cerr);
+      return Response(saved, entry.messages + messages.str());
+    }
+
+    static std::string Response(bool success, const std::string& messages)
+    {
+      return (success ? "ok " : "error ") + std::to_string(messages.size()) + "\n" + messages;
+    }
+
+    // FNV-1a
+    static uint64_t Hash(const std::string& data)
+    {
+      uint64_t hash = 14695981039346656037ull;
+      for(char c : data)
+      {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ull;
+      }
+      return hash;
+    }
+};
+
+// Sends requests to a compile server
+class CompileClient
+{
+  private:
+    std::unique_ptr<SocketStream> stream;
+
+  public:
+    bool Connect(const std::string& path)
+    {
+      sockaddr_un address{};
+      address.sun_family = AF_UNIX;
+      if(path.size() >= sizeof(address.sun_path))
+        return false;
+      strcpy(address.sun_path, path.c_str());
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(fd == -1)
+        return false;
+      stream = std::make_unique<SocketStream>(fd);
+      if(connect(fd, (sockaddr*)&address, sizeof(address)) == -1)
+      {
+        std::cerr << "Failed to connect to " << path << ": " << strerror(errno) << std::endl;
+        stream = nullptr;
+        return false;
+      }
+      return true;
+    }
+
+    // Returns false if the server can't be reached, otherwise success tells
+    // whether the request succeeded
+    bool Request(const std::string& request, bool& success, std::string& messages)
+    {
+      std::string status;
+      if(!stream || !stream->Write(request + "\n") || !stream->ReadLine(status))
+        return false;
+      size_t space = status.find(' ');
+      if(space == std::string::npos)
+        return false;
+      success = status.substr(0, space) == "ok";
+      return stream->Read(messages, std::stoul(status.substr(space + 1)));
+    }
+};
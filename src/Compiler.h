@@ -0,0 +1,286 @@
+#pragma once
+
+#include "Ast.h"
+#include "Bytecode.h"
+#include "Inliner.h"
+#include "Ir.h"
+#include "IrCodegen.h"
+#include "IrPasses.h"
+#include "Parser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+struct CompileOptions
+{
+  // Bitmask of IrPass values to run on each function
+  unsigned passes = IR_PASS_ALL;
+  // Receives the optimized IR of every function if set, string constants
+  // are numbered per function in the IR
+  std::ostream* irDump = nullptr;
+  // Threads checking and compiling the function bodies
+  int threads = 1;
+  // Module::Compile skips the function bodies, they are parsed and compiled
+  // on the first call, see LazyFunction
+  bool lazy = false;
+  // Module::Compile shares identical expressions, see ParseOptions
+  bool shareExpressions = false;
+  // Largest cost of a function inlined by IR_PASS_INLINE, see Inliner
+  int inlineBudget = 24;
+  // Receives the inlining decisions and the change in size if set
+  std::ostream* inlineReport = nullptr;
+};
+
+class Compiler
+{
+  public:
+    // Checks and compiles the functions into the program. Host functions that
+    // are already bound and functions compiled earlier are called directly,
+    // declared functions are imported and resolved when the program is
+    // linked. Functions whose body hasn't been parsed are compiled on their
+    // first call, the program must outlive them and not be moved.
+    static bool Compile(Program& program, const std::vector<AstFunction*>& functions, const CompileOptions& options = {})
+    {
+      std::map<std::string, FunctionSignature> signatures = GetSignatures(program, false);
+
+      size_t base = program.functions.size();
+      std::vector<AstFunction*> definitions;
+      for(AstFunction* function : functions)
+      {
+        if(function->IsDeclaration())
+          continue;
+        const std::string& name = function->name->name;
+        if(signatures.find(name) != signatures.end())
+        {
+          function->Error("Redefinition of function " + name);
+          return false;
+        }
+        signatures[name] = {name, function->name->type, function->params->GetTypes(), (int)(base + definitions.size()), CallKind::SCRIPT};
+        definitions.push_back(function);
+      }
+
+      for(AstFunction* function : functions)
+      {
+        if(!function->IsDeclaration())
+          continue;
+        Import import{function->name->name, function->name->type, function->params->GetTypes()};
+        auto it = signatures.find(import.name);
+        if(it != signatures.end())
+        {
+          if(it->second.returnType != import.returnType || it->second.params != import.params)
+          {
+            function->Error("Declaration of " + import.name + " doesn't match its definition");
+            return false;
+          }
+          continue;
+        }
+        int index = program.AddImport(import);
+        if(index == -1)
+        {
+          function->Error("Declaration of " + import.name + " doesn't match an earlier declaration");
+          return false;
+        }
+        signatures[import.name] = {import.name, import.returnType, import.params, index, CallKind::IMPORT};
+      }
+
+      // The bodies are checked and compiled independently, each into a unit
+      // of its own, and merged into the program in order once all are done.
+      // Calls are inlined once every body has been checked.
+      std::vector<Unit> units(definitions.size());
+      RunParallel(definitions.size(), options.threads, [&](size_t i)
+      {
+        units[i].valid = definitions[i]->IsLazy() || CheckUnit(definitions[i], signatures);
+      });
+      for(const Unit& unit : units)
+      {
+        if(!unit.valid)
+          return false;
+      }
+      if(options.passes & IR_PASS_INLINE)
+        Inliner::Run(definitions, base, options.inlineBudget, options.inlineReport);
+      RunParallel(definitions.size(), options.threads, [&](size_t i)
+      {
+        if(!definitions[i]->IsLazy())
+          GenerateUnit(definitions[i], options, units[i]);
+      });
+
+      program.functions.resize(base + definitions.size());
+      ReserveLazyStrings(program, definitions);
+      for(size_t i = 0;i<definitions.size();i++)
+      {
+        if(definitions[i]->IsLazy())
+        {
+          CreateStub(program, definitions[i], base + i, options);
+          continue;
+        }
+        if(options.irDump)
+          *options.irDump << units[i].irDump;
+        Merge(program, units[i], program.functions[base + i]);
+      }
+      return true;
+    }
+
+  private:
+    // A function compiled apart from the program
+    struct Unit
+    {
+      CompiledFunction function;
+      // Holds the string constants of the function, which LOAD_STRING refers
+      // to until the unit is merged
+      Program constants;
+      std::string irDump;
+      bool valid;
+    };
+
+    // Calls task(i) for every i below count on up to threads threads, which
+    // take the next i from a shared counter
+    template <typename Task>
+    static void RunParallel(size_t count, int threads, const Task& task)
+    {
+      std::atomic<size_t> next{0};
+      auto work = [&]
+      {
+        for(size_t i = next++;i<count;i = next++)
+          task(i);
+      };
+      std::vector<std::thread> pool;
+      for(size_t i = 1;i<std::min<size_t>(std::max(threads, 1), count);i++)
+        pool.emplace_back(work);
+      work();
+      for(std::thread& thread : pool)
+        thread.join();
+    }
+
+    static bool CheckUnit(AstFunction* function, const std::map<std::string, FunctionSignature>& signatures)
+    {
+      CheckData data{signatures, function->name->type};
+      return function->Check(data);
+    }
+
+    static void GenerateUnit(AstFunction* function, const CompileOptions& options, Unit& unit)
+    {
+      std::ostringstream dump;
+      CompileOptions unitOptions = options;
+      if(options.irDump)
+        unitOptions.irDump = &dump;
+      Generate(unit.constants, function, unit.function, unitOptions);
+      unit.irDump = dump.str();
+    }
+
+    static void Merge(Program& program, Unit& unit, CompiledFunction& function)
+    {
+      MergeStrings(program, unit, unit.function);
+      function = std::move(unit.function);
+    }
+
+    static void MergeStrings(Program& program, const Unit& unit, CompiledFunction& function)
+    {
+      for(Instruction& instruction : function.code)
+      {
+        if(instruction.op == Opcode::LOAD_STRING)
+          instruction.b = program.AddString(unit.constants.strings[instruction.b]);
+      }
+      for(ParallelLoop& loop : function.parallelLoops)
+        MergeStrings(program, unit, *loop.body);
+    }
+
+    // Functions that can be called by a function compiled now. Once the
+    // program has been linked the imports are resolved by name instead.
+    static std::map<std::string, FunctionSignature> GetSignatures(const Program& program, bool imports)
+    {
+      std::map<std::string, FunctionSignature> signatures;
+      for(size_t i = 0;i<program.hostFunctions.size();i++)
+      {
+        const HostFunction& host = program.hostFunctions[i];
+        signatures[host.name] = {host.name, host.returnType, host.params, (int)i, CallKind::HOST};
+      }
+      for(size_t i = 0;i<program.functions.size();i++)
+      {
+        const CompiledFunction& function = program.functions[i];
+        signatures[function.name] = {function.name, function.returnType, function.params, (int)i, CallKind::SCRIPT};
+      }
+      for(size_t i = 0;imports && i<program.imports.size();i++)
+      {
+        const Import& import = program.imports[i];
+        signatures.insert({import.name, {import.name, import.returnType, import.params, (int)i, CallKind::IMPORT}});
+      }
+      return signatures;
+    }
+
+    static void Generate(Program& program, AstFunction* function, CompiledFunction& compiled, const CompileOptions& options)
+    {
+      IrFunction ir;
+      function->Lower(program, ir);
+      Generate(ir, compiled, options);
+    }
+
+    // Compiles the function and the bodies of its parallel loops
+    static void Generate(IrFunction& ir, CompiledFunction& compiled, const CompileOptions& options)
+    {
+      IrPasses::Run(ir, options.passes);
+      if(options.irDump)
+        ir.Print(*options.irDump);
+      IrCodegen::Generate(ir, compiled);
+      compiled.parallelLoops.clear();
+      for(IrParallelLoop& loop : ir.parallelLoops)
+      {
+        std::shared_ptr<CompiledFunction> body = std::make_shared<CompiledFunction>();
+        Generate(*loop.body, *body, options);
+        compiled.parallelLoops.push_back({body, loop.reductions});
+      }
+    }
+
+    // Function that parses, checks and compiles the body when it is called
+    static void CreateStub(Program& program, AstFunction* function, int index, const CompileOptions& options)
+    {
+      CompiledFunction& stub = program.functions[index];
+      stub.name = function->name->name;
+      stub.returnType = function->name->type;
+      stub.params = function->params->GetTypes();
+      stub.registerCount = std::max<int>(stub.params.size(), 1);
+      stub.code = {{Opcode::COMPILE, index, 0, 0}};
+      stub.lines.Add(0, {(int32_t)function->pos.line, (int32_t)function->pos.column});
+      stub.lazy = std::make_shared<LazyFunction>();
+      stub.lazy->compile = [&program, function, options](CompiledFunction& compiled)
+      {
+        return CompileLazy(program, function, compiled, options);
+      };
+    }
+
+    // Lazy functions add their strings while other threads may be reading
+    // the string constants, so there must be room for every string literal
+    // of their bodies and the empty string without moving the others
+    static void ReserveLazyStrings(Program& program, const std::vector<AstFunction*>& definitions)
+    {
+      std::set<const std::vector<TokenPos>*> sources;
+      for(AstFunction* function : definitions)
+      {
+        if(function->IsLazy())
+          sources.insert(function->lazyTokens.get());
+      }
+      size_t count = 1;
+      for(const std::vector<TokenPos>* tokens : sources)
+        count += std::count_if(tokens->begin(), tokens->end(), [](const TokenPos& token) { return token.token == Token::STRING; });
+      if(!sources.empty())
+        program.stringValues.reserve(program.stringValues.size() + count);
+    }
+
+    // Called with LazyFunction::GetMutex held
+    static bool CompileLazy(Program& program, AstFunction* function, CompiledFunction& compiled, const CompileOptions& options)
+    {
+      if(!Parser::ParseBody(function))
+        return false;
+      std::map<std::string, FunctionSignature> signatures = GetSignatures(program, true);
+      CheckData data{signatures, function->name->type};
+      if(!function->Check(data))
+        return false;
+      Generate(program, function, compiled, options);
+      return true;
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Vm.h"
+
+#include <cstdint>
+
+struct ContextLimits
+{
+  // Back-edges and calls the context may run, negative for no limit
+  int64_t budget = -1;
+  // Bytes the heap of the context may hold
+  size_t memory = SIZE_MAX;
+  // Registers the stack may grow to
+  size_t stack = Vm::MAX_STACK_SIZE;
+};
+
+// Isolated state for running untrusted script calls, such as one context per
+// request. A context has a vm, stack and heap of its own so a call that fails
+// by hitting a limit leaves every other context as it was. The program is
+// shared and must not change while contexts run calls.
+class Context
+{
+  private:
+    static const size_t INITIAL_STACK = 256;
+
+    Vm vm;
+
+  public:
+    explicit Context(const ContextLimits& limits = {})
+      : vm{INITIAL_STACK}
+    {
+      vm.SetBudget(limits.budget);
+      vm.SetMemoryLimit(limits.memory);
+      vm.SetStackLimit(limits.stack);
+    }
+
+    Vm& GetVm()
+    {
+      return vm;
+    }
+
+    // Why the last call failed, VmError::NONE if it succeeded
+    VmError GetError() const
+    {
+      return vm.GetError();
+    }
+
+    // Back-edges and calls run so far by the calls in the context
+    int64_t BudgetUsed()
+    {
+      return vm.BudgetUsed();
+    }
+};
@@ -0,0 +1,734 @@
+#pragma once
+
+#include "String.h"
+#include "Value.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <vector>
+
+// Work and pauses of the collector since the heap was created
+struct HeapStats
+{
+  static const int PAUSE_BUCKETS = 16;
+
+  uint64_t minorCollections = 0;
+  uint64_t majorCollections = 0;
+  // Bytes allocated by scripts and bytes moved by the collector
+  uint64_t allocatedBytes = 0;
+  uint64_t copiedBytes = 0;
+  size_t peakSize = 0;
+  std::chrono::nanoseconds totalPause{0};
+  std::chrono::nanoseconds maxPause{0};
+  // Bucket i counts the pauses shorter than 2^i microseconds that didn't fit
+  // in an earlier bucket, the last bucket also counts the longer ones
+  uint64_t pauses[PAUSE_BUCKETS] = {};
+};
+
+// Generational heap for the strings, arrays and maps created while a script
+// is running. Small objects are bump allocated in a nursery. Once it is full the
+// vm collects at the next instruction that allocates: the objects that the
+// registers of the running functions refer to, found through their stack
+// maps, are copied to the old space and the nursery is reused. Objects larger
+// than LARGE_SIZE get a block of their own in the old space and never move.
+//
+// Strings are immutable and arrays only hold numbers, so the only references
+// between objects are from a StringData to its StringBuffer and from a map to
+// its table and the strings in it. Tables and the strings stored in them are
+// allocated in the old space, see Tenure. Old objects therefore never refer
+// to young ones and no write barrier is needed, and everything alive is at
+// most three steps from a register. A collection takes time in proportion to
+// the registers and what they refer to, not to the size of the heap. Once the
+// old space has doubled since the last major collection, the next collection
+// also copies the live objects of the old space and frees the large blocks
+// nothing refers to. Freed memory is given back to the system a little at
+// every collection so that a collection never waits for a large heap to be
+// unmapped.
+//
+// Nothing in the language outlives the outermost call (there are no globals),
+// so everything is released at once when the host call returns.
+class Heap
+{
+  public:
+    // The gc field of objects tells the space they live in, whether they
+    // were moved and, in the old space, the major collection they survived
+    static const uint32_t STATIC = 0;
+    static const uint32_t YOUNG = 1;
+    static const uint32_t OLD = 2;
+    static const uint32_t LARGE = 3;
+    static const uint32_t SPACE = 3;
+    static const uint32_t FORWARDED = 4;
+    static const uint32_t EPOCH = 8;
+
+    static const size_t DEFAULT_NURSERY_SIZE = 1 << 20;
+
+  private:
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    static const size_t LARGE_SIZE = CHUNK_SIZE / 4;
+    static const size_t ALIGNMENT = alignof(Array);
+    // Old space at which the first major collection starts
+    static constexpr size_t MIN_MAJOR_SIZE = 8 << 20;
+    // Bytes handed back to the system by each collection
+    static const size_t FREE_PER_COLLECTION = 4 << 20;
+
+    struct BlockDeleter
+    {
+      void operator()(char* block)
+      {
+        ::operator delete(block, std::align_val_t{ALIGNMENT});
+      }
+    };
+
+    using Block = std::unique_ptr<char, BlockDeleter>;
+
+    // Chunks that memory is handed out from by bumping a pointer
+    struct Region
+    {
+      std::vector<Block> chunks;
+      char* cursor = nullptr;
+      char* end = nullptr;
+      size_t used = 0;
+    };
+
+    struct LargeBlock
+    {
+      Block memory;
+      size_t bytes;
+      // Where the gc field of the object is in the block
+      size_t gcOffset;
+    };
+
+    // The first young chunk is the nursery, the chunks after it hold what is
+    // allocated once it is full until the vm reaches an instruction where it
+    // can collect
+    Region young;
+    size_t nurserySize;
+    size_t nurseryCapacity;
+    Region old;
+    std::vector<LargeBlock> largeBlocks;
+    size_t largeBytes;
+    // Chunks of CHUNK_SIZE that are no longer used, reused before new ones
+    // are allocated
+    std::vector<Block> spareChunks;
+    // Large blocks freed by major collections that are still to be unmapped
+    std::vector<LargeBlock> deadBlocks;
+    // Old space at which the next major collection starts
+    size_t majorSize;
+    size_t limit;
+    bool collectRequested;
+    bool majorRequested;
+    // The old space being moved by a major collection
+    Region from;
+    bool major;
+    uint32_t epoch;
+    bool shared;
+    std::chrono::steady_clock::time_point pauseStart;
+    HeapStats stats;
+
+  public:
+    Heap()
+      : nurserySize{DEFAULT_NURSERY_SIZE}, nurseryCapacity{0}, largeBytes{0}, majorSize{MIN_MAJOR_SIZE}, limit{SIZE_MAX},
+        collectRequested{false}, majorRequested{false}, major{false}, epoch{0}, shared{false}
+    {}
+
+    // Returns a zeroed array or nullptr if there isn't enough memory
+    Array* AllocateArray(int32_t length, int elementSize)
+    {
+      size_t bytes = sizeof(Array) + (size_t)length * elementSize;
+      uint32_t gc;
+      void* memory = Allocate(bytes, offsetof(Array, gc), false, gc);
+      if(memory == nullptr)
+        return nullptr;
+      memset(memory, 0, bytes);
+      return new (memory) Array{length, gc, elementSize, nullptr};
+    }
+
+    // Returns an empty map or nullptr if there isn't enough memory, kind
+    // holds the bits of Map::kind
+    Map* AllocateMap(uint32_t kind)
+    {
+      uint32_t gc;
+      void* memory = Allocate(sizeof(Map), offsetof(Map, gc), false, gc);
+      if(memory == nullptr)
+        return nullptr;
+      return new (memory) Map{0, gc, kind, nullptr, nullptr};
+    }
+
+    // Returns a table without entries or nullptr if there isn't enough
+    // memory. Tables start in the old space, see Tenure.
+    MapTable* AllocateMapTable(uint32_t capacity, int keySize, int valueSize)
+    {
+      uint32_t gc;
+      void* memory = Allocate(MapTable::Bytes(capacity, keySize, valueSize), offsetof(MapTable, gc), true, gc);
+      if(memory == nullptr)
+        return nullptr;
+      MapTable* table = new (memory) MapTable{capacity, gc, nullptr};
+      memset(table->Control(), MapTable::EMPTY, capacity);
+      return table;
+    }
+
+    // Returns the string or, if it is young, a copy in the old space so that
+    // a map table can refer to it. Returns a null string if there isn't
+    // enough memory.
+    String Tenure(String str)
+    {
+      if(str.IsInline() || str.IsNull() || (str.Data()->gc & SPACE) != YOUNG)
+        return str;
+      int32_t length = str.Data()->length;
+      uint32_t gc;
+      void* memory = Allocate(sizeof(StringBuffer) + length, offsetof(StringBuffer, gc), true, gc);
+      if(memory == nullptr)
+        return String::Null();
+      StringBuffer* buffer = new (memory) StringBuffer{(uint32_t)length, (uint32_t)length, gc, nullptr};
+      memcpy(buffer->Data(), str.Data()->data, length);
+      memory = Allocate(sizeof(StringData), offsetof(StringData, gc), true, gc);
+      if(memory == nullptr)
+        return String::Null();
+      return String::FromData(new (memory) StringData{buffer->Data(), length, gc, buffer});
+    }
+
+    // Shared by every array without elements, nothing can be stored in it
+    static Array* EmptyArray()
+    {
+      static Array empty{0};
+      return &empty;
+    }
+
+    // Copies the characters into the heap. Returns a null string if there
+    // isn't enough memory.
+    String AllocateString(std::string_view str)
+    {
+      if(str.size() <= String::INLINE_LENGTH)
+        return String::Inline(str.data(), str.size());
+      StringBuffer* buffer = AllocateBuffer(str.size());
+      if(buffer == nullptr)
+        return String::Null();
+      memcpy(buffer->Data(), str.data(), str.size());
+      buffer->used = str.size();
+      return AllocateData(buffer->Data(), str.size(), buffer);
+    }
+
+    // Appends in place when left ends at the end of its buffer, otherwise
+    // both are copied to a new buffer with room to grow. Repeatedly appending
+    // to a string is therefore linear in the final length. The length must
+    // be checked against String::MAX_LENGTH before.
+    String Concat(String left, String right)
+    {
+      char scratchLeft[String::INLINE_LENGTH];
+      char scratchRight[String::INLINE_LENGTH];
+      std::string_view l = left.View(scratchLeft);
+      std::string_view r = right.View(scratchRight);
+      size_t length = l.size() + r.size();
+      if(r.empty())
+        return left;
+      if(l.empty())
+        return right;
+      if(length <= String::INLINE_LENGTH)
+      {
+        char data[String::INLINE_LENGTH];
+        memcpy(data, l.data(), l.size());
+        memcpy(data + l.size(), r.data(), r.size());
+        return String::Inline(data, length);
+      }
+
+      if(!shared && !left.IsInline())
+      {
+        StringBuffer* buffer = left.Data()->buffer;
+        if(buffer && l.data() + l.size() == buffer->Data() + buffer->used && buffer->capacity - buffer->used >= r.size())
+        {
+          memcpy(buffer->Data() + buffer->used, r.data(), r.size());
+          buffer->used += r.size();
+          return AllocateData(l.data(), length, buffer);
+        }
+      }
+
+      StringBuffer* buffer = AllocateBuffer(std::min(length * 2, (size_t)String::MAX_LENGTH));
+      if(buffer == nullptr)
+        return String::Null();
+      memcpy(buffer->Data(), l.data(), l.size());
+      memcpy(buffer->Data() + l.size(), r.data(), r.size());
+      buffer->used = length;
+      return AllocateData(buffer->Data(), length, buffer);
+    }
+
+    // Characters [start, start + count) of the string, clamped to the string.
+    // Long substrings share the characters of the string.
+    String Substring(String str, int32_t start, int32_t count)
+    {
+      int32_t length = str.Length();
+      start = std::clamp(start, 0, length);
+      count = std::clamp(count, 0, length - start);
+      if(count == length)
+        return str;
+      if(count <= String::INLINE_LENGTH)
+      {
+        char data[String::INLINE_LENGTH];
+        for(int32_t i = 0;i<count;i++)
+          data[i] = str.At(start + i);
+        return String::Inline(data, count);
+      }
+      const StringData* data = str.Data();
+      return AllocateData(data->data + start, count, data->buffer);
+    }
+
+    void Release()
+    {
+      largeBlocks.clear();
+      deadBlocks.clear();
+      largeBytes = 0;
+      old = {};
+      ResetYoung();
+      spareChunks.clear();
+      majorSize = MIN_MAJOR_SIZE;
+      collectRequested = false;
+      majorRequested = false;
+    }
+
+    // Bytes allocated and not yet collected
+    size_t Size() const
+    {
+      return young.used + old.used + largeBytes;
+    }
+
+    // Bytes the heap may hold at once, a full collection is tried before an
+    // allocation fails
+    void SetLimit(size_t bytes)
+    {
+      limit = bytes;
+    }
+
+    size_t Limit() const
+    {
+      return limit;
+    }
+
+    // Set while other threads read the strings of the heap or the heap reads
+    // theirs. Concat then copies instead of appending to the buffer of a
+    // string, which may be appended to by another thread.
+    void SetShared(bool shared)
+    {
+      this->shared = shared;
+    }
+
+    // Bytes allocated between minor collections, 0 turns the collector off so
+    // that everything is kept until the heap is released. A new size takes
+    // effect after the next collection.
+    void SetNurserySize(size_t bytes)
+    {
+      nurserySize = bytes == 0 ? 0 : std::max(bytes, CHUNK_SIZE);
+    }
+
+    bool IsCollecting() const
+    {
+      return nurserySize > 0;
+    }
+
+    // Set once the nursery is full or the old space has grown enough for a
+    // major collection
+    bool ShouldCollect() const
+    {
+      return collectRequested;
+    }
+
+    // Called when the vm can't collect, such as while compiled code is
+    // running. The nursery grows by another chunk before it asks again.
+    void Postpone()
+    {
+      collectRequested = false;
+    }
+
+    const HeapStats& Stats() const
+    {
+      return stats;
+    }
+
+    // The vm calls Visit for every register holding a string, array or map
+    // between BeginCollection and EndCollection. A full collection also moves
+    // the old space.
+    void BeginCollection(bool full)
+    {
+      pauseStart = std::chrono::steady_clock::now();
+      major = full || majorRequested;
+      if(major)
+      {
+        epoch ^= EPOCH;
+        from = std::move(old);
+        old = {};
+      }
+    }
+
+    void Visit(String& str)
+    {
+      if(str.IsInline() || str.IsNull())
+        return;
+      str = String::FromData(Move(const_cast<StringData*>(str.Data())));
+    }
+
+    void Visit(Array*& array)
+    {
+      if(array)
+        array = Move(array);
+    }
+
+    void Visit(Map*& map)
+    {
+      if(map)
+        map = Move(map);
+    }
+
+    void EndCollection()
+    {
+      // Everything alive has left the nursery, the chunks after it are spare
+      ResetYoung();
+      if(major)
+      {
+        for(Block& chunk : from.chunks)
+          spareChunks.push_back(std::move(chunk));
+        from = {};
+        std::vector<LargeBlock> live;
+        for(LargeBlock& block : largeBlocks)
+        {
+          uint32_t gc;
+          memcpy(&gc, block.memory.get() + block.gcOffset, sizeof(gc));
+          if((gc & EPOCH) == epoch)
+            live.push_back(std::move(block));
+          else
+          {
+            largeBytes -= block.bytes;
+            deadBlocks.push_back(std::move(block));
+          }
+        }
+        largeBlocks = std::move(live);
+        majorSize = std::max(MIN_MAJOR_SIZE, OldSize() * 2);
+        stats.majorCollections++;
+      }
+      else
+        stats.minorCollections++;
+      collectRequested = false;
+      majorRequested = false;
+      if(OldSize() >= majorSize)
+        collectRequested = majorRequested = true;
+      FreeSome();
+
+      auto pause = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - pauseStart);
+      stats.totalPause += pause;
+      stats.maxPause = std::max(stats.maxPause, pause);
+      int bucket = 0;
+      for(int64_t us = pause.count() / 1000;us > 0 && bucket + 1 < HeapStats::PAUSE_BUCKETS;us >>= 1)
+        bucket++;
+      stats.pauses[bucket]++;
+    }
+
+  private:
+    // Returns memory aligned for arrays or nullptr if there isn't enough or
+    // the limit would be passed. Gc is set to the gc field of the object,
+    // which is at gcOffset. Tenured objects skip the nursery.
+    void* Allocate(size_t bytes, size_t gcOffset, bool tenured, uint32_t& gc)
+    {
+      bytes = (bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+      size_t size = Size();
+      if(size > limit || bytes > limit - size)
+        return nullptr;
+      void* memory;
+      if(bytes > LARGE_SIZE)
+      {
+        gc = LARGE | epoch;
+        memory = AllocateLarge(bytes, gcOffset);
+      }
+      else if(tenured)
+      {
+        gc = OLD | epoch;
+        memory = AllocateTenured(bytes);
+      }
+      else
+      {
+        gc = YOUNG;
+        memory = AllocateYoung(bytes);
+      }
+      if(memory)
+      {
+        stats.allocatedBytes += bytes;
+        stats.peakSize = std::max(stats.peakSize, Size());
+      }
+      return memory;
+    }
+
+    char* AllocateYoung(size_t bytes)
+    {
+      if(bytes > (size_t)(young.end - young.cursor))
+      {
+        if(young.chunks.empty())
+        {
+          nurseryCapacity = std::max(nurserySize, CHUNK_SIZE);
+          if(!AddChunk(young, nurseryCapacity))
+            return nullptr;
+        }
+        else
+        {
+          if(IsCollecting())
+            collectRequested = true;
+          if(!AddChunk(young, CHUNK_SIZE))
+            return nullptr;
+        }
+      }
+      return Bump(young, bytes);
+    }
+
+    // Large objects are allocated straight into the old space, marked as if
+    // they had survived the last major collection
+    char* AllocateLarge(size_t bytes, size_t gcOffset)
+    {
+      char* block = static_cast<char*>(::operator new(bytes, std::align_val_t{ALIGNMENT}, std::nothrow));
+      if(block == nullptr)
+        return nullptr;
+      largeBlocks.push_back({Block{block}, bytes, gcOffset});
+      largeBytes += bytes;
+      if(IsCollecting() && OldSize() >= majorSize)
+        collectRequested = majorRequested = true;
+      return block;
+    }
+
+    // Memory in the old space for an object allocated there, which counts
+    // towards the next major collection like a large block
+    char* AllocateTenured(size_t bytes)
+    {
+      if(bytes > (size_t)(old.end - old.cursor) && !AddChunk(old, CHUNK_SIZE))
+        return nullptr;
+      char* memory = Bump(old, bytes);
+      if(IsCollecting() && OldSize() >= majorSize)
+        collectRequested = majorRequested = true;
+      return memory;
+    }
+
+    // Memory in the old space for an object moved by the collector, which
+    // has no way to fail
+    char* AllocateOld(size_t bytes)
+    {
+      if(bytes > (size_t)(old.end - old.cursor) && !AddChunk(old, CHUNK_SIZE))
+      {
+        std::cerr << "Out of memory while collecting the heap" << std::endl;
+        std::abort();
+      }
+      stats.copiedBytes += bytes;
+      return Bump(old, bytes);
+    }
+
+    bool AddChunk(Region& region, size_t size)
+    {
+      if(size == CHUNK_SIZE && !spareChunks.empty())
+      {
+        region.chunks.push_back(std::move(spareChunks.back()));
+        spareChunks.pop_back();
+      }
+      else
+      {
+        char* chunk = static_cast<char*>(::operator new(size, std::align_val_t{ALIGNMENT}, std::nothrow));
+        if(chunk == nullptr)
+          return false;
+        region.chunks.emplace_back(chunk);
+      }
+      region.cursor = region.chunks.back().get();
+      region.end = region.cursor + size;
+      return true;
+    }
+
+    static char* Bump(Region& region, size_t bytes)
+    {
+      char* memory = region.cursor;
+      region.cursor += bytes;
+      region.used += bytes;
+      return memory;
+    }
+
+    // Keeps the nursery, unless its size was changed, and makes the chunks
+    // after it spare
+    void ResetYoung()
+    {
+      size_t first = nurseryCapacity == std::max(nurserySize, CHUNK_SIZE) ? 1 : 0;
+      for(size_t i = first;i<young.chunks.size();i++)
+      {
+        if(i > 0)
+          spareChunks.push_back(std::move(young.chunks[i]));
+      }
+      young.chunks.resize(std::min(first, young.chunks.size()));
+      young.used = 0;
+      young.cursor = young.chunks.empty() ? nullptr : young.chunks[0].get();
+      young.end = young.chunks.empty() ? nullptr : young.cursor + nurseryCapacity;
+      if(young.chunks.empty())
+        nurseryCapacity = 0;
+    }
+
+    size_t OldSize() const
+    {
+      return old.used + largeBytes;
+    }
+
+    // Unmaps some of the large blocks freed by major collections and the
+    // spare chunks that the old space is unlikely to need again
+    void FreeSome()
+    {
+      size_t freed = 0;
+      while(!deadBlocks.empty() && freed < FREE_PER_COLLECTION)
+      {
+        freed += deadBlocks.back().bytes;
+        deadBlocks.pop_back();
+      }
+      size_t keep = old.chunks.size() / 4 + 1;
+      while(spareChunks.size() > keep && freed < FREE_PER_COLLECTION)
+      {
+        freed += CHUNK_SIZE;
+        spareChunks.pop_back();
+      }
+    }
+
+    // Young objects are copied to the old space, old objects too in a major
+    // collection unless they already were. Large objects are marked with the
+    // epoch of the collection instead.
+    bool IsMoved(uint32_t gc) const
+    {
+      uint32_t space = gc & SPACE;
+      return space == YOUNG || (major && space == OLD && (gc & EPOCH) != epoch);
+    }
+
+    void Mark(uint32_t& gc)
+    {
+      if(major && (gc & SPACE) == LARGE)
+        gc = (gc & ~EPOCH) | epoch;
+    }
+
+    Array* Move(Array* array)
+    {
+      if(array->gc & FORWARDED)
+        return array->forward;
+      if(!IsMoved(array->gc))
+      {
+        Mark(array->gc);
+        return array;
+      }
+      size_t bytes = sizeof(Array) + (size_t)array->length * array->elementSize;
+      Array* copy = reinterpret_cast<Array*>(AllocateOld((bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+      memcpy((void*)copy, array, bytes);
+      copy->gc = OLD | epoch;
+      array->gc |= FORWARDED;
+      array->forward = copy;
+      return copy;
+    }
+
+    StringBuffer* Move(StringBuffer* buffer)
+    {
+      if(buffer->gc & FORWARDED)
+        return buffer->forward;
+      if(!IsMoved(buffer->gc))
+      {
+        Mark(buffer->gc);
+        return buffer;
+      }
+      // Keeps the capacity so that appending in place still works
+      StringBuffer* copy = reinterpret_cast<StringBuffer*>(AllocateOld((sizeof(StringBuffer) + buffer->capacity + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+      memcpy((void*)copy, buffer, sizeof(StringBuffer) + buffer->used);
+      copy->gc = OLD | epoch;
+      buffer->gc |= FORWARDED;
+      buffer->forward = copy;
+      return copy;
+    }
+
+    StringData* Move(StringData* data)
+    {
+      if(data->gc & FORWARDED)
+        return reinterpret_cast<StringData*>(const_cast<char*>(data->data));
+      if(!IsMoved(data->gc))
+        return data;
+      StringData* copy = reinterpret_cast<StringData*>(AllocateOld((sizeof(StringData) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+      *copy = *data;
+      copy->gc = OLD | epoch;
+      if(data->buffer)
+      {
+        copy->buffer = Move(data->buffer);
+        copy->data = copy->buffer->Data() + (data->data - data->buffer->Data());
+      }
+      data->gc |= FORWARDED;
+      data->data = reinterpret_cast<const char*>(copy);
+      return copy;
+    }
+
+    // The table is never young, so only a major collection moves it
+    Map* Move(Map* map)
+    {
+      if(map->gc & FORWARDED)
+        return map->forward;
+      if(!IsMoved(map->gc))
+        return map;
+      Map* copy = reinterpret_cast<Map*>(AllocateOld((sizeof(Map) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+      *copy = *map;
+      copy->gc = OLD | epoch;
+      if(major && map->table)
+        copy->table = Move(map->table, *map);
+      map->gc |= FORWARDED;
+      map->forward = copy;
+      return copy;
+    }
+
+    // Moves or marks the table and moves the strings of its entries
+    MapTable* Move(MapTable* table, const Map& map)
+    {
+      if(table->gc & FORWARDED)
+        return table->forward;
+      MapTable* copy = table;
+      if(IsMoved(table->gc))
+      {
+        size_t bytes = MapTable::Bytes(table->capacity, map.KeySize(), map.ValueSize());
+        copy = reinterpret_cast<MapTable*>(AllocateOld((bytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1)));
+        memcpy((void*)copy, table, bytes);
+        copy->gc = OLD | epoch;
+        table->gc |= FORWARDED;
+        table->forward = copy;
+      }
+      else if((table->gc & EPOCH) == epoch)
+        return table;
+      else
+        Mark(table->gc);
+      if(map.kind & Map::STRING_KEYS)
+        MoveStrings(copy->Keys(), map.length);
+      if(map.kind & Map::STRING_VALUES)
+        MoveStrings(copy->Values(map.KeySize()), map.length);
+      return copy;
+    }
+
+    void MoveStrings(char* strings, int32_t count)
+    {
+      for(int32_t i = 0;i<count;i++)
+      {
+        String str;
+        memcpy(&str, strings + i * sizeof(String), sizeof(String));
+        if(str.IsInline() || str.IsNull())
+          continue;
+        str = String::FromData(Move(const_cast<StringData*>(str.Data())));
+        memcpy(strings + i * sizeof(String), &str, sizeof(String));
+      }
+    }
+
+    StringBuffer* AllocateBuffer(size_t capacity)
+    {
+      uint32_t gc;
+      void* memory = Allocate(sizeof(StringBuffer) + capacity, offsetof(StringBuffer, gc), false, gc);
+      if(memory == nullptr)
+        return nullptr;
+      return new (memory) StringBuffer{(uint32_t)capacity, 0, gc, nullptr};
+    }
+
+    String AllocateData(const char* data, int32_t length, StringBuffer* buffer)
+    {
+      uint32_t gc;
+      void* memory = Allocate(sizeof(StringData), offsetof(StringData, gc), false, gc);
+      if(memory == nullptr)
+        return String::Null();
+      return String::FromData(new (memory) StringData{data, length, gc, buffer});
+    }
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "Bytecode.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Instruction that allocated, its source position is the allocation site
+struct HeapSite
+{
+  const CompiledFunction* function;
+  int32_t pc;
+
+  bool operator<(const HeapSite& other) const
+  {
+    if(function != other.function)
+      return function < other.function;
+    return pc < other.pc;
+  }
+};
+
+struct HeapSiteStats
+{
+  uint64_t allocations;
+  uint64_t bytes;
+  // Bytes that haven't been released, the heap releases everything allocated
+  // by a call from the host when the call returns. Objects freed by the
+  // collector still count until then.
+  int64_t liveBytes;
+  int64_t peakBytes;
+};
+
+// Counters of every allocation site at one point in time
+struct HeapSnapshot
+{
+  std::map<HeapSite, HeapSiteStats> sites;
+  int64_t liveBytes;
+  int64_t peakBytes;
+
+  // What changed since before, peaks are the peaks of this snapshot
+  HeapSnapshot Diff(const HeapSnapshot& before) const
+  {
+    HeapSnapshot diff{{}, liveBytes - before.liveBytes, peakBytes};
+    for(const auto& [site, stats] : sites)
+    {
+      HeapSiteStats change = stats;
+      auto it = before.sites.find(site);
+      if(it != before.sites.end())
+      {
+        change.allocations -= it->second.allocations;
+        change.bytes -= it->second.bytes;
+        change.liveBytes -= it->second.liveBytes;
+      }
+      if(change.allocations != 0 || change.liveBytes != 0)
+        diff.sites[site] = change;
+    }
+    return diff;
+  }
+
+  // The sites with the most live bytes, then the most bytes allocated
+  void Write(std::ostream& os, size_t count = 20) const
+  {
+    std::vector<std::pair<HeapSite, HeapSiteStats>> sorted{sites.begin(), sites.end()};
+    std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b)
+    {
+      if(a.second.liveBytes != b.second.liveBytes)
+        return a.second.liveBytes > b.second.liveBytes;
+      return a.second.bytes > b.second.bytes;
+    });
+    os << "live " << liveBytes << " bytes, peak " << peakBytes << " bytes" << std::endl;
+    os << std::setw(12) << "live" << std::setw(12) << "peak" << std::setw(14) << "allocated" << std::setw(12) << "count" << "  site" << std::endl;
+    for(size_t i = 0;i<sorted.size() && i<count;i++)
+    {
+      const HeapSite& site = sorted[i].first;
+      const HeapSiteStats& stats = sorted[i].second;
+      SourcePos pos = site.function->lines.Find(site.pc);
+      os << std::setw(12) << stats.liveBytes << std::setw(12) << stats.peakBytes << std::setw(14) << stats.bytes
+        << std::setw(12) << stats.allocations << "  " << site.function->name << ":" << pos.line << ":" << pos.column << std::endl;
+    }
+  }
+};
+
+// Attributes the strings and arrays allocated by scripts to the instruction
+// that allocated them. With a sample interval, a vm only records an
+// allocation about every interval bytes and the counters are estimates
+// scaled up from the samples. A heap profiler can be shared by vms on
+// different threads.
+class HeapProfiler
+{
+  private:
+    std::mutex mutex;
+    std::map<HeapSite, HeapSiteStats> sites;
+    int64_t liveBytes;
+    int64_t peakBytes;
+    size_t sampleInterval;
+
+  public:
+    // Records every allocation if sampleInterval is 0
+    explicit HeapProfiler(size_t sampleInterval = 0)
+      : liveBytes{0}, peakBytes{0}, sampleInterval{sampleInterval}
+    {}
+
+    size_t SampleInterval() const
+    {
+      return sampleInterval;
+    }
+
+    void Allocated(const HeapSite& site, uint64_t count, uint64_t bytes)
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      HeapSiteStats& stats = sites[site];
+      stats.allocations += count;
+      stats.bytes += bytes;
+      stats.liveBytes += bytes;
+      stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+      liveBytes += bytes;
+      peakBytes = std::max(peakBytes, liveBytes);
+    }
+
+    void Released(const HeapSite& site, uint64_t bytes)
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      sites[site].liveBytes -= bytes;
+      liveBytes -= bytes;
+    }
+
+    HeapSnapshot Snapshot()
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      return {sites, liveBytes, peakBytes};
+    }
+};
@@ -0,0 +1,634 @@
+#pragma once
+
+#include "Builtins.h"
+#include "Bytecode.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A linked program saved to a file, so it can be loaded without lexing,
+// parsing or compiling. Everything refers to other parts by index, so the
+// image is copied straight out of a memory mapping. Host functions are
+// stored by name and signature and are resolved to the functions bound when
+// the image is loaded. Images are only read by the build that wrote them, the number
+// of opcodes is checked to catch most mismatches. Every register, jump
+// target, function, string and loop that the code refers to is checked to
+// exist, so a corrupt image fails to load. The types of the registers
+// aren't checked.
+class Image
+{
+  private:
+    static const uint32_t VERSION = 7;
+    static constexpr char MAGIC[8] = {'G', 'R', 'E', 'E', 'T', 'I', 'M', 'G'};
+
+    struct Writer
+    {
+      std::string data;
+
+      template <typename T>
+      void Write(T value)
+      {
+        data.append(reinterpret_cast<const char*>(&value), sizeof(T));
+      }
+
+      void WriteString(const std::string& str)
+      {
+        Write<uint32_t>(str.size());
+        data.append(str);
+      }
+
+      void WriteTypes(const std::vector<Type>& types)
+      {
+        Write<uint32_t>(types.size());
+        for(Type type : types)
+          Write<uint8_t>((uint8_t)type);
+      }
+    };
+
+    // Reads from the mapping, the reader is invalid once it reads past the end
+    struct Reader
+    {
+      const char* data;
+      size_t size;
+      size_t pos;
+      bool valid;
+
+      template <typename T>
+      T Read()
+      {
+        T value{};
+        if(!Has(sizeof(T)))
+          return value;
+        memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+      }
+
+      std::string ReadString()
+      {
+        uint32_t length = Read<uint32_t>();
+        if(!Has(length))
+          return "";
+        std::string str{data + pos, length};
+        pos += length;
+        return str;
+      }
+
+      std::vector<Type> ReadTypes()
+      {
+        uint32_t count = Read<uint32_t>();
+        if(!Has(count))
+          return {};
+        std::vector<Type> types(count);
+        for(uint32_t i = 0;i<count;i++)
+          types[i] = (Type)Read<uint8_t>();
+        return types;
+      }
+
+      bool Has(size_t bytes)
+      {
+        if(valid && size - pos >= bytes)
+          return true;
+        valid = false;
+        return false;
+      }
+
+      // Whether count elements of the size are left, without overflowing
+      bool Has(uint32_t count, size_t elementSize)
+      {
+        if(valid && count <= (size - pos) / elementSize)
+          return true;
+        valid = false;
+        return false;
+      }
+    };
+
+  public:
+    // The program must be linked and every function compiled
+    static bool Save(const Program& program, const std::string& path)
+    {
+      Writer writer;
+      writer.data.append(MAGIC, sizeof(MAGIC));
+      writer.Write<uint32_t>(VERSION);
+      writer.Write<uint32_t>((uint32_t)Opcode::RETURN_VOID);
+
+      writer.Write<uint32_t>(program.hostFunctions.size());
+      for(const HostFunction& host : program.hostFunctions)
+      {
+        writer.WriteString(host.name);
+        writer.Write<uint8_t>((uint8_t)host.returnType);
+        writer.WriteTypes(host.params);
+      }
+
+      writer.Write<uint32_t>(program.strings.size());
+      for(const std::string& str : program.strings)
+        writer.WriteString(str);
+
+      writer.Write<uint32_t>(program.functions.size());
+      for(const CompiledFunction& function : program.functions)
+      {
+        if(!WriteFunction(writer, function))
+          return false;
+      }
+
+      std::ofstream file{path, std::ios::binary};
+      if(!file.write(writer.data.data(), writer.data.size()))
+      {
+        std::cerr << "Failed to write image " << path << std::endl;
+        return false;
+      }
+      return true;
+    }
+
+    // Loads the image into a program without script functions. The host
+    // functions used by the image must already be bound.
+    static bool Load(Program& program, const std::string& path)
+    {
+      if(!program.functions.empty() || !program.strings.empty())
+      {
+        std::cerr << "Images can only be loaded into an empty program" << std::endl;
+        return false;
+      }
+
+      int fd = open(path.c_str(), O_RDONLY);
+      if(fd == -1)
+      {
+        std::cerr << "Failed to open image " << path << std::endl;
+        return false;
+      }
+      struct stat info;
+      if(fstat(fd, &info) == -1 || info.st_size == 0)
+      {
+        close(fd);
+        std::cerr << "Failed to read image " << path << std::endl;
+        return false;
+      }
+      void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if(mapping == MAP_FAILED)
+      {
+        std::cerr << "Failed to map image " << path << std::endl;
+        return false;
+      }
+
+      Reader reader{static_cast<const char*>(mapping), (size_t)info.st_size, 0, true};
+      bool valid = Read(program, reader);
+      munmap(mapping, info.st_size);
+      if(!valid)
+      {
+        std::cerr << "Invalid image " << path << std::endl;
+        program.functions.clear();
+        program.strings.clear();
+        program.stringData.clear();
+        program.stringValues.clear();
+      }
+      return valid;
+    }
+
+  private:
+    static bool Read(Program& program, Reader& reader)
+    {
+      if(!reader.Has(sizeof(MAGIC)) || memcmp(reader.data, MAGIC, sizeof(MAGIC)) != 0)
+        return false;
+      reader.pos += sizeof(MAGIC);
+      if(reader.Read<uint32_t>() != VERSION || reader.Read<uint32_t>() != (uint32_t)Opcode::RETURN_VOID)
+        return false;
+
+      // Host functions of the image are called by the index of the bound
+      // function with the same name
+      std::map<std::string, int> hostIndices;
+      for(size_t i = 0;i<program.hostFunctions.size();i++)
+        hostIndices[program.hostFunctions[i].name] = i;
+      uint32_t hostCount = reader.Read<uint32_t>();
+      if(!reader.Has(hostCount))
+        return false;
+      std::vector<int> hostRemap(hostCount);
+      for(size_t i = 0;i<hostRemap.size() && reader.valid;i++)
+      {
+        std::string name = reader.ReadString();
+        Type returnType = (Type)reader.Read<uint8_t>();
+        std::vector<Type> params = reader.ReadTypes();
+        auto it = hostIndices.find(name);
+        if(it == hostIndices.end())
+        {
+          std::cerr << "Image uses host function " << name << " which isn't bound" << std::endl;
+          return false;
+        }
+        const HostFunction& host = program.hostFunctions[it->second];
+        if(host.returnType != returnType || host.params != params)
+        {
+          std::cerr << "Host function " << name << " doesn't match the image" << std::endl;
+          return false;
+        }
+        hostRemap[i] = it->second;
+      }
+
+      uint32_t stringCount = reader.Read<uint32_t>();
+      for(uint32_t i = 0;i<stringCount && reader.valid;i++)
+        program.AddString(reader.ReadString());
+
+      uint32_t functionCount = reader.Read<uint32_t>();
+      if(!reader.Has(functionCount))
+        return false;
+      program.functions.resize(functionCount);
+      for(CompiledFunction& function : program.functions)
+      {
+        if(!ReadFunction(reader, hostRemap, function))
+          return false;
+      }
+      // Calls refer to functions later in the image as well
+      for(const CompiledFunction& function : program.functions)
+      {
+        if(!CheckFunction(program, function))
+          return false;
+      }
+      return reader.valid && reader.pos == reader.size;
+    }
+
+    static bool WriteFunction(Writer& writer, const CompiledFunction& function)
+    {
+      for(const Instruction& instruction : function.code)
+      {
+        if(instruction.op == Opcode::CALL_IMPORT || instruction.op == Opcode::COMPILE || instruction.op == Opcode::CALL_NATIVE)
+        {
+          std::cerr << "Can't save " << function.name << ", it isn't linked or compiled to bytecode" << std::endl;
+          return false;
+        }
+      }
+      writer.WriteString(function.name);
+      writer.Write<uint8_t>((uint8_t)function.returnType);
+      writer.WriteTypes(function.params);
+      writer.Write<int32_t>(function.registerCount);
+      writer.Write<uint32_t>(function.code.size());
+      for(const Instruction& instruction : function.code)
+      {
+        writer.Write<uint8_t>((uint8_t)instruction.op);
+        writer.Write<int32_t>(instruction.a);
+        writer.Write<int32_t>(instruction.b);
+        writer.Write<int32_t>(instruction.c);
+      }
+      const std::vector<uint8_t>& lines = function.lines.Bytes();
+      writer.Write<uint32_t>(lines.size());
+      for(uint8_t byte : lines)
+        writer.Write<uint8_t>(byte);
+      writer.Write<uint32_t>(function.inlineSites.size());
+      for(const InlineSite& site : function.inlineSites)
+      {
+        writer.WriteString(site.name);
+        writer.Write<int32_t>(site.call.line);
+        writer.Write<int32_t>(site.call.column);
+        writer.Write<int32_t>(site.call.inlined);
+      }
+      writer.Write<uint32_t>(function.vectorLoops.size());
+      for(const VectorLoop& loop : function.vectorLoops)
+      {
+        writer.Write<uint32_t>(loop.ops.size());
+        for(const VectorOp& op : loop.ops)
+        {
+          writer.Write<uint8_t>((uint8_t)op.kind);
+          writer.Write<uint8_t>((uint8_t)op.opcode);
+          writer.Write<int32_t>(op.dst);
+          writer.Write<int32_t>(op.a);
+          writer.Write<int32_t>(op.b);
+          writer.Write<int32_t>(op.imm);
+        }
+        writer.Write<int32_t>(loop.temps);
+        writer.Write<uint32_t>(loop.arrays.size());
+        for(int array : loop.arrays)
+          writer.Write<int32_t>(array);
+      }
+      writer.Write<uint32_t>(function.stackMaps.size());
+      for(const StackMap& map : function.stackMaps)
+      {
+        writer.Write<int32_t>(map.pc);
+        for(const std::vector<int32_t>* registers : {&map.strings, &map.arrays, &map.maps})
+        {
+          writer.Write<uint32_t>(registers->size());
+          for(int32_t reg : *registers)
+            writer.Write<int32_t>(reg);
+        }
+      }
+      writer.Write<uint32_t>(function.parallelLoops.size());
+      for(const ParallelLoop& loop : function.parallelLoops)
+      {
+        writer.Write<uint32_t>(loop.reductions.size());
+        for(const Reduction& reduction : loop.reductions)
+        {
+          writer.Write<uint8_t>((uint8_t)reduction.kind);
+          writer.Write<uint8_t>((uint8_t)reduction.type);
+        }
+        if(!WriteFunction(writer, *loop.body))
+          return false;
+      }
+      return true;
+    }
+
+    static bool ReadFunction(Reader& reader, const std::vector<int>& hostRemap, CompiledFunction& function)
+    {
+      function.name = reader.ReadString();
+      function.returnType = (Type)reader.Read<uint8_t>();
+      function.params = reader.ReadTypes();
+      function.registerCount = reader.Read<int32_t>();
+
+      uint32_t codeSize = reader.Read<uint32_t>();
+      if(!reader.Has(codeSize, 13))
+        return false;
+      function.code.resize(codeSize);
+      for(Instruction& instruction : function.code)
+      {
+        instruction.op = (Opcode)reader.Read<uint8_t>();
+        instruction.a = reader.Read<int32_t>();
+        instruction.b = reader.Read<int32_t>();
+        instruction.c = reader.Read<int32_t>();
+        if(instruction.op > Opcode::RETURN_VOID)
+          return false;
+        if(instruction.op == Opcode::CALL_HOST)
+        {
+          if(instruction.a < 0 || instruction.a >= (int32_t)hostRemap.size())
+            return false;
+          instruction.a = hostRemap[instruction.a];
+        }
+      }
+
+      uint32_t lineBytes = reader.Read<uint32_t>();
+      if(!reader.Has(lineBytes))
+        return false;
+      std::vector<uint8_t> lines(lineBytes);
+      for(uint8_t& byte : lines)
+        byte = reader.Read<uint8_t>();
+      if(!function.lines.SetBytes(std::move(lines)))
+        return false;
+
+      // A call can only be in a site inlined before it
+      uint32_t siteCount = reader.Read<uint32_t>();
+      if(!reader.Has(siteCount, 16))
+        return false;
+      function.inlineSites.resize(siteCount);
+      for(size_t i = 0;i<siteCount;i++)
+      {
+        InlineSite& site = function.inlineSites[i];
+        site.name = reader.ReadString();
+        site.call.line = reader.Read<int32_t>();
+        site.call.column = reader.Read<int32_t>();
+        site.call.inlined = reader.Read<int32_t>();
+        if(site.call.inlined < 0 || site.call.inlined > (int64_t)i)
+          return false;
+      }
+      bool sitesValid = true;
+      function.lines.ForEach([&](int32_t pc, SourcePos pos)
+      {
+        sitesValid = pos.inlined >= 0 && pos.inlined <= (int64_t)siteCount;
+        return sitesValid;
+      });
+      if(!sitesValid)
+        return false;
+
+      uint32_t loopCount = reader.Read<uint32_t>();
+      if(!reader.Has(loopCount))
+        return false;
+      function.vectorLoops.resize(loopCount);
+      for(VectorLoop& loop : function.vectorLoops)
+      {
+        uint32_t opCount = reader.Read<uint32_t>();
+        if(!reader.Has(opCount, 18))
+          return false;
+        loop.ops.resize(opCount);
+        for(VectorOp& op : loop.ops)
+        {
+          op.kind = (VectorOpKind)reader.Read<uint8_t>();
+          op.opcode = (Opcode)reader.Read<uint8_t>();
+          op.dst = reader.Read<int32_t>();
+          op.a = reader.Read<int32_t>();
+          op.b = reader.Read<int32_t>();
+          op.imm = reader.Read<int32_t>();
+        }
+        loop.temps = reader.Read<int32_t>();
+        uint32_t arrayCount = reader.Read<uint32_t>();
+        if(!reader.Has(arrayCount, 4))
+          return false;
+        loop.arrays.resize(arrayCount);
+        for(int& array : loop.arrays)
+          array = reader.Read<int32_t>();
+      }
+
+      uint32_t mapCount = reader.Read<uint32_t>();
+      if(!reader.Has(mapCount, 12))
+        return false;
+      function.stackMaps.resize(mapCount);
+      for(StackMap& map : function.stackMaps)
+      {
+        map.pc = reader.Read<int32_t>();
+        if(map.pc < 0 || map.pc >= (int32_t)codeSize)
+          return false;
+        for(std::vector<int32_t>* registers : {&map.strings, &map.arrays, &map.maps})
+        {
+          uint32_t count = reader.Read<uint32_t>();
+          if(!reader.Has(count, 4))
+            return false;
+          registers->resize(count);
+          for(int32_t& reg : *registers)
+          {
+            reg = reader.Read<int32_t>();
+            if(reg < 0 || reg >= function.registerCount)
+              return false;
+          }
+        }
+      }
+
+      uint32_t parallelCount = reader.Read<uint32_t>();
+      if(!reader.Has(parallelCount))
+        return false;
+      function.parallelLoops.resize(parallelCount);
+      for(ParallelLoop& loop : function.parallelLoops)
+      {
+        uint32_t reductionCount = reader.Read<uint32_t>();
+        if(!reader.Has(reductionCount, 2))
+          return false;
+        loop.reductions.resize(reductionCount);
+        for(Reduction& reduction : loop.reductions)
+        {
+          reduction.kind = (ReductionKind)reader.Read<uint8_t>();
+          reduction.type = (Type)reader.Read<uint8_t>();
+        }
+        loop.body = std::make_shared<CompiledFunction>();
+        if(!ReadFunction(reader, hostRemap, *loop.body))
+          return false;
+      }
+      return reader.valid;
+    }
+
+    // Whether every register, jump target, function, string and loop that
+    // the code refers to exists. The code must end in a jump or return so
+    // it can't run past its end.
+    static bool CheckFunction(const Program& program, const CompiledFunction& function)
+    {
+      int32_t size = function.code.size();
+      if(size == 0 || function.registerCount < std::max<int32_t>(function.params.size(), 1))
+        return false;
+      for(const Instruction& in : function.code)
+      {
+        if(!CheckInstruction(program, function, in))
+          return false;
+      }
+      Opcode last = function.code.back().op;
+      if(last != Opcode::JUMP && last != Opcode::RETURN && last != Opcode::RETURN_VOID && last != Opcode::TAIL_CALL)
+        return false;
+      for(const ParallelLoop& loop : function.parallelLoops)
+      {
+        if(!CheckFunction(program, *loop.body))
+          return false;
+      }
+      return true;
+    }
+
+    static bool CheckInstruction(const Program& program, const CompiledFunction& function, const Instruction& in)
+    {
+      int32_t size = function.code.size();
+      switch(in.op)
+      {
+        case Opcode::NOP:
+          return true;
+        case Opcode::LOAD_INT:
+        case Opcode::LOAD_FLOAT:
+        case Opcode::LOAD_EMPTY_ARRAY:
+        case Opcode::RETURN:
+        case Opcode::RETURN_VOID:
+          return HasRegisters(function, in.a, 1);
+        case Opcode::LOAD_STRING:
+          return HasRegisters(function, in.a, 1) && in.b >= 0 && in.b < (int64_t)program.stringValues.size();
+        case Opcode::NEW_MAP:
+          return HasRegisters(function, in.a, 1) && in.b >= 0 && in.b <= (int32_t)(Map::STRING_KEYS | Map::STRING_VALUES);
+        case Opcode::NEW_ARRAY:
+          return HasRegisters(function, in.a, 1) && HasRegisters(function, in.b, 1) && (in.c == 1 || in.c == 4);
+        case Opcode::MOVE:
+        case Opcode::NEG_INT:
+        case Opcode::NEG_FLOAT:
+        case Opcode::NOT:
+        case Opcode::BOOL:
+        case Opcode::ARRAY_LENGTH:
+        case Opcode::STRING_LENGTH:
+        case Opcode::MAP_LENGTH:
+          return HasRegisters(function, in.a, 1) && HasRegisters(function, in.b, 1);
+        case Opcode::CHECK_INDEX:
+        case Opcode::CHECK_STRING_INDEX:
+          return HasRegisters(function, in.b, 1) && HasRegisters(function, in.c, 1);
+        case Opcode::JUMP:
+          return in.a >= 0 && in.a < size;
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+          return in.a >= 0 && in.a < size && HasRegisters(function, in.b, 1);
+        case Opcode::CALL:
+        {
+          if(in.a < 0 || in.a >= (int64_t)program.functions.size())
+            return false;
+          // The result is written to b, also when there are no arguments
+          size_t params = program.functions[in.a].params.size();
+          return HasRegisters(function, in.b, std::max<size_t>(params, 1));
+        }
+        case Opcode::TAIL_CALL:
+          return in.a >= 0 && in.a < (int64_t)program.functions.size() && in.c == (int64_t)program.functions[in.a].params.size() &&
+            HasRegisters(function, in.b, in.c);
+        case Opcode::CALL_HOST:
+        {
+          if(in.a < 0 || in.a >= (int64_t)program.hostFunctions.size())
+            return false;
+          size_t params = program.hostFunctions[in.a].params.size();
+          return HasRegisters(function, in.b, std::max<size_t>(params, 1));
+        }
+        case Opcode::CALL_BUILTIN:
+        {
+          const std::vector<BuiltinSignature>& signatures = Builtins::GetSignatures();
+          if(in.a < 0 || in.a >= (int64_t)signatures.size())
+            return false;
+          size_t args = signatures[in.a].params.size() + Builtins::ReturnsArray((Builtin)in.a);
+          return HasRegisters(function, in.b, args);
+        }
+        case Opcode::VECTOR_LOOP:
+        {
+          int64_t operands;
+          return in.a >= 0 && in.a < (int64_t)function.vectorLoops.size() && CheckVectorLoop(function.vectorLoops[in.a], operands) &&
+            HasRegisters(function, in.b, operands);
+        }
+        case Opcode::PARALLEL_FOR:
+        {
+          if(in.a < 0 || in.a >= (int64_t)function.parallelLoops.size())
+            return false;
+          // The body takes its range of iterations followed by the operands,
+          // which start with the range of the loop and the reductions
+          size_t params = function.parallelLoops[in.a].body->params.size();
+          return params >= 6 && HasRegisters(function, in.b, params - 2);
+        }
+        case Opcode::CALL_IMPORT:
+        case Opcode::COMPILE:
+        case Opcode::CALL_NATIVE:
+          return false;
+        default:
+          return HasRegisters(function, in.a, 1) && HasRegisters(function, in.b, 1) && HasRegisters(function, in.c, 1);
+      }
+    }
+
+    static bool HasRegisters(const CompiledFunction& function, int64_t first, int64_t count)
+    {
+      return first >= 0 && first + count <= function.registerCount;
+    }
+
+    // Whether the temporaries of the loop are written before they are read
+    // and the arrays it loads and stores are bounds checked. Gives the number
+    // of operands read by the loop.
+    static bool CheckVectorLoop(const VectorLoop& loop, int64_t& operands)
+    {
+      operands = 2;
+      for(int array : loop.arrays)
+      {
+        if(array < 0)
+          return false;
+        operands = std::max<int64_t>(operands, array + 1);
+      }
+      // Scalars and constants are written before the first tile
+      bool written[Simd::MAX_TEMPS] = {};
+      for(const VectorOp& op : loop.ops)
+      {
+        if(op.kind != VectorOpKind::STORE && (op.dst < 0 || op.dst >= Simd::MAX_TEMPS))
+          return false;
+        if(op.kind == VectorOpKind::SCALAR || op.kind == VectorOpKind::CONSTANT)
+          written[op.dst] = true;
+      }
+      auto isTemp = [&](int temp) { return temp >= 0 && temp < Simd::MAX_TEMPS && written[temp]; };
+      auto isArray = [&](int operand) { return std::find(loop.arrays.begin(), loop.arrays.end(), operand) != loop.arrays.end(); };
+      for(const VectorOp& op : loop.ops)
+      {
+        bool valid;
+        switch(op.kind)
+        {
+          case VectorOpKind::LOAD: valid = isArray(op.a); break;
+          case VectorOpKind::SCALAR: valid = op.a >= 0; break;
+          case VectorOpKind::CONSTANT: valid = true; break;
+          case VectorOpKind::INDEX: valid = true; break;
+          case VectorOpKind::BINARY: valid = Simd::GetBinary(op.opcode) && isTemp(op.a) && isTemp(op.b); break;
+          case VectorOpKind::UNARY: valid = Simd::GetUnary(op.opcode) && isTemp(op.a); break;
+          case VectorOpKind::STORE: valid = isArray(op.a) && isTemp(op.b); break;
+          default: valid = false; break;
+        }
+        if(!valid)
+          return false;
+        if(op.kind == VectorOpKind::SCALAR)
+          operands = std::max<int64_t>(operands, op.a + 1);
+        if(op.kind != VectorOpKind::STORE)
+          written[op.dst] = true;
+      }
+      return true;
+    }
+};
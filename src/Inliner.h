@@ -0,0 +1,198 @@
+#pragma once
+
+#include "Ast.h"
+#include "Ir.h"
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Decides which calls between functions compiled together are replaced by
+// the body of the called function, which is done while lowering the caller,
+// see AstFunction::LowerInline. Runs after the functions have been checked.
+//
+// The size of a function is the number of IR instructions it lowers to,
+// including the functions inlined into it. A call is inlined when the size
+// of the called function, minus the instructions the call itself needs and
+// a bonus for every constant argument that can be folded, is within the
+// budget. Recursive functions and functions with loops are never inlined, and
+// each caller grows by at most INLINE_GROWTH times the budget. Callees are
+// decided before their callers, so small functions inlined into other small
+// functions are inlined all the way.
+class Inliner
+{
+  private:
+    static const int INLINE_GROWTH = 8;
+    static const int CONSTANT_BONUS = 2;
+
+    struct Node
+    {
+      AstFunction* function;
+      // Tarjan's strongly connected components
+      int index = -1;
+      int lowlink = 0;
+      bool onStack = false;
+      bool recursive = false;
+      bool loops = false;
+      int size = 0;
+    };
+
+    std::vector<Node> nodes;
+    int base;
+    int budget;
+    std::ostream* report;
+    int nextIndex;
+    std::vector<int> stack;
+    int inlinedCalls;
+    int totalCalls;
+    int sizeBefore;
+    int sizeAfter;
+
+  public:
+    // The functions are the definitions compiled together, the first is
+    // called by index base. Functions whose body isn't parsed are skipped.
+    static void Run(const std::vector<AstFunction*>& functions, int base, int budget, std::ostream* report)
+    {
+      Inliner inliner{functions, base, budget, report};
+      for(size_t i = 0;i<inliner.nodes.size();i++)
+      {
+        if(inliner.nodes[i].index == -1 && !functions[i]->IsLazy())
+          inliner.Connect(i);
+      }
+      if(report)
+      {
+        *report << "Inlined " << inliner.inlinedCalls << " of " << inliner.totalCalls << " calls, "
+          << inliner.sizeBefore << " -> " << inliner.sizeAfter << " IR instructions" << std::endl;
+      }
+    }
+
+  private:
+    Inliner(const std::vector<AstFunction*>& functions, int base, int budget, std::ostream* report)
+      : base{base}, budget{budget}, report{report}, nextIndex{0}, inlinedCalls{0}, totalCalls{0}, sizeBefore{0}, sizeAfter{0}
+    {
+      for(AstFunction* function : functions)
+        nodes.push_back({function});
+    }
+
+    // Index of the node called, -1 if it isn't compiled with the caller
+    int Callee(AstCall* call)
+    {
+      int callee = call->index - base;
+      if(call->kind != CallKind::SCRIPT || callee < 0 || callee >= (int)nodes.size() || nodes[callee].function->IsLazy())
+        return -1;
+      return callee;
+    }
+
+    // Visits the callees first and decides the calls of every component once
+    // all components it calls have been decided
+    void Connect(int i)
+    {
+      Node& node = nodes[i];
+      node.index = node.lowlink = nextIndex++;
+      stack.push_back(i);
+      node.onStack = true;
+      for(AstCall* call : node.function->calls)
+      {
+        int callee = Callee(call);
+        if(callee == -1)
+          continue;
+        if(callee == i)
+          node.recursive = true;
+        if(nodes[callee].index == -1)
+        {
+          Connect(callee);
+          node.lowlink = std::min(node.lowlink, nodes[callee].lowlink);
+        }
+        else if(nodes[callee].onStack)
+          node.lowlink = std::min(node.lowlink, nodes[callee].index);
+      }
+      if(node.lowlink != node.index)
+        return;
+
+      std::vector<int> component;
+      do
+      {
+        component.push_back(stack.back());
+        nodes[stack.back()].onStack = false;
+        stack.pop_back();
+      } while(component.back() != i);
+      for(int member : component)
+        nodes[member].recursive |= component.size() > 1;
+      for(int member : component)
+        Decide(nodes[member]);
+    }
+
+    void Decide(Node& node)
+    {
+      int before = Measure(node);
+      int growth = 0;
+      bool inlined = false;
+      for(AstCall* call : node.function->calls)
+      {
+        totalCalls++;
+        int callee = Callee(call);
+        if(callee == -1)
+          continue;
+        Node& target = nodes[callee];
+        int args = target.function->params->GetTypes().size();
+        int constants = 0;
+        for(AstFuncArgs* arg = call->args; arg && arg->first; arg = arg->tail)
+        {
+          if(dynamic_cast<AstInt*>(arg->first) || dynamic_cast<AstFloat*>(arg->first) || dynamic_cast<AstChar*>(arg->first))
+            constants++;
+        }
+        // The call, the parameters and the return disappear
+        int cost = target.size - args - 2 - constants * CONSTANT_BONUS;
+        const char* reason = nullptr;
+        if(target.recursive)
+          reason = "recursive";
+        else if(target.loops)
+          reason = "has loops";
+        else if(cost > budget)
+          reason = "over budget";
+        else if(growth + cost > budget * INLINE_GROWTH)
+          reason = "caller too large";
+
+        if(report)
+        {
+          *report << (reason ? "Not inlining " : "Inlining ") << call->name << " into " << node.function->name->name
+            << " at " << call->pos.line << ":" << call->pos.column << ", cost " << cost;
+          if(reason)
+            *report << ", " << reason;
+          *report << std::endl;
+        }
+        if(reason)
+          continue;
+        call->inlined = target.function;
+        growth += std::max(cost, 0);
+        inlined = true;
+        inlinedCalls++;
+      }
+
+      int after = inlined ? Measure(node) : before;
+      sizeBefore += before;
+      sizeAfter += after;
+      if(report && after != before)
+        *report << node.function->name->name << ": " << before << " -> " << after << " IR instructions" << std::endl;
+    }
+
+    // Lowers the function as it is compiled to find its size
+    int Measure(Node& node)
+    {
+      Program program;
+      IrFunction function;
+      node.function->Lower(program, function);
+      function.Analyze();
+      int size = 0;
+      // The body of a parallel loop is outlined, which is a loop as well
+      node.loops = !function.parallelLoops.empty();
+      for(IrBlock* block : function.rpo)
+      {
+        size += block->instructions.size();
+        for(IrBlock* successor : block->Successors())
+          node.loops |= successor->rpo <= block->rpo;
+      }
+      node.size = size;
+      return size;
+    }
+};
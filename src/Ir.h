@@ -0,0 +1,368 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "Type.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+#include <iostream>
+
+// SSA form mid-level representation. Every instruction defines at most one
+// value and each value is defined exactly once.
+#define LIST_IR_OPS \
+  IR_OP(CONST)      /* imm, float bits or string index depending on type */ \
+  IR_OP(PARAM)      /* imm = parameter index */ \
+  IR_OP(COPY) \
+  IR_OP(PHI)        /* one operand per predecessor of the block */ \
+  IR_OP(BINARY)     /* opcode applied to both operands */ \
+  IR_OP(UNARY)      /* opcode applied to the operand */ \
+  IR_OP(CALL)       /* imm = function index */ \
+  IR_OP(CALL_HOST)  /* imm = host function index */ \
+  IR_OP(CALL_IMPORT) /* imm = import index */ \
+  IR_OP(CALL_BUILTIN) /* imm = Builtin */ \
+  IR_OP(NEW_ARRAY)  /* operand is the length, imm = element size */ \
+  IR_OP(CHECK)      /* bounds check of array, index */ \
+  IR_OP(LOAD)       /* opcode loads array[index] */ \
+  IR_OP(STORE)      /* opcode stores array[index] = value */ \
+  IR_OP(NEW_MAP)    /* imm = Map::kind */ \
+  IR_OP(MAP)        /* opcode applied to the map and the key and value it takes */ \
+  IR_OP(VECTOR)     /* imm = vector loop index, operands as described by VectorLoop */ \
+  IR_OP(PARALLEL)   /* imm = parallel loop index, operands as described by ParallelLoop */ \
+  IR_OP(JUMP) \
+  IR_OP(BRANCH)     /* targets[0] if operand is non-zero else targets[1] */ \
+  IR_OP(RETURN)     /* optional operand */ \
+  IR_OP(TAIL_CALL)  /* imm = function index, returns the result of the call */ \
+
+enum class IrOp
+{
+#define IR_OP(x) x,
+  LIST_IR_OPS
+#undef IR_OP
+};
+
+struct IrBlock;
+
+struct IrInstruction
+{
+  IrOp op;
+  Opcode opcode;
+  Type type;
+  int id;
+  int32_t imm;
+  std::vector<IrInstruction*> operands;
+  IrBlock* targets[2];
+  IrBlock* block;
+  // Source position it was lowered from, line is 0 if it was created by a
+  // pass
+  SourcePos pos;
+
+  bool IsTerminator() const
+  {
+    return op == IrOp::JUMP || op == IrOp::BRANCH || op == IrOp::RETURN || op == IrOp::TAIL_CALL;
+  }
+
+  // Instructions without side effects that can be removed, merged or moved
+  bool IsPure() const
+  {
+    if(op == IrOp::BINARY && opcode == Opcode::DIV_INT)
+      return operands[1]->op == IrOp::CONST && operands[1]->imm != 0;
+    return op == IrOp::CONST || op == IrOp::COPY || op == IrOp::BINARY || op == IrOp::UNARY;
+  }
+
+  static const char* GetName(IrOp op)
+  {
+    switch(op)
+    {
+#define IR_OP(x) case IrOp::x: return #x;
+      LIST_IR_OPS
+#undef IR_OP
+    }
+    return "INVALID";
+  }
+
+  void Print(std::ostream& os) const;
+};
+
+struct IrBlock
+{
+  int id;
+  std::vector<IrInstruction*> instructions;
+  std::vector<IrBlock*> preds;
+
+  // Filled in by IrFunction::Analyze
+  int rpo;
+  IrBlock* idom;
+  std::vector<IrBlock*> domChildren;
+
+  IrInstruction* Terminator() const
+  {
+    if(instructions.empty() || !instructions.back()->IsTerminator())
+      return nullptr;
+    return instructions.back();
+  }
+
+  std::vector<IrBlock*> Successors() const
+  {
+    IrInstruction* terminator = Terminator();
+    if(terminator == nullptr || terminator->op == IrOp::RETURN || terminator->op == IrOp::TAIL_CALL)
+      return {};
+    if(terminator->op == IrOp::JUMP)
+      return {terminator->targets[0]};
+    return {terminator->targets[0], terminator->targets[1]};
+  }
+
+  int PredIndex(IrBlock* pred) const
+  {
+    for(size_t i = 0;i<preds.size();i++)
+    {
+      if(preds[i] == pred)
+        return i;
+    }
+    return -1;
+  }
+
+  // Inserts the instruction right before the terminator
+  void InsertBeforeTerminator(IrInstruction* instruction)
+  {
+    instruction->block = this;
+    instructions.insert(instructions.end() - (Terminator() ? 1 : 0), instruction);
+  }
+
+  bool Dominates(const IrBlock* other) const
+  {
+    for(; other; other = other->idom)
+    {
+      if(other == this)
+        return true;
+      if(other->idom == other)
+        return false;
+    }
+    return false;
+  }
+};
+
+struct IrFunction;
+
+// Body of a #parallel loop lowered into a function of its own, see
+// ParallelLoop
+struct IrParallelLoop
+{
+  std::unique_ptr<IrFunction> body;
+  std::vector<Reduction> reductions;
+};
+
+struct IrFunction
+{
+  std::string name;
+  Type returnType;
+  std::vector<Type> params;
+  std::vector<std::unique_ptr<IrInstruction>> instructionPool;
+  std::vector<std::unique_ptr<IrBlock>> blockPool;
+  std::vector<IrBlock*> blocks;
+  // Reachable blocks in reverse postorder, filled in by Analyze
+  std::vector<IrBlock*> rpo;
+  std::vector<VectorLoop> vectorLoops;
+  std::vector<IrParallelLoop> parallelLoops;
+  // Calls inlined into the function, see SourcePos::inlined
+  std::vector<InlineSite> inlineSites;
+
+  IrBlock* Entry()
+  {
+    return blocks.front();
+  }
+
+  IrBlock* CreateBlock()
+  {
+    blockPool.emplace_back(new IrBlock{(int)blockPool.size()});
+    blocks.push_back(blockPool.back().get());
+    return blocks.back();
+  }
+
+  IrInstruction* Create(IrOp op, Type type, const std::vector<IrInstruction*>& operands = {}, int32_t imm = 0)
+  {
+    instructionPool.emplace_back(new IrInstruction{op, Opcode::NOP, type, (int)instructionPool.size(), imm, operands, {nullptr, nullptr}, nullptr, {0, 0}});
+    return instructionPool.back().get();
+  }
+
+  // Computes reverse postorder, dominators and removes unreachable blocks
+  void Analyze()
+  {
+    std::map<IrBlock*, bool> visited;
+    std::vector<IrBlock*> postorder;
+    std::function<void(IrBlock*)> visit = [&](IrBlock* block)
+    {
+      visited[block] = true;
+      for(IrBlock* succ : block->Successors())
+      {
+        if(!visited[succ])
+          visit(succ);
+      }
+      postorder.push_back(block);
+    };
+    visit(Entry());
+
+    rpo.assign(postorder.rbegin(), postorder.rend());
+    for(size_t i = 0;i<rpo.size();i++)
+    {
+      rpo[i]->rpo = i;
+      rpo[i]->idom = nullptr;
+      rpo[i]->domChildren.clear();
+    }
+
+    // Remove edges from unreachable blocks
+    for(IrBlock* block : blocks)
+    {
+      if(visited[block])
+        continue;
+      for(IrBlock* succ : block->Successors())
+      {
+        if(visited[succ])
+          RemoveEdge(block, succ);
+      }
+    }
+    blocks = rpo;
+
+    // Cooper, Harvey and Kennedy: "A Simple, Fast Dominance Algorithm"
+    Entry()->idom = Entry();
+    bool changed = true;
+    while(changed)
+    {
+      changed = false;
+      for(size_t i = 1;i<rpo.size();i++)
+      {
+        IrBlock* newIdom = nullptr;
+        for(IrBlock* pred : rpo[i]->preds)
+        {
+          if(pred->idom == nullptr)
+            continue;
+          newIdom = newIdom ? Intersect(pred, newIdom) : pred;
+        }
+        if(newIdom != rpo[i]->idom)
+        {
+          rpo[i]->idom = newIdom;
+          changed = true;
+        }
+      }
+    }
+    for(size_t i = 1;i<rpo.size();i++)
+      rpo[i]->idom->domChildren.push_back(rpo[i]);
+  }
+
+  // Removes the edge from the predecessor list and the phi operands of to
+  void RemoveEdge(IrBlock* from, IrBlock* to)
+  {
+    int index = to->PredIndex(from);
+    if(index == -1)
+      return;
+    to->preds.erase(to->preds.begin() + index);
+    for(IrInstruction* instruction : to->instructions)
+    {
+      if(instruction->op == IrOp::PHI)
+        instruction->operands.erase(instruction->operands.begin() + index);
+    }
+  }
+
+  // Replaces the uses of every key with its value and removes the replaced
+  // instructions from their blocks
+  void Replace(std::map<IrInstruction*, IrInstruction*>& replacements)
+  {
+    if(replacements.empty())
+      return;
+    std::function<IrInstruction*(IrInstruction*)> resolve = [&](IrInstruction* value)
+    {
+      auto it = replacements.find(value);
+      if(it == replacements.end())
+        return value;
+      it->second = resolve(it->second);
+      return it->second;
+    };
+    for(IrBlock* block : blocks)
+    {
+      auto& instructions = block->instructions;
+      instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction* instruction)
+      {
+        return replacements.find(instruction) != replacements.end();
+      }), instructions.end());
+      for(IrInstruction* instruction : instructions)
+      {
+        for(IrInstruction*& operand : instruction->operands)
+          operand = resolve(operand);
+      }
+    }
+  }
+
+  void Print(std::ostream& os) const
+  {
+    os << "function " << name << "(";
+    for(size_t i = 0;i<params.size();i++)
+      os << (i == 0 ? "" : ", ") << params[i];
+    os << ") " << returnType << std::endl;
+    for(IrBlock* block : blocks)
+    {
+      os << "b" << block->id << ":";
+      if(!block->preds.empty())
+      {
+        os << " ; preds";
+        for(IrBlock* pred : block->preds)
+          os << " b" << pred->id;
+      }
+      os << std::endl;
+      for(IrInstruction* instruction : block->instructions)
+      {
+        os << "  ";
+        instruction->Print(os);
+        os << std::endl;
+      }
+    }
+  }
+
+  private:
+    static IrBlock* Intersect(IrBlock* a, IrBlock* b)
+    {
+      while(a != b)
+      {
+        while(a->rpo > b->rpo)
+          a = a->idom;
+        while(b->rpo > a->rpo)
+          b = b->idom;
+      }
+      return a;
+    }
+};
+
+inline void IrInstruction::Print(std::ostream& os) const
+{
+  if(type != Type::VOID && !IsTerminator())
+    os << "%" << id << " = " << type << " ";
+  if(op == IrOp::BINARY || op == IrOp::UNARY)
+    os << Opcodes::GetName(opcode);
+  else
+    os << GetName(op);
+
+  if(op == IrOp::CONST && type == Type::FLOAT)
+  {
+    float value;
+    memcpy(&value, &imm, sizeof(float));
+    os << " " << value;
+  }
+  else if(op == IrOp::CONST || op == IrOp::PARAM || op == IrOp::CALL || op == IrOp::CALL_HOST || op == IrOp::CALL_IMPORT || op == IrOp::CALL_BUILTIN || op == IrOp::TAIL_CALL || op == IrOp::NEW_ARRAY || op == IrOp::VECTOR || op == IrOp::PARALLEL)
+  {
+    os << " " << imm;
+  }
+  for(IrInstruction* operand : operands)
+    os << " %" << operand->id;
+  if(op == IrOp::PHI)
+  {
+    os << " ;";
+    for(IrBlock* pred : block->preds)
+      os << " b" << pred->id;
+  }
+  if(op == IrOp::JUMP)
+    os << " b" << targets[0]->id;
+  if(op == IrOp::BRANCH)
+    os << " b" << targets[0]->id << " b" << targets[1]->id;
+}
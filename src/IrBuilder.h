@@ -0,0 +1,319 @@
+#pragma once
+
+#include "Ir.h"
+#include "Token.h"
+
+#include <map>
+#include <vector>
+
+// Builds SSA form directly while lowering the AST, following Braun et al.
+// "Simple and Efficient Construction of Static Single Assignment Form".
+// Locals are identified by the slot assigned to them by the checker.
+class IrBuilder
+{
+  private:
+    // Function inlined by AstFunction::LowerInline
+    struct InlineFrame
+    {
+      int base;
+      int result;
+      IrBlock* exit;
+      // Inline site of the code making the call
+      int32_t inlined;
+    };
+
+    IrFunction& function;
+    Program& program;
+    IrBlock* current;
+    SourcePos pos;
+    std::vector<Type> slotTypes;
+    // Slots are relative to the innermost function being lowered, inlined
+    // functions have their locals after the locals of the caller
+    int base;
+    std::vector<InlineFrame> inlineFrames;
+    std::map<IrBlock*, std::map<int, IrInstruction*>> definitions;
+    std::map<IrBlock*, std::map<int, IrInstruction*>> incompletePhis;
+    std::map<IrBlock*, bool> sealed;
+
+  public:
+    IrBuilder(IrFunction& function, Program& program, const std::vector<Type>& slotTypes)
+      : function{function}, program{program}, current{nullptr}, pos{0, 0}, slotTypes{slotTypes}, base{0}
+    {
+      SetBlock(CreateBlock());
+      SealBlock(current);
+    }
+
+    Program& GetProgram()
+    {
+      return program;
+    }
+
+    IrFunction& GetFunction()
+    {
+      return function;
+    }
+
+    // Source position of the instructions emitted next, in the function
+    // being lowered
+    void SetPosition(const TokenPos& token)
+    {
+      pos = {(int32_t)token.line, (int32_t)token.column, pos.inlined};
+    }
+
+    IrBlock* CreateBlock()
+    {
+      return function.CreateBlock();
+    }
+
+    IrBlock* Block()
+    {
+      return current;
+    }
+
+    void SetBlock(IrBlock* block)
+    {
+      current = block;
+    }
+
+    // A local that only exists in the IR, used to merge values of control flow
+    // within expressions
+    int CreateVariable(Type type)
+    {
+      slotTypes.push_back(type);
+      return slotTypes.size() - 1 - base;
+    }
+
+    // Starts lowering an inlined function with the given locals, called at
+    // the current position. Returns jump to the end of the inlined body
+    // instead of returning from the function.
+    void EnterInline(const std::string& name, const std::vector<Type>& locals, Type returnType)
+    {
+      InlineFrame frame{base, -1, CreateBlock(), pos.inlined};
+      function.inlineSites.push_back({name, pos});
+      pos.inlined = function.inlineSites.size();
+      base = slotTypes.size();
+      slotTypes.insert(slotTypes.end(), locals.begin(), locals.end());
+      if(returnType != Type::VOID)
+        frame.result = CreateVariable(returnType);
+      inlineFrames.push_back(frame);
+    }
+
+    // Continues after the inlined function, returns the value it returned or
+    // nullptr if it returns void
+    IrInstruction* LeaveInline()
+    {
+      InlineFrame frame = inlineFrames.back();
+      inlineFrames.pop_back();
+      SealBlock(frame.exit);
+      SetBlock(frame.exit);
+      IrInstruction* result = frame.result == -1 ? nullptr : ReadVariable(frame.result);
+      base = frame.base;
+      pos.inlined = frame.inlined;
+      return result;
+    }
+
+    bool IsInlining() const
+    {
+      return !inlineFrames.empty();
+    }
+
+    IrInstruction* Emit(IrOp op, Type type, const std::vector<IrInstruction*>& operands = {}, int32_t imm = 0)
+    {
+      IrInstruction* instruction = function.Create(op, type, operands, imm);
+      instruction->block = current;
+      instruction->pos = pos;
+      current->instructions.push_back(instruction);
+      return instruction;
+    }
+
+    IrInstruction* Const(Type type, int32_t imm)
+    {
+      return Emit(IrOp::CONST, type, {}, imm);
+    }
+
+    // Maps are allocated since they can be changed
+    IrInstruction* Default(Type type)
+    {
+      if(type == Type::STRING)
+        return Const(type, program.AddString(""));
+      if(Types::IsMap(type))
+        return NewMap(type);
+      return Const(type, 0);
+    }
+
+    IrInstruction* NewMap(Type type)
+    {
+      uint32_t kind = 0;
+      if(Types::KeyOf(type) == Type::STRING)
+        kind |= Map::STRING_KEYS;
+      if(Types::ElementOf(type) == Type::STRING)
+        kind |= Map::STRING_VALUES;
+      return Emit(IrOp::NEW_MAP, type, {}, kind);
+    }
+
+    // Instruction on a map, type is VOID for stores
+    IrInstruction* MapOp(Opcode opcode, Type type, const std::vector<IrInstruction*>& operands)
+    {
+      IrInstruction* instruction = Emit(IrOp::MAP, type, operands);
+      instruction->opcode = opcode;
+      return instruction;
+    }
+
+    IrInstruction* Load(Type type, IrInstruction* array, IrInstruction* index)
+    {
+      IrInstruction* instruction = Emit(IrOp::LOAD, type, {array, index});
+      if(array->type == Type::STRING)
+        instruction->opcode = Opcode::LOAD_STRING_CHAR;
+      else
+        instruction->opcode = type == Type::CHAR ? Opcode::LOAD_ELEMENT_CHAR : Opcode::LOAD_ELEMENT;
+      return instruction;
+    }
+
+    // Length of an array, string or map. Maps can grow so theirs isn't pure.
+    IrInstruction* Length(IrInstruction* value)
+    {
+      if(Types::IsMap(value->type))
+        return MapOp(Opcode::MAP_LENGTH, Type::INT, {value});
+      return Unary(value->type == Type::STRING ? Opcode::STRING_LENGTH : Opcode::ARRAY_LENGTH, Type::INT, value);
+    }
+
+    void Store(IrInstruction* array, IrInstruction* index, IrInstruction* value)
+    {
+      IrInstruction* instruction = Emit(IrOp::STORE, Type::VOID, {array, index, value});
+      instruction->opcode = value->type == Type::CHAR ? Opcode::STORE_ELEMENT_CHAR : Opcode::STORE_ELEMENT;
+    }
+
+    IrInstruction* Binary(Opcode opcode, Type type, IrInstruction* left, IrInstruction* right)
+    {
+      IrInstruction* instruction = Emit(IrOp::BINARY, type, {left, right});
+      instruction->opcode = opcode;
+      return instruction;
+    }
+
+    IrInstruction* Unary(Opcode opcode, Type type, IrInstruction* operand)
+    {
+      IrInstruction* instruction = Emit(IrOp::UNARY, type, {operand});
+      instruction->opcode = opcode;
+      return instruction;
+    }
+
+    void Jump(IrBlock* target)
+    {
+      IrInstruction* instruction = Emit(IrOp::JUMP, Type::VOID);
+      instruction->targets[0] = target;
+      target->preds.push_back(current);
+    }
+
+    void Branch(IrInstruction* condition, IrBlock* ifTrue, IrBlock* ifFalse)
+    {
+      IrInstruction* instruction = Emit(IrOp::BRANCH, Type::VOID, {condition});
+      instruction->targets[0] = ifTrue;
+      instruction->targets[1] = ifFalse;
+      ifTrue->preds.push_back(current);
+      ifFalse->preds.push_back(current);
+    }
+
+    void Return(IrInstruction* value)
+    {
+      if(IsInlining())
+      {
+        const InlineFrame& frame = inlineFrames.back();
+        if(value)
+          WriteVariable(frame.result, value);
+        Jump(frame.exit);
+        SetBlock(CreateBlock());
+        SealBlock(current);
+        return;
+      }
+      if(value)
+        Emit(IrOp::RETURN, Type::VOID, {value});
+      else
+        Emit(IrOp::RETURN, Type::VOID);
+      // Anything following a return is unreachable
+      SetBlock(CreateBlock());
+      SealBlock(current);
+    }
+
+    // Returns the result of calling the function, which reuses the frame of
+    // the current function
+    void TailCall(int function, const std::vector<IrInstruction*>& args)
+    {
+      Emit(IrOp::TAIL_CALL, Type::VOID, args, function);
+      SetBlock(CreateBlock());
+      SealBlock(current);
+    }
+
+    bool Terminated()
+    {
+      return current->Terminator() != nullptr;
+    }
+
+    void WriteVariable(int slot, IrInstruction* value)
+    {
+      definitions[current][base + slot] = value;
+    }
+
+    IrInstruction* ReadVariable(int slot)
+    {
+      return ReadVariable(base + slot, current);
+    }
+
+    // Must be called once all predecessors of the block are known
+    void SealBlock(IrBlock* block)
+    {
+      for(auto& phi : incompletePhis[block])
+        AddPhiOperands(phi.first, phi.second);
+      incompletePhis.erase(block);
+      sealed[block] = true;
+    }
+
+  private:
+    IrInstruction* ReadVariable(int slot, IrBlock* block)
+    {
+      auto& defs = definitions[block];
+      auto it = defs.find(slot);
+      if(it != defs.end())
+        return it->second;
+
+      IrInstruction* value;
+      if(!sealed[block])
+      {
+        value = CreatePhi(slot, block);
+        incompletePhis[block][slot] = value;
+      }
+      else if(block->preds.size() == 1)
+      {
+        value = ReadVariable(slot, block->preds[0]);
+      }
+      else if(block->preds.empty())
+      {
+        // Only happens in unreachable code
+        value = function.Create(IrOp::CONST, slotTypes[slot]);
+        if(value->type == Type::STRING)
+          value->imm = program.AddString("");
+        block->InsertBeforeTerminator(value);
+      }
+      else
+      {
+        value = CreatePhi(slot, block);
+        definitions[block][slot] = value;
+        AddPhiOperands(slot, value);
+      }
+      definitions[block][slot] = value;
+      return value;
+    }
+
+    IrInstruction* CreatePhi(int slot, IrBlock* block)
+    {
+      IrInstruction* phi = function.Create(IrOp::PHI, slotTypes[slot]);
+      phi->block = block;
+      block->instructions.insert(block->instructions.begin(), phi);
+      return phi;
+    }
+
+    void AddPhiOperands(int slot, IrInstruction* phi)
+    {
+      for(IrBlock* pred : phi->block->preds)
+        phi->operands.push_back(ReadVariable(slot, pred));
+    }
+};
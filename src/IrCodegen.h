@@ -0,0 +1,684 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "Ir.h"
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+// Translates SSA form to register bytecode. Phis are replaced by copies in
+// the predecessors, after which virtual registers are coalesced and colored
+// using an interference graph. Arguments of calls are placed in registers
+// after all colored registers since that is where the frame of the callee
+// starts. The liveness used for coloring also gives the stack maps, the
+// strings and arrays live at the instructions where the heap may be
+// collected.
+class IrCodegen
+{
+  private:
+    // Marks the n:th register after the colored registers
+    static int Outgoing(int n) { return -1 - n; }
+
+    struct Fields
+    {
+      bool defA;
+      bool useA;
+      bool useB;
+      bool useC;
+    };
+
+    IrFunction& ir;
+    CompiledFunction& function;
+    std::vector<std::vector<Instruction>> code;
+    // Source position of each instruction in code
+    std::vector<std::vector<SourcePos>> positions;
+    // Index into roots of the stack map of each instruction in code, -1 if
+    // it isn't a safepoint
+    std::vector<std::vector<int>> safepoints;
+    // Live virtual registers holding strings and arrays at each safepoint
+    std::vector<std::vector<int>> roots;
+    // Type of each virtual register
+    std::vector<Type> types;
+    std::set<IrInstruction*> used;
+    int registerCount;
+    int maxOutgoing;
+
+  public:
+    static void Generate(IrFunction& ir, CompiledFunction& function)
+    {
+      IrCodegen codegen{ir, function};
+      codegen.Generate();
+    }
+
+  private:
+    IrCodegen(IrFunction& ir, CompiledFunction& function)
+      : ir{ir}, function{function}, registerCount{(int)ir.instructionPool.size()}, maxOutgoing{1}
+    {}
+
+    static Fields GetFields(Opcode op)
+    {
+      switch(op)
+      {
+        case Opcode::NOP:
+        case Opcode::JUMP:
+        case Opcode::CALL:
+        case Opcode::CALL_HOST:
+        case Opcode::CALL_IMPORT:
+        case Opcode::CALL_BUILTIN:
+        case Opcode::TAIL_CALL:
+        case Opcode::VECTOR_LOOP:
+        case Opcode::PARALLEL_FOR:
+        case Opcode::COMPILE:
+        case Opcode::CALL_NATIVE:
+        case Opcode::RETURN_VOID:
+          return {false, false, false, false};
+        case Opcode::LOAD_INT:
+        case Opcode::LOAD_FLOAT:
+        case Opcode::LOAD_STRING:
+        case Opcode::LOAD_EMPTY_ARRAY:
+        case Opcode::NEW_MAP:
+          return {true, false, false, false};
+        case Opcode::MOVE:
+        case Opcode::NEG_INT:
+        case Opcode::NEG_FLOAT:
+        case Opcode::NOT:
+        case Opcode::BOOL:
+        case Opcode::NEW_ARRAY:
+        case Opcode::ARRAY_LENGTH:
+        case Opcode::STRING_LENGTH:
+        case Opcode::MAP_LENGTH:
+          return {true, false, true, false};
+        case Opcode::CHECK_INDEX:
+        case Opcode::CHECK_STRING_INDEX:
+          return {false, false, true, true};
+        case Opcode::STORE_ELEMENT:
+        case Opcode::STORE_ELEMENT_CHAR:
+        case Opcode::MAP_SET_INT:
+        case Opcode::MAP_SET_STRING:
+          return {false, true, true, true};
+        case Opcode::JUMP_IF_FALSE:
+        case Opcode::JUMP_IF_TRUE:
+          return {false, false, true, false};
+        case Opcode::RETURN:
+          return {false, true, false, false};
+        default:
+          return {true, false, true, true};
+      }
+    }
+
+    // Instructions where the heap may be collected. Calls need the registers
+    // live after them, allocations the ones live before them. Parallel loops
+    // aren't listed, the heap isn't collected while other threads read it.
+    static bool IsCall(Opcode op)
+    {
+      return op == Opcode::CALL || op == Opcode::CALL_HOST || op == Opcode::CALL_IMPORT;
+    }
+
+    static bool IsAllocation(Opcode op)
+    {
+      return op == Opcode::ADD_STRING || op == Opcode::DROP_STRING || op == Opcode::TAKE_STRING || op == Opcode::NEW_ARRAY ||
+        op == Opcode::NEW_MAP || op == Opcode::MAP_SET_INT || op == Opcode::MAP_SET_STRING;
+    }
+
+    static Opcode GetCallOpcode(IrOp op)
+    {
+      switch(op)
+      {
+        case IrOp::CALL: return Opcode::CALL;
+        case IrOp::CALL_HOST: return Opcode::CALL_HOST;
+        case IrOp::CALL_IMPORT: return Opcode::CALL_IMPORT;
+        case IrOp::CALL_BUILTIN: return Opcode::CALL_BUILTIN;
+        case IrOp::PARALLEL: return Opcode::PARALLEL_FOR;
+        default: return Opcode::VECTOR_LOOP;
+      }
+    }
+
+    void Generate()
+    {
+      function.name = ir.name;
+      function.returnType = ir.returnType;
+      function.params = ir.params;
+      function.code.clear();
+      function.lines = {};
+      function.inlineSites = ir.inlineSites;
+      function.vectorLoops = ir.vectorLoops;
+      function.stackMaps.clear();
+
+      ir.Analyze();
+      SplitCriticalEdges();
+      ir.Analyze();
+      registerCount = ir.instructionPool.size();
+      for(const auto& instruction : ir.instructionPool)
+        types.push_back(instruction->type);
+      for(IrBlock* block : ir.rpo)
+      {
+        for(IrInstruction* instruction : block->instructions)
+          used.insert(instruction->operands.begin(), instruction->operands.end());
+      }
+      for(IrBlock* block : ir.rpo)
+        code.push_back(Translate(block));
+      std::vector<int> colors = Allocate();
+      Emit(colors);
+    }
+
+    void SplitCriticalEdges()
+    {
+      for(IrBlock* block : std::vector<IrBlock*>{ir.rpo})
+      {
+        IrInstruction* terminator = block->Terminator();
+        if(terminator == nullptr || terminator->op != IrOp::BRANCH)
+          continue;
+        for(int i = 0;i<2;i++)
+        {
+          IrBlock* succ = terminator->targets[i];
+          if(succ->preds.size() < 2 || !HasPhi(succ))
+            continue;
+          IrBlock* split = ir.CreateBlock();
+          IrInstruction* jump = ir.Create(IrOp::JUMP, Type::VOID);
+          jump->targets[0] = succ;
+          jump->block = split;
+          split->instructions.push_back(jump);
+          split->preds.push_back(block);
+          terminator->targets[i] = split;
+          // Keeps the position of the edge so that the phi operands still match
+          *std::find(succ->preds.begin(), succ->preds.end(), block) = split;
+        }
+      }
+    }
+
+    static bool HasPhi(IrBlock* block)
+    {
+      return !block->instructions.empty() && block->instructions.front()->op == IrOp::PHI;
+    }
+
+    static int Register(IrInstruction* instruction)
+    {
+      return instruction->id;
+    }
+
+    std::vector<Instruction> Translate(IrBlock* block)
+    {
+      std::vector<Instruction> result;
+      std::vector<SourcePos> resultPositions;
+      // Instructions created by passes get the position of the instruction
+      // before
+      SourcePos pos{0, 0};
+      for(IrInstruction* instruction : block->instructions)
+      {
+        resultPositions.resize(result.size(), pos);
+        if(instruction->pos.line != 0)
+          pos = instruction->pos;
+        if(instruction->IsTerminator())
+          CopyPhis(block, result);
+        int d = Register(instruction);
+        auto operand = [&](int i) { return Register(instruction->operands[i]); };
+        switch(instruction->op)
+        {
+          case IrOp::CONST:
+            if(instruction->type == Type::STRING)
+              result.push_back({Opcode::LOAD_STRING, d, instruction->imm, 0});
+            else if(Types::IsArray(instruction->type))
+              result.push_back({Opcode::LOAD_EMPTY_ARRAY, d, 0, 0});
+            else if(instruction->type == Type::FLOAT)
+              result.push_back({Opcode::LOAD_FLOAT, d, instruction->imm, 0});
+            else
+              result.push_back({Opcode::LOAD_INT, d, instruction->imm, 0});
+            break;
+          case IrOp::PARAM:
+          case IrOp::PHI:
+            break;
+          case IrOp::COPY:
+            result.push_back({Opcode::MOVE, d, operand(0), 0});
+            break;
+          case IrOp::BINARY:
+            result.push_back({instruction->opcode, d, operand(0), operand(1)});
+            break;
+          case IrOp::UNARY:
+            result.push_back({instruction->opcode, d, operand(0), 0});
+            break;
+          case IrOp::CALL:
+          case IrOp::CALL_HOST:
+          case IrOp::CALL_IMPORT:
+          case IrOp::CALL_BUILTIN:
+          case IrOp::VECTOR:
+          case IrOp::PARALLEL:
+          {
+            int count = instruction->operands.size();
+            for(int i = 0;i<count;i++)
+              result.push_back({Opcode::MOVE, Outgoing(i), operand(i), 0});
+            maxOutgoing = std::max(maxOutgoing, count);
+            Opcode opcode = GetCallOpcode(instruction->op);
+            result.push_back({opcode, instruction->imm, Outgoing(0), 0});
+            if(used.count(instruction))
+              result.push_back({Opcode::MOVE, d, Outgoing(0), 0});
+            break;
+          }
+          case IrOp::NEW_ARRAY:
+            result.push_back({Opcode::NEW_ARRAY, d, operand(0), instruction->imm});
+            break;
+          case IrOp::CHECK:
+          {
+            Opcode opcode = instruction->operands[0]->type == Type::STRING ? Opcode::CHECK_STRING_INDEX : Opcode::CHECK_INDEX;
+            result.push_back({opcode, 0, operand(0), operand(1)});
+            break;
+          }
+          case IrOp::LOAD:
+            result.push_back({instruction->opcode, d, operand(0), operand(1)});
+            break;
+          case IrOp::STORE:
+            result.push_back({instruction->opcode, operand(0), operand(1), operand(2)});
+            break;
+          case IrOp::NEW_MAP:
+            result.push_back({Opcode::NEW_MAP, d, instruction->imm, 0});
+            break;
+          case IrOp::MAP:
+            if(instruction->type == Type::VOID)
+              result.push_back({instruction->opcode, operand(0), operand(1), operand(2)});
+            else
+              result.push_back({instruction->opcode, d, operand(0), instruction->operands.size() > 1 ? operand(1) : 0});
+            break;
+          case IrOp::JUMP:
+            result.push_back({Opcode::JUMP, instruction->targets[0]->rpo, 0, 0});
+            break;
+          case IrOp::BRANCH:
+            result.push_back({Opcode::JUMP_IF_TRUE, instruction->targets[0]->rpo, operand(0), 0});
+            result.push_back({Opcode::JUMP, instruction->targets[1]->rpo, 0, 0});
+            break;
+          case IrOp::TAIL_CALL:
+          {
+            int count = instruction->operands.size();
+            for(int i = 0;i<count;i++)
+              result.push_back({Opcode::MOVE, Outgoing(i), operand(i), 0});
+            maxOutgoing = std::max(maxOutgoing, count);
+            result.push_back({Opcode::TAIL_CALL, instruction->imm, Outgoing(0), count});
+            break;
+          }
+          case IrOp::RETURN:
+            if(instruction->operands.empty())
+              result.push_back({Opcode::RETURN_VOID, 0, 0, 0});
+            else
+              result.push_back({Opcode::RETURN, operand(0), 0, 0});
+            break;
+        }
+      }
+      resultPositions.resize(result.size(), pos);
+      // Instructions before the first with a position get the first position
+      auto first = std::find_if(resultPositions.begin(), resultPositions.end(), [](const SourcePos& pos) { return pos.line != 0; });
+      if(first != resultPositions.end())
+        std::fill(resultPositions.begin(), first, *first);
+      positions.push_back(resultPositions);
+      return result;
+    }
+
+    // Phi operands are copied at the end of the predecessor. All copies into a
+    // block happen in parallel so they are ordered to not overwrite values
+    // that are still to be read.
+    void CopyPhis(IrBlock* block, std::vector<Instruction>& result)
+    {
+      for(IrBlock* succ : block->Successors())
+      {
+        int index = succ->PredIndex(block);
+        std::vector<std::pair<int, int>> copies;
+        for(IrInstruction* phi : succ->instructions)
+        {
+          if(phi->op != IrOp::PHI)
+            break;
+          int src = Register(phi->operands[index]);
+          if(src != Register(phi))
+            copies.push_back({Register(phi), src});
+        }
+        while(!copies.empty())
+        {
+          bool emitted = false;
+          for(size_t i = 0;i<copies.size();i++)
+          {
+            int dst = copies[i].first;
+            bool read = std::any_of(copies.begin(), copies.end(), [&](const std::pair<int, int>& copy) { return copy.second == dst; });
+            if(read)
+              continue;
+            result.push_back({Opcode::MOVE, dst, copies[i].second, 0});
+            copies.erase(copies.begin() + i);
+            emitted = true;
+            break;
+          }
+          if(emitted)
+            continue;
+          // Every destination is read by another copy, break the cycle by
+          // saving one of the destinations in a temporary
+          int temp = registerCount++;
+          int dst = copies[0].first;
+          types.push_back(types[dst]);
+          result.push_back({Opcode::MOVE, temp, dst, 0});
+          for(auto& copy : copies)
+          {
+            if(copy.second == dst)
+              copy.second = temp;
+          }
+        }
+      }
+    }
+
+    std::vector<int> Allocate()
+    {
+      int count = registerCount;
+      size_t blockCount = code.size();
+
+      // Liveness of the virtual registers
+      std::vector<std::vector<bool>> liveIn(blockCount, std::vector<bool>(count));
+      std::vector<std::vector<bool>> liveOut(blockCount, std::vector<bool>(count));
+      bool changed = true;
+      while(changed)
+      {
+        changed = false;
+        for(int b = blockCount - 1;b >= 0;b--)
+        {
+          std::vector<bool> live(count);
+          for(IrBlock* succ : ir.rpo[b]->Successors())
+          {
+            for(int i = 0;i<count;i++)
+            {
+              if(liveIn[succ->rpo][i])
+                live[i] = true;
+            }
+          }
+          liveOut[b] = live;
+          for(auto it = code[b].rbegin(); it != code[b].rend(); ++it)
+            Step(*it, live);
+          if(live != liveIn[b])
+          {
+            liveIn[b] = live;
+            changed = true;
+          }
+        }
+      }
+
+      FindRoots(liveOut);
+
+      // Interference graph
+      std::vector<std::set<int>> edges(count);
+      auto interfere = [&](int a, int b)
+      {
+        if(a == b)
+          return;
+        edges[a].insert(b);
+        edges[b].insert(a);
+      };
+      for(size_t b = 0;b<blockCount;b++)
+      {
+        std::set<int> live;
+        for(int i = 0;i<count;i++)
+        {
+          if(liveOut[b][i])
+            live.insert(i);
+        }
+        for(auto it = code[b].rbegin(); it != code[b].rend(); ++it)
+        {
+          Fields fields = GetFields(it->op);
+          if(fields.defA && it->a >= 0)
+          {
+            for(int other : live)
+            {
+              // A copy doesn't make its source and destination interfere
+              if(it->op == Opcode::MOVE && other == it->b)
+                continue;
+              interfere(it->a, other);
+            }
+            live.erase(it->a);
+          }
+          if(fields.useA && it->a >= 0) live.insert(it->a);
+          if(fields.useB && it->b >= 0) live.insert(it->b);
+          if(fields.useC && it->c >= 0) live.insert(it->c);
+        }
+      }
+
+      // Parameters arrive in the first registers
+      std::vector<int> colors(count, -1);
+      std::vector<int> params;
+      for(IrInstruction* instruction : ir.Entry()->instructions)
+      {
+        if(instruction->op == IrOp::PARAM)
+        {
+          colors[Register(instruction)] = instruction->imm;
+          params.push_back(Register(instruction));
+        }
+      }
+      for(int a : params)
+      {
+        for(int b : params)
+        {
+          if(liveIn[0][a] && liveIn[0][b])
+            interfere(a, b);
+        }
+      }
+
+      // Coalesce copies between registers that don't interfere
+      std::vector<int> parent(count);
+      for(int i = 0;i<count;i++)
+        parent[i] = i;
+      std::function<int(int)> find = [&](int i) { return parent[i] == i ? i : parent[i] = find(parent[i]); };
+      for(auto& block : code)
+      {
+        for(Instruction& instruction : block)
+        {
+          if(instruction.op != Opcode::MOVE || instruction.a < 0 || instruction.b < 0)
+            continue;
+          int a = find(instruction.a);
+          int b = find(instruction.b);
+          if(a == b || edges[a].count(b) || (colors[a] != -1 && colors[b] != -1))
+            continue;
+          if(colors[b] != -1)
+            std::swap(a, b);
+          parent[b] = a;
+          for(int other : edges[b])
+          {
+            edges[other].erase(b);
+            interfere(a, other);
+          }
+          edges[b].clear();
+        }
+      }
+
+      // Greedy coloring, there is no limit on the number of registers
+      int colorCount = std::max<int>(ir.params.size(), 1);
+      for(int i = 0;i<count;i++)
+      {
+        if(find(i) != i || colors[i] != -1)
+          continue;
+        std::vector<bool> used(count + 1);
+        for(int other : edges[i])
+        {
+          if(colors[other] != -1)
+            used[colors[other]] = true;
+        }
+        int color = 0;
+        while(used[color])
+          color++;
+        colors[i] = color;
+      }
+      for(int i = 0;i<count;i++)
+      {
+        colors[i] = colors[find(i)];
+        colorCount = std::max(colorCount, colors[i] + 1);
+      }
+      registerCount = colorCount;
+      return colors;
+    }
+
+    void FindRoots(const std::vector<std::vector<bool>>& liveOut)
+    {
+      std::vector<int> references;
+      for(int i = 0;i<registerCount;i++)
+      {
+        if(Types::IsReference(types[i]))
+          references.push_back(i);
+      }
+      for(size_t b = 0;b<code.size();b++)
+      {
+        std::vector<bool> live = liveOut[b];
+        safepoints.push_back(std::vector<int>(code[b].size(), -1));
+        auto record = [&](size_t i)
+        {
+          safepoints[b][i] = roots.size();
+          roots.emplace_back();
+          for(int reg : references)
+          {
+            if(live[reg])
+              roots.back().push_back(reg);
+          }
+        };
+        for(size_t i = code[b].size();i-- > 0;)
+        {
+          if(IsCall(code[b][i].op))
+            record(i);
+          Step(code[b][i], live);
+          if(IsAllocation(code[b][i].op))
+            record(i);
+        }
+      }
+    }
+
+    StackMap GetStackMap(int32_t pc, const std::vector<int>& live, const std::vector<int>& colors)
+    {
+      StackMap map{pc, {}, {}, {}};
+      for(int reg : live)
+      {
+        if(types[reg] == Type::STRING)
+          map.strings.push_back(colors[reg]);
+        else if(Types::IsMap(types[reg]))
+          map.maps.push_back(colors[reg]);
+        else
+          map.arrays.push_back(colors[reg]);
+      }
+      // Copies that were coalesced share a register
+      for(std::vector<int32_t>* registers : {&map.strings, &map.arrays, &map.maps})
+      {
+        std::sort(registers->begin(), registers->end());
+        registers->erase(std::unique(registers->begin(), registers->end()), registers->end());
+      }
+      return map;
+    }
+
+    // Updates the live set backwards over one instruction
+    static void Step(const Instruction& instruction, std::vector<bool>& live)
+    {
+      Fields fields = GetFields(instruction.op);
+      if(fields.defA && instruction.a >= 0) live[instruction.a] = false;
+      if(fields.useA && instruction.a >= 0) live[instruction.a] = true;
+      if(fields.useB && instruction.b >= 0) live[instruction.b] = true;
+      if(fields.useC && instruction.c >= 0) live[instruction.c] = true;
+    }
+
+    int Rewrite(int reg, const std::vector<int>& colors)
+    {
+      if(reg < 0)
+        return registerCount - 1 - reg;
+      return colors[reg];
+    }
+
+    void Emit(const std::vector<int>& colors)
+    {
+      // Rewrite virtual registers
+      for(size_t b = 0;b<code.size();b++)
+      {
+        std::vector<Instruction> rewritten;
+        std::vector<SourcePos> rewrittenPositions;
+        std::vector<int> rewrittenSafepoints;
+        for(size_t i = 0;i<code[b].size();i++)
+        {
+          Instruction instruction = code[b][i];
+          Fields fields = GetFields(instruction.op);
+          if(fields.defA || fields.useA) instruction.a = Rewrite(instruction.a, colors);
+          if(fields.useB) instruction.b = Rewrite(instruction.b, colors);
+          if(fields.useC) instruction.c = Rewrite(instruction.c, colors);
+          if(instruction.op == Opcode::CALL || instruction.op == Opcode::CALL_HOST || instruction.op == Opcode::CALL_IMPORT || instruction.op == Opcode::CALL_BUILTIN || instruction.op == Opcode::TAIL_CALL || instruction.op == Opcode::VECTOR_LOOP || instruction.op == Opcode::PARALLEL_FOR)
+            instruction.b = Rewrite(instruction.b, colors);
+          if(instruction.op == Opcode::MOVE && instruction.a == instruction.b)
+            continue;
+          rewritten.push_back(instruction);
+          rewrittenPositions.push_back(positions[b][i]);
+          rewrittenSafepoints.push_back(safepoints[b][i]);
+        }
+        code[b] = rewritten;
+        positions[b] = rewrittenPositions;
+        safepoints[b] = rewrittenSafepoints;
+      }
+
+      // Blocks only containing a jump are skipped
+      size_t blockCount = code.size();
+      std::vector<int> forward(blockCount, -1);
+      for(size_t b = 1;b<blockCount;b++)
+      {
+        if(code[b].size() == 1 && code[b][0].op == Opcode::JUMP)
+          forward[b] = code[b][0].a;
+      }
+      auto final = [&](int b)
+      {
+        std::set<int> seen;
+        while(forward[b] != -1 && seen.insert(b).second)
+          b = forward[b];
+        return b;
+      };
+      for(size_t b = 0;b<blockCount;b++)
+      {
+        int target = final(b);
+        forward[target] = -1;
+      }
+      std::vector<int> order;
+      for(size_t b = 0;b<blockCount;b++)
+      {
+        if(forward[b] == -1)
+          order.push_back(b);
+      }
+
+      std::vector<int> start(blockCount, -1);
+      std::vector<size_t> jumps;
+      for(size_t i = 0;i<order.size();i++)
+      {
+        auto& block = code[order[i]];
+        auto& blockPositions = positions[order[i]];
+        int next = i + 1 < order.size() ? order[i + 1] : -1;
+        start[order[i]] = function.code.size();
+        for(size_t j = 0;j<block.size();j++)
+        {
+          Instruction instruction = block[j];
+          // Replaced by the next one if nothing is emitted for it
+          function.lines.Add(function.code.size(), blockPositions[j]);
+          bool isJump = instruction.op == Opcode::JUMP || instruction.op == Opcode::JUMP_IF_TRUE || instruction.op == Opcode::JUMP_IF_FALSE;
+          if(isJump)
+            instruction.a = final(instruction.a);
+          if(instruction.op == Opcode::JUMP && instruction.a == next)
+            continue;
+          if(instruction.op == Opcode::JUMP_IF_TRUE && j + 1 < block.size())
+          {
+            int other = final(block[j + 1].a);
+            if(other == next)
+            {
+              function.code.push_back(instruction);
+              jumps.push_back(function.code.size() - 1);
+              j++;
+              continue;
+            }
+            if(instruction.a == next)
+            {
+              function.code.push_back({Opcode::JUMP_IF_FALSE, other, instruction.b, 0});
+              jumps.push_back(function.code.size() - 1);
+              j++;
+              continue;
+            }
+          }
+          if(safepoints[order[i]][j] != -1)
+            function.stackMaps.push_back(GetStackMap(function.code.size(), roots[safepoints[order[i]][j]], colors));
+          function.code.push_back(instruction);
+          if(isJump)
+            jumps.push_back(function.code.size() - 1);
+        }
+      }
+      for(size_t jump : jumps)
+        function.code[jump].a = start[function.code[jump].a];
+
+      function.registerCount = registerCount + maxOutgoing;
+    }
+};
@@ -0,0 +1,549 @@
+#pragma once
+
+#include "Ir.h"
+#include "IrVectorize.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+enum IrPass : unsigned
+{
+  IR_PASS_NONE = 0,
+  IR_PASS_COPY_PROPAGATION = 1 << 0,
+  IR_PASS_CONSTANT_FOLDING = 1 << 1,
+  IR_PASS_CSE = 1 << 2,
+  IR_PASS_LICM = 1 << 3,
+  IR_PASS_DCE = 1 << 4,
+  IR_PASS_BCE = 1 << 5,
+  IR_PASS_VECTORIZE = 1 << 6,
+  // Inlining happens while lowering, see Inliner
+  IR_PASS_INLINE = 1 << 7,
+  IR_PASS_ALL = ~0u,
+};
+
+class IrPasses
+{
+  public:
+    static void Run(IrFunction& function, unsigned passes)
+    {
+      function.Analyze();
+      if(passes & IR_PASS_COPY_PROPAGATION)
+        CopyPropagation(function);
+      if(passes & IR_PASS_CONSTANT_FOLDING)
+        ConstantFolding(function);
+      if(passes & IR_PASS_CSE)
+        CommonSubexpressionElimination(function);
+      if(passes & IR_PASS_LICM)
+        LoopInvariantCodeMotion(function);
+      if(passes & IR_PASS_COPY_PROPAGATION)
+        CopyPropagation(function);
+      if(passes & IR_PASS_BCE)
+        BoundsCheckElimination(function);
+      if(passes & IR_PASS_DCE)
+        DeadCodeElimination(function);
+      if(passes & IR_PASS_VECTORIZE)
+        IrVectorize::Run(function);
+    }
+
+    static unsigned GetPass(const std::string& name)
+    {
+      if(name == "copyprop") return IR_PASS_COPY_PROPAGATION;
+      if(name == "fold") return IR_PASS_CONSTANT_FOLDING;
+      if(name == "cse") return IR_PASS_CSE;
+      if(name == "licm") return IR_PASS_LICM;
+      if(name == "dce") return IR_PASS_DCE;
+      if(name == "bce") return IR_PASS_BCE;
+      if(name == "vectorize") return IR_PASS_VECTORIZE;
+      if(name == "inline") return IR_PASS_INLINE;
+      if(name == "all") return IR_PASS_ALL;
+      return IR_PASS_NONE;
+    }
+
+    // Removes copies and phis whose operands all are the same value
+    static void CopyPropagation(IrFunction& function)
+    {
+      bool changed = true;
+      while(changed)
+      {
+        std::map<IrInstruction*, IrInstruction*> replacements;
+        for(IrBlock* block : function.blocks)
+        {
+          for(IrInstruction* instruction : block->instructions)
+          {
+            if(instruction->op == IrOp::COPY)
+            {
+              replacements[instruction] = instruction->operands[0];
+            }
+            else if(instruction->op == IrOp::PHI)
+            {
+              IrInstruction* same = nullptr;
+              bool trivial = true;
+              for(IrInstruction* operand : instruction->operands)
+              {
+                if(operand == instruction || operand == same)
+                  continue;
+                if(same != nullptr)
+                {
+                  trivial = false;
+                  break;
+                }
+                same = operand;
+              }
+              if(trivial && same)
+                replacements[instruction] = same;
+            }
+          }
+        }
+        changed = !replacements.empty();
+        function.Replace(replacements);
+      }
+    }
+
+    // Evaluates operations on constants and removes branches on constants.
+    // Removing an edge can turn phis into constants so it is repeated until
+    // no more branches are removed.
+    static void ConstantFolding(IrFunction& function)
+    {
+      while(FoldConstants(function))
+      {
+        function.Analyze();
+        CopyPropagation(function);
+      }
+    }
+
+    static bool FoldConstants(IrFunction& function)
+    {
+      std::map<IrInstruction*, IrInstruction*> replacements;
+      bool removedEdge = false;
+      for(IrBlock* block : function.blocks)
+      {
+        for(size_t i = 0;i<block->instructions.size();i++)
+        {
+          IrInstruction* instruction = block->instructions[i];
+          for(IrInstruction*& operand : instruction->operands)
+          {
+            auto it = replacements.find(operand);
+            if(it != replacements.end())
+              operand = it->second;
+          }
+          if(instruction->op == IrOp::BRANCH && IsConst(instruction->operands[0]))
+          {
+            int taken = instruction->operands[0]->imm != 0 ? 0 : 1;
+            IrBlock* target = instruction->targets[taken];
+            IrBlock* other = instruction->targets[1 - taken];
+            if(target != other)
+              function.RemoveEdge(block, other);
+            instruction->op = IrOp::JUMP;
+            instruction->operands.clear();
+            instruction->targets[0] = target;
+            instruction->targets[1] = nullptr;
+            removedEdge = true;
+            continue;
+          }
+          int32_t value;
+          if(!Fold(instruction, value))
+            continue;
+          IrInstruction* constant = function.Create(IrOp::CONST, instruction->type, {}, value);
+          constant->block = block;
+          block->instructions[i] = constant;
+          replacements[instruction] = constant;
+        }
+      }
+      function.Replace(replacements);
+      return removedEdge;
+    }
+
+    // Dominator based value numbering, an expression is replaced by an
+    // identical one that dominates it
+    static void CommonSubexpressionElimination(IrFunction& function)
+    {
+      std::map<Key, IrInstruction*> available;
+      std::map<IrInstruction*, IrInstruction*> replacements;
+      std::function<void(IrBlock*)> visit = [&](IrBlock* block)
+      {
+        std::vector<Key> added;
+        for(IrInstruction* instruction : block->instructions)
+        {
+          for(IrInstruction*& operand : instruction->operands)
+          {
+            auto it = replacements.find(operand);
+            if(it != replacements.end())
+              operand = it->second;
+          }
+          if(!instruction->IsPure() || instruction->op == IrOp::COPY)
+            continue;
+          Key key = GetKey(instruction);
+          auto it = available.find(key);
+          if(it != available.end())
+          {
+            replacements[instruction] = it->second;
+            continue;
+          }
+          available[key] = instruction;
+          added.push_back(key);
+        }
+        for(IrBlock* child : block->domChildren)
+          visit(child);
+        for(const Key& key : added)
+          available.erase(key);
+      };
+      visit(function.Entry());
+      function.Replace(replacements);
+    }
+
+    // Moves pure instructions whose operands are defined outside of a loop to
+    // the preheader of the loop. Inner loops are handled first so that their
+    // invariants can continue out of the enclosing loops.
+    static void LoopInvariantCodeMotion(IrFunction& function)
+    {
+      std::vector<Loop> loops = FindLoops(function);
+      std::sort(loops.begin(), loops.end(), [](const Loop& a, const Loop& b) { return a.blocks.size() < b.blocks.size(); });
+      for(Loop& loop : loops)
+      {
+        IrBlock* preheader = GetPreheader(loop);
+        if(preheader == nullptr)
+          continue;
+        for(IrBlock* block : function.rpo)
+        {
+          if(loop.blocks.find(block) == loop.blocks.end())
+            continue;
+          auto& instructions = block->instructions;
+          for(size_t i = 0;i<instructions.size();)
+          {
+            IrInstruction* instruction = instructions[i];
+            if(instruction->IsPure() && IsInvariant(instruction, loop))
+            {
+              instructions.erase(instructions.begin() + i);
+              preheader->InsertBeforeTerminator(instruction);
+            }
+            else
+            {
+              i++;
+            }
+          }
+        }
+      }
+    }
+
+    // Removes bounds checks of indices that are known to be within the array.
+    // An index is in range when it is guarded by a comparison against the
+    // length of the array, either directly or as an induction variable
+    // starting at a non-negative value that is compared at every edge into
+    // the loop. Checks dominated by an identical check are removed as well.
+    static void BoundsCheckElimination(IrFunction& function)
+    {
+      std::set<std::pair<IrInstruction*, IrInstruction*>> checked;
+      std::function<void(IrBlock*)> visit = [&](IrBlock* block)
+      {
+        std::vector<std::pair<IrInstruction*, IrInstruction*>> added;
+        auto& instructions = block->instructions;
+        instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction* instruction)
+        {
+          if(instruction->op != IrOp::CHECK)
+            return false;
+          auto check = std::make_pair(SkipCopies(instruction->operands[0]), SkipCopies(instruction->operands[1]));
+          if(checked.count(check) || InRange(instruction->operands[1], instruction->operands[0], block))
+            return true;
+          checked.insert(check);
+          added.push_back(check);
+          return false;
+        }), instructions.end());
+        for(IrBlock* child : block->domChildren)
+          visit(child);
+        for(auto& check : added)
+          checked.erase(check);
+      };
+      visit(function.Entry());
+    }
+
+    // Removes pure instructions and loads whose values are never used
+    static void DeadCodeElimination(IrFunction& function)
+    {
+      std::set<IrInstruction*> live;
+      std::vector<IrInstruction*> worklist;
+      for(IrBlock* block : function.blocks)
+      {
+        for(IrInstruction* instruction : block->instructions)
+        {
+          if(!instruction->IsPure() && instruction->op != IrOp::PHI && instruction->op != IrOp::PARAM && instruction->op != IrOp::LOAD)
+          {
+            live.insert(instruction);
+            worklist.push_back(instruction);
+          }
+        }
+      }
+      while(!worklist.empty())
+      {
+        IrInstruction* instruction = worklist.back();
+        worklist.pop_back();
+        for(IrInstruction* operand : instruction->operands)
+        {
+          if(live.insert(operand).second)
+            worklist.push_back(operand);
+        }
+      }
+      for(IrBlock* block : function.blocks)
+      {
+        auto& instructions = block->instructions;
+        instructions.erase(std::remove_if(instructions.begin(), instructions.end(), [&](IrInstruction* instruction)
+        {
+          return instruction->op != IrOp::PARAM && live.find(instruction) == live.end();
+        }), instructions.end());
+      }
+    }
+
+  private:
+    using Key = std::tuple<IrOp, Opcode, Type, int32_t, std::vector<int>>;
+
+    struct Loop
+    {
+      IrBlock* header;
+      std::set<IrBlock*> blocks;
+    };
+
+    static Key GetKey(IrInstruction* instruction)
+    {
+      std::vector<int> operands;
+      for(IrInstruction* operand : instruction->operands)
+        operands.push_back(operand->id);
+      return Key{instruction->op, instruction->opcode, instruction->type, instruction->imm, operands};
+    }
+
+    static bool IsConst(IrInstruction* instruction)
+    {
+      return instruction->op == IrOp::CONST && !Types::IsReference(instruction->type);
+    }
+
+    static IrInstruction* SkipCopies(IrInstruction* value)
+    {
+      while(value->op == IrOp::COPY)
+        value = value->operands[0];
+      return value;
+    }
+
+    // Length of an array or a string
+    static bool IsLengthOp(IrInstruction* value)
+    {
+      return value->op == IrOp::UNARY && (value->opcode == Opcode::ARRAY_LENGTH || value->opcode == Opcode::STRING_LENGTH);
+    }
+
+    static bool IsNonNegative(IrInstruction* value)
+    {
+      value = SkipCopies(value);
+      if(value->op == IrOp::CONST)
+        return value->imm >= 0;
+      return IsLengthOp(value);
+    }
+
+    // Whether the value is at most the length of the array
+    static bool IsLength(IrInstruction* value, IrInstruction* array)
+    {
+      value = SkipCopies(value);
+      array = SkipCopies(array);
+      if(IsLengthOp(value))
+        return SkipCopies(value->operands[0]) == array;
+      if(array->op != IrOp::NEW_ARRAY)
+        return false;
+      IrInstruction* length = SkipCopies(array->operands[0]);
+      if(value == length)
+        return true;
+      return IsConst(value) && IsConst(length) && value->imm <= length->imm;
+    }
+
+    // Whether the condition being true means that index < length of array
+    static bool IsBelowLength(IrInstruction* condition, IrInstruction* index, IrInstruction* array)
+    {
+      condition = SkipCopies(condition);
+      if(condition->op != IrOp::BINARY)
+        return false;
+      IrInstruction* left = SkipCopies(condition->operands[0]);
+      IrInstruction* right = SkipCopies(condition->operands[1]);
+      // A product is only true if both factors are
+      if(condition->opcode == Opcode::MUL_INT)
+        return IsBelowLength(left, index, array) || IsBelowLength(right, index, array);
+      if(condition->opcode == Opcode::LT_INT)
+        return left == index && IsLength(right, array);
+      if(condition->opcode == Opcode::GT_INT)
+        return right == index && IsLength(left, array);
+      return false;
+    }
+
+    // Whether the edge is only taken when index < length of array
+    static bool IsGuardedEdge(IrBlock* from, IrBlock* to, IrInstruction* index, IrInstruction* array)
+    {
+      IrInstruction* terminator = from->Terminator();
+      return terminator && terminator->op == IrOp::BRANCH && terminator->targets[0] == to && terminator->targets[1] != to &&
+        IsBelowLength(terminator->operands[0], index, array);
+    }
+
+    // Whether a constant index is less than the constant length of an array
+    static bool IsConstBelowLength(IrInstruction* index, IrInstruction* array)
+    {
+      array = SkipCopies(array);
+      if(!IsConst(index) || array->op != IrOp::NEW_ARRAY)
+        return false;
+      IrInstruction* length = SkipCopies(array->operands[0]);
+      return IsConst(length) && index->imm < length->imm;
+    }
+
+    // Whether index < length of array holds at the start of the block because
+    // of a guarded edge dominating it
+    static bool IsBelowLengthAt(IrBlock* block, IrInstruction* index, IrInstruction* array)
+    {
+      if(IsConstBelowLength(index, array))
+        return true;
+      for(IrBlock* dominator = block;;dominator = dominator->idom)
+      {
+        if(dominator->preds.size() == 1 && IsGuardedEdge(dominator->preds[0], dominator, index, array))
+          return true;
+        if(dominator->idom == dominator || dominator->idom == nullptr)
+          return false;
+      }
+    }
+
+    // Whether 0 <= index < length of array holds in the block
+    static bool InRange(IrInstruction* index, IrInstruction* array, IrBlock* block)
+    {
+      index = SkipCopies(index);
+      if(IsNonNegative(index) && IsBelowLengthAt(block, index, array))
+        return true;
+      if(IsConst(index))
+        return index->imm >= 0 && IsConstBelowLength(index, array);
+      if(index->op != IrOp::PHI)
+        return false;
+
+      // An induction variable is in range if every value flowing into it is.
+      // Values from the back edges are the variable plus a non-negative step,
+      // which can't overflow since the variable is less than MAX_LENGTH.
+      IrBlock* header = index->block;
+      for(size_t i = 0;i<index->operands.size();i++)
+      {
+        IrInstruction* value = SkipCopies(index->operands[i]);
+        IrBlock* pred = header->preds[i];
+        if(!IsGuardedEdge(pred, header, value, array) && !IsBelowLengthAt(pred, value, array))
+          return false;
+        if(IsNonNegative(value))
+          continue;
+        if(value->op != IrOp::BINARY || value->opcode != Opcode::ADD_INT)
+          return false;
+        IrInstruction* left = SkipCopies(value->operands[0]);
+        IrInstruction* right = SkipCopies(value->operands[1]);
+        if(left != index)
+          std::swap(left, right);
+        if(left != index || !IsConst(right) || right->imm < 0 || right->imm > Array::MAX_LENGTH)
+          return false;
+      }
+      return true;
+    }
+
+    static bool Fold(IrInstruction* instruction, int32_t& result)
+    {
+      if(instruction->op != IrOp::BINARY && instruction->op != IrOp::UNARY)
+        return false;
+      for(IrInstruction* operand : instruction->operands)
+      {
+        if(!IsConst(operand))
+          return false;
+      }
+      Value a;
+      Value b;
+      Value r;
+      a.i = instruction->operands[0]->imm;
+      b.i = instruction->op == IrOp::BINARY ? instruction->operands[1]->imm : 0;
+      switch(instruction->opcode)
+      {
+        case Opcode::ADD_INT: r.i = (int32_t)((uint32_t)a.i + (uint32_t)b.i); break;
+        case Opcode::SUB_INT: r.i = (int32_t)((uint32_t)a.i - (uint32_t)b.i); break;
+        case Opcode::MUL_INT: r.i = (int32_t)((uint32_t)a.i * (uint32_t)b.i); break;
+        case Opcode::DIV_INT:
+          if(b.i == 0)
+            return false;
+          r.i = b.i == -1 ? (int32_t)(0u - (uint32_t)a.i) : a.i / b.i;
+          break;
+        case Opcode::ADD_FLOAT: r.f = a.f + b.f; break;
+        case Opcode::SUB_FLOAT: r.f = a.f - b.f; break;
+        case Opcode::MUL_FLOAT: r.f = a.f * b.f; break;
+        case Opcode::DIV_FLOAT: r.f = a.f / b.f; break;
+        case Opcode::NEG_INT: r.i = (int32_t)(0u - (uint32_t)a.i); break;
+        case Opcode::NEG_FLOAT: r.f = -a.f; break;
+        case Opcode::NOT: r.i = a.i == 0; break;
+        case Opcode::BOOL: r.i = a.i != 0; break;
+        case Opcode::EQ_INT: r.i = a.i == b.i; break;
+        case Opcode::NE_INT: r.i = a.i != b.i; break;
+        case Opcode::LT_INT: r.i = a.i < b.i; break;
+        case Opcode::LE_INT: r.i = a.i <= b.i; break;
+        case Opcode::GT_INT: r.i = a.i > b.i; break;
+        case Opcode::GE_INT: r.i = a.i >= b.i; break;
+        case Opcode::EQ_FLOAT: r.i = a.f == b.f; break;
+        case Opcode::NE_FLOAT: r.i = a.f != b.f; break;
+        case Opcode::LT_FLOAT: r.i = a.f < b.f; break;
+        case Opcode::LE_FLOAT: r.i = a.f <= b.f; break;
+        case Opcode::GT_FLOAT: r.i = a.f > b.f; break;
+        case Opcode::GE_FLOAT: r.i = a.f >= b.f; break;
+        default: return false;
+      }
+      result = r.i;
+      return true;
+    }
+
+    static std::vector<Loop> FindLoops(IrFunction& function)
+    {
+      std::map<IrBlock*, Loop> loops;
+      for(IrBlock* block : function.rpo)
+      {
+        for(IrBlock* succ : block->Successors())
+        {
+          // A back edge goes to a block dominating its source
+          if(!succ->Dominates(block))
+            continue;
+          Loop& loop = loops[succ];
+          loop.header = succ;
+          loop.blocks.insert(succ);
+          std::vector<IrBlock*> worklist{block};
+          while(!worklist.empty())
+          {
+            IrBlock* current = worklist.back();
+            worklist.pop_back();
+            if(!loop.blocks.insert(current).second)
+              continue;
+            for(IrBlock* pred : current->preds)
+              worklist.push_back(pred);
+          }
+        }
+      }
+      std::vector<Loop> result;
+      for(auto& loop : loops)
+        result.push_back(loop.second);
+      return result;
+    }
+
+    // The single block outside of the loop jumping unconditionally to the header
+    static IrBlock* GetPreheader(const Loop& loop)
+    {
+      IrBlock* preheader = nullptr;
+      for(IrBlock* pred : loop.header->preds)
+      {
+        if(loop.blocks.find(pred) != loop.blocks.end())
+          continue;
+        if(preheader != nullptr)
+          return nullptr;
+        preheader = pred;
+      }
+      if(preheader == nullptr || preheader->Successors().size() != 1)
+        return nullptr;
+      return preheader;
+    }
+
+    static bool IsInvariant(IrInstruction* instruction, const Loop& loop)
+    {
+      for(IrInstruction* operand : instruction->operands)
+      {
+        if(loop.blocks.find(operand->block) != loop.blocks.end())
+          return false;
+      }
+      return true;
+    }
+};
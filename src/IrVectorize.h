@@ -0,0 +1,235 @@
+#pragma once
+
+#include "Ir.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+// Replaces element-wise loops over int and float arrays with a single vector
+// loop instruction. A loop is vectorized when it is a single block with one
+// induction variable i counting up by one towards a loop invariant end, and
+// the rest of the block only loads and stores elements at i of loop invariant
+// arrays and does arithmetic that has a vector kernel. Bounds checks in the
+// loop are replaced by checking the whole range of i once.
+class IrVectorize
+{
+  private:
+    IrFunction& function;
+    IrBlock* header;
+    IrInstruction* index;
+    VectorLoop loop;
+    // Operands of the vector instruction and their position
+    std::vector<IrInstruction*> operands;
+    std::map<IrInstruction*, int> operandIndex;
+    // Temporary holding the value of each instruction in the loop
+    std::map<IrInstruction*, int> temps;
+
+  public:
+    static void Run(IrFunction& function)
+    {
+      bool changed = false;
+      for(IrBlock* block : std::vector<IrBlock*>{function.rpo})
+      {
+        IrVectorize vectorize{function, block};
+        if(vectorize.Vectorize())
+          changed = true;
+      }
+      if(changed)
+        function.Analyze();
+    }
+
+  private:
+    IrVectorize(IrFunction& function, IrBlock* header)
+      : function{function}, header{header}, index{nullptr}, loop{{}, 0, {}}
+    {}
+
+    bool Vectorize()
+    {
+      // The loop is a block branching back to itself or to the exit
+      IrInstruction* branch = header->Terminator();
+      if(branch == nullptr || branch->op != IrOp::BRANCH || branch->targets[0] != header || branch->targets[1] == header)
+        return false;
+      IrBlock* exit = branch->targets[1];
+      if(header->preds.size() != 2)
+        return false;
+      int entryIndex = header->preds[0] == header ? 1 : 0;
+      IrBlock* preheader = header->preds[entryIndex];
+      IrInstruction* jump = preheader->Terminator();
+      if(jump == nullptr || jump->op != IrOp::JUMP)
+        return false;
+
+      // i = phi(start, i + 1) and the loop continues while i + 1 < end
+      IrInstruction* condition = branch->operands[0];
+      if(condition->op != IrOp::BINARY || condition->opcode != Opcode::LT_INT || !IsInvariant(condition->operands[1]))
+        return false;
+      IrInstruction* next = condition->operands[0];
+      if(next->op != IrOp::BINARY || next->opcode != Opcode::ADD_INT || next->block != header)
+        return false;
+      index = next->operands[0];
+      IrInstruction* step = next->operands[1];
+      if(index->op != IrOp::PHI)
+        std::swap(index, step);
+      if(index->op != IrOp::PHI || index->block != header || step->op != IrOp::CONST || step->imm != 1)
+        return false;
+      if(index->operands[1 - entryIndex] != next || !IsInvariant(index->operands[entryIndex]))
+        return false;
+      if(UsedOutside())
+        return false;
+
+      AddOperand(index->operands[entryIndex]);
+      AddOperand(condition->operands[1]);
+      bool stored = false;
+      for(IrInstruction* instruction : header->instructions)
+      {
+        if(instruction == index || instruction == next || instruction == condition || instruction == branch)
+          continue;
+        if(!Translate(instruction, stored))
+          return false;
+      }
+      if(!stored || loop.temps > Simd::MAX_TEMPS)
+        return false;
+
+      // The preheader runs the vector loop and continues at the exit in place
+      // of the loop block
+      IrInstruction* vector = function.Create(IrOp::VECTOR, Type::VOID, operands, function.vectorLoops.size());
+      function.vectorLoops.push_back(loop);
+      preheader->InsertBeforeTerminator(vector);
+      jump->targets[0] = exit;
+      *std::find(exit->preds.begin(), exit->preds.end(), header) = preheader;
+      return true;
+    }
+
+    bool IsInvariant(IrInstruction* value)
+    {
+      return value->block != header;
+    }
+
+    // Values of the loop can't be used after it since the loop block is removed
+    bool UsedOutside()
+    {
+      for(IrBlock* block : function.rpo)
+      {
+        if(block == header)
+          continue;
+        for(IrInstruction* instruction : block->instructions)
+        {
+          for(IrInstruction* operand : instruction->operands)
+          {
+            if(operand->block == header)
+              return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    int AddOperand(IrInstruction* value)
+    {
+      auto it = operandIndex.find(value);
+      if(it != operandIndex.end())
+        return it->second;
+      operands.push_back(value);
+      operandIndex[value] = operands.size() - 1;
+      return operands.size() - 1;
+    }
+
+    int AddOp(VectorOpKind kind, Opcode opcode, int a, int b, int32_t imm = 0)
+    {
+      loop.ops.push_back({kind, opcode, loop.temps, a, b, imm});
+      return loop.temps++;
+    }
+
+    // Temporary holding the value in every lane of the loop
+    int GetTemp(IrInstruction* value)
+    {
+      auto it = temps.find(value);
+      if(it != temps.end())
+        return it->second;
+      int temp;
+      if(value == index)
+        temp = AddOp(VectorOpKind::INDEX, Opcode::NOP, 0, 0);
+      else if(value->op == IrOp::CONST)
+        temp = AddOp(VectorOpKind::CONSTANT, Opcode::NOP, 0, 0, value->imm);
+      else if(IsInvariant(value))
+        temp = AddOp(VectorOpKind::SCALAR, Opcode::NOP, AddOperand(value), 0);
+      else
+        return -1;
+      temps[value] = temp;
+      return temp;
+    }
+
+    // Arrays indexed by i that are the same in every iteration
+    int GetArray(IrInstruction* array, IrInstruction* at)
+    {
+      while(at->op == IrOp::COPY)
+        at = at->operands[0];
+      if(at != index || !IsInvariant(array) || (array->type != Type::INT_ARRAY && array->type != Type::FLOAT_ARRAY))
+        return -1;
+      int operand = AddOperand(array);
+      if(std::find(loop.arrays.begin(), loop.arrays.end(), operand) == loop.arrays.end())
+        loop.arrays.push_back(operand);
+      return operand;
+    }
+
+    bool Translate(IrInstruction* instruction, bool& stored)
+    {
+      switch(instruction->op)
+      {
+        case IrOp::CONST:
+          return true;
+        case IrOp::COPY:
+        {
+          int temp = GetTemp(instruction->operands[0]);
+          temps[instruction] = temp;
+          return temp != -1;
+        }
+        case IrOp::CHECK:
+          return GetArray(instruction->operands[0], instruction->operands[1]) != -1;
+        case IrOp::LOAD:
+        {
+          // Loads after the store could read what it wrote
+          int array = GetArray(instruction->operands[0], instruction->operands[1]);
+          if(array == -1 || stored)
+            return false;
+          temps[instruction] = AddOp(VectorOpKind::LOAD, Opcode::NOP, array, 0);
+          return true;
+        }
+        case IrOp::STORE:
+        {
+          int array = GetArray(instruction->operands[0], instruction->operands[1]);
+          int value = GetTemp(instruction->operands[2]);
+          if(array == -1 || value == -1 || stored)
+            return false;
+          loop.ops.push_back({VectorOpKind::STORE, Opcode::NOP, -1, array, value, 0});
+          stored = true;
+          return true;
+        }
+        case IrOp::BINARY:
+        {
+          if(Simd::GetBinary(instruction->opcode) == nullptr)
+            return false;
+          int a = GetTemp(instruction->operands[0]);
+          int b = GetTemp(instruction->operands[1]);
+          if(a == -1 || b == -1)
+            return false;
+          temps[instruction] = AddOp(VectorOpKind::BINARY, instruction->opcode, a, b);
+          return true;
+        }
+        case IrOp::UNARY:
+        {
+          if(Simd::GetUnary(instruction->opcode) == nullptr)
+            return false;
+          int a = GetTemp(instruction->operands[0]);
+          if(a == -1)
+            return false;
+          temps[instruction] = AddOp(VectorOpKind::UNARY, instruction->opcode, a, 0);
+          return true;
+        }
+        default:
+          return false;
+      }
+    }
+};
@@ -16,17 +16,28 @@ struct LexerData
     char c;
     size_t lineNr;
     size_t columnNr;
+    bool empty;
 
   public:
     LexerData(std::istream& stream)
       : stream{stream}, c{'\0'}, lineNr{1}, columnNr{1}
     {
       stream >> c;
+      empty = stream.eof();
     }
 
+    // Reads from the buffer directly, which skips the sentry of the stream
+    // for every character
     char Read()
     {
-      stream.get(c);
+      int next = stream.rdbuf()->sbumpc();
+      if(next == std::char_traits<char>::eof())
+      {
+        c = '\0';
+        empty = true;
+      }
+      else
+        c = (char)next;
       columnNr++;
       if(c == '\n')
       {
@@ -43,7 +54,7 @@ struct LexerData
 
     bool Empty()
     {
-      return stream.eof();
+      return empty;
     }
 
     size_t LineNr()
@@ -55,21 +66,112 @@ struct LexerData
       return columnNr;
     }
 };
+
+// Character classes and symbols, every token starts with a lookup of its
+// first character in these instead of a chain of comparisons
+struct LexerTables
+{
+  // Kind of token a character can start
+  enum CharClass : uint8_t
+  {
+    CHAR_INVALID, CHAR_SPACE, CHAR_LETTER, CHAR_DIGIT, CHAR_QUOTE, CHAR_APOSTROPHE, CHAR_SYMBOL
+  };
+
+  // Token of a one character symbol, or of the two character symbol when
+  // it's followed by suffix
+  struct Symbol
+  {
+    Token token = Token::INVALID;
+    char suffix = '\0';
+    Token withSuffix = Token::INVALID;
+  };
+
+  CharClass classes[256] = {};
+  Symbol symbols[256] = {};
+
+  static constexpr LexerTables Create()
+  {
+    LexerTables tables{};
+    for(int c = 'a';c<='z';c++)
+      tables.classes[c] = CHAR_LETTER;
+    for(int c = 'A';c<='Z';c++)
+      tables.classes[c] = CHAR_LETTER;
+    tables.classes['_'] = CHAR_LETTER;
+    for(int c = '0';c<='9';c++)
+      tables.classes[c] = CHAR_DIGIT;
+    tables.classes[' '] = CHAR_SPACE;
+    tables.classes['\n'] = CHAR_SPACE;
+    tables.classes['\r'] = CHAR_SPACE;
+    tables.classes['\t'] = CHAR_SPACE;
+    tables.classes['"'] = CHAR_QUOTE;
+    tables.classes['\''] = CHAR_APOSTROPHE;
+
+    struct Entry
+    {
+      char c;
+      Symbol symbol;
+    };
+    const Entry entries[] = {
+      {'(', {Token::OPEN_PARAM}},
+      {')', {Token::CLOSE_PARAM}},
+      {'[', {Token::OPEN_SQUARE}},
+      {']', {Token::CLOSE_SQUARE}},
+      {'{', {Token::OPEN_CURLY}},
+      {'}', {Token::CLOSE_CURLY}},
+      {'=', {Token::ASSIGN, '=', Token::EQUAL}},
+      {'+', {Token::ADD}},
+      {'-', {Token::SUB}},
+      {'*', {Token::MUL}},
+      {'/', {Token::DIV}},
+      {'!', {Token::NOT, '=', Token::NEQUAL}},
+      {'&', {Token::BIN_AND, '&', Token::AND}},
+      {'|', {Token::BIN_OR, '|', Token::OR}},
+      {'^', {Token::BIN_XOR}},
+      {'~', {Token::BIN_NOT}},
+      {'<', {Token::LT, '=', Token::LTE}},
+      {'>', {Token::GT, '=', Token::GTE}},
+      {'#', {Token::HASH}},
+      {'.', {Token::DOT}},
+      {',', {Token::COMMA}},
+      {':', {Token::COLON}},
+      {';', {Token::SEMICOLON}},
+    };
+    for(const Entry& entry : entries)
+    {
+      tables.classes[(uint8_t)entry.c] = CHAR_SYMBOL;
+      tables.symbols[(uint8_t)entry.c] = entry.symbol;
+    }
+    return tables;
+  }
+};
+
 class Lexer
 {
+  private:
+    // Constant initialized, so nothing is set up before main
+    static constexpr LexerTables tables = LexerTables::Create();
+
+    static LexerTables::CharClass GetClass(char c)
+    {
+      return tables.classes[(uint8_t)c];
+    }
+
   public:
     static std::vector<TokenPos> Read(std::istream& source)
     {
       std::vector<TokenPos> tokens;
       LexerData data{source};
-      TokenPos t;
-      while(!data.Empty() && ((t = ReadToken(data)).token != Token::INVALID))
+      while(!data.Empty())
       {
+        TokenPos t = ReadToken(data);
+        if(t.token == Token::INVALID)
+        {
+          std::cerr << "Invalid token at: " << t.line << ":" << t.column << std::endl;
+          return {t};
+        }
         tokens.push_back(t);
         ReadWhiteSpace(data);
       }
-      if(t.token == Token::INVALID)
-        return {t};
 
       return tokens;
     }
@@ -78,7 +180,7 @@ class Lexer
   private:
     static void ReadWhiteSpace(LexerData& data)
     {
-      while(!data.Empty() && (data.Top() == ' ' || data.Top() == '\n' || data.Top() == '\r' || data.Top() == '\t'))
+      while(!data.Empty() && GetClass(data.Top()) == LexerTables::CHAR_SPACE)
         data.Read();
     }
 
@@ -86,68 +188,32 @@ class Lexer
     {
       size_t line = data.LineNr();
       size_t column = data.ColumnNr();
-      if(IsName(data.Top()))
+      switch(GetClass(data.Top()))
       {
-        std::string str = ReadName(data);
-        Token reservedToken = Tokens::GetReservedToken(str);
-        if(reservedToken == Token::INVALID)
+        case LexerTables::CHAR_LETTER:
         {
-          return {Token::NAME, line, column};
+          std::string str = ReadName(data);
+          Token reservedToken = Tokens::GetReservedToken(str);
+          if(reservedToken == Token::INVALID)
+            return {Token::NAME, line, column, str};
+          return {reservedToken, line, column};
         }
-        else
+        case LexerTables::CHAR_DIGIT:
+          return {Token::NUMBER, line, column, ReadNumber(data)};
+        case LexerTables::CHAR_QUOTE:
+          return {Token::STRING, line, column, ReadString(data)};
+        case LexerTables::CHAR_APOSTROPHE:
         {
-          return {reservedToken, line, column};
+          char c;
+          if(!ReadChar(data, c))
+            return {Token::INVALID, line, column};
+          return {Token::CHAR, line, column, std::string(1, c)};
         }
+        case LexerTables::CHAR_SYMBOL:
+          return {ReadSymbol(data), line, column};
+        default:
+          return {Token::INVALID, line, column};
       }
-      else if(IsNumber(data.Top()))
-      {
-        ReadNumber(data);
-        return {Token::NUMBER, line, column};
-      }
-      else if(IsString(data.Top()))
-      {
-        ReadString(data);
-        return {Token::STRING, line, column};
-      }
-      else if(IsChar(data.Top()))
-      {
-        char i = ReadChar(data);
-        return {Token::CHAR, line, column};
-      }
-      else
-      {
-        return {ReadSymbol(data), line, column};
-      }
-      if(!data.Empty())
-      {
-        std::cerr << "Invalid token at: " << line << ":" << column << std::endl;
-      }
-      return {Token::INVALID, line, column};
-    }
-
-    static bool IsLetter(char c)
-    {
-      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
-    }
-
-    static bool IsNumber(char c)
-    {
-      return c >= '0' && c <= '9';
-    }
-
-    static bool IsName(char c)
-    {
-      return IsLetter(c) || c == '_';
-    }
-
-    static bool IsString(char c)
-    {
-      return c == '"';
-    }
-
-    static bool IsChar(char c)
-    {
-      return c == '\'';
     }
 
     static bool IsEscapeCharacter(char c)
@@ -155,7 +221,7 @@ class Lexer
       return c == 'n' || c == 'r' || c == 't' || c == '\\' || c == '"' || c == '\'' || c == '0';
     }
 
-    static bool GetEscapeCharacter(char c)
+    static char GetEscapeCharacter(char c)
     {
       if(c == 'n') return '\n';
       if(c == 'r') return '\r';
@@ -172,21 +238,28 @@ class Lexer
     {
       std::stringstream ss;
       data.Read();
-      char lastchar = data.Top();
-      while(!data.Empty() && !(data.Top() == '"' && lastchar != '\\'))
+      while(!data.Empty() && data.Top() != '"')
       {
-        ss << data.Top();
-        lastchar = data.Top();
+        if(data.Top() == '\\')
+        {
+          data.Read();
+          if(!IsEscapeCharacter(data.Top()))
+            std::cerr << "Invalid escape character: " << data.Top() << std::endl;
+          else
+            ss << GetEscapeCharacter(data.Top());
+        }
+        else
+        {
+          ss << data.Top();
+        }
         data.Read();
       }
       data.Read();
       return ss.str();
     }
 
-    static char ReadChar(LexerData& data)
+    static bool ReadChar(LexerData& data, char& ret)
     {
-      char ret = '\0';
-      std::stringstream ss;
       ret = data.Read();
       if(data.Top() == '\\')
       {
@@ -194,7 +267,7 @@ class Lexer
         if(!IsEscapeCharacter(data.Top()))
         {
           std::cerr << "Invalid escape character: " << data.Top() << std::endl;
-          return '\0';
+          return false;
         }
         ret = GetEscapeCharacter(data.Top());
         data.Read();
@@ -204,79 +277,50 @@ class Lexer
         if(data.Top() == '\'')
         {
           std::cerr << "No character specified within char" << std::endl;
-          return '\0';
+          return false;
         }
         data.Read();
       }
       if(data.Top() != '\'')
       {
         std::cerr << "More than 1 character within single quote" << std::endl;
-        return '\0';
+        return false;
       }
       data.Read();
-      return ret;
+      return true;
     }
 
     static Token ReadSymbol(LexerData& data)
     {
-      if(data.Top() == '(') READ_RETURN(Token::OPEN_PARAM);
-      if(data.Top() == ')') READ_RETURN(Token::CLOSE_PARAM);
-      if(data.Top() == '[') READ_RETURN(Token::OPEN_SQUARE);
-      if(data.Top() == ']') READ_RETURN(Token::CLOSE_SQUARE);
-      if(data.Top() == '{') READ_RETURN(Token::OPEN_CURLY);
-      if(data.Top() == '}') READ_RETURN(Token::CLOSE_CURLY);
-      if(data.Top() == '=') READ_RETURN(ReadSymbolSuffix(data, '=', Token::ASSIGN, Token::EQUAL));
-      if(data.Top() == '+') READ_RETURN(Token::ADD);
-      if(data.Top() == '-') READ_RETURN(Token::SUB);
-      if(data.Top() == '*') READ_RETURN(Token::MUL);
-      if(data.Top() == '/') READ_RETURN(Token::DIV);
-      if(data.Top() == '!') READ_RETURN(ReadSymbolSuffix(data, '=', Token::NOT, Token::NEQUAL));
-      if(data.Top() == '&') READ_RETURN(ReadSymbolSuffix(data, '&', Token::BIN_AND, Token::AND));
-      if(data.Top() == '|') READ_RETURN(ReadSymbolSuffix(data, '|', Token::BIN_OR, Token::OR));
-      if(data.Top() == '^') READ_RETURN(Token::BIN_XOR);
-      if(data.Top() == '~') READ_RETURN(Token::BIN_NOT);
-      if(data.Top() == '<') READ_RETURN(ReadSymbolSuffix(data, '=', Token::LT, Token::LTE));
-      if(data.Top() == '>') READ_RETURN(ReadSymbolSuffix(data, '=', Token::GT, Token::GTE));;
-      if(data.Top() == '#') READ_RETURN(Token::HASH);
-      if(data.Top() == '.') READ_RETURN(Token::DOT);
-      if(data.Top() == ',') READ_RETURN(Token::COMMA);
-      if(data.Top() == ':') READ_RETURN(Token::COLON);
-      if(data.Top() == ';') READ_RETURN(Token::SEMICOLON);
-
-      return Token::INVALID;
-    }
-
-    // Returns different Tokens depending on if the suffix exists behind char.
-    static Token ReadSymbolSuffix(LexerData& data, char suffix, Token noSuffix, Token withSuffix)
-    {
-      if(data.Top() == suffix) READ_RETURN(withSuffix);
-      return noSuffix;
+      const LexerTables::Symbol& symbol = tables.symbols[(uint8_t)data.Top()];
+      data.Read();
+      if(symbol.suffix != '\0' && data.Top() == symbol.suffix)
+        READ_RETURN(symbol.withSuffix);
+      return symbol.token;
     }
 
     static std::string ReadName(LexerData& data)
     {
-      std::stringstream ss;
-      while(IsLetter(data.Top()) || IsNumber(data.Top()) || data.Top() == '_')
+      std::string str;
+      while(GetClass(data.Top()) == LexerTables::CHAR_LETTER || GetClass(data.Top()) == LexerTables::CHAR_DIGIT)
       {
-        ss << data.Top();
+        str += data.Top();
         data.Read();
       }
-
-      return ss.str();
+      return str;
     }
 
     static std::string ReadNumber(LexerData& data)
     {
-      std::stringstream ss;
+      std::string str;
       bool hasReadComma = false;
-      while(IsNumber(data.Top()) || (data.Top() == '.' && !hasReadComma))
+      while(GetClass(data.Top()) == LexerTables::CHAR_DIGIT || (data.Top() == '.' && !hasReadComma))
       {
         if(data.Top() == '.')
           hasReadComma = true;
-        ss << data.Top();
+        str += data.Top();
         data.Read();
       }
-
-      return ss.str();
+      return str;
     }
 };
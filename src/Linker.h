@@ -0,0 +1,87 @@
+#pragma once
+
+#include "Bytecode.h"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Resolves the imports of a program to the script or host function with the
+// same name and replaces every call through an import by a direct call, so
+// no call is looked up while running. Unresolved imports are reported here,
+// before any script runs.
+class Linker
+{
+  public:
+    static bool Link(Program& program)
+    {
+      // The call targets used by the interpreter
+      program.hostCalls.clear();
+      for(const HostFunction& host : program.hostFunctions)
+        program.hostCalls.push_back({host.invoke, host.function});
+
+      std::map<std::string, int> scriptIndices;
+      std::map<std::string, int> hostIndices;
+      for(size_t i = 0;i<program.functions.size();i++)
+        scriptIndices[program.functions[i].name] = i;
+      for(size_t i = 0;i<program.hostFunctions.size();i++)
+        hostIndices[program.hostFunctions[i].name] = i;
+
+      bool valid = true;
+      std::vector<Instruction> targets;
+      for(const Import& import : program.imports)
+      {
+        auto script = scriptIndices.find(import.name);
+        auto host = hostIndices.find(import.name);
+        if(script != scriptIndices.end())
+        {
+          const CompiledFunction& function = program.functions[script->second];
+          if(!Matches(import, function.returnType, function.params))
+            valid = false;
+          targets.push_back({Opcode::CALL, script->second, 0, 0});
+        }
+        else if(host != hostIndices.end())
+        {
+          const HostFunction& function = program.hostFunctions[host->second];
+          if(!Matches(import, function.returnType, function.params))
+            valid = false;
+          targets.push_back({Opcode::CALL_HOST, host->second, 0, 0});
+        }
+        else
+        {
+          std::cerr << "Link error: unresolved function " << import.name << std::endl;
+          valid = false;
+          targets.push_back({Opcode::CALL_IMPORT, 0, 0, 0});
+        }
+      }
+      if(!valid)
+        return false;
+
+      for(CompiledFunction& function : program.functions)
+        Resolve(function, targets);
+      return true;
+    }
+
+  private:
+    static void Resolve(CompiledFunction& function, const std::vector<Instruction>& targets)
+    {
+      for(Instruction& instruction : function.code)
+      {
+        if(instruction.op != Opcode::CALL_IMPORT)
+          continue;
+        instruction.op = targets[instruction.a].op;
+        instruction.a = targets[instruction.a].a;
+      }
+      for(ParallelLoop& loop : function.parallelLoops)
+        Resolve(*loop.body, targets);
+    }
+
+    static bool Matches(const Import& import, Type returnType, const std::vector<Type>& params)
+    {
+      if(import.returnType == returnType && import.params == params)
+        return true;
+      std::cerr << "Link error: " << import.name << " doesn't match its declaration" << std::endl;
+      return false;
+    }
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "Heap.h"
+#include "Value.h"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Operations on maps. A table is open addressed with the slots split into
+// groups of MapTable::GROUP. The control bytes of a group are compared with
+// the low 7 bits of the hash at once and only the slots that match have their
+// keys compared. Groups are probed in triangular order, which visits every
+// group of a power of two table. Entries are never removed, so a probe ends at
+// the first group with an empty slot and the entries stay in the order they
+// were added, which is the order maps are iterated in.
+class Maps
+{
+  public:
+    // Returns the index of the entry with the key or -1
+    template <typename Key>
+    static int32_t Find(const Map* map, Key key)
+    {
+      return Find(map, key, Hash(key));
+    }
+
+    // Adds the key or replaces its value. Returns false if there isn't enough
+    // memory, the map is left as it was or with a larger table.
+    template <typename Key>
+    static bool Set(Heap& heap, Map* map, Key key, Value value)
+    {
+      uint64_t hash = Hash(key);
+      int32_t entry = Find(map, key, hash);
+      if(map->kind & Map::STRING_VALUES)
+      {
+        value.s = heap.Tenure(value.s);
+        if(value.s.IsNull())
+          return false;
+      }
+      if(entry != -1)
+      {
+        SetValue(map, entry, value);
+        return true;
+      }
+      if(map->table == nullptr || (uint32_t)map->length == MapTable::EntryCapacity(map->table->capacity))
+      {
+        if(!Grow(heap, map))
+          return false;
+      }
+      if(!Tenure(heap, key))
+        return false;
+      entry = map->length;
+      memcpy(map->table->Keys() + (size_t)entry * sizeof(Key), &key, sizeof(Key));
+      SetValue(map, entry, value);
+      Place(map->table, hash, entry);
+      map->length++;
+      return true;
+    }
+
+    static Value GetKey(const Map* map, int32_t entry)
+    {
+      Value key;
+      int size = map->KeySize();
+      memcpy(&key, map->table->Keys() + (size_t)entry * size, size);
+      return key;
+    }
+
+    static Value GetValue(const Map* map, int32_t entry)
+    {
+      Value value;
+      int size = map->ValueSize();
+      memcpy(&value, map->table->Values(map->KeySize()) + (size_t)entry * size, size);
+      return value;
+    }
+
+  private:
+    static uint64_t Mix(uint64_t h)
+    {
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ull;
+      h ^= h >> 33;
+      return h;
+    }
+
+    static uint64_t Hash(int32_t key)
+    {
+      return Mix((uint32_t)key);
+    }
+
+    // Inline strings are hashed by their bits, equal strings are either both
+    // inline or both not
+    static uint64_t Hash(String key)
+    {
+      if(key.IsInline())
+        return Mix(key.bits);
+      const StringData* data = key.Data();
+      uint64_t h = data->length;
+      int32_t i = 0;
+      for(;i + 8<=data->length;i += 8)
+      {
+        uint64_t word;
+        memcpy(&word, data->data + i, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ull;
+        h ^= h >> 29;
+      }
+      uint64_t tail = 0;
+      memcpy(&tail, data->data + i, data->length - i);
+      return Mix(h ^ tail);
+    }
+
+    static bool Equals(int32_t a, int32_t b)
+    {
+      return a == b;
+    }
+
+    static bool Equals(String a, String b)
+    {
+      return String::Equals(a, b);
+    }
+
+    static bool Tenure(Heap& heap, int32_t& key)
+    {
+      return true;
+    }
+
+    static bool Tenure(Heap& heap, String& key)
+    {
+      key = heap.Tenure(key);
+      return !key.IsNull();
+    }
+
+    // Bit i is set if control byte i of the group equals the byte
+    static uint32_t Match(const uint8_t* group, uint8_t byte)
+    {
+#ifdef __SSE2__
+      __m128i control = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+#else
+      uint32_t mask = 0;
+      for(uint32_t i = 0;i<MapTable::GROUP;i++)
+        mask |= (uint32_t)(group[i] == byte) << i;
+      return mask;
+#endif
+    }
+
+    template <typename Key>
+    static int32_t Find(const Map* map, Key key, uint64_t hash)
+    {
+      MapTable* table = map->table;
+      if(table == nullptr)
+        return -1;
+      const uint8_t* control = table->Control();
+      const int32_t* slots = table->Slots();
+      const char* keys = table->Keys();
+      uint32_t groups = table->capacity / MapTable::GROUP;
+      uint32_t group = (hash >> 7) & (groups - 1);
+      uint8_t h2 = hash & 0x7f;
+      for(uint32_t step = 1;;step++)
+      {
+        const uint8_t* bytes = control + group * MapTable::GROUP;
+        for(uint32_t mask = Match(bytes, h2);mask != 0;mask &= mask - 1)
+        {
+          int32_t entry = slots[group * MapTable::GROUP + __builtin_ctz(mask)];
+          Key other;
+          memcpy(&other, keys + (size_t)entry * sizeof(Key), sizeof(Key));
+          if(Equals(key, other))
+            return entry;
+        }
+        if(Match(bytes, MapTable::EMPTY) != 0)
+          return -1;
+        group = (group + step) & (groups - 1);
+      }
+    }
+
+    // Puts the entry in the first empty slot of the probe sequence
+    static void Place(MapTable* table, uint64_t hash, int32_t entry)
+    {
+      uint8_t* control = table->Control();
+      uint32_t groups = table->capacity / MapTable::GROUP;
+      uint32_t group = (hash >> 7) & (groups - 1);
+      for(uint32_t step = 1;;step++)
+      {
+        uint32_t mask = Match(control + group * MapTable::GROUP, MapTable::EMPTY);
+        if(mask != 0)
+        {
+          uint32_t slot = group * MapTable::GROUP + __builtin_ctz(mask);
+          control[slot] = hash & 0x7f;
+          table->Slots()[slot] = entry;
+          return;
+        }
+        group = (group + step) & (groups - 1);
+      }
+    }
+
+    static void SetValue(Map* map, int32_t entry, Value value)
+    {
+      int size = map->ValueSize();
+      memcpy(map->table->Values(map->KeySize()) + (size_t)entry * size, &value, size);
+    }
+
+    // Replaces the table with one of twice the capacity
+    static bool Grow(Heap& heap, Map* map)
+    {
+      MapTable* old = map->table;
+      uint32_t capacity = old ? old->capacity * 2 : MapTable::GROUP;
+      int keySize = map->KeySize();
+      int valueSize = map->ValueSize();
+      MapTable* table = heap.AllocateMapTable(capacity, keySize, valueSize);
+      if(table == nullptr)
+        return false;
+      if(old)
+      {
+        memcpy(table->Keys(), old->Keys(), (size_t)map->length * keySize);
+        memcpy(table->Values(keySize), old->Values(keySize), (size_t)map->length * valueSize);
+      }
+      for(int32_t i = 0;i<map->length;i++)
+      {
+        if(map->kind & Map::STRING_KEYS)
+        {
+          String key;
+          memcpy(&key, table->Keys() + (size_t)i * sizeof(String), sizeof(String));
+          Place(table, Hash(key), i);
+        }
+        else
+        {
+          int32_t key;
+          memcpy(&key, table->Keys() + (size_t)i * sizeof(int32_t), sizeof(int32_t));
+          Place(table, Hash(key), i);
+        }
+      }
+      map->table = table;
+      return true;
+    }
+};
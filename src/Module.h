@@ -0,0 +1,341 @@
+#pragma once
+
+#include "Ast.h"
+#include "Bytecode.h"
+#include "CCodegen.h"
+#include "Compiler.h"
+#include "Context.h"
+#include "Image.h"
+#include "Lexer.h"
+#include "Linker.h"
+#include "Native.h"
+#include "Parser.h"
+#include "Scheduler.h"
+#include "TypeInfo.h"
+#include "Vm.h"
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Ret, typename... Args>
+struct HostBinding
+{
+  static void Invoke(void(*function)(), Value* args, Heap& heap)
+  {
+    Invoke(reinterpret_cast<Ret(*)(Args...)>(function), args, heap, std::index_sequence_for<Args...>{});
+  }
+
+  template <size_t... I>
+  static void Invoke(Ret(*function)(Args...), Value* args, Heap& heap, std::index_sequence<I...>)
+  {
+    if constexpr(std::is_void_v<Ret>)
+      function(TypeInfoOf<Args>::FromValue(args[I])...);
+    else
+      args[0] = TypeInfo<Ret>::ToValue(function(TypeInfoOf<Args>::FromValue(args[I])...), heap);
+  }
+};
+
+class Module;
+
+template <typename Signature>
+class ScriptFunction;
+
+// Handle to a compiled script function, the signature is verified once when
+// the handle is created so calls don't check any types.
+template <typename Ret, typename... Args>
+class ScriptFunction<Ret(Args...)>
+{
+  private:
+    Program* program;
+    Vm* vm;
+    int index;
+
+  public:
+    ScriptFunction()
+      : program{nullptr}, vm{nullptr}, index{-1}
+    {}
+
+    ScriptFunction(Program* program, Vm* vm, int index)
+      : program{program}, vm{vm}, index{index}
+    {}
+
+    bool IsValid() const
+    {
+      return index != -1;
+    }
+
+    // Returns false if the script failed with a runtime error. The result is
+    // only written for non-void functions.
+    template <typename Result = Ret>
+    bool Call(std::enable_if_t<!std::is_void_v<Result>, Result>& result, Args... args)
+    {
+      return CallIn(*vm, result, args...);
+    }
+
+    template <typename Result = Ret, typename = std::enable_if_t<std::is_void_v<Result>>>
+    bool Call(Args... args)
+    {
+      return CallIn(*vm, args...);
+    }
+
+    // Runs the call in the context instead of the vm of the module. Returns
+    // false if it failed, context.GetError() tells if a limit was hit.
+    template <typename Result = Ret>
+    bool Call(Context& context, std::enable_if_t<!std::is_void_v<Result>, Result>& result, Args... args)
+    {
+      return CallIn(context.GetVm(), result, args...);
+    }
+
+    template <typename Result = Ret, typename = std::enable_if_t<std::is_void_v<Result>>>
+    bool Call(Context& context, Args... args)
+    {
+      return CallIn(context.GetVm(), args...);
+    }
+
+    // Runs the call as a task on the scheduler, the result is read from the
+    // task once it is done
+    std::shared_ptr<Task> Spawn(Scheduler& scheduler, Args... args)
+    {
+      std::shared_ptr<Task> task = std::make_shared<Task>(*program, index);
+      if(Value* regs = task->Arguments())
+      {
+        size_t i = 0;
+        ((regs[i++] = TypeInfoOf<Args>::ToValue(args, task->GetHeap())), ...);
+      }
+      scheduler.Submit(task);
+      return task;
+    }
+
+  private:
+    template <typename Result = Ret>
+    bool CallIn(Vm& vm, std::enable_if_t<!std::is_void_v<Result>, Result>& result, Args... args)
+    {
+      vm.Enter();
+      Value* regs = Run(vm, args...);
+      if(regs)
+        result = TypeInfo<Ret>::FromValue(regs[0]);
+      vm.Leave();
+      return regs != nullptr;
+    }
+
+    template <typename Result = Ret, typename = std::enable_if_t<std::is_void_v<Result>>>
+    bool CallIn(Vm& vm, Args... args)
+    {
+      vm.Enter();
+      bool success = Run(vm, args...) != nullptr;
+      vm.Leave();
+      return success;
+    }
+
+    // Returns the registers holding the result or nullptr if the call failed
+    Value* Run(Vm& vm, Args... args)
+    {
+      Value* regs = vm.Reserve(*program, index);
+      if(regs == nullptr)
+        return nullptr;
+      size_t i = 0;
+      ((regs[i++] = TypeInfoOf<Args>::ToValue(args, vm.heap)), ...);
+      return vm.Call(*program, index, regs) ? regs : nullptr;
+    }
+};
+
+class Module
+{
+  private:
+    Program program;
+    // Outlives the vm, whose loops may run on it
+    std::unique_ptr<ParallelPool> parallelPool;
+    Vm vm;
+    NativeLibrary native;
+    std::vector<AstFunction*> functions;
+    CompileOptions options;
+    bool linked = false;
+
+  public:
+    Module() = default;
+    // Functions compiled lazily refer to the program of the module
+    Module(const Module&) = delete;
+    Module& operator=(const Module&) = delete;
+
+    // Options used by the following calls to Compile and Load
+    CompileOptions& Options()
+    {
+      return options;
+    }
+
+    // Makes a host function callable from the scripts. Scripts compiled
+    // before the function is bound must declare it, such as "int f(int a);".
+    // Lambdas without captures can be bound with
+    // BindFunction("name", +[](int a) { ... }).
+    template <typename Ret, typename... Args>
+    bool BindFunction(const std::string& name, Ret(*function)(Args...))
+    {
+      static_assert(TypeInfo<Ret>::type != Type::INVALID, "Unsupported return type");
+      static_assert(((TypeInfoOf<Args>::type != Type::INVALID && TypeInfoOf<Args>::type != Type::VOID) && ...), "Unsupported argument type");
+
+      for(const HostFunction& host : program.hostFunctions)
+      {
+        if(host.name == name)
+        {
+          std::cerr << "Host function " << name << " is already bound" << std::endl;
+          return false;
+        }
+      }
+      program.hostFunctions.push_back({name, TypeInfo<Ret>::type, {TypeInfoOf<Args>::type...},
+          &HostBinding<Ret, Args...>::Invoke, reinterpret_cast<void(*)()>(function)});
+      linked = false;
+      return true;
+    }
+
+    bool Compile(const std::string& source)
+    {
+      std::istringstream stream{source};
+      return Compile(stream);
+    }
+
+    bool Compile(std::istream& source)
+    {
+      std::vector<AstFunction*> parsed;
+      ParseOptions parseOptions;
+      parseOptions.shareExpressions = options.shareExpressions;
+      if(options.lazy)
+      {
+        if(!Parser::ParseLazy(std::make_shared<const std::vector<TokenPos>>(Lexer::Read(source)), parsed, parseOptions))
+          return false;
+      }
+      else if(!Parser::Parse(Lexer::Read(source), parsed, parseOptions))
+        return false;
+      return Load(parsed);
+    }
+
+    // Checks and compiles already parsed functions into the module
+    bool Load(const std::vector<AstFunction*>& parsed)
+    {
+      if(!Compiler::Compile(program, parsed, options))
+        return false;
+      functions.insert(functions.end(), parsed.begin(), parsed.end());
+      linked = false;
+      return true;
+    }
+
+    // Resolves the calls to declared functions. Done by GetFunction if
+    // needed, calling it directly reports link errors earlier.
+    bool Link()
+    {
+      linked = Linker::Link(program);
+      return linked;
+    }
+
+    // Writes the compiled program to an image, functions compiled lazily
+    // must have been called
+    bool SaveImage(const std::string& path)
+    {
+      if(!linked && !Link())
+        return false;
+      return Image::Save(program, path);
+    }
+
+    // Loads an image instead of compiling, into a module that hasn't
+    // compiled anything. The host functions used by the image must be bound
+    // first.
+    bool LoadImage(const std::string& path)
+    {
+      if(!Image::Load(program, path))
+        return false;
+      linked = false;
+      return true;
+    }
+
+    // Writes the program as C to be compiled ahead of time, see CCodegen
+    bool WriteC(std::ostream& os)
+    {
+      if(!linked && !Link())
+        return false;
+      return CCodegen::Generate(program, os);
+    }
+
+    // Runs the functions as native code from a shared library built from the
+    // C written by WriteC for the same scripts
+    bool LoadNative(const std::string& path)
+    {
+      if(!linked && !Link())
+        return false;
+      return native.Load(program, path);
+    }
+
+    AstFunction* FindFunction(const std::string& name)
+    {
+      for(AstFunction* function : functions)
+      {
+        if(function->name->name == name && !function->IsDeclaration())
+          return function;
+      }
+      return nullptr;
+    }
+
+    // Returns an invalid handle if the function doesn't exist, its
+    // signature doesn't match or the program can't be linked
+    template <typename Signature>
+    ScriptFunction<Signature> GetFunction(const std::string& name)
+    {
+      if(!linked && !Link())
+        return {};
+      return GetFunction(name, (Signature*)nullptr);
+    }
+
+    // Samples the calls made through the handles of the module
+    void SetProfiler(Profiler* profiler)
+    {
+      vm.SetProfiler(profiler);
+    }
+
+    void SetHeapProfiler(HeapProfiler* profiler)
+    {
+      vm.SetHeapProfiler(profiler);
+    }
+
+    // Threads that the #parallel loops of calls made through the handles of
+    // the module run on, the calling thread included
+    void SetParallelThreads(int threads)
+    {
+      parallelPool.reset();
+      if(threads > 1)
+        parallelPool = std::make_unique<ParallelPool>(threads);
+      vm.SetParallelPool(parallelPool.get());
+    }
+
+    const Program& GetProgram() const
+    {
+      return program;
+    }
+
+    // Heap of the calls made through the handles of the module
+    Heap& GetHeap()
+    {
+      return vm.heap;
+    }
+
+  private:
+    template <typename Ret, typename... Args>
+    ScriptFunction<Ret(Args...)> GetFunction(const std::string& name, Ret(*)(Args...))
+    {
+      for(size_t i = 0;i<program.functions.size();i++)
+      {
+        const CompiledFunction& function = program.functions[i];
+        if(function.name != name)
+          continue;
+        if(function.returnType != TypeInfo<Ret>::type || function.params != std::vector<Type>{TypeInfoOf<Args>::type...})
+        {
+          std::cerr << "Signature of " << name << " doesn't match the script function" << std::endl;
+          return {};
+        }
+        return {&program, &vm, (int)i};
+      }
+      std::cerr << "Undefined function " << name << std::endl;
+      return {};
+    }
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "Value.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <dlfcn.h>
+
+class Vm;
+
+// Interface between the vm and functions compiled to C by CCodegen. The
+// generated code declares the same struct in C, see CCodegen::PRELUDE, so
+// the two must be changed together and NATIVE_ABI bumped. Everything that
+// allocates, fails or leaves the generated code goes through the vm.
+struct NativeRuntime
+{
+  Vm* vm;
+  const Program* program;
+  const String* strings;
+  Array* emptyArray;
+  int32_t depth;
+  int32_t maxDepth;
+  // Set by fail, compiled functions return as soon as it is set
+  int32_t failed;
+  // Reports a runtime error in program->functions[function], kind is a
+  // VmError. The functions that allocate call it and return null on failure.
+  void (*fail)(NativeRuntime* runtime, int32_t function, const char* message, int32_t kind);
+  String (*concat)(NativeRuntime* runtime, int32_t function, String left, String right);
+  String (*substring)(NativeRuntime* runtime, int32_t function, String str, int32_t start, int32_t count);
+  Array* (*newArray)(NativeRuntime* runtime, int32_t function, int32_t length, int32_t elementSize);
+  void (*callHost)(NativeRuntime* runtime, int32_t host, Value* args);
+  // Returns 0 if an index is out of bounds
+  int (*vectorLoop)(NativeRuntime* runtime, int32_t function, int32_t loop, Value* operands);
+  // Runs the body of a parallel loop in the vm, returns 0 once the failure
+  // has been reported
+  int (*parallelFor)(NativeRuntime* runtime, int32_t function, int32_t loop, Value* operands);
+  // Runs a map instruction other than MAP_LENGTH on the registers, returns 0
+  // once the failure has been reported
+  int (*map)(NativeRuntime* runtime, int32_t function, int32_t opcode, Value* regs, int32_t a, int32_t b, int32_t c);
+  // Runs a Builtin on the arguments, returns 0 once the failure has been
+  // reported
+  int (*builtin)(NativeRuntime* runtime, int32_t function, int32_t builtin, Value* args);
+};
+
+static const uint32_t NATIVE_ABI = 4;
+// Calls nested in compiled code, which runs on the stack of the host thread.
+// Enough for small frames on a stack of 8 MB.
+static const int32_t NATIVE_MAX_DEPTH = 1 << 17;
+
+static_assert(sizeof(Value) == 8 && sizeof(String) == 8, "Compiled code stores every register in 8 bytes");
+static_assert(sizeof(Array) == 32, "Compiled code expects the elements of an array 32 bytes after the header");
+static_assert(offsetof(Map, length) == 0 && offsetof(Array, length) == 0, "Compiled code reads the length of arrays and maps alike");
+
+// Shared library built from the C written by CCodegen for a program. Loading
+// it replaces every function of the program by a stub calling the compiled
+// function, so the program is called as before. The library must outlive
+// the calls.
+class NativeLibrary
+{
+  private:
+    struct Closer
+    {
+      void operator()(void* handle)
+      {
+        dlclose(handle);
+      }
+    };
+
+    std::unique_ptr<void, Closer> handle;
+
+  public:
+    // The program must be the one the C was written for, with the same host
+    // functions bound first
+    bool Load(Program& program, const std::string& path)
+    {
+      handle.reset(dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL));
+      if(handle == nullptr)
+      {
+        std::cerr << "Failed to load " << path << ": " << dlerror() << std::endl;
+        return false;
+      }
+      auto abi = static_cast<const uint32_t*>(dlsym(handle.get(), "gr_abi"));
+      auto names = static_cast<const char* const*>(dlsym(handle.get(), "gr_function_names"));
+      auto hosts = static_cast<const char* const*>(dlsym(handle.get(), "gr_host_names"));
+      auto functions = static_cast<const NativeFunction*>(dlsym(handle.get(), "gr_functions"));
+      if(!abi || !names || !hosts || !functions || *abi != NATIVE_ABI)
+      {
+        std::cerr << path << " wasn't compiled by this version" << std::endl;
+        return false;
+      }
+
+      size_t count = 0;
+      for(;names[count];count++)
+      {
+        if(count == program.functions.size() || program.functions[count].name != names[count])
+          break;
+      }
+      size_t hostCount = 0;
+      for(;hosts[hostCount];hostCount++)
+      {
+        if(hostCount == program.hostFunctions.size() || program.hostFunctions[hostCount].name != hosts[hostCount])
+          break;
+      }
+      if(names[count] || count != program.functions.size() || hosts[hostCount])
+      {
+        std::cerr << path << " was compiled for another program" << std::endl;
+        return false;
+      }
+
+      for(size_t i = 0;i<count;i++)
+      {
+        CompiledFunction& function = program.functions[i];
+        function.native = functions[i];
+        function.code = {{Opcode::CALL_NATIVE, (int32_t)i, 0, 0}, {Opcode::RETURN, 0, 0, 0}};
+        function.stackMaps.clear();
+        function.lines.Truncate(function.code.size());
+      }
+      return true;
+    }
+};
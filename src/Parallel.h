@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that #parallel loops run on, see Vm::SetParallelPool. The
+// iterations of a loop are split into one share per thread, the calling
+// thread included, and every share into chunks. A thread runs the chunks of
+// its own share in order and then takes the chunks left in the shares of the
+// other threads, so a thread that falls behind holds up the loop by at most a
+// chunk. The pool runs one loop at a time, TryRun fails while it is busy.
+class ParallelPool
+{
+  public:
+    // Chunks the share of every thread is split into
+    static const int CHUNKS_PER_THREAD = 8;
+
+    // Runs the iterations [begin, end), which are the chunk:th chunk of the
+    // loop, on the thread. Thread 0 is the calling thread. Returning false
+    // stops the threads from taking more chunks.
+    using Task = std::function<bool(int thread, int64_t begin, int64_t end, size_t chunk)>;
+
+  private:
+    struct alignas(64) Share
+    {
+      std::atomic<size_t> next;
+      size_t end;
+    };
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Share[]> shares;
+    int threads;
+    std::atomic<bool> busy;
+    // Guards the loop being run and the state of the workers
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const Task* task;
+    int64_t count;
+    int64_t grain;
+    // Incremented for every loop, the workers wait for it to change
+    uint64_t generation;
+    int running;
+    bool stopping;
+    std::atomic<bool> failed;
+
+  public:
+    // Starts threads - 1 workers
+    explicit ParallelPool(int threads)
+      : shares{new Share[std::max(threads, 1)]}, threads{std::max(threads, 1)}, busy{false}, task{nullptr}, count{0},
+        grain{1}, generation{0}, running{0}, stopping{false}, failed{false}
+    {
+      for(int i = 1;i<this->threads;i++)
+        workers.emplace_back([this, i] { Work(i); });
+    }
+
+    ~ParallelPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+      }
+      wake.notify_all();
+      for(std::thread& worker : workers)
+        worker.join();
+    }
+
+    ParallelPool(const ParallelPool&) = delete;
+    ParallelPool& operator=(const ParallelPool&) = delete;
+
+    int Threads() const
+    {
+      return threads;
+    }
+
+    // Number of chunks a loop of count iterations is split into
+    size_t Chunks(int64_t count) const
+    {
+      int64_t size = Grain(count);
+      return (count + size - 1) / size;
+    }
+
+    // Runs the task for every chunk of count iterations and returns once all
+    // are done. Returns false without running anything if the pool is running
+    // another loop, such as when a task starts a loop of its own. Success is
+    // set to false if a task returned false.
+    bool TryRun(int64_t count, const Task& task, bool& success)
+    {
+      if(busy.exchange(true))
+        return false;
+      {
+        std::lock_guard<std::mutex> lock{mutex};
+        this->task = &task;
+        this->count = count;
+        grain = Grain(count);
+        size_t chunks = Chunks(count);
+        for(int i = 0;i<threads;i++)
+        {
+          shares[i].next = chunks * i / threads;
+          shares[i].end = chunks * (i + 1) / threads;
+        }
+        failed = false;
+        running = threads - 1;
+        generation++;
+      }
+      wake.notify_all();
+      Run(0);
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        done.wait(lock, [&] { return running == 0; });
+        this->task = nullptr;
+      }
+      success = !failed;
+      busy = false;
+      return true;
+    }
+
+  private:
+    int64_t Grain(int64_t count) const
+    {
+      return std::max<int64_t>(1, count / ((int64_t)threads * CHUNKS_PER_THREAD));
+    }
+
+    void Work(int thread)
+    {
+      uint64_t seen = 0;
+      while(true)
+      {
+        {
+          std::unique_lock<std::mutex> lock{mutex};
+          wake.wait(lock, [&] { return stopping || generation != seen; });
+          if(stopping)
+            return;
+          seen = generation;
+        }
+        Run(thread);
+        {
+          std::lock_guard<std::mutex> lock{mutex};
+          running--;
+        }
+        done.notify_one();
+      }
+    }
+
+    // Takes the chunks of the thread's share and then those of the others
+    void Run(int thread)
+    {
+      for(int i = 0;i<threads && !failed;i++)
+      {
+        Share& share = shares[(thread + i) % threads];
+        while(!failed)
+        {
+          size_t chunk = share.next++;
+          if(chunk >= share.end)
+            break;
+          int64_t begin = chunk * grain;
+          int64_t end = std::min(begin + grain, count);
+          if(!(*task)(thread, begin, end, chunk))
+            failed = true;
+        }
+      }
+    }
+};
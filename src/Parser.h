@@ -3,6 +3,9 @@
 #include "Token.h"
 #include "Ast.h"
 
+#include <cstdlib>
+#include <memory>
+#include <unordered_set>
 #include <vector>
 #include <iostream>
 
@@ -14,12 +17,46 @@
   return nullptr; \
 }
 
+struct ParseOptions
+{
+  // Structurally identical expressions without side effects are created once
+  // per function and shared, which saves memory on generated scripts that
+  // repeat the same expressions. Shared expressions keep the position of
+  // their first occurrence.
+  bool shareExpressions = false;
+};
+
+struct ExpressionHash
+{
+  size_t operator()(const AstExpression* expression) const
+  {
+    return expression->Hash();
+  }
+};
+
+struct ExpressionEqual
+{
+  bool operator()(const AstExpression* left, const AstExpression* right) const
+  {
+    return left->Equals(right);
+  }
+};
+
+using ExpressionTable = std::unordered_set<AstExpression*, ExpressionHash, ExpressionEqual>;
+
 struct ParseData
 {
   const std::vector<TokenPos>& tokens;
   size_t pos;
-  ParseData(const std::vector<TokenPos>& tokens)
-    : tokens{tokens}, pos{0}
+  bool shareExpressions;
+  // Expressions of the current function
+  ExpressionTable expressions;
+  // Changes after every declaration and at the end of every scope, so
+  // variables read with the same name and binding refer to the same
+  // declaration. Follows the order the declarations are checked in.
+  uint32_t binding;
+  ParseData(const std::vector<TokenPos>& tokens, bool shareExpressions = false)
+    : tokens{tokens}, pos{0}, shareExpressions{shareExpressions}, binding{0}
   {}
 
   bool Read(Token token)
@@ -47,51 +84,169 @@ struct ParseData
 
   Token Top()
   {
+    if(pos >= tokens.size())
+      return Token::INVALID;
     return tokens[pos].token;
   }
 
   TokenPos TopPos()
   {
+    if(pos >= tokens.size())
+      return tokens.empty() ? TokenPos{Token::INVALID, 0, 0} : tokens.back();
     return tokens[pos];
   }
+
+  // Value of the token that was just read
+  const std::string& Value()
+  {
+    return tokens[pos - 1].value;
+  }
 };
 
 class Parser
 {
   public:
-    static bool Parse(const std::vector<TokenPos>& tokens)
+    static bool Parse(const std::vector<TokenPos>& tokens, std::vector<AstFunction*>& functions, const ParseOptions& options = {})
+    {
+      return Parse(tokens, functions, options, nullptr);
+    }
+
+    // Only parses the signatures, the body of every function is skipped by
+    // matching braces and parsed by ParseBody when the function is first
+    // compiled. Errors in a body are reported once it is parsed. The
+    // functions keep the tokens alive until then.
+    static bool ParseLazy(std::shared_ptr<const std::vector<TokenPos>> tokens, std::vector<AstFunction*>& functions, const ParseOptions& options = {})
+    {
+      return Parse(*tokens, functions, options, &tokens);
+    }
+
+    // Parses the body skipped by ParseLazy, does nothing for other functions
+    static bool ParseBody(AstFunction* function)
     {
-      ParseData data{tokens};
+      if(!function->IsLazy())
+        return true;
+      ParseData data{*function->lazyTokens, function->lazyShareExpressions};
+      data.Backtrack(function->lazyBegin);
+      AstStatements* body = Body(data);
+      if(body == nullptr)
+      {
+        std::cerr << "Failed to parse body of " << function->name->name << std::endl;
+        return false;
+      }
+      function->body = body;
+      function->lazyTokens = nullptr;
+      return true;
+    }
+
+  private:
+    static bool Parse(const std::vector<TokenPos>& tokens, std::vector<AstFunction*>& functions, const ParseOptions& options,
+        const std::shared_ptr<const std::vector<TokenPos>>* lazyTokens)
+    {
+      if(tokens.size() == 1 && tokens[0].token == Token::INVALID)
+        return false;
+
+      ParseData data{tokens, options.shareExpressions};
       while(!data.Empty())
       {
-        AstFunction* func = Function(data);
+        AstFunction* func = Function(data, lazyTokens);
         if(func == nullptr)
         {
           std::cerr << "Failed to parse file" << std::endl;
           std::cerr << "Invalid symbol at " << data.TopPos() << std::endl;
           return false;
         }
-        std::cout << func << std::endl;
+        functions.push_back(func);
       }
       return true;
     }
 
-  private:
+    template <typename T>
+    static T* At(T* node, const TokenPos& pos)
+    {
+      node->pos = pos;
+      return node;
+    }
+
+    // Creates the expression unless an equal one already exists
+    template <typename T>
+    static T* Share(ParseData& data, T&& node, const TokenPos& pos)
+    {
+      if(!data.shareExpressions || !node.IsShareable())
+        return At(new T(std::move(node)), pos);
+      auto it = data.expressions.find(&node);
+      if(it != data.expressions.end())
+        return static_cast<T*>(*it);
+      T* shared = At(new T(std::move(node)), pos);
+      data.expressions.insert(shared);
+      return shared;
+    }
 
-    // FUNC -> FTYPE name ( FPARAMS ) { Ss }
-    static AstFunction* Function(ParseData& data)
+    static AstVariable* Variable(ParseData& data, const std::string& name, const TokenPos& pos)
     {
+      AstVariable variable{name};
+      variable.binding = data.binding;
+      return Share(data, std::move(variable), pos);
+    }
+
+    // FUNC -> FTYPE name ( FPARAMS ) { BODY
+    //      -> FTYPE name ( FPARAMS ) ;
+    static AstFunction* Function(ParseData& data, const std::shared_ptr<const std::vector<TokenPos>>* lazyTokens)
+    {
+      TokenPos pos = data.TopPos();
       Type type;
       if((type = FunctionType(data)) == Type::INVALID)
         return nullptr;
       VALID_TOKEN(Token::NAME);
+      std::string name = data.Value();
       VALID_TOKEN(Token::OPEN_PARAM);
       VALID_PRODUCTION(AstFuncParams, params, FunctionParams(data));
       VALID_TOKEN(Token::CLOSE_PARAM);
+      // Declaration of a function defined elsewhere
+      if(data.Read(Token::SEMICOLON))
+        return At(new AstFunction(At(new AstName(type, name), pos), params, nullptr), pos);
       VALID_TOKEN(Token::OPEN_CURLY);
+      if(lazyTokens)
+      {
+        AstFunction* function = At(new AstFunction(At(new AstName(type, name), pos), params, nullptr), pos);
+        function->lazyTokens = *lazyTokens;
+        function->lazyBegin = data.pos;
+        function->lazyShareExpressions = data.shareExpressions;
+        if(!SkipBody(data))
+          return nullptr;
+        return function;
+      }
+      VALID_PRODUCTION(AstStatements, body, Body(data));
+      return At(new AstFunction(At(new AstName(type, name), pos), params, body), pos);
+    }
+
+    // BODY -> Ss }
+    static AstStatements* Body(ParseData& data)
+    {
+      // Functions are checked on different threads, so they can't share
+      // expressions
+      data.expressions.clear();
       VALID_PRODUCTION(AstStatements, body, Statements(data));
       VALID_TOKEN(Token::CLOSE_CURLY);
-      return new AstFunction(new AstName(type), params, body);
+      return body;
+    }
+
+    // Moves past the brace closing the body without parsing it
+    static bool SkipBody(ParseData& data)
+    {
+      int depth = 1;
+      for(;data.pos < data.tokens.size();data.pos++)
+      {
+        Token token = data.tokens[data.pos].token;
+        if(token == Token::OPEN_CURLY)
+          depth++;
+        else if(token == Token::CLOSE_CURLY && --depth == 0)
+        {
+          data.pos++;
+          return true;
+        }
+      }
+      std::cerr << "Missing closing brace at " << data.TopPos() << std::endl;
+      return false;
     }
 
     // Ss -> S
@@ -102,26 +257,63 @@ class Parser
       if(statements->first == nullptr)
         return statements;
 
+      AstStatements* last = statements;
       AstStatement* statement;
       while((statement = Statement(data)) != nullptr)
       {
-        statements->tail = new AstStatements(statement, nullptr);
+        last->tail = new AstStatements(statement, nullptr);
+        last = last->tail;
       }
       return statements;
     }
 
     // S -> IF
-    //   -> for ( EA ; E ; EA ) { Ss }
-    //   -> while ( E ) { Ss }
+    //   -> PARALLEL
+    //   -> for ( PRIM name in RANGE ) CFBODY
+    //   -> for ( PRIM name in EL ) CFBODY
+    //   -> for ( E ; E ; E ) CFBODY
+    //   -> while ( E ) CFBODY
+    //   -> return ;
+    //   -> return E ;
+    //   -> ;
+    //   -> E ;
     static AstStatement* Statement(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       if(data.Top() == Token::IF)
       {
         return StatementIf(data);
       }
+      else if(data.Top() == Token::HASH)
+      {
+        return StatementParallel(data);
+      }
       else if(data.Read(Token::FOR))
       {
         VALID_TOKEN(Token::OPEN_PARAM);
+        size_t initPos = data.pos;
+        TokenPos namePos = data.TopPos();
+        Type type = Primitive(data);
+        if(type != Type::INVALID && data.Read(Token::NAME) && data.Top() == Token::IN)
+        {
+          AstName* name = At(new AstName(type, data.Value()), namePos);
+          VALID_TOKEN(Token::IN);
+          if(data.TopPos().value != "range")
+          {
+            VALID_PRODUCTION(AstExpression, array, ExpressionLogical(data));
+            VALID_TOKEN(Token::CLOSE_PARAM);
+            data.binding++;
+            VALID_PRODUCTION(AstStatements, body, ControlFlowBody(data));
+            return At(new AstForEach(name, array, body), pos);
+          }
+          VALID_PRODUCTION(AstRange, range, Range(data));
+          VALID_TOKEN(Token::CLOSE_PARAM);
+          data.binding++;
+          VALID_PRODUCTION(AstStatements, body, ControlFlowBody(data));
+          return At(new AstForRange(name, range, body), pos);
+        }
+        data.Backtrack(initPos);
+
         VALID_PRODUCTION(AstExpression, init, Expression(data));
         VALID_TOKEN(Token::SEMICOLON);
         VALID_PRODUCTION(AstExpression, until, Expression(data));
@@ -129,7 +321,7 @@ class Parser
         VALID_PRODUCTION(AstExpression, next, Expression(data));
         VALID_TOKEN(Token::CLOSE_PARAM);
         VALID_PRODUCTION(AstStatements, body, ControlFlowBody(data));
-        return new AstStatement();
+        return At(new AstFor(init, until, next, body), pos);
       }
       else if(data.Read(Token::WHILE))
       {
@@ -137,21 +329,26 @@ class Parser
         VALID_PRODUCTION(AstExpression, until, Expression(data));
         VALID_TOKEN(Token::CLOSE_PARAM);
         VALID_PRODUCTION(AstStatements, body, ControlFlowBody(data));
-        return new AstStatement();
+        return At(new AstWhile(until, body), pos);
       }
       else if(data.Read(Token::RETURN))
       {
-        AstNode* node = Expression(data);
+        AstExpression* node = nullptr;
+        if(data.Top() != Token::SEMICOLON)
+        {
+          node = Expression(data);
+          if(node == nullptr)
+            return nullptr;
+        }
         VALID_TOKEN(Token::SEMICOLON);
-        return new AstStatement();
+        return At(new AstReturn(node), pos);
       }
       else if(data.Read(Token::SEMICOLON))
       {
-        return new AstExpressionImpl();
+        return At(new AstStatement(), pos);
       }
       else
       {
-        int pos = data.pos;
         AstExpression* node = Expression(data);
         if(node != nullptr)
         {
@@ -164,10 +361,96 @@ class Parser
       return nullptr;
     }
 
+    // PARALLEL -> # parallel for ( PRIM name in RANGE ) CFBODY
+    //          -> # parallel ( REDS ) for ( PRIM name in RANGE ) CFBODY
+    // REDS -> RED name
+    //      -> RED name , REDS
+    // RED -> sum | min | max
+    static AstStatement* StatementParallel(ParseData& data)
+    {
+      TokenPos pos = data.TopPos();
+      VALID_TOKEN(Token::HASH);
+      VALID_TOKEN(Token::NAME);
+      if(data.Value() != "parallel")
+      {
+        std::cerr << "Expected parallel at " << pos << std::endl;
+        return nullptr;
+      }
+      std::vector<AstParallelFor::ReductionName> reductions;
+      if(data.Read(Token::OPEN_PARAM))
+      {
+        do
+        {
+          TokenPos kindPos = data.TopPos();
+          VALID_TOKEN(Token::NAME);
+          ReductionKind kind;
+          if(data.Value() == "sum")
+            kind = ReductionKind::SUM;
+          else if(data.Value() == "min")
+            kind = ReductionKind::MIN;
+          else if(data.Value() == "max")
+            kind = ReductionKind::MAX;
+          else
+          {
+            std::cerr << "Expected sum, min or max at " << kindPos << std::endl;
+            return nullptr;
+          }
+          VALID_TOKEN(Token::NAME);
+          reductions.push_back({kind, data.Value(), -1});
+        } while(data.Read(Token::COMMA));
+        VALID_TOKEN(Token::CLOSE_PARAM);
+      }
+
+      VALID_TOKEN(Token::FOR);
+      VALID_TOKEN(Token::OPEN_PARAM);
+      TokenPos namePos = data.TopPos();
+      Type type = Primitive(data);
+      if(type == Type::INVALID)
+      {
+        std::cerr << "Expected a range loop at " << namePos << std::endl;
+        return nullptr;
+      }
+      VALID_TOKEN(Token::NAME);
+      AstName* name = At(new AstName(type, data.Value()), namePos);
+      VALID_TOKEN(Token::IN);
+      VALID_PRODUCTION(AstRange, range, Range(data));
+      VALID_TOKEN(Token::CLOSE_PARAM);
+      data.binding++;
+      VALID_PRODUCTION(AstStatements, body, ControlFlowBody(data));
+      return At(new AstParallelFor(name, range, body, reductions), pos);
+    }
+
+    // RANGE -> range ( E , E )
+    //       -> range ( E , E , E )
+    static AstRange* Range(ParseData& data)
+    {
+      TokenPos pos = data.TopPos();
+      VALID_TOKEN(Token::NAME);
+      if(data.Value() != "range")
+      {
+        std::cerr << "Expected range at " << pos << std::endl;
+        return nullptr;
+      }
+      VALID_TOKEN(Token::OPEN_PARAM);
+      VALID_PRODUCTION(AstExpression, start, Expression(data));
+      VALID_TOKEN(Token::COMMA);
+      VALID_PRODUCTION(AstExpression, end, Expression(data));
+      AstExpression* step = nullptr;
+      if(data.Read(Token::COMMA))
+      {
+        step = Expression(data);
+        if(step == nullptr)
+          return nullptr;
+      }
+      VALID_TOKEN(Token::CLOSE_PARAM);
+      return At(new AstRange(start, end, step), pos);
+    }
+
     // IF -> if ( E ) CFBODY
     //    -> if ( E ) CFBODY ELSE
     static AstIf* StatementIf(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       VALID_TOKEN(Token::IF);
       VALID_TOKEN(Token::OPEN_PARAM);
       VALID_PRODUCTION(AstExpression, condition, Expression(data));
@@ -177,9 +460,9 @@ class Parser
       if(data.Top() == Token::ELSE)
       {
         VALID_PRODUCTION(AstStatements, elseBody, StatementElse(data));
-        return new AstIf(condition, body, elseBody);
+        return At(new AstIf(condition, body, elseBody), pos);
       }
-      return new AstIf(condition, body);
+      return At(new AstIf(condition, body), pos);
     }
 
     // ELSE -> else CFBODY
@@ -190,148 +473,186 @@ class Parser
       return body;
     }
 
-    // E -> LVALD = EL
+    // E -> TYPE name = EL
+    //   -> TYPE name
+    //   -> LVAL = EL
     //   -> EL
     static AstExpression* Expression(ParseData& data)
     {
-      int pos = data.pos;
-      if(LValueDefine(data))
+      size_t pos = data.pos;
+      TokenPos topPos = data.TopPos();
+      Type type = VariableType(data);
+      if(type != Type::INVALID && data.Top() == Token::NAME)
       {
+        VALID_TOKEN(Token::NAME);
+        AstName* name = At(new AstName(type, data.Value()), topPos);
+        AstExpression* value = nullptr;
         if(data.Read(Token::ASSIGN))
         {
-          return ExpressionLogical(data);
+          value = ExpressionLogical(data);
+          if(value == nullptr)
+            return nullptr;
         }
-        else
+        data.binding++;
+        return At(new AstDeclaration(name, value), topPos);
+      }
+      // Types not followed by a name are expressions such as int[n]
+      data.Backtrack(pos);
+
+      AstExpression* lvalue = LValue(data);
+      if(lvalue)
+      {
+        if(data.Read(Token::ASSIGN))
         {
-          // Go back since there was no assignment
-          data.Backtrack(pos);
+          VALID_PRODUCTION(AstExpression, value, ExpressionLogical(data));
+          AstVariable* variable = dynamic_cast<AstVariable*>(lvalue);
+          if(variable == nullptr)
+            return At(new AstAssignIndex(static_cast<AstIndex*>(lvalue), value), topPos);
+          return At(new AstAssign(variable, value), topPos);
         }
       }
+      // Go back since there was no assignment
+      data.Backtrack(pos);
       return ExpressionLogical(data);
     }
 
-    // EL -> EC && EL
+    // EL -> EC
+    //    -> EC && EL
     //    -> EC || EL
     static AstExpression* ExpressionLogical(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       VALID_PRODUCTION(AstExpression, left, ExpressionCompare(data));
       if(data.Read(Token::AND))
       {
         VALID_PRODUCTION(AstExpression, right, ExpressionLogical(data));
-        return new AstExpressionImpl();
+        return Share(data, AstLogical(left, right, Opcode::JUMP_IF_FALSE), pos);
       }
       else if(data.Read(Token::OR))
       {
         VALID_PRODUCTION(AstExpression, right, ExpressionLogical(data));
-        return new AstExpressionImpl();
+        return Share(data, AstLogical(left, right, Opcode::JUMP_IF_TRUE), pos);
       }
       return left;
     }
 
     // EC -> EAS
-    //    -> EAS == EC
-    //    -> EAS != EC
-    //    -> EAS >= EC
-    //    -> EAS <= EC
-    //    -> EAS > EC
-    //    -> EAS < EC
+    //    -> EC == EAS
+    //    -> EC != EAS
+    //    -> EC >= EAS
+    //    -> EC <= EAS
+    //    -> EC > EAS
+    //    -> EC < EAS
     static AstExpression* ExpressionCompare(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       VALID_PRODUCTION(AstExpression, left, ExpressionAddSub(data));
-      if(data.Read(Token::EQUAL))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::NEQUAL))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::GTE))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::LTE))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::GT))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::LT))
+      while(true)
       {
-        VALID_PRODUCTION(AstExpression, right, ExpressionCompare(data));
-        return new AstExpressionImpl();
+        if(data.Read(Token::EQUAL))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstEqual(left, right), pos);
+        }
+        else if(data.Read(Token::NEQUAL))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstNEqual(left, right), pos);
+        }
+        else if(data.Read(Token::GTE))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstGTE(left, right), pos);
+        }
+        else if(data.Read(Token::LTE))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstLTE(left, right), pos);
+        }
+        else if(data.Read(Token::GT))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstGT(left, right), pos);
+        }
+        else if(data.Read(Token::LT))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
+          left = Share(data, AstLT(left, right), pos);
+        }
+        else
+        {
+          return left;
+        }
       }
-      return left;
     }
 
     // EAS -> EMD
-    //     -> EMD + EAS
-    //     -> EMD - EAS
+    //     -> EAS + EMD
+    //     -> EAS - EMD
     static AstExpression* ExpressionAddSub(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       VALID_PRODUCTION(AstExpression, node, ExpressionMulDiv(data));
-      if(data.Read(Token::ADD))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
-        return new AstExpressionImpl();
-      }
-      else if(data.Read(Token::SUB))
+      while(true)
       {
-        VALID_PRODUCTION(AstExpression, right, ExpressionAddSub(data));
-        return new AstExpressionImpl();
+        if(data.Read(Token::ADD))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionMulDiv(data));
+          node = Share(data, AstAdd(node, right), pos);
+        }
+        else if(data.Read(Token::SUB))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionMulDiv(data));
+          node = Share(data, AstSub(node, right), pos);
+        }
+        else
+        {
+          return node;
+        }
       }
-      return node;
     }
 
-    // EMD -> EV
-    //     -> EV * EMD
-    //     -> EV / EMD
+    // EMD -> EU
+    //     -> EMD * EU
+    //     -> EMD / EU
     static AstExpression* ExpressionMulDiv(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       VALID_PRODUCTION(AstExpression, left, ExpressionUnary(data));
-      if(data.Read(Token::MUL))
+      while(true)
       {
-        VALID_PRODUCTION(AstExpression, right, ExpressionMulDiv(data));
-        return new AstMul(left, right);
-      }
-      else if(data.Read(Token::DIV))
-      {
-        VALID_PRODUCTION(AstExpression, right, ExpressionMulDiv(data));
-        return new AstDiv(left, right);
+        if(data.Read(Token::MUL))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionUnary(data));
+          left = Share(data, AstMul(left, right), pos);
+        }
+        else if(data.Read(Token::DIV))
+        {
+          VALID_PRODUCTION(AstExpression, right, ExpressionUnary(data));
+          left = Share(data, AstDiv(left, right), pos);
+        }
+        else
+        {
+          return left;
+        }
       }
-      return left;
     }
 
     // EU -> ! EU
-    //    -> EP
+    //    -> - EU
+    //    -> RVAL
     static AstExpression* ExpressionUnary(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       if(data.Read(Token::NOT))
       {
-        return ExpressionUnary(data);
+        VALID_PRODUCTION(AstExpression, node, ExpressionUnary(data));
+        return Share(data, AstNot(node), pos);
       }
       else if(data.Read(Token::SUB))
       {
-        return ExpressionUnary(data);
-      }
-      VALID_PRODUCTION(AstExpression, node, RValue(data));
-      return node;
-    }
-
-    // EP -> ( E )
-    //    -> RVAL
-    static AstExpression* ExpressionParam(ParseData& data)
-    {
-      if(data.Read(Token::OPEN_PARAM))
-      {
-        return Expression(data);
+        VALID_PRODUCTION(AstExpression, node, ExpressionUnary(data));
+        return Share(data, AstUMinus(node), pos);
       }
       VALID_PRODUCTION(AstExpression, node, RValue(data));
       return node;
@@ -341,22 +662,43 @@ class Parser
     //      -> string
     //      -> char
     //      -> ( E )
+    //      -> PRIM INDEX
+    //      -> MAP
+    //      -> len ( E )
+    //      -> has ( E , E )
+    //      -> substr ( E , E , E )
     //      -> name INDEX
     //      -> name ( FARGS )
     //      -> name
     static AstExpression* RValue(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
+      Type element = Primitive(data);
+      if(element != Type::INVALID)
+      {
+        size_t mapPos = data.pos;
+        Type map = MapType(data, element);
+        if(map != Type::INVALID)
+          return At(new AstNewMap(map), pos);
+        // Invalid maps are reported, anything else is the length of an array
+        if(data.pos != mapPos)
+          return nullptr;
+        VALID_PRODUCTION(AstExpression, length, Indexing(data));
+        return At(new AstNewArray(element, length), pos);
+      }
       if(data.Read(Token::NUMBER))
       {
-        return new AstExpressionImpl();
+        if(data.Value().find('.') != std::string::npos)
+          return Share(data, AstFloat(strtof(data.Value().c_str(), nullptr)), pos);
+        return Share(data, AstInt(strtoll(data.Value().c_str(), nullptr, 10)), pos);
       }
       else if(data.Read(Token::STRING))
       {
-        return new AstExpressionImpl();
+        return Share(data, AstString(data.Value()), pos);
       }
       else if(data.Read(Token::CHAR))
       {
-        return new AstExpressionImpl();
+        return Share(data, AstChar(data.Value()[0]), pos);
       }
       else if(data.Read(Token::OPEN_PARAM))
       {
@@ -366,60 +708,84 @@ class Parser
       }
       else if(data.Read(Token::NAME))
       {
-        AstExpression* topNode = new AstExpressionImpl();
+        std::string name = data.Value();
+        if(name == "len" && data.Top() == Token::OPEN_PARAM)
+        {
+          VALID_TOKEN(Token::OPEN_PARAM);
+          VALID_PRODUCTION(AstExpression, array, Expression(data));
+          VALID_TOKEN(Token::CLOSE_PARAM);
+          return Share(data, AstLength(array), pos);
+        }
+        if(name == "has" && data.Top() == Token::OPEN_PARAM)
+        {
+          VALID_TOKEN(Token::OPEN_PARAM);
+          VALID_PRODUCTION(AstExpression, map, Expression(data));
+          VALID_TOKEN(Token::COMMA);
+          VALID_PRODUCTION(AstExpression, key, Expression(data));
+          VALID_TOKEN(Token::CLOSE_PARAM);
+          return At(new AstHas(map, key), pos);
+        }
+        if(name == "substr" && data.Top() == Token::OPEN_PARAM)
+        {
+          VALID_TOKEN(Token::OPEN_PARAM);
+          VALID_PRODUCTION(AstExpression, str, Expression(data));
+          VALID_TOKEN(Token::COMMA);
+          VALID_PRODUCTION(AstExpression, start, Expression(data));
+          VALID_TOKEN(Token::COMMA);
+          VALID_PRODUCTION(AstExpression, count, Expression(data));
+          VALID_TOKEN(Token::CLOSE_PARAM);
+          return At(new AstSubstring(str, start, count), pos);
+        }
         if(data.Top() == Token::OPEN_SQUARE)
         {
-          VALID_PRODUCTION(AstNode, node, Indexing(data));
+          VALID_PRODUCTION(AstExpression, index, Indexing(data));
+          return Share(data, AstIndex(Variable(data, name, pos), index), pos);
         }
         if(data.Top() == Token::OPEN_PARAM)
         {
           VALID_TOKEN(Token::OPEN_PARAM);
-          VALID_PRODUCTION(AstNode, node, FunctionArguments(data));
+          VALID_PRODUCTION(AstFuncArgs, args, FunctionArguments(data));
           VALID_TOKEN(Token::CLOSE_PARAM);
+          return At(new AstCall(name, args), pos);
         }
-        return topNode;
+        return Variable(data, name, pos);
       }
       return nullptr;
     }
 
-    // LVALD -> LVAL
-    //       -> PRIM LVAL
-    static AstNode* LValueDefine(ParseData& data)
-    {
-      Primitive(data);
-      return LValue(data);
-    }
-
     // LVAL -> name INDEX
     //      -> name
-    static AstNode* LValue(ParseData& data)
+    static AstExpression* LValue(ParseData& data)
     {
+      TokenPos pos = data.TopPos();
       if(data.Read(Token::NAME))
       {
+        AstVariable* variable = Variable(data, data.Value(), pos);
         if(data.Top() == Token::OPEN_SQUARE)
         {
-          VALID_PRODUCTION(AstNode, node, Indexing(data));
+          VALID_PRODUCTION(AstExpression, index, Indexing(data));
+          return Share(data, AstIndex(variable, index), pos);
         }
-        return new AstNodeImpl();
+        return variable;
       }
       return nullptr;
     }
 
     // INDEX -> [ E ]
-    static AstNode* Indexing(ParseData& data)
+    static AstExpression* Indexing(ParseData& data)
     {
       VALID_TOKEN(Token::OPEN_SQUARE);
-      VALID_PRODUCTION(AstNode, node, Expression(data));
+      VALID_PRODUCTION(AstExpression, node, Expression(data));
       VALID_TOKEN(Token::CLOSE_SQUARE);
-      return new AstNodeImpl();
+      return node;
     }
 
-    // FTYPE -> PRIM
+    // FTYPE -> TYPE
     //       -> void
     static Type FunctionType(ParseData& data)
     {
       Type type = Type::INVALID;
-      if((type = Primitive(data)) == Type::INVALID)
+      if((type = VariableType(data)) == Type::INVALID)
       {
         if(data.Read(Token::VOID))
         {
@@ -430,25 +796,34 @@ class Parser
       return type;
     }
 
-    // FARGS -> name
-    //       -> name, FARGS
-    static AstNode* FunctionArguments(ParseData& data)
+    // FARGS ->
+    //       -> E
+    //       -> E , FARGS
+    static AstFuncArgs* FunctionArguments(ParseData& data)
     {
       if(data.Top() == Token::CLOSE_PARAM)
-        return new AstNodeImpl();
+        return new AstFuncArgs(nullptr, nullptr);
 
-      VALID_PRODUCTION(AstNode, node, Expression(data));
+      VALID_PRODUCTION(AstExpression, node, Expression(data));
       if(data.Read(Token::COMMA))
       {
-        VALID_PRODUCTION(AstNode, args, FunctionArguments(data));
-        return node;
+        VALID_PRODUCTION(AstFuncArgs, args, FunctionArguments(data));
+        return new AstFuncArgs(node, args);
       }
-      return node;
+      return new AstFuncArgs(node, nullptr);
     }
 
     // CFBODY -> { Ss }
     //        -> S
     static AstStatements* ControlFlowBody(ParseData& data)
+    {
+      AstStatements* body = ScopeBody(data);
+      // The declarations of the body go out of scope
+      data.binding++;
+      return body;
+    }
+
+    static AstStatements* ScopeBody(ParseData& data)
     {
       if(data.Top() == Token::OPEN_CURLY)
       {
@@ -465,19 +840,30 @@ class Parser
     }
 
     // FPARAMS ->
-    //         -> PRIM name
-    //         -> PRIM name, FPARAMS
+    //         -> TYPE name
+    //         -> TYPE name, FPARAMS
     static AstFuncParams* FunctionParams(ParseData& data)
     {
       AstFuncParams* top = new AstFuncParams{nullptr, nullptr};
+      AstFuncParams* last = nullptr;
       while(data.Top() != Token::CLOSE_PARAM)
       {
+        TokenPos pos = data.TopPos();
         Type type;
-        if((type = Primitive(data)) == Type::INVALID)
+        if((type = VariableType(data)) == Type::INVALID)
           return nullptr;
         VALID_TOKEN(Token::NAME);
-        // TODO: FIX NAME
-        top = new AstFuncParams(new AstFuncParam(new AstName{type}), top);
+        AstFuncParam* param = At(new AstFuncParam(At(new AstName{type, data.Value()}, pos)), pos);
+        if(last == nullptr)
+        {
+          top->first = param;
+          last = top;
+        }
+        else
+        {
+          last->tail = new AstFuncParams(param, nullptr);
+          last = last->tail;
+        }
         if(!data.Read(Token::COMMA))
           break;
       }
@@ -485,6 +871,50 @@ class Parser
       return top;
     }
 
+    // TYPE -> PRIM
+    //      -> PRIM [ ]
+    //      -> MAP
+    static Type VariableType(ParseData& data)
+    {
+      Type type = Primitive(data);
+      if(type == Type::INVALID || data.Top() != Token::OPEN_SQUARE)
+        return type;
+      size_t pos = data.pos;
+      Type map = MapType(data, type);
+      if(map != Type::INVALID || data.pos != pos)
+        return map;
+      data.Read(Token::OPEN_SQUARE);
+      if(!data.Read(Token::CLOSE_SQUARE))
+      {
+        // Not an array type but the length of a new array
+        data.Backtrack(pos);
+        return type;
+      }
+      Type array = Types::ArrayOf(type);
+      if(array == Type::INVALID)
+        std::cerr << "Cannot create an array of " << Types::GetName(type) << " at " << data.TopPos() << std::endl;
+      return array;
+    }
+
+    // MAP -> PRIM [ PRIM ]
+    // Reads the key of a map with the given values, nothing is read unless
+    // it is one
+    static Type MapType(ParseData& data, Type value)
+    {
+      size_t pos = data.pos;
+      TokenPos topPos = data.TopPos();
+      Type key = Type::INVALID;
+      if(!data.Read(Token::OPEN_SQUARE) || (key = Primitive(data)) == Type::INVALID || !data.Read(Token::CLOSE_SQUARE))
+      {
+        data.Backtrack(pos);
+        return Type::INVALID;
+      }
+      Type map = Types::MapOf(value, key);
+      if(map == Type::INVALID)
+        std::cerr << "Cannot create a map from " << Types::GetName(key) << " to " << Types::GetName(value) << " at " << topPos << std::endl;
+      return map;
+    }
+
     // PRIM -> int
     //      -> float
     //      -> char_k
@@ -512,7 +942,7 @@ class Parser
 
     static void PrintError(ParseData& data, Token got, Token expected)
     {
-      std::cerr << "Invalid token at " << data.pos << std::endl;
+      std::cerr << "Invalid token at " << data.TopPos() << std::endl;
       std::cerr << "Got " << Tokens::GetName(got) << " but expected " << Tokens::GetName(expected) << std::endl;
     }
 };
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "Bytecode.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+// Function and code offset of a sampled frame, which is mapped to a source
+// line when the profile is written. A null function stands for the outer
+// frames of a stack that was too deep to record.
+struct ProfileFrame
+{
+  const CompiledFunction* function;
+  int32_t pc;
+
+  bool operator<(const ProfileFrame& other) const
+  {
+    if(function != other.function)
+      return function < other.function;
+    return pc < other.pc;
+  }
+};
+
+// Sampling profiler for script code. A vm with a profiler checks the clock
+// every SAMPLE_TICKS back-edges and calls and records its call stack once a
+// period of script execution has passed since the last sample, so the
+// interpreter loop itself is unchanged. Time spent outside of calls from the
+// host isn't counted. A profiler can be shared by vms on different threads.
+class Profiler
+{
+  public:
+    static constexpr int64_t SAMPLE_TICKS = 1024;
+    static const size_t MAX_DEPTH = 256;
+
+  private:
+    std::mutex mutex;
+    std::chrono::nanoseconds period;
+    // Sample count of each call stack, outermost frame first
+    std::map<std::vector<ProfileFrame>, uint64_t> stacks;
+    uint64_t samples;
+
+  public:
+    // Samples per second of script execution
+    explicit Profiler(int rate = 1000)
+      : period{std::chrono::nanoseconds{std::chrono::seconds{1}} / std::max(rate, 1)}, samples{0}
+    {}
+
+    std::chrono::nanoseconds Period() const
+    {
+      return period;
+    }
+
+    void Add(const std::vector<ProfileFrame>& stack, uint64_t count = 1)
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      stacks[stack] += count;
+      samples += count;
+    }
+
+    uint64_t Samples()
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      return samples;
+    }
+
+    void Clear()
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      stacks.clear();
+      samples = 0;
+    }
+
+    // One line per call stack, such as "main:20;work:8 12", in the format
+    // read by flamegraph.pl and speedscope
+    void WriteCollapsed(std::ostream& os)
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      // Written by line, so pc holds the line of each frame and stacks that
+      // only differ within a line are merged
+      std::map<std::vector<ProfileFrame>, uint64_t> lineStacks;
+      for(const auto& [stack, count] : stacks)
+      {
+        std::vector<ProfileFrame> lines = stack;
+        for(ProfileFrame& frame : lines)
+        {
+          if(frame.function)
+            frame.pc = frame.function->lines.Find(frame.pc).line;
+        }
+        lineStacks[lines] += count;
+      }
+      for(const auto& [stack, count] : lineStacks)
+      {
+        for(size_t i = 0;i<stack.size();i++)
+        {
+          if(i > 0)
+            os << ";";
+          if(stack[i].function)
+            os << stack[i].function->name << ":" << stack[i].pc;
+          else
+            os << "[truncated]";
+        }
+        os << " " << count << std::endl;
+      }
+    }
+
+    // Time of each function, self is spent in the function itself and total
+    // also includes its callees. Recursive functions are counted once per
+    // sample.
+    void WriteReport(std::ostream& os)
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      std::map<std::string, uint64_t> self;
+      std::map<std::string, uint64_t> total;
+      for(const auto& [stack, count] : stacks)
+      {
+        self[stack.back().function->name] += count;
+        std::set<std::string> seen;
+        for(const ProfileFrame& frame : stack)
+        {
+          if(frame.function && seen.insert(frame.function->name).second)
+            total[frame.function->name] += count;
+        }
+      }
+      std::vector<std::pair<std::string, uint64_t>> sorted{total.begin(), total.end()};
+      std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+
+      double ms = std::chrono::duration<double, std::milli>(period).count();
+      os << samples << " samples, " << ms << " ms each" << std::endl;
+      os << std::setw(10) << "self ms" << std::setw(8) << "self%" << std::setw(10) << "total ms" << std::setw(8) << "total%" << "  function" << std::endl;
+      for(const auto& [name, count] : sorted)
+      {
+        os << std::fixed << std::setprecision(1)
+          << std::setw(10) << self[name] * ms << std::setw(7) << 100.0 * self[name] / samples << "%"
+          << std::setw(10) << count * ms << std::setw(7) << 100.0 * count / samples << "%"
+          << "  " << name << std::endl;
+      }
+      os << std::defaultfloat;
+    }
+};
@@ -0,0 +1,432 @@
+#pragma once
+
+#include "Bytecode.h"
+#include "TypeInfo.h"
+#include "Value.h"
+#include "Vm.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class Scheduler;
+
+enum class TaskState
+{
+  READY, RUNNING, SUSPENDED, DONE, FAILED
+};
+
+// A script call that runs on a scheduler. Every task has a vm of its own with
+// a small stack, so a task that is suspended by a host function only keeps its
+// registers and heap and no thread.
+class Task : public std::enable_shared_from_this<Task>
+{
+  friend class Scheduler;
+  private:
+    static const size_t INITIAL_STACK = 1024;
+
+    const Program& program;
+    int index;
+    Vm vm;
+    Value* regs;
+    Scheduler* scheduler;
+    bool started;
+
+    // Guards the state while the task is suspended and resumed
+    std::mutex mutex;
+    TaskState state;
+    // Set when Resume is called before the worker has finished suspending
+    bool resumed;
+    std::function<Value(Heap&)> resumeValue;
+
+    std::chrono::steady_clock::time_point created;
+    std::chrono::steady_clock::time_point finished;
+
+  public:
+    Task(const Program& program, int index)
+      : program{program}, index{index}, vm{INITIAL_STACK}, regs{nullptr}, scheduler{nullptr}, started{false},
+        state{TaskState::READY}, resumed{false}, created{std::chrono::steady_clock::now()}
+    {
+      vm.SetSuspendable(true);
+      vm.Enter();
+      regs = vm.Reserve(program, index);
+    }
+
+    // Registers receiving the arguments, nullptr if they didn't fit
+    Value* Arguments()
+    {
+      return regs;
+    }
+
+    Heap& GetHeap()
+    {
+      return vm.heap;
+    }
+
+    // Task running on the current thread, nullptr outside of tasks
+    static Task*& Current()
+    {
+      static thread_local Task* current = nullptr;
+      return current;
+    }
+
+    // Called by a host function to suspend the task once it returns. The
+    // task continues when Scheduler::Resume is called with the result of the
+    // host function. Returns false if the task can't be suspended, such as
+    // when the host function was called by a script called by another host
+    // function.
+    bool Suspend()
+    {
+      return vm.Suspend();
+    }
+
+    TaskState GetState()
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      return state;
+    }
+
+    bool IsFinished()
+    {
+      TaskState current = GetState();
+      return current == TaskState::DONE || current == TaskState::FAILED;
+    }
+
+    // Only valid once the task is done
+    template <typename T>
+    T Result() const
+    {
+      return TypeInfo<T>::FromValue(regs[0]);
+    }
+
+    // Time from when the task was created until it finished
+    std::chrono::steady_clock::duration Latency() const
+    {
+      return finished - created;
+    }
+};
+
+struct SchedulerOptions
+{
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  // Back-edges and calls a task runs before it is moved to the back of the
+  // queue so other tasks can run, negative to run tasks until they finish
+  // or suspend
+  int64_t timeSlice = 10000;
+  // Workers run their newest task first. Better cache locality, but a busy
+  // worker can starve its oldest tasks.
+  bool lifo = false;
+  // Samples the tasks when set
+  Profiler* profiler = nullptr;
+  HeapProfiler* heapProfiler = nullptr;
+};
+
+struct SchedulerMetrics
+{
+  uint64_t spawned;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t suspensions;
+  uint64_t resumes;
+  uint64_t preemptions;
+  uint64_t steals;
+  // Tasks waiting in each queue and the most that have waited in any queue
+  std::vector<size_t> queueDepths;
+  size_t maxQueueDepth;
+};
+
+// Runs tasks on a pool of worker threads. Every worker has a queue of its
+// own and takes tasks from the other queues when its own is empty. Tasks
+// that are preempted or resumed go back to the queue of the current worker.
+// The program must not be changed while tasks are running.
+class Scheduler
+{
+  private:
+    struct Worker
+    {
+      std::mutex mutex;
+      std::deque<std::shared_ptr<Task>> queue;
+      size_t maxDepth = 0;
+      std::thread thread;
+    };
+
+    SchedulerOptions options;
+    std::vector<std::unique_ptr<Worker>> workers;
+    // Tasks in the queues, idle workers sleep until it is above zero
+    std::atomic<int64_t> queued;
+    std::atomic<int> sleeping;
+    std::atomic<bool> stopping;
+    std::atomic<unsigned> nextWorker;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    // Tasks that have been submitted but haven't finished
+    int64_t unfinished;
+    std::mutex unfinishedMutex;
+    std::condition_variable finished;
+
+    std::atomic<uint64_t> spawned;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> suspensions;
+    std::atomic<uint64_t> resumes;
+    std::atomic<uint64_t> preemptions;
+    std::atomic<uint64_t> steals;
+
+  public:
+    explicit Scheduler(const SchedulerOptions& options = {})
+      : options{options}, queued{0}, sleeping{0}, stopping{false}, nextWorker{0}, unfinished{0},
+        spawned{0}, completed{0}, failed{0}, suspensions{0}, resumes{0}, preemptions{0}, steals{0}
+    {
+      int threads = std::max(1, options.threads);
+      for(int i = 0;i<threads;i++)
+        workers.push_back(std::make_unique<Worker>());
+      for(int i = 0;i<threads;i++)
+        workers[i]->thread = std::thread{&Scheduler::Work, this, i};
+    }
+
+    // Tasks that haven't started are dropped, suspended tasks are never run
+    ~Scheduler()
+    {
+      stopping = true;
+      {
+        std::lock_guard<std::mutex> lock{idleMutex};
+      }
+      idle.notify_all();
+      for(std::unique_ptr<Worker>& worker : workers)
+        worker->thread.join();
+    }
+
+    // Queues a task whose arguments have been written
+    void Submit(const std::shared_ptr<Task>& task)
+    {
+      task->scheduler = this;
+      {
+        std::lock_guard<std::mutex> lock{unfinishedMutex};
+        unfinished++;
+      }
+      spawned++;
+      Push(task);
+    }
+
+    // Continues a task suspended by a host function, value is returned by the
+    // host function. Can be called from any thread, also before the host
+    // function has returned.
+    template <typename T>
+    void Resume(const std::shared_ptr<Task>& task, T value)
+    {
+      static_assert(TypeInfoOf<T>::type != Type::INVALID && TypeInfoOf<T>::type != Type::VOID, "Unsupported result type");
+      resumes++;
+      std::unique_lock<std::mutex> lock{task->mutex};
+      // Strings are allocated on the heap of the task, so the value is
+      // converted by the worker that runs it
+      task->resumeValue = [value](Heap& heap) { return TypeInfoOf<T>::ToValue(value, heap); };
+      if(task->state != TaskState::SUSPENDED)
+      {
+        task->resumed = true;
+        return;
+      }
+      task->state = TaskState::READY;
+      lock.unlock();
+      Push(task);
+    }
+
+    // Blocks until every submitted task has finished. Tasks that are
+    // suspended must be resumed by another thread.
+    void Wait()
+    {
+      std::unique_lock<std::mutex> lock{unfinishedMutex};
+      finished.wait(lock, [&] { return unfinished == 0; });
+    }
+
+    SchedulerMetrics Metrics()
+    {
+      SchedulerMetrics metrics{spawned, completed, failed, suspensions, resumes, preemptions, steals, {}, 0};
+      for(std::unique_ptr<Worker>& worker : workers)
+      {
+        std::lock_guard<std::mutex> lock{worker->mutex};
+        metrics.queueDepths.push_back(worker->queue.size());
+        metrics.maxQueueDepth = std::max(metrics.maxQueueDepth, worker->maxDepth);
+      }
+      return metrics;
+    }
+
+  private:
+    // Worker running on the current thread, -1 outside of this scheduler
+    int CurrentWorker()
+    {
+      static thread_local Scheduler* scheduler = nullptr;
+      static thread_local int index = -1;
+      if(scheduler != this)
+      {
+        for(size_t i = 0;i<workers.size();i++)
+        {
+          if(workers[i]->thread.get_id() == std::this_thread::get_id())
+          {
+            scheduler = this;
+            index = i;
+            return index;
+          }
+        }
+        return -1;
+      }
+      return index;
+    }
+
+    void Push(const std::shared_ptr<Task>& task)
+    {
+      int index = CurrentWorker();
+      if(index == -1)
+        index = nextWorker++ % workers.size();
+      Worker& worker = *workers[index];
+      {
+        std::lock_guard<std::mutex> lock{worker.mutex};
+        worker.queue.push_back(task);
+        worker.maxDepth = std::max(worker.maxDepth, worker.queue.size());
+      }
+      queued++;
+      if(sleeping > 0)
+      {
+        {
+          std::lock_guard<std::mutex> lock{idleMutex};
+        }
+        idle.notify_one();
+      }
+    }
+
+    std::shared_ptr<Task> Pop(int index)
+    {
+      Worker& worker = *workers[index];
+      std::lock_guard<std::mutex> lock{worker.mutex};
+      if(worker.queue.empty())
+        return nullptr;
+      std::shared_ptr<Task> task;
+      if(options.lifo)
+      {
+        task = std::move(worker.queue.back());
+        worker.queue.pop_back();
+      }
+      else
+      {
+        task = std::move(worker.queue.front());
+        worker.queue.pop_front();
+      }
+      queued--;
+      return task;
+    }
+
+    // Takes a task from the end of another queue that its owner takes last
+    std::shared_ptr<Task> Steal(int thief)
+    {
+      for(size_t i = 1;i<workers.size();i++)
+      {
+        Worker& worker = *workers[(thief + i) % workers.size()];
+        std::lock_guard<std::mutex> lock{worker.mutex};
+        if(worker.queue.empty())
+          continue;
+        std::shared_ptr<Task> task;
+        if(options.lifo)
+        {
+          task = std::move(worker.queue.front());
+          worker.queue.pop_front();
+        }
+        else
+        {
+          task = std::move(worker.queue.back());
+          worker.queue.pop_back();
+        }
+        queued--;
+        steals++;
+        return task;
+      }
+      return nullptr;
+    }
+
+    void Work(int index)
+    {
+      while(true)
+      {
+        std::shared_ptr<Task> task = Pop(index);
+        if(task == nullptr)
+          task = Steal(index);
+        if(task)
+        {
+          Run(task);
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock{idleMutex};
+        sleeping++;
+        idle.wait(lock, [&] { return queued > 0 || stopping; });
+        sleeping--;
+        if(stopping)
+          return;
+      }
+    }
+
+    void Run(const std::shared_ptr<Task>& task)
+    {
+      {
+        std::lock_guard<std::mutex> lock{task->mutex};
+        task->state = TaskState::RUNNING;
+      }
+      Task::Current() = task.get();
+      bool success;
+      if(!task->started)
+      {
+        task->started = true;
+        task->vm.SetTimeSlice(options.timeSlice);
+        task->vm.SetProfiler(options.profiler);
+        task->vm.SetHeapProfiler(options.heapProfiler);
+        success = task->regs && task->vm.Call(task->program, task->index, task->regs);
+      }
+      else
+      {
+        if(task->resumeValue)
+        {
+          task->vm.SetHostResult(task->resumeValue(task->vm.heap));
+          task->resumeValue = nullptr;
+        }
+        success = task->vm.Resume(task->program);
+      }
+      Task::Current() = nullptr;
+
+      if(success && task->vm.IsSuspended())
+      {
+        std::unique_lock<std::mutex> lock{task->mutex};
+        if(task->vm.WasPreempted())
+          preemptions++;
+        else
+          suspensions++;
+        if(task->vm.WasPreempted() || task->resumed)
+        {
+          task->resumed = false;
+          task->state = TaskState::READY;
+          lock.unlock();
+          Push(task);
+        }
+        else
+          task->state = TaskState::SUSPENDED;
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock{task->mutex};
+        task->state = success ? TaskState::DONE : TaskState::FAILED;
+        task->finished = std::chrono::steady_clock::now();
+      }
+      if(success)
+        completed++;
+      else
+        failed++;
+      std::lock_guard<std::mutex> lock{unfinishedMutex};
+      if(--unfinished == 0)
+        finished.notify_all();
+    }
+};
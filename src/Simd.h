@@ -0,0 +1,611 @@
+#pragma once
+
+#include "Bytecode.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Element-wise kernels over int and float buffers. Every kernel has a scalar
+// version and, on x86, SSE4.1 and AVX2 versions which process 4 and 8 lanes at
+// a time followed by a scalar epilogue for the remaining elements. The
+// versions are picked at runtime from the features of the cpu. The kernels of
+// the numeric library, see Builtins, are built the same way.
+enum class SimdLevel
+{
+  SCALAR, SSE, AVX
+};
+
+using SimdBinary = void(*)(void* dst, const void* a, const void* b, int n);
+using SimdUnary = void(*)(void* dst, const void* a, int n);
+// Folds write one element to result, maps take the factor of SCALE or the
+// bounds of CLAMP as scalars
+using SimdFold = void(*)(void* result, const void* a, int n);
+using SimdDot = void(*)(void* result, const void* a, const void* b, int n);
+using SimdMap = void(*)(void* dst, const void* a, const void* scalars, int n);
+
+enum class SimdFoldOp
+{
+  ADD, MIN, MAX
+};
+
+// Running results kept by a fold, see SimdScalar::Fold
+static const int SIMD_LANES = 8;
+
+// Scalar operations, these define the semantics that the vector versions
+// must match. Int arithmetic wraps around.
+#define LIST_SIMD_BINARY \
+  SIMD_BINARY(ADD_INT, int32_t, (int32_t)((uint32_t)x + (uint32_t)y)) \
+  SIMD_BINARY(SUB_INT, int32_t, (int32_t)((uint32_t)x - (uint32_t)y)) \
+  SIMD_BINARY(MUL_INT, int32_t, (int32_t)((uint32_t)x * (uint32_t)y)) \
+  SIMD_BINARY(ADD_FLOAT, float, x + y) \
+  SIMD_BINARY(SUB_FLOAT, float, x - y) \
+  SIMD_BINARY(MUL_FLOAT, float, x * y) \
+  SIMD_BINARY(DIV_FLOAT, float, x / y)
+
+#define LIST_SIMD_UNARY \
+  SIMD_UNARY(NEG_INT, int32_t, (int32_t)(0u - (uint32_t)x)) \
+  SIMD_UNARY(NEG_FLOAT, float, -x)
+
+// Kernels of the numeric library, written with the operations of the Int
+// and Float structs in the namespace of each level
+#define LIST_SIMD_LIBRARY \
+  SIMD_FOLD(SUM_INT, Int, ADD) \
+  SIMD_FOLD(SUM_FLOAT, Float, ADD) \
+  SIMD_FOLD(MIN_INT, Int, MIN) \
+  SIMD_FOLD(MIN_FLOAT, Float, MIN) \
+  SIMD_FOLD(MAX_INT, Int, MAX) \
+  SIMD_FOLD(MAX_FLOAT, Float, MAX) \
+  SIMD_DOT(DOT_INT, Int) \
+  SIMD_DOT(DOT_FLOAT, Float) \
+  SIMD_SCAN(PREFIX_INT, Int) \
+  SIMD_SCAN(PREFIX_FLOAT, Float) \
+  SIMD_MAP(SCALE_INT, Int, Scale) \
+  SIMD_MAP(SCALE_FLOAT, Float, Scale) \
+  SIMD_MAP(CLAMP_INT, Int, Clamp) \
+  SIMD_MAP(CLAMP_FLOAT, Float, Clamp)
+
+struct SimdKernels
+{
+#define SIMD_BINARY(name, type, expr) SimdBinary name;
+#define SIMD_UNARY(name, type, expr) SimdUnary name;
+#define SIMD_FOLD(name, ops, op) SimdFold name;
+#define SIMD_DOT(name, ops) SimdDot name;
+#define SIMD_SCAN(name, ops) SimdUnary name;
+#define SIMD_MAP(name, ops, function) SimdMap name;
+  LIST_SIMD_BINARY
+  LIST_SIMD_UNARY
+  LIST_SIMD_LIBRARY
+#undef SIMD_BINARY
+#undef SIMD_UNARY
+#undef SIMD_FOLD
+#undef SIMD_DOT
+#undef SIMD_SCAN
+#undef SIMD_MAP
+};
+
+// Every namespace defines Fold, Prefix, Scale and Clamp for the library
+// kernels to call
+#define SIMD_FOLD(name, ops, op) \
+  inline void name(void* result, const void* a, int n) \
+  { \
+    Fold<ops, SimdFoldOp::op, false>(result, a, nullptr, n); \
+  }
+#define SIMD_DOT(name, ops) \
+  inline void name(void* result, const void* a, const void* b, int n) \
+  { \
+    Fold<ops, SimdFoldOp::ADD, true>(result, a, b, n); \
+  }
+#define SIMD_SCAN(name, ops) \
+  inline void name(void* dst, const void* a, int n) \
+  { \
+    Prefix<ops>(dst, a, n); \
+  }
+#define SIMD_MAP(name, ops, function) \
+  inline void name(void* dst, const void* a, const void* scalars, int n) \
+  { \
+    function<ops>(dst, a, scalars, n); \
+  }
+
+namespace SimdScalar
+{
+#define SIMD_BINARY(name, type, expr) \
+  inline void name(void* dst, const void* a, const void* b, int n) \
+  { \
+    for(int i = 0;i<n;i++) \
+    { \
+      type x = ((const type*)a)[i]; \
+      type y = ((const type*)b)[i]; \
+      ((type*)dst)[i] = expr; \
+    } \
+  }
+#define SIMD_UNARY(name, type, expr) \
+  inline void name(void* dst, const void* a, int n) \
+  { \
+    for(int i = 0;i<n;i++) \
+    { \
+      type x = ((const type*)a)[i]; \
+      ((type*)dst)[i] = expr; \
+    } \
+  }
+  LIST_SIMD_BINARY
+  LIST_SIMD_UNARY
+#undef SIMD_BINARY
+#undef SIMD_UNARY
+
+  // Int sums and products wrap around. Min and Max return y unless x is
+  // smaller or larger, as the vector instructions do, so a NaN element never
+  // replaces a running result.
+  struct Int
+  {
+    using T = int32_t;
+    static T Add(T x, T y) { return (int32_t)((uint32_t)x + (uint32_t)y); }
+    static T Mul(T x, T y) { return (int32_t)((uint32_t)x * (uint32_t)y); }
+    static T Min(T x, T y) { return x < y ? x : y; }
+    static T Max(T x, T y) { return x > y ? x : y; }
+    static T Lowest() { return std::numeric_limits<T>::min(); }
+    static T Highest() { return std::numeric_limits<T>::max(); }
+  };
+
+  struct Float
+  {
+    using T = float;
+    static T Add(T x, T y) { return x + y; }
+    static T Mul(T x, T y) { return x * y; }
+    static T Min(T x, T y) { return x < y ? x : y; }
+    static T Max(T x, T y) { return x > y ? x : y; }
+    static T Lowest() { return -std::numeric_limits<T>::infinity(); }
+    static T Highest() { return std::numeric_limits<T>::infinity(); }
+  };
+
+  template <typename Ops, SimdFoldOp OP>
+  inline typename Ops::T Apply(typename Ops::T x, typename Ops::T y)
+  {
+    if constexpr(OP == SimdFoldOp::ADD)
+      return Ops::Add(x, y);
+    else if constexpr(OP == SimdFoldOp::MIN)
+      return Ops::Min(x, y);
+    else
+      return Ops::Max(x, y);
+  }
+
+  template <typename Ops, SimdFoldOp OP>
+  inline typename Ops::T Identity()
+  {
+    if constexpr(OP == SimdFoldOp::ADD)
+      return 0;
+    else if constexpr(OP == SimdFoldOp::MIN)
+      return Ops::Highest();
+    else
+      return Ops::Lowest();
+  }
+
+  // Combines the lanes of a fold and folds in the elements from i on
+  template <typename Ops, SimdFoldOp OP, bool DOT>
+  inline typename Ops::T Finish(typename Ops::T* lanes, const typename Ops::T* a, const typename Ops::T* b, int i, int n)
+  {
+    for(int l = 0;l<4;l++)
+      lanes[l] = Apply<Ops, OP>(lanes[l], lanes[l + 4]);
+    for(int l = 0;l<2;l++)
+      lanes[l] = Apply<Ops, OP>(lanes[l], lanes[l + 2]);
+    typename Ops::T result = Apply<Ops, OP>(lanes[0], lanes[1]);
+    for(;i<n;i++)
+      result = Apply<Ops, OP>(DOT ? Ops::Mul(a[i], b[i]) : a[i], result);
+    return result;
+  }
+
+  // A fold keeps SIMD_LANES running results, element i going to lane
+  // i % SIMD_LANES. They are combined pairwise, lane l with lane l + 4 and
+  // then with lane l + 2, before the elements after the last full group are
+  // folded in one at a time. The vector versions keep the same lanes, so the
+  // result doesn't depend on the level. Dot folds the products of a and b.
+  template <typename Ops, SimdFoldOp OP, bool DOT>
+  inline void Fold(void* result, const void* a, const void* b, int n)
+  {
+    using T = typename Ops::T;
+    const T* x = (const T*)a;
+    const T* y = (const T*)b;
+    T lanes[SIMD_LANES];
+    std::fill(lanes, lanes + SIMD_LANES, Identity<Ops, OP>());
+    int i = 0;
+    for(;i + SIMD_LANES<=n;i += SIMD_LANES)
+    {
+      for(int l = 0;l<SIMD_LANES;l++)
+        lanes[l] = Apply<Ops, OP>(DOT ? Ops::Mul(x[i + l], y[i + l]) : x[i + l], lanes[l]);
+    }
+    *(T*)result = Finish<Ops, OP, DOT>(lanes, x, y, i, n);
+  }
+
+  // Sums of the elements up to and including each one, added in order to
+  // the sum before the first
+  template <typename Ops>
+  inline void Prefix(void* dst, const void* a, int n, typename Ops::T sum = 0)
+  {
+    for(int i = 0;i<n;i++)
+    {
+      sum = Ops::Add(sum, ((const typename Ops::T*)a)[i]);
+      ((typename Ops::T*)dst)[i] = sum;
+    }
+  }
+
+  template <typename Ops>
+  inline void Scale(void* dst, const void* a, const void* scalars, int n)
+  {
+    using T = typename Ops::T;
+    T factor = ((const T*)scalars)[0];
+    for(int i = 0;i<n;i++)
+      ((T*)dst)[i] = Ops::Mul(((const T*)a)[i], factor);
+  }
+
+  // Elements are raised to the lower bound before they are lowered to the
+  // upper one
+  template <typename Ops>
+  inline void Clamp(void* dst, const void* a, const void* scalars, int n)
+  {
+    using T = typename Ops::T;
+    T low = ((const T*)scalars)[0];
+    T high = ((const T*)scalars)[1];
+    for(int i = 0;i<n;i++)
+      ((T*)dst)[i] = Ops::Min(Ops::Max(((const T*)a)[i], low), high);
+  }
+
+  LIST_SIMD_LIBRARY
+}
+
+#ifdef SIMD_X86
+
+// Vector loop over width lanes followed by the scalar epilogue. ptype is the
+// pointer type taken by the load and store intrinsics.
+#define SIMD_VECTOR_BINARY(name, isa, type, width, vtype, ptype, load, store, vop) \
+  __attribute__((target(isa))) inline void name(void* dst, const void* a, const void* b, int n) \
+  { \
+    int i = 0; \
+    for(;i + width <= n;i += width) \
+    { \
+      vtype x = load((const ptype*)((const type*)a + i)); \
+      vtype y = load((const ptype*)((const type*)b + i)); \
+      store((ptype*)((type*)dst + i), vop); \
+    } \
+    SimdScalar::name((type*)dst + i, (const type*)a + i, (const type*)b + i, n - i); \
+  }
+
+#define SIMD_VECTOR_UNARY(name, isa, type, width, vtype, ptype, load, store, vop) \
+  __attribute__((target(isa))) inline void name(void* dst, const void* a, int n) \
+  { \
+    int i = 0; \
+    for(;i + width <= n;i += width) \
+    { \
+      vtype x = load((const ptype*)((const type*)a + i)); \
+      store((ptype*)((type*)dst + i), vop); \
+    } \
+    SimdScalar::name((type*)dst + i, (const type*)a + i, n - i); \
+  }
+
+// Library kernels over the Int and Float structs of the namespace, which
+// hold WIDTH lanes per vector. Folds keep SIMD_LANES / WIDTH vectors of
+// running results and finish like the scalar version. Float prefix sums are
+// left to the scalar version since adding the elements in another order
+// changes the result.
+#define SIMD_VECTOR_LIBRARY(isa) \
+  template <typename Ops, SimdFoldOp OP> \
+  __attribute__((target(isa))) inline typename Ops::V Apply(typename Ops::V x, typename Ops::V y) \
+  { \
+    if constexpr(OP == SimdFoldOp::ADD) \
+      return Ops::Add(x, y); \
+    else if constexpr(OP == SimdFoldOp::MIN) \
+      return Ops::Min(x, y); \
+    else \
+      return Ops::Max(x, y); \
+  } \
+  template <typename Ops, SimdFoldOp OP, bool DOT> \
+  __attribute__((target(isa))) inline void Fold(void* result, const void* a, const void* b, int n) \
+  { \
+    using T = typename Ops::T; \
+    using V = typename Ops::V; \
+    const int count = SIMD_LANES / Ops::WIDTH; \
+    const T* x = (const T*)a; \
+    const T* y = (const T*)b; \
+    V lanes[count]; \
+    for(int v = 0;v<count;v++) \
+      lanes[v] = Ops::Set(SimdScalar::Identity<typename Ops::Scalar, OP>()); \
+    int i = 0; \
+    for(;i + SIMD_LANES<=n;i += SIMD_LANES) \
+    { \
+      for(int v = 0;v<count;v++) \
+      { \
+        V element = Ops::Load(x + i + v * Ops::WIDTH); \
+        if constexpr(DOT) \
+          element = Ops::Mul(element, Ops::Load(y + i + v * Ops::WIDTH)); \
+        lanes[v] = Apply<Ops, OP>(element, lanes[v]); \
+      } \
+    } \
+    T spilled[SIMD_LANES]; \
+    for(int v = 0;v<count;v++) \
+      Ops::Store(spilled + v * Ops::WIDTH, lanes[v]); \
+    *(T*)result = SimdScalar::Finish<typename Ops::Scalar, OP, DOT>(spilled, x, y, i, n); \
+  } \
+  template <typename Ops> \
+  __attribute__((target(isa))) inline void Prefix(void* dst, const void* a, int n) \
+  { \
+    using T = typename Ops::T; \
+    if constexpr(std::is_same<T, float>::value) \
+    { \
+      SimdScalar::Prefix<typename Ops::Scalar>(dst, a, n); \
+    } \
+    else \
+    { \
+      const T* x = (const T*)a; \
+      T* out = (T*)dst; \
+      typename Ops::V sum = Ops::Set(0); \
+      int i = 0; \
+      for(;i + Ops::WIDTH<=n;i += Ops::WIDTH) \
+      { \
+        sum = Ops::Add(Ops::Scan(Ops::Load(x + i)), sum); \
+        Ops::Store(out + i, sum); \
+        sum = Ops::Last(sum); \
+      } \
+      SimdScalar::Prefix<typename Ops::Scalar>(out + i, x + i, n - i, i > 0 ? out[i - 1] : 0); \
+    } \
+  } \
+  template <typename Ops> \
+  __attribute__((target(isa))) inline void Scale(void* dst, const void* a, const void* scalars, int n) \
+  { \
+    using T = typename Ops::T; \
+    typename Ops::V factor = Ops::Set(((const T*)scalars)[0]); \
+    int i = 0; \
+    for(;i + Ops::WIDTH<=n;i += Ops::WIDTH) \
+      Ops::Store((T*)dst + i, Ops::Mul(Ops::Load((const T*)a + i), factor)); \
+    SimdScalar::Scale<typename Ops::Scalar>((T*)dst + i, (const T*)a + i, scalars, n - i); \
+  } \
+  template <typename Ops> \
+  __attribute__((target(isa))) inline void Clamp(void* dst, const void* a, const void* scalars, int n) \
+  { \
+    using T = typename Ops::T; \
+    typename Ops::V low = Ops::Set(((const T*)scalars)[0]); \
+    typename Ops::V high = Ops::Set(((const T*)scalars)[1]); \
+    int i = 0; \
+    for(;i + Ops::WIDTH<=n;i += Ops::WIDTH) \
+      Ops::Store((T*)dst + i, Ops::Min(Ops::Max(Ops::Load((const T*)a + i), low), high)); \
+    SimdScalar::Clamp<typename Ops::Scalar>((T*)dst + i, (const T*)a + i, scalars, n - i); \
+  }
+
+namespace SimdSse
+{
+#define INT_BINARY(name, vop) SIMD_VECTOR_BINARY(name, "sse4.1", int32_t, 4, __m128i, __m128i, _mm_loadu_si128, _mm_storeu_si128, vop)
+#define FLOAT_BINARY(name, vop) SIMD_VECTOR_BINARY(name, "sse4.1", float, 4, __m128, float, _mm_loadu_ps, _mm_storeu_ps, vop)
+  INT_BINARY(ADD_INT, _mm_add_epi32(x, y))
+  INT_BINARY(SUB_INT, _mm_sub_epi32(x, y))
+  INT_BINARY(MUL_INT, _mm_mullo_epi32(x, y))
+  FLOAT_BINARY(ADD_FLOAT, _mm_add_ps(x, y))
+  FLOAT_BINARY(SUB_FLOAT, _mm_sub_ps(x, y))
+  FLOAT_BINARY(MUL_FLOAT, _mm_mul_ps(x, y))
+  FLOAT_BINARY(DIV_FLOAT, _mm_div_ps(x, y))
+  SIMD_VECTOR_UNARY(NEG_INT, "sse4.1", int32_t, 4, __m128i, __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_sub_epi32(_mm_setzero_si128(), x))
+  SIMD_VECTOR_UNARY(NEG_FLOAT, "sse4.1", float, 4, __m128, float, _mm_loadu_ps, _mm_storeu_ps, _mm_xor_ps(x, _mm_set1_ps(-0.0f)))
+#undef INT_BINARY
+#undef FLOAT_BINARY
+
+#define SIMD_SSE __attribute__((target("sse4.1")))
+  struct Int
+  {
+    using T = int32_t;
+    using V = __m128i;
+    using Scalar = SimdScalar::Int;
+    static const int WIDTH = 4;
+    SIMD_SSE static V Load(const T* p) { return _mm_loadu_si128((const __m128i*)p); }
+    SIMD_SSE static void Store(T* p, V x) { _mm_storeu_si128((__m128i*)p, x); }
+    SIMD_SSE static V Set(T x) { return _mm_set1_epi32(x); }
+    SIMD_SSE static V Add(V x, V y) { return _mm_add_epi32(x, y); }
+    SIMD_SSE static V Mul(V x, V y) { return _mm_mullo_epi32(x, y); }
+    SIMD_SSE static V Min(V x, V y) { return _mm_min_epi32(x, y); }
+    SIMD_SSE static V Max(V x, V y) { return _mm_max_epi32(x, y); }
+    // Sums of the lanes up to and including each one
+    SIMD_SSE static V Scan(V x)
+    {
+      x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+      return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    }
+    SIMD_SSE static V Last(V x) { return _mm_shuffle_epi32(x, 0xff); }
+  };
+
+  struct Float
+  {
+    using T = float;
+    using V = __m128;
+    using Scalar = SimdScalar::Float;
+    static const int WIDTH = 4;
+    SIMD_SSE static V Load(const T* p) { return _mm_loadu_ps(p); }
+    SIMD_SSE static void Store(T* p, V x) { _mm_storeu_ps(p, x); }
+    SIMD_SSE static V Set(T x) { return _mm_set1_ps(x); }
+    SIMD_SSE static V Add(V x, V y) { return _mm_add_ps(x, y); }
+    SIMD_SSE static V Mul(V x, V y) { return _mm_mul_ps(x, y); }
+    SIMD_SSE static V Min(V x, V y) { return _mm_min_ps(x, y); }
+    SIMD_SSE static V Max(V x, V y) { return _mm_max_ps(x, y); }
+  };
+#undef SIMD_SSE
+
+  SIMD_VECTOR_LIBRARY("sse4.1")
+  LIST_SIMD_LIBRARY
+}
+
+namespace SimdAvx
+{
+#define INT_BINARY(name, vop) SIMD_VECTOR_BINARY(name, "avx2", int32_t, 8, __m256i, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, vop)
+#define FLOAT_BINARY(name, vop) SIMD_VECTOR_BINARY(name, "avx2", float, 8, __m256, float, _mm256_loadu_ps, _mm256_storeu_ps, vop)
+  INT_BINARY(ADD_INT, _mm256_add_epi32(x, y))
+  INT_BINARY(SUB_INT, _mm256_sub_epi32(x, y))
+  INT_BINARY(MUL_INT, _mm256_mullo_epi32(x, y))
+  FLOAT_BINARY(ADD_FLOAT, _mm256_add_ps(x, y))
+  FLOAT_BINARY(SUB_FLOAT, _mm256_sub_ps(x, y))
+  FLOAT_BINARY(MUL_FLOAT, _mm256_mul_ps(x, y))
+  FLOAT_BINARY(DIV_FLOAT, _mm256_div_ps(x, y))
+  SIMD_VECTOR_UNARY(NEG_INT, "avx2", int32_t, 8, __m256i, __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_sub_epi32(_mm256_setzero_si256(), x))
+  SIMD_VECTOR_UNARY(NEG_FLOAT, "avx2", float, 8, __m256, float, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_xor_ps(x, _mm256_set1_ps(-0.0f)))
+#undef INT_BINARY
+#undef FLOAT_BINARY
+
+#define SIMD_AVX __attribute__((target("avx2")))
+  struct Int
+  {
+    using T = int32_t;
+    using V = __m256i;
+    using Scalar = SimdScalar::Int;
+    static const int WIDTH = 8;
+    SIMD_AVX static V Load(const T* p) { return _mm256_loadu_si256((const __m256i*)p); }
+    SIMD_AVX static void Store(T* p, V x) { _mm256_storeu_si256((__m256i*)p, x); }
+    SIMD_AVX static V Set(T x) { return _mm256_set1_epi32(x); }
+    SIMD_AVX static V Add(V x, V y) { return _mm256_add_epi32(x, y); }
+    SIMD_AVX static V Mul(V x, V y) { return _mm256_mullo_epi32(x, y); }
+    SIMD_AVX static V Min(V x, V y) { return _mm256_min_epi32(x, y); }
+    SIMD_AVX static V Max(V x, V y) { return _mm256_max_epi32(x, y); }
+    // Sums of the lanes up to and including each one. The shifts stay within
+    // each half, so the last sum of the low half is added to the high half.
+    SIMD_AVX static V Scan(V x)
+    {
+      x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+      x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+      V low = _mm256_permute2x128_si256(x, x, 0x08);
+      return _mm256_add_epi32(x, _mm256_shuffle_epi32(low, 0xff));
+    }
+    SIMD_AVX static V Last(V x) { return _mm256_permutevar8x32_epi32(x, _mm256_set1_epi32(7)); }
+  };
+
+  struct Float
+  {
+    using T = float;
+    using V = __m256;
+    using Scalar = SimdScalar::Float;
+    static const int WIDTH = 8;
+    SIMD_AVX static V Load(const T* p) { return _mm256_loadu_ps(p); }
+    SIMD_AVX static void Store(T* p, V x) { _mm256_storeu_ps(p, x); }
+    SIMD_AVX static V Set(T x) { return _mm256_set1_ps(x); }
+    SIMD_AVX static V Add(V x, V y) { return _mm256_add_ps(x, y); }
+    SIMD_AVX static V Mul(V x, V y) { return _mm256_mul_ps(x, y); }
+    SIMD_AVX static V Min(V x, V y) { return _mm256_min_ps(x, y); }
+    SIMD_AVX static V Max(V x, V y) { return _mm256_max_ps(x, y); }
+  };
+#undef SIMD_AVX
+
+  SIMD_VECTOR_LIBRARY("avx2")
+  LIST_SIMD_LIBRARY
+}
+
+#undef SIMD_VECTOR_BINARY
+#undef SIMD_VECTOR_UNARY
+#undef SIMD_VECTOR_LIBRARY
+
+#endif
+
+#undef SIMD_FOLD
+#undef SIMD_DOT
+#undef SIMD_SCAN
+#undef SIMD_MAP
+
+class Simd
+{
+  public:
+    // Number of elements processed by each kernel call of a vector loop
+    static const int TILE = 1024;
+    static const int MAX_TEMPS = 16;
+
+    // The best level supported by the cpu
+    static SimdLevel Detect()
+    {
+#ifdef SIMD_X86
+      __builtin_cpu_init();
+      if(__builtin_cpu_supports("avx2"))
+        return SimdLevel::AVX;
+      if(__builtin_cpu_supports("sse4.1"))
+        return SimdLevel::SSE;
+#endif
+      return SimdLevel::SCALAR;
+    }
+
+    static SimdLevel GetLevel()
+    {
+      return level;
+    }
+
+    // Levels above what the cpu supports are lowered to the best supported
+    static void SetLevel(SimdLevel newLevel)
+    {
+      level = std::min(newLevel, Detect());
+    }
+
+    static const char* GetName(SimdLevel level)
+    {
+      switch(level)
+      {
+        case SimdLevel::SCALAR: return "scalar";
+        case SimdLevel::SSE: return "sse4.1";
+        case SimdLevel::AVX: return "avx2";
+      }
+      return "invalid";
+    }
+
+    // Kernels of the current level
+    static const SimdKernels& Kernels()
+    {
+#define SIMD_BINARY(name, type, expr) SIMD_NAMESPACE::name,
+#define SIMD_UNARY(name, type, expr) SIMD_NAMESPACE::name,
+#define SIMD_FOLD(name, ops, op) SIMD_NAMESPACE::name,
+#define SIMD_DOT(name, ops) SIMD_NAMESPACE::name,
+#define SIMD_SCAN(name, ops) SIMD_NAMESPACE::name,
+#define SIMD_MAP(name, ops, function) SIMD_NAMESPACE::name,
+#define SIMD_NAMESPACE SimdScalar
+      static const SimdKernels scalar{LIST_SIMD_BINARY LIST_SIMD_UNARY LIST_SIMD_LIBRARY};
+#undef SIMD_NAMESPACE
+#ifdef SIMD_X86
+#define SIMD_NAMESPACE SimdSse
+      static const SimdKernels sse{LIST_SIMD_BINARY LIST_SIMD_UNARY LIST_SIMD_LIBRARY};
+#undef SIMD_NAMESPACE
+#define SIMD_NAMESPACE SimdAvx
+      static const SimdKernels avx{LIST_SIMD_BINARY LIST_SIMD_UNARY LIST_SIMD_LIBRARY};
+#undef SIMD_NAMESPACE
+      if(level == SimdLevel::AVX)
+        return avx;
+      if(level == SimdLevel::SSE)
+        return sse;
+#endif
+#undef SIMD_BINARY
+#undef SIMD_UNARY
+#undef SIMD_FOLD
+#undef SIMD_DOT
+#undef SIMD_SCAN
+#undef SIMD_MAP
+      return scalar;
+    }
+
+    static SimdBinary GetBinary(Opcode opcode)
+    {
+      const SimdKernels& kernels = Kernels();
+      switch(opcode)
+      {
+#define SIMD_BINARY(name, type, expr) case Opcode::name: return kernels.name;
+        LIST_SIMD_BINARY
+#undef SIMD_BINARY
+        default: return nullptr;
+      }
+    }
+
+    static SimdUnary GetUnary(Opcode opcode)
+    {
+      const SimdKernels& kernels = Kernels();
+      switch(opcode)
+      {
+#define SIMD_UNARY(name, type, expr) case Opcode::name: return kernels.name;
+        LIST_SIMD_UNARY
+#undef SIMD_UNARY
+        default: return nullptr;
+      }
+    }
+
+  private:
+    static inline SimdLevel level = Detect();
+};
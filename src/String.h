@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Shared storage for the characters of long strings. The characters of a
+// buffer are never changed once a string refers to them, so concatenating to
+// the string that ends at used can append in place and share the buffer.
+struct StringBuffer
+{
+  uint32_t capacity;
+  uint32_t used;
+  // Where the buffer lives and set once it is moved, see Heap
+  uint32_t gc;
+  StringBuffer* forward;
+
+  char* Data()
+  {
+    return reinterpret_cast<char*>(this + 1);
+  }
+};
+
+// Characters of a string that doesn't fit in a register. Substrings point
+// into the characters of the string they are taken from. Buffer is null when
+// the characters aren't owned by the heap, such as the constants of a program.
+// Once the collector has moved the string data points to the copy.
+struct StringData
+{
+  const char* data;
+  int32_t length;
+  uint32_t gc;
+  StringBuffer* buffer;
+};
+
+// Immutable string stored in a single register. Strings of up to 7 characters
+// are kept inline with the length in the low byte and the characters in the
+// following bytes, longer strings point to their StringData. Every string
+// that fits inline is stored inline so equal strings are either both inline
+// or both not.
+struct String
+{
+  static const int INLINE_LENGTH = 7;
+  static const int32_t MAX_LENGTH = 1 << 30;
+
+  uint64_t bits;
+
+  static String Inline(const char* data, int length)
+  {
+    uint64_t bits = (uint64_t)length << 1 | 1;
+    for(int i = 0;i<length;i++)
+      bits |= (uint64_t)(uint8_t)data[i] << (8 * (i + 1));
+    return {bits};
+  }
+
+  static String FromData(const StringData* data)
+  {
+    return {(uint64_t)(uintptr_t)data};
+  }
+
+  // Returned by the heap when it is out of memory
+  static String Null()
+  {
+    return {0};
+  }
+
+  bool IsNull() const
+  {
+    return bits == 0;
+  }
+
+  bool IsInline() const
+  {
+    return bits & 1;
+  }
+
+  const StringData* Data() const
+  {
+    return reinterpret_cast<const StringData*>((uintptr_t)bits);
+  }
+
+  int32_t Length() const
+  {
+    if(IsInline())
+      return (bits & 0xff) >> 1;
+    return Data()->length;
+  }
+
+  char At(int32_t index) const
+  {
+    if(IsInline())
+      return (char)(bits >> (8 * (index + 1)));
+    return Data()->data[index];
+  }
+
+  // The characters of the string, inline strings are copied to scratch
+  std::string_view View(char (&scratch)[INLINE_LENGTH]) const
+  {
+    if(!IsInline())
+      return {Data()->data, (size_t)Data()->length};
+    int length = Length();
+    for(int i = 0;i<length;i++)
+      scratch[i] = At(i);
+    return {scratch, (size_t)length};
+  }
+
+  static bool Equals(String a, String b)
+  {
+    if(a.bits == b.bits)
+      return true;
+    if(a.IsInline() || b.IsInline())
+      return false;
+    const StringData* x = a.Data();
+    const StringData* y = b.Data();
+    return x->length == y->length && memcmp(x->data, y->data, x->length) == 0;
+  }
+
+  // Returns a negative, zero or positive value like strcmp
+  static int Compare(String a, String b)
+  {
+    char scratchA[INLINE_LENGTH];
+    char scratchB[INLINE_LENGTH];
+    int result = a.View(scratchA).compare(b.View(scratchB));
+    return result < 0 ? -1 : result > 0 ? 1 : 0;
+  }
+};
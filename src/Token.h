@@ -1,6 +1,7 @@
 #pragma once
 
-#include <map>
+#include <string>
+#include <string_view>
 #include <iostream>
 
 #define LIST_TOKENS \
@@ -61,53 +62,58 @@ enum class Token
 
 class Tokens
 {
-
   private:
+    struct Reserved
+    {
+      std::string_view name;
+      Token token;
+    };
 
-    static std::map<std::string_view, Token> reservedTokens;
-    static std::map<Token, std::string> tokenName;
-
+    // Constant initialized, so nothing is set up before main
+    static constexpr Reserved reservedTokens[] = {
+      {"int", Token::INT},
+      {"float", Token::FLOAT},
+      {"string", Token::STRING_K},
+      {"char", Token::CHAR_K},
+      {"if", Token::IF},
+      {"for", Token::FOR},
+      {"while", Token::WHILE},
+      {"else", Token::ELSE},
+      {"return", Token::RETURN},
+      {"in", Token::IN},
+      {"void", Token::VOID},
+    };
 
   public:
     static std::string GetName(Token token)
     {
-      return tokenName.find(token)->second;
+      switch(token)
+      {
+#define TOKEN(x) case Token::x: return #x;
+        LIST_TOKENS
+#undef TOKEN
+      }
+      return "INVALID";
     }
 
-    static Token GetReservedToken(const std::string& str)
+    static Token GetReservedToken(std::string_view str)
     {
-      auto it = reservedTokens.find(str);
-      if(it == reservedTokens.end())
-        return Token::INVALID;
-      return it->second;
+      for(const Reserved& reserved : reservedTokens)
+      {
+        if(reserved.name == str)
+          return reserved.token;
+      }
+      return Token::INVALID;
     }
 };
 
-std::map<std::string_view, Token> Tokens::reservedTokens{
-  {"int", Token::INT},
-  {"float", Token::FLOAT},
-  {"string", Token::STRING_K},
-  {"char", Token::CHAR_K},
-  {"if", Token::IF},
-  {"for", Token::FOR},
-  {"while", Token::WHILE},
-  {"else", Token::ELSE},
-  {"return", Token::RETURN},
-  {"in", Token::IN},
-  {"void", Token::VOID},
-};
-
-#define TOKEN(x) {Token::x, #x},
-    std::map<Token, std::string> Tokens::tokenName{
-      LIST_TOKENS
-    };
-#undef TOKEN
-
 struct TokenPos
 {
   Token token;
   size_t line;
   size_t column;
+  // Text of names and literals, empty for all other tokens
+  std::string value;
 
   friend std::ostream& operator<<(std::ostream& stream, const TokenPos& token)
   {
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <iostream>
+
+enum class Type
+{
+  INVALID, VOID, INT, FLOAT, CHAR, STRING, INT_ARRAY, FLOAT_ARRAY, CHAR_ARRAY,
+  // Maps named by their values and keys, int[string] maps strings to ints
+  INT_BY_INT, INT_BY_STRING, FLOAT_BY_INT, FLOAT_BY_STRING, STRING_BY_INT, STRING_BY_STRING
+};
+
+class Types
+{
+  public:
+    static const char* GetName(Type type)
+    {
+      switch(type)
+      {
+        case Type::INVALID: return "invalid";
+        case Type::VOID: return "void";
+        case Type::INT: return "int";
+        case Type::FLOAT: return "float";
+        case Type::CHAR: return "char";
+        case Type::STRING: return "string";
+        case Type::INT_ARRAY: return "int[]";
+        case Type::FLOAT_ARRAY: return "float[]";
+        case Type::CHAR_ARRAY: return "char[]";
+        case Type::INT_BY_INT: return "int[int]";
+        case Type::INT_BY_STRING: return "int[string]";
+        case Type::FLOAT_BY_INT: return "float[int]";
+        case Type::FLOAT_BY_STRING: return "float[string]";
+        case Type::STRING_BY_INT: return "string[int]";
+        case Type::STRING_BY_STRING: return "string[string]";
+      }
+      return "invalid";
+    }
+
+    static bool IsArray(Type type)
+    {
+      return type == Type::INT_ARRAY || type == Type::FLOAT_ARRAY || type == Type::CHAR_ARRAY;
+    }
+
+    static bool IsMap(Type type)
+    {
+      return type >= Type::INT_BY_INT && type <= Type::STRING_BY_STRING;
+    }
+
+    // Types whose values live in the heap
+    static bool IsReference(Type type)
+    {
+      return type == Type::STRING || IsArray(type) || IsMap(type);
+    }
+
+    // Arrays, strings and maps can be indexed and iterated over
+    static bool IsIndexable(Type type)
+    {
+      return IsArray(type) || type == Type::STRING || IsMap(type);
+    }
+
+    // Returns INVALID for element types that can't be stored in arrays
+    static Type ArrayOf(Type element)
+    {
+      switch(element)
+      {
+        case Type::INT: return Type::INT_ARRAY;
+        case Type::FLOAT: return Type::FLOAT_ARRAY;
+        case Type::CHAR: return Type::CHAR_ARRAY;
+        default: return Type::INVALID;
+      }
+    }
+
+    // Returns INVALID for keys and values that can't be stored in maps
+    static Type MapOf(Type value, Type key)
+    {
+      if(key != Type::INT && key != Type::STRING)
+        return Type::INVALID;
+      bool stringKeys = key == Type::STRING;
+      switch(value)
+      {
+        case Type::INT: return stringKeys ? Type::INT_BY_STRING : Type::INT_BY_INT;
+        case Type::FLOAT: return stringKeys ? Type::FLOAT_BY_STRING : Type::FLOAT_BY_INT;
+        case Type::STRING: return stringKeys ? Type::STRING_BY_STRING : Type::STRING_BY_INT;
+        default: return Type::INVALID;
+      }
+    }
+
+    // Type of indexing the array, string or map, the value of a map
+    static Type ElementOf(Type array)
+    {
+      switch(array)
+      {
+        case Type::INT_ARRAY: return Type::INT;
+        case Type::FLOAT_ARRAY: return Type::FLOAT;
+        case Type::CHAR_ARRAY: return Type::CHAR;
+        case Type::STRING: return Type::CHAR;
+        case Type::INT_BY_INT: return Type::INT;
+        case Type::INT_BY_STRING: return Type::INT;
+        case Type::FLOAT_BY_INT: return Type::FLOAT;
+        case Type::FLOAT_BY_STRING: return Type::FLOAT;
+        case Type::STRING_BY_INT: return Type::STRING;
+        case Type::STRING_BY_STRING: return Type::STRING;
+        default: return Type::INVALID;
+      }
+    }
+
+    static Type KeyOf(Type map)
+    {
+      switch(map)
+      {
+        case Type::INT_BY_INT:
+        case Type::FLOAT_BY_INT:
+        case Type::STRING_BY_INT:
+          return Type::INT;
+        case Type::INT_BY_STRING:
+        case Type::FLOAT_BY_STRING:
+        case Type::STRING_BY_STRING:
+          return Type::STRING;
+        default:
+          return Type::INVALID;
+      }
+    }
+
+    // Type of the loop variable when iterating over the value, maps are
+    // iterated over their keys
+    static Type IterationOf(Type type)
+    {
+      return IsMap(type) ? KeyOf(type) : ElementOf(type);
+    }
+
+    // Size in bytes of an element in an array
+    static int GetSize(Type element)
+    {
+      return element == Type::CHAR ? 1 : 4;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& os, Type type)
+{
+  return os << Types::GetName(type);
+}
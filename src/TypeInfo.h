@@ -0,0 +1,57 @@
+#pragma once
+
+#include "Heap.h"
+#include "Type.h"
+#include "Value.h"
+
+#include <string>
+#include <type_traits>
+
+// Conversion between host types and registers, resolved at compile time so
+// that arguments are never boxed.
+template <typename T>
+struct TypeInfo
+{
+  static constexpr Type type = Type::INVALID;
+};
+
+template <>
+struct TypeInfo<void>
+{
+  static constexpr Type type = Type::VOID;
+};
+
+template <>
+struct TypeInfo<int>
+{
+  static constexpr Type type = Type::INT;
+  static Value ToValue(int value, Heap& heap) { Value v; v.i = value; return v; }
+  static int FromValue(Value value) { return value.i; }
+};
+
+template <>
+struct TypeInfo<float>
+{
+  static constexpr Type type = Type::FLOAT;
+  static Value ToValue(float value, Heap& heap) { Value v; v.f = value; return v; }
+  static float FromValue(Value value) { return value.f; }
+};
+
+template <>
+struct TypeInfo<char>
+{
+  static constexpr Type type = Type::CHAR;
+  static Value ToValue(char value, Heap& heap) { Value v; v.i = value; return v; }
+  static char FromValue(Value value) { return value.i; }
+};
+
+template <>
+struct TypeInfo<std::string>
+{
+  static constexpr Type type = Type::STRING;
+  static Value ToValue(const std::string& value, Heap& heap) { Value v; v.s = heap.AllocateString(value); return v; }
+  static std::string FromValue(Value value) { char scratch[String::INLINE_LENGTH]; return std::string{value.s.View(scratch)}; }
+};
+
+template <typename T>
+using TypeInfoOf = TypeInfo<std::decay_t<T>>;
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "String.h"
+
+#include <cstdint>
+
+// Arrays are a header followed by the unboxed elements in the same block of
+// memory. The header is padded so that the elements are aligned for vector
+// loads.
+struct alignas(32) Array
+{
+  static const int32_t MAX_LENGTH = 1 << 30;
+
+  int32_t length;
+  // Where the array lives and set once it is moved, see Heap
+  uint32_t gc;
+  int32_t elementSize;
+  Array* forward;
+
+  template <typename T>
+  T* Data()
+  {
+    return reinterpret_cast<T*>(this + 1);
+  }
+};
+
+// Slots and entries of a map in a single block: a control byte for every
+// slot, the entry in every slot, then the keys followed by the values of the
+// entries in the order they were added. Slots are probed a group at a time.
+struct alignas(32) MapTable
+{
+  static const uint32_t GROUP = 16;
+  // Control byte of a slot without an entry, the others hold the low 7 bits
+  // of the hash of their key
+  static const uint8_t EMPTY = 0x80;
+
+  // Slots, a power of two of at least GROUP
+  uint32_t capacity;
+  // Where the table lives and set once it is moved, see Heap
+  uint32_t gc;
+  MapTable* forward;
+
+  // Entries that fit in the table, which keeps an eighth of the slots empty
+  static uint32_t EntryCapacity(uint32_t capacity)
+  {
+    return capacity / 8 * 7;
+  }
+
+  static size_t Bytes(uint32_t capacity, int keySize, int valueSize)
+  {
+    return sizeof(MapTable) + (size_t)capacity * (1 + sizeof(int32_t)) + (size_t)EntryCapacity(capacity) * (keySize + valueSize);
+  }
+
+  uint8_t* Control()
+  {
+    return reinterpret_cast<uint8_t*>(this + 1);
+  }
+
+  int32_t* Slots()
+  {
+    return reinterpret_cast<int32_t*>(Control() + capacity);
+  }
+
+  char* Keys()
+  {
+    return reinterpret_cast<char*>(Slots() + capacity);
+  }
+
+  char* Values(int keySize)
+  {
+    return Keys() + (size_t)EntryCapacity(capacity) * keySize;
+  }
+};
+
+// Hash table from int or string keys to int, float or string values, see
+// Maps. The length is in the same place as in arrays. The table is replaced
+// by a larger one when it is full and is null until the first entry is
+// added.
+struct Map
+{
+  static const int32_t MAX_LENGTH = 1 << 28;
+  // Bits of kind
+  static const uint32_t STRING_KEYS = 1;
+  static const uint32_t STRING_VALUES = 2;
+
+  int32_t length;
+  // Where the map lives and set once it is moved, see Heap
+  uint32_t gc;
+  uint32_t kind;
+  MapTable* table;
+  Map* forward;
+
+  int KeySize() const
+  {
+    return kind & STRING_KEYS ? sizeof(String) : sizeof(int32_t);
+  }
+
+  int ValueSize() const
+  {
+    return kind & STRING_VALUES ? sizeof(String) : sizeof(int32_t);
+  }
+};
+
+// A single register. The compiler knows the static type of every register so
+// values are stored unboxed and never carry a type tag.
+union Value
+{
+  int32_t i;
+  float f;
+  String s;
+  Array* a;
+  Map* m;
+};
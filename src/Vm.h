@@ -0,0 +1,1425 @@
+#pragma once
+
+#include "Builtins.h"
+#include "Bytecode.h"
+#include "Heap.h"
+#include "HeapProfiler.h"
+#include "Map.h"
+#include "Native.h"
+#include "Parallel.h"
+#include "Profiler.h"
+#include "Simd.h"
+#include "Value.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <iostream>
+
+// Why the last call made by the host failed
+enum class VmError
+{
+  NONE, RUNTIME, BUDGET, MEMORY, STACK
+};
+
+class Vm
+{
+  public:
+    // Registers are allocated in segments. A call whose frame doesn't fit in
+    // the current segment continues in the next one with its arguments
+    // copied over, so the stack grows without moving any frame.
+    static constexpr size_t SEGMENT_SIZE = 1 << 16;
+    static constexpr size_t MAX_STACK_SIZE = 1 << 24;
+    static const size_t MAX_CALL_DEPTH = 1 << 22;
+    // Callers listed with a runtime error
+    static constexpr size_t MAX_TRACE_DEPTH = 16;
+
+  private:
+
+    struct Segment
+    {
+      std::unique_ptr<Value[]> registers;
+      size_t size;
+    };
+
+    // Where execution continues when a call returns. The result is written
+    // to the frame start b of the call instruction before ip. Script calls
+    // don't recurse in the interpreter, only calls made by host functions do.
+    struct Frame
+    {
+      const CompiledFunction* function;
+      const Instruction* ip;
+      Value* regs;
+      int segment;
+    };
+
+    // Registers and segment of the caller of each host call
+    struct HostFrame
+    {
+      Value* top;
+      int segment;
+    };
+
+    // Where a call made by the host is executing, saved when it is suspended
+    struct Activation
+    {
+      const CompiledFunction* function;
+      const Instruction* ip;
+      Value* regs;
+      // Registers receiving the result and the state to unwind to
+      Value* entryRegs;
+      size_t base;
+      int entrySegment;
+    };
+
+    std::vector<Segment> segments;
+    std::vector<Frame> frames;
+    // Number of frames in use, frames only grows
+    size_t frameCount;
+    std::vector<HostFrame> hostFrames;
+    // Tiles of the temporaries of vector loops, allocated by the first loop
+    std::vector<int32_t> vectorTemps;
+    int segment;
+    Value* segmentEnd;
+    size_t stackSize;
+    // First register that isn't used by a running function
+    Value* top;
+    // Number of Execute calls on the native stack, only the outermost one
+    // can be suspended
+    int executeDepth;
+    // Functions running as native code, whose registers the heap can't be
+    // collected under
+    int nativeDepth;
+    bool suspendable;
+    bool suspendRequested;
+    bool suspended;
+    bool preempted;
+    // Counts down the back-edges and calls until the time slice or the
+    // budget ends, whichever is first. It started at sliceStart.
+    int64_t slice;
+    int64_t sliceStart;
+    int64_t sliceLength;
+    // Back-edges and calls the vm may run, negative for no limit
+    int64_t budget;
+    int64_t budgetUsed;
+    size_t maxStackSize;
+    VmError error;
+    Activation activation;
+    Profiler* profiler;
+    // Execution time since the last sample and when it was last counted
+    std::chrono::nanoseconds sampleCredit;
+    std::chrono::steady_clock::time_point lastCheck;
+    std::vector<ProfileFrame> sampleStack;
+    HeapProfiler* heapProfiler;
+    // Bytes until the next sampled allocation
+    int64_t heapSampleCountdown;
+    // Bytes recorded for each site since the heap was released
+    std::map<HeapSite, uint64_t> liveSites;
+    ParallelPool* parallelPool;
+    // Bodies of parallel loops whose callees are compiled, see CompileCallees
+    std::set<const CompiledFunction*> readyLoops;
+
+  public:
+    Heap heap;
+
+    // The first segment holds initialStack registers, the stack of a vm
+    // that runs small scripts can therefore be small
+    explicit Vm(size_t initialStack = SEGMENT_SIZE)
+      : frames(16), frameCount{0}, segment{0}, stackSize{initialStack}, executeDepth{0}, nativeDepth{0}, suspendable{false},
+        suspendRequested{false}, suspended{false}, preempted{false}, slice{INT64_MAX}, sliceStart{INT64_MAX},
+        sliceLength{-1}, budget{-1}, budgetUsed{0}, maxStackSize{MAX_STACK_SIZE}, error{VmError::NONE},
+        profiler{nullptr}, sampleCredit{0}, heapProfiler{nullptr}, heapSampleCountdown{0}, parallelPool{nullptr}
+    {
+      segments.push_back({std::make_unique<Value[]>(initialStack), initialStack});
+      top = segments[0].registers.get();
+      segmentEnd = top + initialStack;
+    }
+
+    ~Vm()
+    {
+      ReleaseSites();
+    }
+
+    // The vm running on the current thread, used by host functions to reach
+    // the vm calling them
+    static Vm*& Current()
+    {
+      static thread_local Vm* current = nullptr;
+      return current;
+    }
+
+    // Called around each call made by the host, the heap is released when
+    // the outermost call returns
+    void Enter()
+    {
+      hostFrames.push_back({top, segment});
+    }
+
+    void Leave()
+    {
+      top = hostFrames.back().top;
+      SetSegment(hostFrames.back().segment);
+      hostFrames.pop_back();
+      if(hostFrames.empty())
+      {
+        heap.Release();
+        ReleaseSites();
+      }
+    }
+
+    // Registers for a call made by the host. Returns nullptr if the stack is
+    // full.
+    Value* Reserve(const Program& program, int index)
+    {
+      return Reserve(program.functions[index]);
+    }
+
+    Value* Reserve(const CompiledFunction& function)
+    {
+      if(top + function.registerCount <= segmentEnd)
+        return top;
+      Value* regs = NextSegment(function.registerCount);
+      if(regs == nullptr)
+        Error(function, "Stack overflow", VmError::STACK);
+      return regs;
+    }
+
+    // Returns false on a runtime error. A suspendable call can also stop
+    // early, which is told by IsSuspended, and is then continued by Resume.
+    bool Call(const Program& program, int index, Value* regs)
+    {
+      return Call(program, program.functions[index], regs);
+    }
+
+    bool Call(const Program& program, const CompiledFunction& function, Value* regs)
+    {
+      if(regs + function.registerCount > segmentEnd)
+        return Error(function, "Stack overflow", VmError::STACK);
+      return Run(program, {&function, function.code.data(), regs, regs, frameCount, segment});
+    }
+
+    bool Resume(const Program& program)
+    {
+      suspended = false;
+      preempted = false;
+      return Run(program, activation);
+    }
+
+    // Allows the outermost call to be suspended by host functions and
+    // preempted by the time slice
+    void SetSuspendable(bool value)
+    {
+      suspendable = value;
+    }
+
+    // Number of back-edges and calls a suspendable call runs before it is
+    // preempted, negative for no limit
+    void SetTimeSlice(int64_t length)
+    {
+      sliceLength = length;
+    }
+
+    // Back-edges and calls the following calls may run together before they
+    // fail, negative for no limit. Bounds the time a script can run since
+    // code without back-edges and calls runs each instruction once.
+    void SetBudget(int64_t length)
+    {
+      budget = length;
+      budgetUsed = 0;
+    }
+
+    int64_t BudgetUsed()
+    {
+      SyncBudget();
+      return budgetUsed;
+    }
+
+    // Bytes the heap may hold, the heap is also limited by MAX_LENGTH of
+    // strings and arrays
+    void SetMemoryLimit(size_t bytes)
+    {
+      heap.SetLimit(bytes);
+    }
+
+    // Registers the stack may grow to, at most MAX_STACK_SIZE
+    void SetStackLimit(size_t registers)
+    {
+      maxStackSize = std::min(std::max(registers, segments[0].size), MAX_STACK_SIZE);
+    }
+
+    // Samples the calls made by the host into the profiler, nullptr to stop
+    void SetProfiler(Profiler* newProfiler)
+    {
+      profiler = newProfiler;
+      sampleCredit = std::chrono::nanoseconds{0};
+    }
+
+    // Attributes the allocations of scripts to their allocation site,
+    // nullptr to stop
+    void SetHeapProfiler(HeapProfiler* newProfiler)
+    {
+      ReleaseSites();
+      heapProfiler = newProfiler;
+      heapSampleCountdown = newProfiler ? newProfiler->SampleInterval() : 0;
+    }
+
+    // Threads that #parallel loops run on, nullptr to run them on the
+    // calling thread. They also run on the calling thread while the vm has a
+    // budget or a profiler and while the pool runs another loop. Host
+    // functions called by the loops must be thread-safe. The heap isn't
+    // collected until the loop is done.
+    void SetParallelPool(ParallelPool* pool)
+    {
+      parallelPool = pool;
+    }
+
+    VmError GetError() const
+    {
+      return error;
+    }
+
+    static const char* GetErrorName(VmError error)
+    {
+      switch(error)
+      {
+        case VmError::NONE: return "none";
+        case VmError::RUNTIME: return "runtime error";
+        case VmError::BUDGET: return "budget exceeded";
+        case VmError::MEMORY: return "out of memory";
+        case VmError::STACK: return "stack overflow";
+      }
+      return "invalid";
+    }
+
+    // Called by a host function to suspend the call once the host function
+    // returns. The result of the host function can be replaced with
+    // SetHostResult before resuming. Returns false if the call can't be
+    // suspended, such as when a host function called into the script.
+    bool Suspend()
+    {
+      if(!suspendable || executeDepth != 1)
+        return false;
+      suspendRequested = true;
+      return true;
+    }
+
+    bool IsSuspended() const
+    {
+      return suspended;
+    }
+
+    // Whether the call was suspended because its time slice ran out
+    bool WasPreempted() const
+    {
+      return preempted;
+    }
+
+    // Replaces the result of the host function that suspended the call
+    void SetHostResult(Value value)
+    {
+      activation.regs[activation.ip[-1].b] = value;
+    }
+
+  private:
+    bool Run(const Program& program, const Activation& start)
+    {
+      Vm* caller = Current();
+      Current() = this;
+      executeDepth++;
+      if(profiler && executeDepth == 1)
+        lastCheck = std::chrono::steady_clock::now();
+      error = VmError::NONE;
+      SyncBudget();
+      ResetSlice();
+      bool success = Execute(program, start);
+      executeDepth--;
+      if(profiler && executeDepth == 0)
+        sampleCredit += std::chrono::steady_clock::now() - lastCheck;
+      // The caller of a host function continues with a slice of its own
+      SyncBudget();
+      ResetSlice();
+      Current() = caller;
+      if(success && suspended)
+        return true;
+      // Unwind the script frames if the call failed
+      frameCount = start.base;
+      SetSegment(start.entrySegment);
+      return success;
+    }
+
+    // Counts what was used of the current slice
+    void SyncBudget()
+    {
+      budgetUsed += sliceStart - slice;
+      sliceStart = slice;
+    }
+
+    void ResetSlice()
+    {
+      sliceStart = INT64_MAX;
+      if(suspendable && executeDepth == 1 && sliceLength >= 0)
+        sliceStart = sliceLength;
+      if(budget >= 0)
+        sliceStart = std::min(sliceStart, std::max<int64_t>(budget - budgetUsed, 0));
+      if(profiler)
+        sliceStart = std::min(sliceStart, Profiler::SAMPLE_TICKS);
+      slice = sliceStart;
+    }
+
+    // Called when the slice has ended, returns whether the call is preempted
+    // or fails with VmError::BUDGET
+    VmError EndSlice(bool& preempt, const CompiledFunction* function, const Instruction* ip)
+    {
+      if(profiler)
+        Sample(function, ip);
+      // The count down ended one past zero
+      bool timeSliceEnded = suspendable && executeDepth == 1 && sliceStart == sliceLength;
+      budgetUsed += sliceStart + 1;
+      sliceStart = slice = 0;
+      if(budget >= 0 && budgetUsed > budget)
+        return VmError::BUDGET;
+      preempt = timeSliceEnded;
+      ResetSlice();
+      return VmError::NONE;
+    }
+
+    // Records the call stack, with ip in the innermost function, once a
+    // sample period of execution has passed
+    void Sample(const CompiledFunction* function, const Instruction* ip)
+    {
+      auto now = std::chrono::steady_clock::now();
+      sampleCredit += now - lastCheck;
+      lastCheck = now;
+      int64_t count = sampleCredit / profiler->Period();
+      if(count == 0)
+        return;
+      sampleCredit -= count * profiler->Period();
+      sampleStack.clear();
+      // Deep stacks keep their innermost frames
+      size_t first = 0;
+      if(frameCount >= Profiler::MAX_DEPTH)
+      {
+        first = frameCount - Profiler::MAX_DEPTH + 1;
+        sampleStack.push_back({nullptr, 0});
+      }
+      for(size_t i = first;i<frameCount;i++)
+        sampleStack.push_back({frames[i].function, (int32_t)(frames[i].ip - 1 - frames[i].function->code.data())});
+      sampleStack.push_back({function, (int32_t)(ip - function->code.data())});
+      profiler->Add(sampleStack, count);
+    }
+
+    // Records the bytes allocated by the instruction at ip, every allocation
+    // or the ones that pass a multiple of the sample interval
+    void RecordAllocation(const CompiledFunction* function, const Instruction* ip, size_t bytes)
+    {
+      if(bytes == 0)
+        return;
+      uint64_t count = 1;
+      uint64_t recorded = bytes;
+      int64_t interval = heapProfiler->SampleInterval();
+      if(interval > 0)
+      {
+        heapSampleCountdown -= bytes;
+        if(heapSampleCountdown > 0)
+          return;
+        int64_t samples = 1 + -heapSampleCountdown / interval;
+        heapSampleCountdown += samples * interval;
+        recorded = samples * interval;
+        count = std::max<uint64_t>(1, recorded / bytes);
+      }
+      HeapSite site{function, (int32_t)(ip - function->code.data())};
+      heapProfiler->Allocated(site, count, recorded);
+      liveSites[site] += recorded;
+    }
+
+    // The heap was released so everything recorded is no longer live
+    void ReleaseSites()
+    {
+      for(const auto& [site, bytes] : liveSites)
+        heapProfiler->Released(site, bytes);
+      liveSites.clear();
+    }
+
+    // Saves where the call continues when it is resumed
+    bool Pause(const Activation& at, bool timeSlice)
+    {
+      activation = at;
+      suspended = true;
+      preempted = timeSlice;
+      return true;
+    }
+
+    void SetSegment(int index)
+    {
+      segment = index;
+      segmentEnd = segments[index].registers.get() + segments[index].size;
+    }
+
+    // Moves to the start of the next segment, which must fit count registers.
+    // Segments after the current one are unused, so if the next one is too
+    // small it and the ones after it are dropped.
+    Value* NextSegment(size_t count)
+    {
+      size_t size = std::max(SEGMENT_SIZE, count);
+      if((size_t)segment + 1 == segments.size() || segments[segment + 1].size < size)
+      {
+        while((size_t)segment + 1 < segments.size())
+        {
+          stackSize -= segments.back().size;
+          segments.pop_back();
+        }
+        if(stackSize + size > maxStackSize)
+          return nullptr;
+        segments.push_back({std::make_unique<Value[]>(size), size});
+        stackSize += size;
+      }
+      SetSegment(segment + 1);
+      return segments[segment].registers.get();
+    }
+
+    bool GrowFrames()
+    {
+      if(frames.size() >= MAX_CALL_DEPTH)
+        return false;
+      frames.resize(frames.size() * 2);
+      return true;
+    }
+
+    // Registers of a callee frame with count arguments at args. The frame
+    // starts at args unless it doesn't fit in the current segment, in which
+    // case the arguments are copied to the next segment.
+    Value* CalleeFrame(const CompiledFunction& callee, Value* args, size_t count)
+    {
+      if(args + callee.registerCount <= segmentEnd)
+        return args;
+      Value* regs = NextSegment(callee.registerCount);
+      if(regs)
+        std::copy(args, args + count, regs);
+      return regs;
+    }
+
+    // Counts a back-edge or call, fails when the budget is used and pauses at
+    // ip once the time slice is used
+#define VM_TICK(at) \
+  if(--slice < 0) \
+  { \
+    bool preempt = false; \
+    if(EndSlice(preempt, function, &in) != VmError::NONE) \
+      return Error(*function, &in, "Budget exceeded", VmError::BUDGET); \
+    if(preempt) \
+      return Pause({function, at, regs, entryRegs, base, start.entrySegment}, true); \
+  }
+
+    bool Execute(const Program& program, const Activation& start)
+    {
+      const size_t base = start.base;
+      Value* const entryRegs = start.entryRegs;
+      const CompiledFunction* function = start.function;
+      Value* regs = start.regs;
+      const Instruction* code = function->code.data();
+      const Instruction* ip = start.ip;
+      while(true)
+      {
+        const Instruction& in = *ip++;
+        switch(in.op)
+        {
+          case Opcode::NOP:
+            break;
+          case Opcode::LOAD_INT:
+            regs[in.a].i = in.b;
+            break;
+          case Opcode::LOAD_FLOAT:
+            memcpy(&regs[in.a].f, &in.b, sizeof(float));
+            break;
+          case Opcode::LOAD_STRING:
+            regs[in.a].s = program.stringValues[in.b];
+            break;
+          case Opcode::MOVE:
+            regs[in.a] = regs[in.b];
+            break;
+          case Opcode::ADD_INT:
+            regs[in.a].i = (int32_t)((uint32_t)regs[in.b].i + (uint32_t)regs[in.c].i);
+            break;
+          case Opcode::SUB_INT:
+            regs[in.a].i = (int32_t)((uint32_t)regs[in.b].i - (uint32_t)regs[in.c].i);
+            break;
+          case Opcode::MUL_INT:
+            regs[in.a].i = (int32_t)((uint32_t)regs[in.b].i * (uint32_t)regs[in.c].i);
+            break;
+          case Opcode::DIV_INT:
+            if(regs[in.c].i == 0)
+              return Error(*function, &in, "Division by zero");
+            if(regs[in.c].i == -1)
+              regs[in.a].i = (int32_t)(0u - (uint32_t)regs[in.b].i);
+            else
+              regs[in.a].i = regs[in.b].i / regs[in.c].i;
+            break;
+          case Opcode::ADD_FLOAT:
+            regs[in.a].f = regs[in.b].f + regs[in.c].f;
+            break;
+          case Opcode::SUB_FLOAT:
+            regs[in.a].f = regs[in.b].f - regs[in.c].f;
+            break;
+          case Opcode::MUL_FLOAT:
+            regs[in.a].f = regs[in.b].f * regs[in.c].f;
+            break;
+          case Opcode::DIV_FLOAT:
+            regs[in.a].f = regs[in.b].f / regs[in.c].f;
+            break;
+          case Opcode::ADD_STRING:
+          {
+            if((int64_t)regs[in.b].s.Length() + regs[in.c].s.Length() > String::MAX_LENGTH)
+              return Error(*function, &in, "String is too large");
+            String result = AllocateAt(function, in, regs, [&] { return heap.Concat(regs[in.b].s, regs[in.c].s); });
+            if(result.IsNull())
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            regs[in.a].s = result;
+            break;
+          }
+          case Opcode::NEG_INT:
+            regs[in.a].i = (int32_t)(0u - (uint32_t)regs[in.b].i);
+            break;
+          case Opcode::NEG_FLOAT:
+            regs[in.a].f = -regs[in.b].f;
+            break;
+          case Opcode::NOT:
+            regs[in.a].i = regs[in.b].i == 0;
+            break;
+          case Opcode::BOOL:
+            regs[in.a].i = regs[in.b].i != 0;
+            break;
+          case Opcode::EQ_INT:
+            regs[in.a].i = regs[in.b].i == regs[in.c].i;
+            break;
+          case Opcode::NE_INT:
+            regs[in.a].i = regs[in.b].i != regs[in.c].i;
+            break;
+          case Opcode::LT_INT:
+            regs[in.a].i = regs[in.b].i < regs[in.c].i;
+            break;
+          case Opcode::LE_INT:
+            regs[in.a].i = regs[in.b].i <= regs[in.c].i;
+            break;
+          case Opcode::GT_INT:
+            regs[in.a].i = regs[in.b].i > regs[in.c].i;
+            break;
+          case Opcode::GE_INT:
+            regs[in.a].i = regs[in.b].i >= regs[in.c].i;
+            break;
+          case Opcode::EQ_FLOAT:
+            regs[in.a].i = regs[in.b].f == regs[in.c].f;
+            break;
+          case Opcode::NE_FLOAT:
+            regs[in.a].i = regs[in.b].f != regs[in.c].f;
+            break;
+          case Opcode::LT_FLOAT:
+            regs[in.a].i = regs[in.b].f < regs[in.c].f;
+            break;
+          case Opcode::LE_FLOAT:
+            regs[in.a].i = regs[in.b].f <= regs[in.c].f;
+            break;
+          case Opcode::GT_FLOAT:
+            regs[in.a].i = regs[in.b].f > regs[in.c].f;
+            break;
+          case Opcode::GE_FLOAT:
+            regs[in.a].i = regs[in.b].f >= regs[in.c].f;
+            break;
+          case Opcode::EQ_STRING:
+            regs[in.a].i = String::Equals(regs[in.b].s, regs[in.c].s);
+            break;
+          case Opcode::NE_STRING:
+            regs[in.a].i = !String::Equals(regs[in.b].s, regs[in.c].s);
+            break;
+          case Opcode::COMPARE_STRING:
+            regs[in.a].i = String::Compare(regs[in.b].s, regs[in.c].s);
+            break;
+          case Opcode::STRING_LENGTH:
+            regs[in.a].i = regs[in.b].s.Length();
+            break;
+          case Opcode::CHECK_STRING_INDEX:
+            if((uint32_t)regs[in.c].i >= (uint32_t)regs[in.b].s.Length())
+              return Error(*function, &in, "Index out of bounds");
+            break;
+          case Opcode::LOAD_STRING_CHAR:
+            regs[in.a].i = regs[in.b].s.At(regs[in.c].i);
+            break;
+          case Opcode::DROP_STRING:
+          {
+            String result = AllocateAt(function, in, regs, [&] { return heap.Substring(regs[in.b].s, regs[in.c].i, String::MAX_LENGTH); });
+            if(result.IsNull())
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            regs[in.a].s = result;
+            break;
+          }
+          case Opcode::TAKE_STRING:
+          {
+            String result = AllocateAt(function, in, regs, [&] { return heap.Substring(regs[in.b].s, 0, regs[in.c].i); });
+            if(result.IsNull())
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            regs[in.a].s = result;
+            break;
+          }
+          case Opcode::NEW_ARRAY:
+          {
+            int32_t length = regs[in.b].i;
+            if(length < 0)
+              return Error(*function, &in, "Negative array length");
+            if(length > Array::MAX_LENGTH)
+              return Error(*function, &in, "Array is too large");
+            Array* result = AllocateAt(function, in, regs, [&] { return heap.AllocateArray(length, in.c); });
+            if(result == nullptr)
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            regs[in.a].a = result;
+            break;
+          }
+          case Opcode::LOAD_EMPTY_ARRAY:
+            regs[in.a].a = Heap::EmptyArray();
+            break;
+          case Opcode::ARRAY_LENGTH:
+            regs[in.a].i = regs[in.b].a->length;
+            break;
+          case Opcode::CHECK_INDEX:
+            // Unsigned compare catches negative indices as well
+            if((uint32_t)regs[in.c].i >= (uint32_t)regs[in.b].a->length)
+              return Error(*function, &in, "Index out of bounds");
+            break;
+          case Opcode::LOAD_ELEMENT:
+            memcpy(&regs[in.a].i, regs[in.b].a->Data<int32_t>() + regs[in.c].i, sizeof(int32_t));
+            break;
+          case Opcode::LOAD_ELEMENT_CHAR:
+            regs[in.a].i = regs[in.b].a->Data<char>()[regs[in.c].i];
+            break;
+          case Opcode::STORE_ELEMENT:
+            memcpy(regs[in.a].a->Data<int32_t>() + regs[in.b].i, &regs[in.c].i, sizeof(int32_t));
+            break;
+          case Opcode::STORE_ELEMENT_CHAR:
+            regs[in.a].a->Data<char>()[regs[in.b].i] = (char)regs[in.c].i;
+            break;
+          case Opcode::NEW_MAP:
+          {
+            Map* result = AllocateAt(function, in, regs, [&] { return heap.AllocateMap(in.b); });
+            if(result == nullptr)
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            regs[in.a].m = result;
+            break;
+          }
+          case Opcode::MAP_LENGTH:
+            regs[in.a].i = regs[in.b].m->length;
+            break;
+          case Opcode::MAP_HAS_INT:
+            regs[in.a].i = Maps::Find(regs[in.b].m, regs[in.c].i) != -1;
+            break;
+          case Opcode::MAP_HAS_STRING:
+            regs[in.a].i = Maps::Find(regs[in.b].m, regs[in.c].s) != -1;
+            break;
+          case Opcode::MAP_GET_INT:
+          case Opcode::MAP_GET_STRING:
+          {
+            int32_t entry = in.op == Opcode::MAP_GET_INT ? Maps::Find(regs[in.b].m, regs[in.c].i) : Maps::Find(regs[in.b].m, regs[in.c].s);
+            if(entry == -1)
+              return Error(*function, &in, "Key not found");
+            regs[in.a] = Maps::GetValue(regs[in.b].m, entry);
+            break;
+          }
+          case Opcode::MAP_SET_INT:
+          case Opcode::MAP_SET_STRING:
+          {
+            bool stringKey = in.op == Opcode::MAP_SET_STRING;
+            if(regs[in.a].m->length == Map::MAX_LENGTH && (stringKey ? Maps::Find(regs[in.a].m, regs[in.b].s) : Maps::Find(regs[in.a].m, regs[in.b].i)) == -1)
+              return Error(*function, &in, "Map is too large");
+            // The registers are read after a collection may have moved them
+            bool set = AllocateAt(function, in, regs, [&]
+            {
+              if(stringKey)
+                return Maps::Set(heap, regs[in.a].m, regs[in.b].s, regs[in.c]);
+              return Maps::Set(heap, regs[in.a].m, regs[in.b].i, regs[in.c]);
+            });
+            if(!set)
+              return Error(*function, &in, "Out of memory", VmError::MEMORY);
+            break;
+          }
+          case Opcode::MAP_KEY:
+            regs[in.a] = Maps::GetKey(regs[in.b].m, regs[in.c].i);
+            break;
+          case Opcode::JUMP:
+            if(code + in.a < ip)
+            {
+              VM_TICK(code + in.a);
+            }
+            ip = code + in.a;
+            break;
+          case Opcode::JUMP_IF_FALSE:
+            if(!regs[in.b].i)
+            {
+              if(code + in.a < ip)
+              {
+                VM_TICK(code + in.a);
+              }
+              ip = code + in.a;
+            }
+            break;
+          case Opcode::JUMP_IF_TRUE:
+            if(regs[in.b].i)
+            {
+              if(code + in.a < ip)
+              {
+                VM_TICK(code + in.a);
+              }
+              ip = code + in.a;
+            }
+            break;
+          case Opcode::CALL:
+          {
+            VM_TICK(&in);
+            const CompiledFunction& callee = program.functions[in.a];
+            if(frameCount == frames.size() && !GrowFrames())
+              return Error(*function, &in, "Stack overflow", VmError::STACK);
+            int callerSegment = segment;
+            Value* frame = CalleeFrame(callee, regs + in.b, callee.params.size());
+            if(frame == nullptr)
+              return Error(*function, &in, "Stack overflow", VmError::STACK);
+            frames[frameCount++] = {function, ip, regs, callerSegment};
+            function = &callee;
+            regs = frame;
+            code = callee.code.data();
+            ip = code;
+            break;
+          }
+          case Opcode::TAIL_CALL:
+          {
+            // The callee replaces the frame of the current function and
+            // returns directly to its caller
+            VM_TICK(&in);
+            const CompiledFunction& callee = program.functions[in.a];
+            Value* frame = regs;
+            if(regs + callee.registerCount > segmentEnd)
+            {
+              frame = NextSegment(callee.registerCount);
+              if(frame == nullptr)
+                return Error(*function, &in, "Stack overflow", VmError::STACK);
+            }
+            std::copy(regs + in.b, regs + in.b + in.c, frame);
+            regs = frame;
+            function = &callee;
+            code = callee.code.data();
+            ip = code;
+            break;
+          }
+          case Opcode::CALL_HOST:
+          {
+            const HostCall& host = program.hostCalls[in.a];
+            // The host function might call back into the vm, whose samples
+            // and collections need the frame of the caller
+            if(frameCount == frames.size() && !GrowFrames())
+              return Error(*function, &in, "Stack overflow", VmError::STACK);
+            Value* savedTop = top;
+            top = regs + function->registerCount;
+            frames[frameCount++] = {function, ip, regs, segment};
+            host.invoke(host.function, regs + in.b, heap);
+            frameCount--;
+            top = savedTop;
+            if(suspendRequested)
+            {
+              suspendRequested = false;
+              return Pause({function, ip, regs, entryRegs, base, start.entrySegment}, false);
+            }
+            break;
+          }
+          case Opcode::CALL_IMPORT:
+            return Error(*function, &in, "Call to a function that isn't linked");
+          case Opcode::CALL_BUILTIN:
+            if(const char* message = Builtins::Run((Builtin)in.a, regs + in.b))
+              return Error(*function, &in, message);
+            break;
+          case Opcode::COMPILE:
+          {
+            // Continues in the compiled function, which usually needs a larger
+            // frame. Every call of the stub goes through here.
+            const CompiledFunction* compiled = function->lazy ? function->lazy->Get() : nullptr;
+            if(compiled == nullptr)
+              return Error(*function, &in, "Failed to compile function");
+            function = compiled;
+            if(regs + function->registerCount > segmentEnd)
+            {
+              Value* frame = NextSegment(function->registerCount);
+              if(frame == nullptr)
+                return Error(*function, &in, "Stack overflow", VmError::STACK);
+              std::copy(regs, regs + function->params.size(), frame);
+              regs = frame;
+            }
+            code = function->code.data();
+            ip = code;
+            break;
+          }
+          case Opcode::CALL_NATIVE:
+          {
+            // Compiled code can call back into the vm through host functions
+            // but can't be suspended, preempted or counted against the budget
+            NativeRuntime runtime{this, &program, program.stringValues.data(), Heap::EmptyArray(), 0, NATIVE_MAX_DEPTH, 0,
+              NativeFail, NativeConcat, NativeSubstring, NativeNewArray, NativeCallHost, NativeVectorLoop, NativeParallelFor, NativeMap, NativeBuiltin};
+            Value* savedTop = top;
+            top = regs + function->registerCount;
+            executeDepth++;
+            nativeDepth++;
+            bool success = function->native(&runtime, regs);
+            nativeDepth--;
+            executeDepth--;
+            top = savedTop;
+            if(!success)
+              return false;
+            break;
+          }
+          case Opcode::VECTOR_LOOP:
+            if(!RunVectorLoop(function->vectorLoops[in.a], regs + in.b))
+              return Error(*function, &in, "Index out of bounds");
+            break;
+          case Opcode::PARALLEL_FOR:
+          {
+            int64_t count = GetIterations(regs + in.b);
+            if(count > INT32_MAX)
+              return Error(*function, &in, "Too many iterations in a parallel loop");
+            // The iterations on this thread run above the registers of the
+            // function, with the frame of the function as their caller
+            if(frameCount == frames.size() && !GrowFrames())
+              return Error(*function, &in, "Stack overflow", VmError::STACK);
+            Value* savedTop = top;
+            top = regs + function->registerCount;
+            frames[frameCount++] = {function, ip, regs, segment};
+            VmError result = RunParallelLoop(program, function->parallelLoops[in.a], regs + in.b, count);
+            frameCount--;
+            top = savedTop;
+            if(result != VmError::NONE)
+            {
+              error = result;
+              return false;
+            }
+            break;
+          }
+          case Opcode::RETURN:
+          case Opcode::RETURN_VOID:
+          {
+            // a is 0 for void returns, the copied value is never read
+            Value result = regs[in.a];
+            if(frameCount == base)
+            {
+              entryRegs[0] = result;
+              return true;
+            }
+            const Frame& caller = frames[--frameCount];
+            caller.regs[caller.ip[-1].b] = result;
+            function = caller.function;
+            code = function->code.data();
+            ip = caller.ip;
+            regs = caller.regs;
+            if(caller.segment != segment)
+              SetSegment(caller.segment);
+            break;
+          }
+        }
+      }
+    }
+#undef VM_TICK
+
+    // Runs an allocation made by the instruction at, collecting the heap
+    // first if the nursery is full. A failed allocation is run once more
+    // after a full collection.
+    template <typename Allocation>
+    auto AllocateAt(const CompiledFunction* function, const Instruction& at, Value* regs, const Allocation& allocation) -> decltype(allocation())
+    {
+      if(heap.ShouldCollect())
+        Collect(function, &at, regs, false);
+      size_t used = heap.Size();
+      auto result = allocation();
+      if(IsNull(result) && Collect(function, &at, regs, true))
+      {
+        used = heap.Size();
+        result = allocation();
+      }
+      if(heapProfiler && !IsNull(result))
+        RecordAllocation(function, &at, heap.Size() - used);
+      return result;
+    }
+
+    static bool IsNull(String str)
+    {
+      return str.IsNull();
+    }
+
+    static bool IsNull(Array* array)
+    {
+      return array == nullptr;
+    }
+
+    static bool IsNull(Map* map)
+    {
+      return map == nullptr;
+    }
+
+    // Stores to maps return whether they succeeded
+    static bool IsNull(bool success)
+    {
+      return !success;
+    }
+
+    // Moves what the registers of the running functions refer to, see Heap.
+    // The callers are at a call and the innermost function is at the
+    // instruction about to allocate. Returns false if the heap can't be
+    // collected, such as while native code or a suspended call is running
+    // or if a function has no stack maps.
+    bool Collect(const CompiledFunction* function, const Instruction* at, Value* regs, bool full)
+    {
+      bool collectable = heap.IsCollecting() && nativeDepth == 0 && !suspended && function->GetStackMap(at);
+      for(size_t i = 0;i<frameCount && collectable;i++)
+        collectable = frames[i].function->GetStackMap(frames[i].ip - 1) != nullptr;
+      if(!collectable)
+      {
+        heap.Postpone();
+        return false;
+      }
+      heap.BeginCollection(full);
+      for(size_t i = 0;i<frameCount;i++)
+        VisitFrame(*frames[i].function, frames[i].ip - 1, frames[i].regs);
+      VisitFrame(*function, at, regs);
+      heap.EndCollection();
+      return true;
+    }
+
+    void VisitFrame(const CompiledFunction& function, const Instruction* at, Value* regs)
+    {
+      const StackMap* map = function.GetStackMap(at);
+      for(int32_t reg : map->strings)
+        heap.Visit(regs[reg].s);
+      for(int32_t reg : map->arrays)
+        heap.Visit(regs[reg].a);
+      for(int32_t reg : map->maps)
+        heap.Visit(regs[reg].m);
+    }
+
+    // Runs the loop one tile at a time with each operation applied to the
+    // whole tile. All indices are checked before anything runs, a failed check
+    // aborts the script so the skipped iterations can't be observed.
+    bool RunVectorLoop(const VectorLoop& loop, Value* operands)
+    {
+      int32_t start = operands[0].i;
+      int64_t count = std::max<int64_t>((int64_t)operands[1].i - start, 1);
+      for(int array : loop.arrays)
+      {
+        if(start < 0 || start + count > operands[array].a->length)
+          return false;
+      }
+
+      if(vectorTemps.empty())
+        vectorTemps.resize(Simd::MAX_TEMPS * Simd::TILE);
+      const void* sources[Simd::MAX_TEMPS];
+      auto temp = [&](int index) { return vectorTemps.data() + index * Simd::TILE; };
+      // Scalars are the same in every tile
+      for(const VectorOp& op : loop.ops)
+      {
+        if(op.kind != VectorOpKind::SCALAR && op.kind != VectorOpKind::CONSTANT)
+          continue;
+        std::fill(temp(op.dst), temp(op.dst) + Simd::TILE, op.kind == VectorOpKind::SCALAR ? operands[op.a].i : op.imm);
+        sources[op.dst] = temp(op.dst);
+      }
+
+      for(int64_t done = 0;done < count;done += Simd::TILE)
+      {
+        int n = (int)std::min<int64_t>(Simd::TILE, count - done);
+        int32_t index = start + (int32_t)done;
+        for(const VectorOp& op : loop.ops)
+        {
+          switch(op.kind)
+          {
+            case VectorOpKind::LOAD:
+              sources[op.dst] = operands[op.a].a->Data<int32_t>() + index;
+              break;
+            case VectorOpKind::SCALAR:
+            case VectorOpKind::CONSTANT:
+              break;
+            case VectorOpKind::INDEX:
+              for(int i = 0;i<n;i++)
+                temp(op.dst)[i] = index + i;
+              sources[op.dst] = temp(op.dst);
+              break;
+            case VectorOpKind::BINARY:
+              Simd::GetBinary(op.opcode)(temp(op.dst), sources[op.a], sources[op.b], n);
+              sources[op.dst] = temp(op.dst);
+              break;
+            case VectorOpKind::UNARY:
+              Simd::GetUnary(op.opcode)(temp(op.dst), sources[op.a], n);
+              sources[op.dst] = temp(op.dst);
+              break;
+            case VectorOpKind::STORE:
+              memmove(operands[op.a].a->Data<int32_t>() + index, sources[op.b], n * sizeof(int32_t));
+              break;
+          }
+        }
+      }
+      return true;
+    }
+
+    // Iterations of a parallel loop with the range in operands
+    static int64_t GetIterations(const Value* operands)
+    {
+      int64_t start = operands[0].i;
+      int64_t end = operands[1].i;
+      int64_t step = operands[2].i;
+      if(step > 0 && end > start)
+        return (end - start + step - 1) / step;
+      if(step < 0 && end < start)
+        return (start - end - step - 1) / -step;
+      return 0;
+    }
+
+    // Runs count iterations of the loop, on the pool if the vm has one that
+    // isn't busy. Every chunk of iterations stores its reductions in an array
+    // of its own outside of the heap, which are combined in the order of the
+    // chunks into the array in the operands. Returns the error of a failed
+    // chunk.
+    VmError RunParallelLoop(const Program& program, const ParallelLoop& loop, const Value* operands, int64_t count)
+    {
+      if(count == 0)
+        return VmError::NONE;
+      size_t reductionCount = loop.reductions.size();
+      size_t stride = 1 + (reductionCount * sizeof(int32_t) + sizeof(Array) - 1) / sizeof(Array);
+      bool pooled = parallelPool && parallelPool->Threads() > 1 && budget < 0 && !profiler && !heapProfiler;
+      if(pooled && !CompileCallees(program, *loop.body))
+        pooled = false;
+      size_t chunks = pooled ? parallelPool->Chunks(count) : 1;
+      std::vector<Array> partials(chunks * stride);
+      for(size_t i = 0;i<chunks;i++)
+        partials[i * stride] = {(int32_t)reductionCount, Heap::STATIC, sizeof(int32_t), nullptr};
+
+      VmError result = VmError::NONE;
+      bool ran = false;
+      if(pooled)
+      {
+        std::mutex resultMutex;
+        bool workerFailed = false;
+        size_t heapLimit = heap.Limit();
+        ParallelPool::Task task = [&](int thread, int64_t begin, int64_t end, size_t chunk)
+        {
+          Vm& vm = thread == 0 ? *this : GetWorker();
+          if(thread != 0)
+          {
+            vm.heap.SetLimit(heapLimit);
+            vm.maxStackSize = maxStackSize;
+          }
+          if(vm.RunChunk(program, *loop.body, operands, begin, end, &partials[chunk * stride]))
+            return true;
+          std::lock_guard<std::mutex> lock{resultMutex};
+          if(result == VmError::NONE)
+          {
+            result = vm.error;
+            workerFailed = thread != 0;
+          }
+          return false;
+        };
+        bool success;
+        heap.SetShared(true);
+        ran = parallelPool->TryRun(count, task, success);
+        heap.SetShared(false);
+        // The error was reported by a worker, without the calls that led here
+        if(ran && !success && workerFailed)
+          PrintTrace();
+      }
+      if(!ran)
+      {
+        chunks = 1;
+        if(!RunChunk(program, *loop.body, operands, 0, count, &partials[0]))
+          result = error;
+      }
+      if(result != VmError::NONE)
+        return result;
+
+      Array* results = operands[3].a;
+      for(size_t i = 0;i<reductionCount;i++)
+      {
+        Value value;
+        memcpy(&value.i, results->Data<int32_t>() + i, sizeof(int32_t));
+        for(size_t chunk = 0;chunk<chunks;chunk++)
+        {
+          Value partial;
+          memcpy(&partial.i, partials[chunk * stride].Data<int32_t>() + i, sizeof(int32_t));
+          value = Combine(loop.reductions[i], value, partial);
+        }
+        memcpy(results->Data<int32_t>() + i, &value.i, sizeof(int32_t));
+      }
+      return VmError::NONE;
+    }
+
+    // Compiles the lazy functions that the body of a parallel loop can call
+    // before the threads of the pool run it. Returns false if one fails to
+    // compile, the loop then runs on this thread which reports the error.
+    bool CompileCallees(const Program& program, const CompiledFunction& body)
+    {
+      if(readyLoops.count(&body))
+        return true;
+      std::set<const CompiledFunction*> seen{&body};
+      std::vector<const CompiledFunction*> pending{&body};
+      while(!pending.empty())
+      {
+        const CompiledFunction* function = pending.back();
+        pending.pop_back();
+        if(function->lazy)
+        {
+          function = function->lazy->Get();
+          if(function == nullptr)
+            return false;
+        }
+        for(const Instruction& in : function->code)
+        {
+          if((in.op == Opcode::CALL || in.op == Opcode::TAIL_CALL) && seen.insert(&program.functions[in.a]).second)
+            pending.push_back(&program.functions[in.a]);
+        }
+        for(const ParallelLoop& loop : function->parallelLoops)
+        {
+          if(seen.insert(loop.body.get()).second)
+            pending.push_back(loop.body.get());
+        }
+      }
+      readyLoops.insert(&body);
+      return true;
+    }
+
+    // Runs the iterations [begin, end) of a parallel loop like a call made
+    // by the host, the reductions of the iterations are stored in reductions
+    bool RunChunk(const Program& program, const CompiledFunction& body, const Value* operands, int64_t begin, int64_t end, Array* reductions)
+    {
+      Enter();
+      Value* regs = Reserve(body);
+      bool success = regs != nullptr;
+      if(success)
+      {
+        regs[0].i = (int32_t)begin;
+        regs[1].i = (int32_t)end;
+        std::copy(operands, operands + body.params.size() - 2, regs + 2);
+        regs[5].a = reductions;
+        success = Call(program, body, regs);
+      }
+      Leave();
+      return success;
+    }
+
+    // Vm of a thread of a pool. Its heap is never collected since the
+    // registers of the loop refer to objects in the heap of the calling vm.
+    static Vm& GetWorker()
+    {
+      static thread_local std::unique_ptr<Vm> worker;
+      if(worker == nullptr)
+      {
+        worker = std::make_unique<Vm>();
+        worker->heap.SetNurserySize(0);
+        worker->heap.SetShared(true);
+      }
+      return *worker;
+    }
+
+    static Value Combine(const Reduction& reduction, Value left, Value right)
+    {
+      Value result;
+      if(reduction.type == Type::FLOAT)
+      {
+        switch(reduction.kind)
+        {
+          case ReductionKind::SUM: result.f = left.f + right.f; break;
+          case ReductionKind::MIN: result.f = right.f < left.f ? right.f : left.f; break;
+          case ReductionKind::MAX: result.f = right.f > left.f ? right.f : left.f; break;
+        }
+        return result;
+      }
+      switch(reduction.kind)
+      {
+        case ReductionKind::SUM: result.i = (int32_t)((uint32_t)left.i + (uint32_t)right.i); break;
+        case ReductionKind::MIN: result.i = std::min(left.i, right.i); break;
+        case ReductionKind::MAX: result.i = std::max(left.i, right.i); break;
+      }
+      return result;
+    }
+
+    // Called by compiled code, see NativeRuntime
+    static void NativeFail(NativeRuntime* runtime, int32_t function, const char* message, int32_t kind)
+    {
+      runtime->failed = 1;
+      runtime->vm->Error(runtime->program->functions[function], message, (VmError)kind);
+    }
+
+    static String NativeConcat(NativeRuntime* runtime, int32_t function, String left, String right)
+    {
+      if((int64_t)left.Length() + right.Length() > String::MAX_LENGTH)
+      {
+        NativeFail(runtime, function, "String is too large", (int32_t)VmError::RUNTIME);
+        return String::Null();
+      }
+      String result = runtime->vm->heap.Concat(left, right);
+      if(result.IsNull())
+        NativeFail(runtime, function, "Out of memory", (int32_t)VmError::MEMORY);
+      return result;
+    }
+
+    static String NativeSubstring(NativeRuntime* runtime, int32_t function, String str, int32_t start, int32_t count)
+    {
+      String result = runtime->vm->heap.Substring(str, start, count);
+      if(result.IsNull())
+        NativeFail(runtime, function, "Out of memory", (int32_t)VmError::MEMORY);
+      return result;
+    }
+
+    static Array* NativeNewArray(NativeRuntime* runtime, int32_t function, int32_t length, int32_t elementSize)
+    {
+      if(length < 0)
+      {
+        NativeFail(runtime, function, "Negative array length", (int32_t)VmError::RUNTIME);
+        return nullptr;
+      }
+      if(length > Array::MAX_LENGTH)
+      {
+        NativeFail(runtime, function, "Array is too large", (int32_t)VmError::RUNTIME);
+        return nullptr;
+      }
+      Array* result = runtime->vm->heap.AllocateArray(length, elementSize);
+      if(result == nullptr)
+        NativeFail(runtime, function, "Out of memory", (int32_t)VmError::MEMORY);
+      return result;
+    }
+
+    static int NativeMap(NativeRuntime* runtime, int32_t function, int32_t opcode, Value* regs, int32_t a, int32_t b, int32_t c)
+    {
+      Heap& heap = runtime->vm->heap;
+      const char* message = nullptr;
+      bool memory = false;
+      switch((Opcode)opcode)
+      {
+        case Opcode::NEW_MAP:
+          regs[a].m = heap.AllocateMap(b);
+          memory = regs[a].m == nullptr;
+          break;
+        case Opcode::MAP_HAS_INT:
+          regs[a].i = Maps::Find(regs[b].m, regs[c].i) != -1;
+          break;
+        case Opcode::MAP_HAS_STRING:
+          regs[a].i = Maps::Find(regs[b].m, regs[c].s) != -1;
+          break;
+        case Opcode::MAP_GET_INT:
+        case Opcode::MAP_GET_STRING:
+        {
+          int32_t entry = (Opcode)opcode == Opcode::MAP_GET_INT ? Maps::Find(regs[b].m, regs[c].i) : Maps::Find(regs[b].m, regs[c].s);
+          if(entry == -1)
+            message = "Key not found";
+          else
+            regs[a] = Maps::GetValue(regs[b].m, entry);
+          break;
+        }
+        case Opcode::MAP_SET_INT:
+        case Opcode::MAP_SET_STRING:
+        {
+          bool stringKey = (Opcode)opcode == Opcode::MAP_SET_STRING;
+          if(regs[a].m->length == Map::MAX_LENGTH && (stringKey ? Maps::Find(regs[a].m, regs[b].s) : Maps::Find(regs[a].m, regs[b].i)) == -1)
+            message = "Map is too large";
+          else
+            memory = stringKey ? !Maps::Set(heap, regs[a].m, regs[b].s, regs[c]) : !Maps::Set(heap, regs[a].m, regs[b].i, regs[c]);
+          break;
+        }
+        case Opcode::MAP_KEY:
+          regs[a] = Maps::GetKey(regs[b].m, regs[c].i);
+          break;
+        default:
+          break;
+      }
+      if(memory)
+        NativeFail(runtime, function, "Out of memory", (int32_t)VmError::MEMORY);
+      else if(message)
+        NativeFail(runtime, function, message, (int32_t)VmError::RUNTIME);
+      return !memory && !message;
+    }
+
+    static int NativeBuiltin(NativeRuntime* runtime, int32_t function, int32_t builtin, Value* args)
+    {
+      const char* message = Builtins::Run((Builtin)builtin, args);
+      if(message)
+        NativeFail(runtime, function, message, (int32_t)VmError::RUNTIME);
+      return message == nullptr;
+    }
+
+    static void NativeCallHost(NativeRuntime* runtime, int32_t index, Value* args)
+    {
+      const HostCall& host = runtime->program->hostCalls[index];
+      host.invoke(host.function, args, runtime->vm->heap);
+    }
+
+    static int NativeVectorLoop(NativeRuntime* runtime, int32_t function, int32_t loop, Value* operands)
+    {
+      return runtime->vm->RunVectorLoop(runtime->program->functions[function].vectorLoops[loop], operands);
+    }
+
+    static int NativeParallelFor(NativeRuntime* runtime, int32_t function, int32_t loop, Value* operands)
+    {
+      int64_t count = GetIterations(operands);
+      if(count > INT32_MAX)
+      {
+        NativeFail(runtime, function, "Too many iterations in a parallel loop", (int32_t)VmError::RUNTIME);
+        return 0;
+      }
+      Vm* vm = runtime->vm;
+      VmError result = vm->RunParallelLoop(*runtime->program, runtime->program->functions[function].parallelLoops[loop], operands, count);
+      if(result == VmError::NONE)
+        return 1;
+      runtime->failed = 1;
+      vm->error = result;
+      return 0;
+    }
+
+    bool Error(const CompiledFunction& function, const char* message, VmError kind = VmError::RUNTIME)
+    {
+      return Error(function, nullptr, message, kind);
+    }
+
+    // Reports the error at the instruction, if it's known, and the calls that
+    // led there. The positions come from the line tables, inlined calls are
+    // reported like the calls they replaced.
+    bool Error(const CompiledFunction& function, const Instruction* at, const char* message, VmError kind = VmError::RUNTIME)
+    {
+      error = kind;
+      SourcePos pos = at ? function.GetPosition(at) : SourcePos{0, 0};
+      std::cerr << "Runtime error in " << function.GetName(pos) << Position(pos) << ": " << message << std::endl;
+      PrintInlined(function, pos);
+      PrintTrace();
+      return false;
+    }
+
+    void PrintTrace()
+    {
+      size_t shown = std::min(frameCount, MAX_TRACE_DEPTH);
+      for(size_t i = frameCount;i>frameCount - shown;i--)
+      {
+        const Frame& caller = frames[i - 1];
+        SourcePos pos = caller.function->GetPosition(caller.ip - 1);
+        std::cerr << "  called from " << caller.function->GetName(pos) << Position(pos) << std::endl;
+        PrintInlined(*caller.function, pos);
+      }
+      if(frameCount > shown)
+        std::cerr << "  and " << frameCount - shown << " more calls" << std::endl;
+    }
+
+    // Prints the calls that the code at the position was inlined through
+    static void PrintInlined(const CompiledFunction& function, SourcePos pos)
+    {
+      while(pos.inlined != 0)
+      {
+        pos = function.inlineSites[pos.inlined - 1].call;
+        std::cerr << "  called from " << function.GetName(pos) << Position(pos) << std::endl;
+      }
+    }
+
+    static std::string Position(SourcePos pos)
+    {
+      if(pos.line == 0)
+        return "";
+      return " at " + std::to_string(pos.line) + ":" + std::to_string(pos.column);
+    }
+};
@@ -1,38 +1,511 @@
 #include "Token.h"
 
+#include "CompileServer.h"
 #include "Lexer.h"
+#include "Module.h"
 #include "Parser.h"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <cstring>
 #include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
+#include <climits>
+#include <cstdlib>
+#include <unistd.h>
+
+int Print(int value)
+{
+  std::cout << value << std::endl;
+  return value;
+}
+
+float PrintFloat(float value)
+{
+  std::cout << value << std::endl;
+  return value;
+}
+
+std::string PrintString(const std::string& value)
+{
+  std::cout << value << std::endl;
+  return value;
+}
+
+// Simulated asynchronous I/O, io(value) completes with value + 1 on the I/O
+// thread. Outside of tasks it completes immediately.
+struct IoRequest
+{
+  std::shared_ptr<Task> task;
+  int value;
+};
+
+std::mutex ioMutex;
+std::condition_variable ioReady;
+std::deque<IoRequest> ioRequests;
+bool ioStopping = false;
+
+int Io(int value)
+{
+  Task* task = Task::Current();
+  if(task == nullptr || !task->Suspend())
+    return value + 1;
+  {
+    std::lock_guard<std::mutex> lock{ioMutex};
+    ioRequests.push_back({task->shared_from_this(), value});
+  }
+  ioReady.notify_one();
+  return 0;
+}
+
+void ServeIo(Scheduler& scheduler)
+{
+  std::unique_lock<std::mutex> lock{ioMutex};
+  while(true)
+  {
+    ioReady.wait(lock, [] { return !ioRequests.empty() || ioStopping; });
+    if(ioRequests.empty())
+      return;
+    IoRequest request = std::move(ioRequests.front());
+    ioRequests.pop_front();
+    lock.unlock();
+    scheduler.Resume(request.task, request.value + 1);
+    lock.lock();
+  }
+}
+
+void BindFunctions(Module& module)
+{
+  module.BindFunction("print", &Print);
+  module.BindFunction("printf", &PrintFloat);
+  module.BindFunction("prints", &PrintString);
+  module.BindFunction("io", &Io);
+}
+
+// Relative paths are resolved by the client since the server runs elsewhere
+std::string AbsolutePath(const char* path)
+{
+  if(path[0] == '/')
+    return path;
+  char cwd[PATH_MAX];
+  if(getcwd(cwd, sizeof(cwd)) == nullptr)
+    return path;
+  return std::string{cwd} + "/" + path;
+}
+
+// Checks the file on a compile server, or compiles it to an image when one
+// is given. Repeats the request to time it against a warm cache.
+bool CompileOnServer(const char* socket, const char* path, const char* image, int iterations)
+{
+  CompileClient client;
+  if(!client.Connect(socket))
+    return false;
+  std::string request = image ? "compile " + AbsolutePath(path) + "\t" + AbsolutePath(image) : "check " + AbsolutePath(path);
+  bool success = false;
+  std::string messages;
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0;i<iterations;i++)
+  {
+    if(!client.Request(request, success, messages))
+    {
+      std::cerr << "Lost connection to " << socket << std::endl;
+      return false;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::cerr << messages;
+  std::cout << (success ? "ok" : "failed") << ", " << std::chrono::duration<double, std::micro>(end - start).count() / iterations
+    << " us/request" << std::endl;
+  return success;
+}
+
+// Comma separated list of passes, such as "cse,licm", "all" or "none"
+unsigned ParsePasses(const std::string& list)
+{
+  unsigned passes = IR_PASS_NONE;
+  std::stringstream ss{list};
+  std::string pass;
+  while(std::getline(ss, pass, ','))
+    passes |= IrPasses::GetPass(pass);
+  return passes;
+}
+
+// Times calls from the host into the main function of the script
+void Benchmark(Module& module, int iterations)
+{
+  ScriptFunction<int()> function = module.GetFunction<int()>("main");
+  if(!function.IsValid())
+    return;
+
+  int result = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0;i<iterations;i++)
+  {
+    if(!function.Call(result))
+      return;
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << iterations << " calls, " << ns / iterations << " ns/call" << std::endl;
+}
+
+// Times creating a context, calling main in it and destroying it, then
+// shows the limits stopping runaway calls without affecting other contexts
+void BenchmarkContexts(Module& module, int iterations, const ContextLimits& limits)
+{
+  ScriptFunction<int()> function = module.GetFunction<int()>("main");
+  if(!function.IsValid())
+    return;
+
+  int result = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(int i = 0;i<iterations;i++)
+  {
+    Context context{limits};
+    if(!function.Call(context, result))
+    {
+      std::cout << "main failed: " << Vm::GetErrorName(context.GetError()) << std::endl;
+      return;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  std::cout << iterations << " contexts, " << ns / iterations << " ns/context" << std::endl;
+
+  for(const char* name : {"spin", "hog", "deep"})
+  {
+    if(module.FindFunction(name) == nullptr)
+      continue;
+    ScriptFunction<int(int)> runaway = module.GetFunction<int(int)>(name);
+    Context context{limits};
+    auto start = std::chrono::steady_clock::now();
+    bool success = runaway.IsValid() && runaway.Call(context, result, 1000000);
+    auto end = std::chrono::steady_clock::now();
+    std::cout << name << ": " << (success ? "returned" : Vm::GetErrorName(context.GetError())) << " after "
+      << context.BudgetUsed() << " back-edges and calls, " << std::chrono::duration<double, std::micro>(end - start).count() << " us" << std::endl;
+  }
+}
+
+// Allocation throughput and the distribution of the pauses of the collector
+void PrintCollectorStats(const HeapStats& stats)
+{
+  uint64_t collections = stats.minorCollections + stats.majorCollections;
+  std::cout << "Allocated " << stats.allocatedBytes / (1 << 20) << " MB, copied " << stats.copiedBytes / (1 << 20) << " MB, peak heap "
+    << stats.peakSize / (1 << 20) << " MB" << std::endl;
+  std::cout << stats.minorCollections << " minor and " << stats.majorCollections << " major collections, pauses total "
+    << std::chrono::duration<double, std::milli>(stats.totalPause).count() << " ms, max "
+    << std::chrono::duration<double, std::micro>(stats.maxPause).count() << " us" << std::endl;
+  uint64_t counted = 0;
+  for(int i = 0;i<HeapStats::PAUSE_BUCKETS && counted < collections;i++)
+  {
+    if(stats.pauses[i] == 0)
+      continue;
+    counted += stats.pauses[i];
+    std::cout << "  < " << (1 << i) << " us: " << stats.pauses[i] << " (" << 100.0 * counted / collections << "%)" << std::endl;
+  }
+}
+
+// Runs work(i) for every i as a task and compares with calling it directly
+void BenchmarkTasks(Module& module, int count, const SchedulerOptions& options)
+{
+  ScriptFunction<int(int)> function = module.GetFunction<int(int)>("work");
+  if(!function.IsValid())
+    return;
+
+  std::vector<int> expected(count);
+  for(int i = 0;i<count;i++)
+  {
+    if(!function.Call(expected[i], i))
+      return;
+  }
+
+  std::vector<std::shared_ptr<Task>> tasks;
+  tasks.reserve(count);
+  auto start = std::chrono::steady_clock::now();
+  {
+    Scheduler scheduler{options};
+    std::thread io{ServeIo, std::ref(scheduler)};
+    for(int i = 0;i<count;i++)
+      tasks.push_back(function.Spawn(scheduler, i));
+    scheduler.Wait();
+    auto end = std::chrono::steady_clock::now();
+    {
+      std::lock_guard<std::mutex> lock{ioMutex};
+      ioStopping = true;
+    }
+    ioReady.notify_one();
+    io.join();
+
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+    SchedulerMetrics metrics = scheduler.Metrics();
+    std::cout << count << " tasks on " << options.threads << " threads, " << ms << " ms, " << count / ms * 1000 << " tasks/s" << std::endl;
+    std::cout << "suspensions " << metrics.suspensions << ", resumes " << metrics.resumes << ", preemptions " << metrics.preemptions
+      << ", steals " << metrics.steals << ", max queue depth " << metrics.maxQueueDepth << std::endl;
+  }
+
+  int mismatches = 0;
+  std::vector<double> latencies;
+  for(int i = 0;i<count;i++)
+  {
+    if(tasks[i]->GetState() != TaskState::DONE || tasks[i]->Result<int>() != expected[i])
+      mismatches++;
+    latencies.push_back(std::chrono::duration<double, std::milli>(tasks[i]->Latency()).count());
+  }
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "latency p50 " << latencies[count / 2] << " ms, p99 " << latencies[count * 99 / 100] << " ms, max " << latencies.back() << " ms" << std::endl;
+  if(mismatches > 0)
+    std::cout << mismatches << " tasks returned the wrong result" << std::endl;
+}
 
 int main(int argc, char** argv)
 {
+  if(argc == 3 && strcmp(argv[1], "--server") == 0)
+  {
+    CompileServer server{BindFunctions};
+    return server.Serve(argv[2]) ? 0 : 1;
+  }
   if(argc < 2)
+  {
     std::cout << "No input file" << std::endl;
-  std::ifstream source(argv[1]);
-  std::cout << "Compiling: " << argv[1] << std::endl;
-  std::vector<TokenPos> tokens = Lexer::Read(source);
-  if(argc >= 3)
+    std::cout << "Usage: " << argv[0] << " --server socket" << std::endl;
+    std::cout << "Usage: " << argv[0] << " file [-k socket] [-t] [-a] [-i] [-d] [-r] [-b iterations] [-O passes] [-s scalar|sse|avx] [-c tasks] [-j threads] [-q slice] [-l] [-x contexts] [-B budget] [-M bytes] [-p file] [-H interval] [-z] [-e] [-S image] [-L] [-C file.c] [-N library] [-J threads] [-I budget] [-n] [-G nursery] [-g] [-P threads]" << std::endl;
+    return 1;
+  }
+  bool printTokens = false;
+  bool printAst = false;
+  bool printBytecode = false;
+  bool printIr = false;
+  bool lazy = false;
+  ParseOptions parseOptions;
+  int compileThreads = 1;
+  int inlineBudget = -1;
+  bool inlineReport = false;
+  bool loadImage = false;
+  const char* saveImage = nullptr;
+  const char* writeC = nullptr;
+  const char* nativeLibrary = nullptr;
+  const char* server = nullptr;
+  unsigned passes = IR_PASS_ALL;
+  bool run = false;
+  int benchmark = 0;
+  int tasks = 0;
+  int contexts = 0;
+  const char* profile = nullptr;
+  int heapInterval = -1;
+  long long nurserySize = -1;
+  int parallelThreads = 1;
+  bool collectorStats = false;
+  ContextLimits limits;
+  SchedulerOptions schedulerOptions;
+  for(int i = 2;i<argc;i++)
   {
-    if(strcmp(argv[2], "-t") == 0)
+    if(strcmp(argv[i], "-t") == 0)
+      printTokens = true;
+    else if(strcmp(argv[i], "-a") == 0)
+      printAst = true;
+    else if(strcmp(argv[i], "-d") == 0)
+      printBytecode = true;
+    else if(strcmp(argv[i], "-i") == 0)
+      printIr = true;
+    else if(strcmp(argv[i], "-O") == 0 && i + 1 < argc)
+      passes = ParsePasses(argv[++i]);
+    else if(strcmp(argv[i], "-r") == 0)
+      run = true;
+    else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      benchmark = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      tasks = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      schedulerOptions.threads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+      schedulerOptions.timeSlice = atoll(argv[++i]);
+    else if(strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+      contexts = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-B") == 0 && i + 1 < argc)
+      limits.budget = atoll(argv[++i]);
+    else if(strcmp(argv[i], "-M") == 0 && i + 1 < argc)
+      limits.memory = atoll(argv[++i]);
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      profile = argv[++i];
+    else if(strcmp(argv[i], "-H") == 0 && i + 1 < argc)
+      heapInterval = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-l") == 0)
+      schedulerOptions.lifo = true;
+    else if(strcmp(argv[i], "-z") == 0)
+      lazy = true;
+    else if(strcmp(argv[i], "-e") == 0)
+      parseOptions.shareExpressions = true;
+    else if(strcmp(argv[i], "-J") == 0 && i + 1 < argc)
+      compileThreads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-I") == 0 && i + 1 < argc)
+      inlineBudget = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-n") == 0)
+      inlineReport = true;
+    else if(strcmp(argv[i], "-G") == 0 && i + 1 < argc)
+      nurserySize = atoll(argv[++i]);
+    else if(strcmp(argv[i], "-P") == 0 && i + 1 < argc)
+      parallelThreads = atoi(argv[++i]);
+    else if(strcmp(argv[i], "-g") == 0)
+      collectorStats = true;
+    else if(strcmp(argv[i], "-S") == 0 && i + 1 < argc)
+      saveImage = argv[++i];
+    else if(strcmp(argv[i], "-L") == 0)
+      loadImage = true;
+    else if(strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+      writeC = argv[++i];
+    else if(strcmp(argv[i], "-N") == 0 && i + 1 < argc)
+      nativeLibrary = argv[++i];
+    else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+      server = argv[++i];
+    else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+    {
+      i++;
+      Simd::SetLevel(strcmp(argv[i], "avx") == 0 ? SimdLevel::AVX : strcmp(argv[i], "sse") == 0 ? SimdLevel::SSE : SimdLevel::SCALAR);
+    }
+  }
+
+  if(server)
+    return CompileOnServer(server, argv[1], saveImage, std::max(benchmark, 1)) ? 0 : 1;
+
+  Module module;
+  module.Options().passes = passes;
+  module.Options().threads = compileThreads;
+  if(inlineBudget >= 0)
+    module.Options().inlineBudget = inlineBudget;
+  if(inlineReport)
+    module.Options().inlineReport = &std::cout;
+  if(printIr)
+    module.Options().irDump = &std::cout;
+  BindFunctions(module);
+  if(nurserySize >= 0)
+    module.GetHeap().SetNurserySize(nurserySize);
+  module.SetParallelThreads(parallelThreads);
+
+  auto start = std::chrono::steady_clock::now();
+  if(loadImage)
+  {
+    std::cout << "Loading: " << argv[1] << std::endl;
+    if(!module.LoadImage(argv[1]) || !module.Link())
+      return 1;
+  }
+  else
+  {
+    std::ifstream source(argv[1]);
+    std::cout << "Compiling: " << argv[1] << std::endl;
+    auto tokens = std::make_shared<const std::vector<TokenPos>>(Lexer::Read(source));
+    if(printTokens)
     {
       int i = 0;
-      for(auto token : tokens)
+      for(auto token : *tokens)
       {
         std::cout << i << ": " << Tokens::GetName(token.token) << std::endl;
         i++;
       }
+
+      std::cout << std::endl;
+    }
+
+    std::vector<AstFunction*> functions;
+    if(lazy ? !Parser::ParseLazy(tokens, functions, parseOptions) : !Parser::Parse(*tokens, functions, parseOptions))
+      return 1;
+    std::cout << "Succesfully Parsed file!" << std::endl;
+
+    if(printAst)
+    {
+      for(AstFunction* function : functions)
+        std::cout << function << std::endl;
     }
 
-    std::cout << std::endl;
+    if(!module.Load(functions) || !module.Link())
+      return 1;
   }
+  auto end = std::chrono::steady_clock::now();
+  std::cout << "Startup " << std::chrono::duration<double, std::milli>(end - start).count() << " ms"
+    << (loadImage ? " (image)" : lazy ? " (lazy)" : "") << std::endl;
+
+  if(saveImage && !module.SaveImage(saveImage))
+    return 1;
 
-  if(Parser::Parse(tokens))
+  if(writeC)
   {
-    std::cout << "Succesfully Parsed file!" << std::endl;
+    std::ofstream output{writeC};
+    if(!module.WriteC(output))
+      return 1;
+  }
+
+  if(nativeLibrary)
+  {
+    if(!module.LoadNative(nativeLibrary))
+      return 1;
+    std::cout << "Running native code from " << nativeLibrary << std::endl;
+  }
+
+  if(printBytecode)
+  {
+    for(const CompiledFunction& function : module.GetProgram().functions)
+      function.Print(std::cout);
+  }
+
+  Profiler profiler;
+  if(profile)
+  {
+    module.SetProfiler(&profiler);
+    schedulerOptions.profiler = &profiler;
+  }
+  HeapProfiler heapProfiler{(size_t)std::max(heapInterval, 0)};
+  if(heapInterval >= 0)
+  {
+    module.SetHeapProfiler(&heapProfiler);
+    schedulerOptions.heapProfiler = &heapProfiler;
+  }
+
+  if(run)
+  {
+    ScriptFunction<int()> function = module.GetFunction<int()>("main");
+    int result = 0;
+    if(!function.IsValid() || !function.Call(result))
+      return 1;
+    std::cout << "main returned " << result << std::endl;
+  }
+
+  if(benchmark > 0)
+  {
+    HeapSnapshot before = heapProfiler.Snapshot();
+    std::cout << "Vector kernels: " << Simd::GetName(Simd::GetLevel()) << std::endl;
+    Benchmark(module, benchmark);
+    if(heapInterval >= 0)
+    {
+      std::cout << "Allocations during the benchmark:" << std::endl;
+      heapProfiler.Snapshot().Diff(before).Write(std::cout, 10);
+    }
+  }
+
+  if(collectorStats)
+    PrintCollectorStats(module.GetHeap().Stats());
+
+  if(tasks > 0)
+    BenchmarkTasks(module, tasks, schedulerOptions);
+
+  if(contexts > 0)
+    BenchmarkContexts(module, contexts, limits);
+
+  if(heapInterval >= 0)
+  {
+    std::cout << "Heap profile:" << std::endl;
+    heapProfiler.Snapshot().Write(std::cout, 10);
+  }
+
+  if(profile)
+  {
+    std::ofstream output{profile};
+    profiler.WriteCollapsed(output);
+    profiler.WriteReport(std::cout);
   }
 
   return 0;